@@ -2,9 +2,21 @@
 
 #include <cstdio>
 
+#include <llvm/ADT/STLFunctionalExtras.h>
 #include <llvm/Support/JSON.h>
 #include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <unistd.h>
 
 namespace lspserver {
@@ -16,6 +28,40 @@ enum class JSONStreamStyle {
   Delimited
 };
 
+/// Texts of document sync notifications, taken out of the raw message before
+/// parsing (see `extractTexts`). They are decoded once, and moved into
+/// handler parameters instead of being copied out of the JSON value.
+using MessageTexts = std::vector<std::string>;
+
+/// Serialized JSON, e.g. results of replies. It can be forwarded as it is,
+/// instead of being parsed and serialized again.
+struct RawJSON {
+  std::string Text = "null";
+
+  RawJSON() = default;
+  explicit RawJSON(std::string Text) : Text(std::move(Text)) {}
+  explicit RawJSON(const char *Text) : Text(Text) {}
+  explicit RawJSON(const llvm::json::Value &V);
+};
+
+/// A message read from the port.
+struct InboundMessage {
+  llvm::json::Value JSON = nullptr;
+  /// Extracted texts, in order. They are replaced by "" in JSON.
+  MessageTexts Texts;
+  /// The result of a reply, not parsed. It is replaced by 0 in JSON.
+  std::optional<RawJSON> Result;
+};
+
+/// Extract "text" strings of "textDocument/didOpen" and
+/// "textDocument/didChange" from the raw message \p JSONString, in place,
+/// leaving empty strings. Other messages are not changed.
+/// \returns false if nothing is extracted, \p JSONString is then unchanged.
+bool extractTexts(std::string &JSONString, MessageTexts &Texts);
+
+/// Extract the "result" of the reply \p JSONString, like `extractTexts`.
+bool extractResult(std::string &JSONString, RawJSON &Result);
+
 /// Parsed & classfied messages are dispatched to this handler class
 /// LSP Servers should inherit from this hanlder and dispatch
 /// notify/call/reply to implementations.
@@ -23,19 +69,47 @@ class MessageHandler {
 public:
   virtual ~MessageHandler() = default;
   // Handler returns true to keep processing messages, or false to shut down.
-  virtual bool onNotify(llvm::StringRef Method, llvm::json::Value) = 0;
+  virtual bool onNotify(llvm::StringRef Method, llvm::json::Value,
+                        MessageTexts Texts) = 0;
   virtual bool onCall(llvm::StringRef Method, llvm::json::Value Params,
                       llvm::json::Value ID) = 0;
   virtual bool onReply(llvm::json::Value ID,
-                       llvm::Expected<llvm::json::Value> Result) = 0;
+                       llvm::Expected<RawJSON> Result) = 0;
 };
 
 class InboundPort {
+  /// Messages read ahead, but not dispatched yet.
+  struct MessageQueue {
+    std::mutex Lock;
+    std::condition_variable CV;
+    std::deque<InboundMessage> Messages; // GUARDED_BY(Lock)
+    bool Closed = false;                 // GUARDED_BY(Lock)
+
+    /// Calls received but not answered yet (by serialized IDs), and whether
+    /// they were cancelled by "$/cancelRequest". Cancellations of other calls
+    /// are ignored, so that this does not grow.
+    std::map<std::string, bool> Calls; // GUARDED_BY(Lock)
+
+    /// Number of "$/cancelRequest" received.
+    std::atomic<size_t> Cancellations = 0;
+  };
+
+  /// Shared with the reader thread, which may outlive this port.
+  std::shared_ptr<MessageQueue> Queue;
+
+  /// Pop a message from the queue, start the reader thread if necessary.
+  std::optional<InboundMessage> popMessage();
+
 public:
   int In;
 
   JSONStreamStyle StreamStyle = JSONStreamStyle::Standard;
 
+  /// Read & parse messages in a background thread, instead of the dispatching
+  /// thread. Handlers could then look ahead messages that have been received
+  /// but not dispatched yet (see `anyQueued`).
+  bool ReadAhead = false;
+
   bool readStandardMessage(std::string &JSONString);
 
   bool readDelimitedMessage(std::string &JSONString);
@@ -50,10 +124,32 @@ public:
   /// HTTP headers, delimited  by \r\n, and terminated by an empty line (\r\n).
   bool readMessage(std::string &JSONString);
 
+  /// Read a message and parse it. Texts of document sync notifications, and
+  /// results of replies, are extracted before parsing.
+  /// \returns std::nullopt on EOF, or the message cannot be parsed.
+  std::optional<InboundMessage> readJSON();
+
+  /// \returns true if there is a queued message (object) satisfying \p Pred.
+  /// Always false if `ReadAhead` is disabled.
+  bool anyQueued(llvm::function_ref<bool(const llvm::json::Object &)> Pred);
+
+  /// Number of cancellations received, which is cheap to poll. Cancellations
+  /// are consumed by the reader, and never dispatched.
+  /// Always zero if `ReadAhead` is disabled.
+  [[nodiscard]] size_t cancellations() const {
+    return Queue ? Queue->Cancellations.load() : 0;
+  }
+
+  /// \returns true if call \p ID has been cancelled by the peer.
+  bool isCancelled(const llvm::json::Value &ID);
+
+  /// Call \p ID has been answered, forget it (see `isCancelled`).
+  void answered(const llvm::json::Value &ID);
+
   /// Dispatch messages to on{Notify,Call,Reply} ( \p Handlers)
   /// Return values should be forwarded from \p Handlers
   /// i.e. returns true to keep processing messages, or false to shut down.
-  bool dispatch(llvm::json::Value Message, MessageHandler &Hanlder);
+  bool dispatch(InboundMessage Message, MessageHandler &Hanlder);
 
   void loop(MessageHandler &Handler);
 };
@@ -68,6 +164,9 @@ private:
 
   bool Pretty = false;
 
+  /// Write OutputBuffer as a message. Requires Mutex.
+  void flushOutput();
+
 public:
   explicit OutboundPort(bool Pretty = false)
       : Outs(llvm::outs()), Pretty(Pretty) {}
@@ -78,6 +177,10 @@ public:
             llvm::json::Value ID);
   void reply(llvm::json::Value ID, llvm::Expected<llvm::json::Value> Result);
 
+  /// Reply \p Result as it is, without parsing it. Pretty ports still parse
+  /// it, to keep the output readable.
+  void replyRaw(llvm::json::Value ID, llvm::Expected<RawJSON> Result);
+
   void sendMessage(llvm::json::Value Message);
 };
 
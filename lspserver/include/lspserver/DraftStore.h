@@ -9,6 +9,7 @@
 #pragma once
 
 #include "Path.h"
+#include "Rope.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Support/VirtualFileSystem.h"
 #include <mutex>
@@ -25,14 +26,21 @@ namespace lspserver {
 class DraftStore {
 public:
   struct Draft {
+    /// Flat contents, made from `Text` once per version, on demand.
     std::shared_ptr<const std::string> Contents;
     std::string Version;
+    /// Immutable snapshot, edits share unchanged chunks with it.
+    Rope Text;
   };
 
   /// \return Contents of the stored document.
   /// For untracked files, a std::nullopt is returned.
   std::optional<Draft> getDraft(PathRef File) const;
 
+  /// Like `getDraft`, but do not flatten the text: `Contents` may be null.
+  /// Use this for edits and versions.
+  std::optional<Draft> peekDraft(PathRef File) const;
+
   /// \return List of names of the drafts in this store.
   std::vector<Path> getActiveFiles() const;
 
@@ -42,6 +50,8 @@ public:
   std::string addDraft(PathRef File, llvm::StringRef Version,
                        llvm::StringRef Contents);
 
+  std::string addDraft(PathRef File, llvm::StringRef Version, Rope Text);
+
   /// Remove the draft from the store.
   void removeDraft(PathRef File);
 
@@ -55,7 +65,11 @@ private:
     std::time_t MTime;
   };
   mutable std::mutex Mutex;
-  llvm::StringMap<DraftAndTime> Drafts;
+  /// Mutable for flattening contents on demand.
+  mutable llvm::StringMap<DraftAndTime> Drafts;
+
+  /// Flatten the text of \p D if needed. Must hold Mutex.
+  static const std::shared_ptr<const std::string> &flatten(Draft &D);
 };
 
 } // namespace lspserver
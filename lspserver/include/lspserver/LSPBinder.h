@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Connection.h"
 #include "Function.h"
 #include "Logger.h"
 #include "Protocol.h"
@@ -7,6 +8,8 @@
 #include <llvm/ADT/StringMap.h>
 #include <llvm/Support/JSON.h>
 
+#include <type_traits>
+
 namespace lspserver {
 
 template <typename T>
@@ -31,13 +34,52 @@ llvm::Expected<T> parseParam(const llvm::json::Value &Raw,
   }
   return Result;
 }
+
+/// Raw JSON known to represent a \p T. It is forwarded as it is, and decoded
+/// only if necessary, e.g. for merging or rewriting.
+template <typename T> struct Serialized : RawJSON {
+  Serialized() = default;
+  explicit Serialized(RawJSON Raw) : RawJSON(std::move(Raw)) {}
+  explicit Serialized(const T &V) : RawJSON(llvm::json::Value(V)) {}
+
+  [[nodiscard]] llvm::Expected<T> decode() const {
+    auto Parsed = llvm::json::parse(Text);
+    if (!Parsed)
+      return Parsed.takeError();
+    return parseParam<T>(*Parsed, "serialized", "value");
+  }
+};
+
+/// Decode the result of a reply, raw JSON is not parsed.
+template <typename T>
+llvm::Expected<T> parseReply(RawJSON Raw, llvm::StringRef Method) {
+  if constexpr (std::is_same_v<T, RawJSON>) {
+    return Raw;
+  } else if constexpr (std::is_base_of_v<RawJSON, T>) {
+    return T(std::move(Raw));
+  } else {
+    auto Parsed = llvm::json::parse(Raw.Text);
+    if (!Parsed)
+      return Parsed.takeError();
+    return parseParam<T>(*Parsed, Method, "reply");
+  }
+}
+
+/// Move texts extracted from the message into \p R, see `extractTexts`.
+/// Parameters without such texts accept none.
+template <typename T> bool takeTexts(T &, MessageTexts &Texts) {
+  return Texts.empty();
+}
+
 struct HandlerRegistry {
   using JSON = llvm::json::Value;
   template <typename HandlerT>
   using HandlerMap = llvm::StringMap<llvm::unique_function<HandlerT>>;
 
-  HandlerMap<void(JSON)> NotificationHandlers;
+  HandlerMap<void(JSON, MessageTexts)> NotificationHandlers;
   HandlerMap<void(JSON, Callback<JSON>)> MethodHandlers;
+  /// Methods replying raw JSON, see `Serialized`.
+  HandlerMap<void(JSON, Callback<RawJSON>)> RawMethodHandlers;
   HandlerMap<void(JSON, Callback<JSON>)> CommandHandlers;
 
 public:
@@ -45,16 +87,28 @@ public:
   /// e.g. method("peek", this, &ThisModule::peek);
   /// Handler should be e.g. void peek(const PeekParams&, Callback<PeekResult>);
   /// PeekParams must be JSON-parseable and PeekResult must be serializable.
+  /// If Result is raw JSON, it is replied as it is.
   template <typename Param, typename Result, typename ThisT>
   void addMethod(llvm::StringLiteral Method, ThisT *This,
                  void (ThisT::*Handler)(const Param &, Callback<Result>)) {
-    MethodHandlers[Method] = [Method, Handler, This](JSON RawParams,
-                                                     Callback<JSON> Reply) {
-      auto P = parseParam<Param>(RawParams, Method, "request");
-      if (!P)
-        return Reply(P.takeError());
-      (This->*Handler)(*P, std::move(Reply));
-    };
+    if constexpr (std::is_base_of_v<RawJSON, Result>) {
+      RawMethodHandlers[Method] = [Method, Handler,
+                                   This](JSON RawParams,
+                                         Callback<RawJSON> Reply) {
+        auto P = parseParam<Param>(RawParams, Method, "request");
+        if (!P)
+          return Reply(P.takeError());
+        (This->*Handler)(*P, std::move(Reply));
+      };
+    } else {
+      MethodHandlers[Method] = [Method, Handler, This](JSON RawParams,
+                                                       Callback<JSON> Reply) {
+        auto P = parseParam<Param>(RawParams, Method, "request");
+        if (!P)
+          return Reply(P.takeError());
+        (This->*Handler)(*P, std::move(Reply));
+      };
+    }
   }
 
   /// Bind a handler for an LSP notification.
@@ -64,12 +118,18 @@ public:
   template <typename Param, typename ThisT>
   void addNotification(llvm::StringLiteral Method, ThisT *This,
                        void (ThisT::*Handler)(const Param &)) {
-    NotificationHandlers[Method] = [Method, Handler, This](JSON RawParams) {
-      llvm::Expected<Param> P = parseParam<Param>(RawParams, Method, "request");
-      if (!P)
-        return llvm::consumeError(P.takeError());
-      (This->*Handler)(*P);
-    };
+    bindNotification<Param>(
+        Method, [This, Handler](Param &&P) { (This->*Handler)(P); });
+  }
+
+  /// Like above, but the handler takes \p Param, e.g. to keep texts of the
+  /// message without copying them.
+  template <typename Param, typename ThisT>
+  void addNotification(llvm::StringLiteral Method, ThisT *This,
+                       void (ThisT::*Handler)(Param &&)) {
+    bindNotification<Param>(Method, [This, Handler](Param &&P) {
+      (This->*Handler)(std::move(P));
+    });
   }
 
   /// Bind a handler for an LSP command.
@@ -87,6 +147,22 @@ public:
       (This->*Handler)(*P, std::move(Reply));
     };
   }
+
+private:
+  template <typename Param, typename HandlerT>
+  void bindNotification(llvm::StringLiteral Method, HandlerT Handler) {
+    NotificationHandlers[Method] = [Method, Handler](JSON RawParams,
+                                                     MessageTexts Texts) {
+      llvm::Expected<Param> P = parseParam<Param>(RawParams, Method, "request");
+      if (!P)
+        return llvm::consumeError(P.takeError());
+      if (!takeTexts(*P, Texts)) {
+        elog("Failed to decode {0} request: unexpected texts", Method);
+        return;
+      }
+      Handler(std::move(*P));
+    };
+  }
 };
 
 } // namespace lspserver
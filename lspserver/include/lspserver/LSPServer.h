@@ -4,11 +4,18 @@
 #include "lspserver/Function.h"
 #include "lspserver/LSPBinder.h"
 
+#include <llvm/ADT/FunctionExtras.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/JSON.h>
 
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
 
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/JSON.h>
@@ -22,40 +29,142 @@ private:
   std::unique_ptr<InboundPort> In;
   std::unique_ptr<OutboundPort> Out;
 
-  bool onNotify(llvm::StringRef Method, llvm::json::Value) override;
-  bool onCall(llvm::StringRef Method, llvm::json::Value Params,
-              llvm::json::Value ID) override;
-  bool onReply(llvm::json::Value ID,
-               llvm::Expected<llvm::json::Value> Result) override;
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// Calls without a deadline expire after this.
+  static constexpr std::chrono::seconds DefaultCallTimeout{60};
+
+  /// Default number of calls in flight to a peer, see `setCallLimit`.
+  static constexpr size_t DefaultCallLimit = 100;
+
+private:
+  struct PendingCall {
+    Callback<RawJSON> CB;
+    Clock::time_point Deadline;
+  };
+
+  /// A call not sent yet, because the peer has too many calls in flight.
+  struct QueuedCall {
+    int ID;
+    std::string Method;
+    llvm::json::Value Params;
+    PendingCall Call;
+  };
+
+  /// Calls to a single peer.
+  struct CallTable {
+    /// Calls sent, and waiting for the response.
+    std::map<int, PendingCall> Sent;
+    /// Calls delayed until some of `Sent` are answered, or expired.
+    std::deque<QueuedCall> Queued;
+    size_t Limit = DefaultCallLimit;
+  };
 
   std::mutex PendingCallsLock;
 
-  /// Calls to the client sent, and waiting for the response.
-  /// The callback function will be invoked when we get the result.
-  ///
-  /// If the call has no response for a long time, it should be removed and
-  /// associated an error.
-  std::map<int, Callback<llvm::json::Value>> PendingCalls;
+  /// Calls sent (or going to be sent) to each port. The callback function
+  /// will be invoked when we get the result, or with an error if the call has
+  /// passed its deadline.
+  // GUARDED_BY(PendingCallsLock)
+  std::map<OutboundPort *, CallTable> PendingCalls;
 
-  /// Number of maximum callbacks stored in the structure.
-  /// Give an error to the oldest callback (least ID) while exceeding this
-  /// value.
-  static constexpr int MaxPendingCalls = 100;
+  /// Ports of pending calls, by IDs.
+  std::map<int, OutboundPort *> CallPorts; // GUARDED_BY(PendingCallsLock)
 
-  int TopID = 1;
+  /// Nothing expires before this.
+  // GUARDED_BY(PendingCallsLock)
+  Clock::time_point NextExpiry = Clock::time_point::max();
 
-  /// Allocate an "ID" (as returned value) for this callback.
-  int bindReply(Callback<llvm::json::Value>);
+  /// Failures of calls cancelled or forgotten, invoked by `expireCalls`, so
+  /// that callbacks never run with locks of the caller.
+  // GUARDED_BY(PendingCallsLock)
+  std::vector<llvm::unique_function<void()>> Dropped;
 
-  void callMethod(llvm::StringRef Method, llvm::json::Value Params,
-                  Callback<llvm::json::Value> CB, OutboundPort *O) {
-    llvm::json::Value ID(bindReply(std::move(CB)));
-    log("--> call {0}({1})", Method, ID.getAsInteger());
-    O->call(Method, Params, ID);
-  }
+  int TopID = 1; // GUARDED_BY(PendingCallsLock)
+
+  /// Move queued calls of \p Table to sent ones, while the limit permits.
+  /// Requires PendingCallsLock, the returned calls should be sent then.
+  static std::vector<QueuedCall> admitQueued(CallTable &Table);
+
+  static void sendQueued(OutboundPort *O, std::vector<QueuedCall> Calls);
+
+  /// Send the call, or queue it if \p O has too many calls in flight.
+  llvm::json::Value callMethod(llvm::StringRef Method,
+                               llvm::json::Value Params, Callback<RawJSON> CB,
+                               OutboundPort *O,
+                               std::optional<Clock::time_point> Deadline);
 
 protected:
   HandlerRegistry Registry;
+
+  bool onNotify(llvm::StringRef Method, llvm::json::Value,
+                MessageTexts Texts) override;
+  bool onCall(llvm::StringRef Method, llvm::json::Value Params,
+              llvm::json::Value ID) override;
+  bool onReply(llvm::json::Value ID, llvm::Expected<RawJSON> Result) override;
+
+  /// Whether the call should be dropped without running its handler.
+  /// Dropped calls are replied with "RequestCancelled".
+  virtual bool isStale(llvm::StringRef Method,
+                       const llvm::json::Value &Params) {
+    return false;
+  }
+
+  /// Invoked once message \p Method has been handled: calls when replied,
+  /// notifications when their handlers returned. \p Failed calls are replied
+  /// with errors, including stale ones. Must be cheap, e.g. for statistics.
+  virtual void onHandled(llvm::StringRef Method, Clock::duration Elapsed,
+                         bool Failed) {}
+
+  /// \returns true if there is another call to \p Method, for the same text
+  /// document, received but not dispatched yet.
+  /// Requires read-ahead, see `switchReadAhead`.
+  bool isSuperseded(llvm::StringRef Method, const llvm::json::Value &Params);
+
+  /// \returns true if call \p ID has been cancelled by the peer.
+  /// Requires read-ahead, see `switchReadAhead`.
+  bool isCancelled(const llvm::json::Value &ID) { return In->isCancelled(ID); }
+
+  /// Number of cancellations received, poll this before `isCancelled`.
+  [[nodiscard]] size_t cancellations() const { return In->cancellations(); }
+
+  /// Ask the peer to cancel our call \p ID. The reply is still expected, unless
+  /// the call is not sent yet. It fails on the next `expireCalls` then.
+  void cancelCall(const llvm::json::Value &ID, OutboundPort *O = nullptr);
+
+  /// Number of calls in flight to \p O, more calls are queued until some of
+  /// them are answered (or expired).
+  void setCallLimit(OutboundPort *O, size_t Limit);
+
+  /// Forget calls to \p O, e.g. the peer exited. They fail on the next
+  /// `expireCalls`.
+  void forgetCalls(OutboundPort *O);
+
+  /// Fail calls that have passed their deadlines, or have been dropped. This
+  /// is also done when receiving replies, but should be invoked periodically.
+  void expireCalls();
+
+  /// Call \p Method, like functions made by `mkOutMethod`.
+  /// \returns the ID of the call, see `cancelCall`.
+  template <class ParamTy, class ResponseTy>
+  llvm::json::Value
+  callOutMethod(llvm::StringRef Method, const ParamTy &Params,
+                Callback<ResponseTy> Reply, OutboundPort *O = nullptr,
+                std::optional<Clock::time_point> Deadline = std::nullopt) {
+    if (!O)
+      O = Out.get();
+    return callMethod(
+        Method, Params,
+        [Method = Method.str(),
+         Reply = std::move(Reply)](llvm::Expected<RawJSON> Response) mutable {
+          if (!Response)
+            return Reply(Response.takeError());
+          Reply(parseReply<ResponseTy>(std::move(*Response), Method));
+        },
+        O, Deadline);
+  }
+
   template <class T>
   llvm::unique_function<void(const T &)>
   mkOutNotifiction(llvm::StringRef Method, OutboundPort *O = nullptr) {
@@ -67,22 +176,24 @@ protected:
     };
   }
 
+  /// Calls expire after \p Deadline, or after `DefaultCallTimeout` if not
+  /// specified.
   template <class ParamTy, class ResponseTy>
   llvm::unique_function<void(const ParamTy &, Callback<ResponseTy>)>
-  mkOutMethod(llvm::StringRef Method, OutboundPort *O = nullptr) {
+  mkOutMethod(llvm::StringRef Method, OutboundPort *O = nullptr,
+              std::optional<Clock::time_point> Deadline = std::nullopt) {
     if (!O)
       O = Out.get();
     return [=, this](const ParamTy &Params, Callback<ResponseTy> Reply) {
       callMethod(
           Method, Params,
           [=, Reply = std::move(Reply)](
-              llvm::Expected<llvm::json::Value> Response) mutable {
+              llvm::Expected<RawJSON> Response) mutable {
             if (!Response)
               return Reply(Response.takeError());
-            Reply(
-                parseParam<ResponseTy>(std::move(*Response), Method, "reply"));
+            Reply(parseReply<ResponseTy>(std::move(*Response), Method));
           },
-          O);
+          O, Deadline);
     };
   }
 
@@ -92,6 +203,8 @@ public:
   void run();
 
   void switchStreamStyle(JSONStreamStyle Style) { In->StreamStyle = Style; }
+
+  void switchReadAhead(bool ReadAhead) { In->ReadAhead = ReadAhead; }
 };
 
 } // namespace lspserver
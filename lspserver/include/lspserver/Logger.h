@@ -5,6 +5,8 @@
 #include <llvm/Support/FormatAdapters.h>
 #include <llvm/Support/FormatVariadic.h>
 
+#include <chrono>
+#include <memory>
 #include <mutex>
 
 namespace lspserver {
@@ -22,10 +24,15 @@ public:
   /// Implementations of this method must be thread-safe.
   virtual void log(Level, const char *Fmt,
                    const llvm::formatv_object_base &Message) = 0;
+
+  /// Whether messages of level \p L are logged. Checked before messages are
+  /// formatted, so that filtered messages cost nothing.
+  [[nodiscard]] virtual bool enabled(Level L) const { return true; }
 };
 
 namespace detail {
 const char *debugType(const char *Filename);
+bool enabled(Logger::Level);
 void logImpl(Logger::Level, const char *Fmt, const llvm::formatv_object_base &);
 
 // We often want to consume llvm::Errors by value when passing them to log().
@@ -36,6 +43,8 @@ inline decltype(fmt_consume(llvm::Error::success())) wrap(llvm::Error &&V) {
 }
 template <typename... Ts>
 void log(Logger::Level L, const char *Fmt, Ts &&...Vals) {
+  if (!enabled(L))
+    return;
   detail::logImpl(L, Fmt,
                   llvm::formatv(Fmt, detail::wrap(std::forward<Ts>(Vals))...));
 }
@@ -63,6 +72,9 @@ template <typename... Ts> void log(const char *Fmt, Ts &&...Vals) {
 template <typename... Ts> void vlog(const char *Fmt, Ts &&...Vals) {
   detail::log(Logger::Verbose, Fmt, std::forward<Ts>(Vals)...);
 }
+// Whether vlog() messages are logged. Arguments that are expensive to prepare
+// (not only to format) should be skipped otherwise.
+inline bool vlogEnabled() { return detail::enabled(Logger::Verbose); }
 // error() constructs an llvm::Error object, using formatv()-style arguments.
 // It is not automatically logged! (This function is a little out of place).
 // The error simply embeds the message string.
@@ -101,21 +113,43 @@ public:
 };
 
 // Logs to an output stream, such as stderr.
+//
+// Messages are rendered by the logging thread into its own ring buffer, which
+// is lock-free, and written by a background thread in batches. Logging threads
+// never wait for the output, nor for each other. Forked processes (workers)
+// share a lock per batch, so that lines are not interleaved.
 class StreamLogger : public Logger {
-  pthread_mutex_t *ShmLock;
-
 public:
+  /// Each format string is logged at most this many times per second, others
+  /// are counted and reported. Errors are never suppressed.
+  static constexpr unsigned RateLimit = 100;
+
+  /// Messages buffered per thread, more are dropped (and counted) until the
+  /// writer catches up.
+  static constexpr size_t RingSize = 1024;
+
+  /// Interval of the writer, errors are written immediately.
+  static constexpr auto WriteInterval = std::chrono::milliseconds(20);
+
   StreamLogger(llvm::raw_ostream &Logs, Logger::Level MinLevel);
 
-  ~StreamLogger() override { pthread_mutex_destroy(ShmLock); }
+  ~StreamLogger() override;
 
-  /// Write a line to the logging stream.
+  /// Buffer a line for the logging stream.
   void log(Level, const char *Fmt,
            const llvm::formatv_object_base &Message) override;
 
+  [[nodiscard]] bool enabled(Level L) const override { return L >= MinLevel; }
+
+  /// Write messages buffered so far.
+  void flush();
+
+  /// Rings & the writer thread, see Logger.cpp.
+  struct Writer;
+
 private:
   Logger::Level MinLevel;
-  llvm::raw_ostream &Logs;
+  std::unique_ptr<Writer> W;
 };
 
 } // namespace lspserver
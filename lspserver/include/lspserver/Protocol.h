@@ -395,9 +395,9 @@ enum class OffsetEncoding {
   UnsupportedEncoding,
   // Length counts code units of UTF-16 encoded text. (Standard LSP behavior).
   UTF16,
-  // Length counts bytes of UTF-8 encoded text. (Clangd extension).
+  // Length counts bytes of UTF-8 encoded text. (Since LSP 3.17).
   UTF8,
-  // Length counts codepoints in unicode text. (Clangd extension).
+  // Length counts codepoints in unicode text. (Since LSP 3.17).
   UTF32,
 };
 llvm::json::Value toJSON(const OffsetEncoding &);
@@ -434,6 +434,14 @@ struct ClientCapabilities {
   /// textDocument.publishDiagnostics.categorySupport
   bool DiagnosticCategory = false;
 
+  /// Client supports pulling diagnostics.
+  /// textDocument.diagnostic
+  bool DiagnosticPull = false;
+
+  /// Client supports refreshing pulled diagnostics.
+  /// workspace.diagnostics.refreshSupport
+  bool DiagnosticRefresh = false;
+
   /// Client supports snippets as insert text.
   /// textDocument.completion.completionItem.snippetSupport
   bool CompletionSnippets = false;
@@ -495,6 +503,10 @@ struct ClientCapabilities {
   /// Supported encodings for LSP character offsets. (clangd extension).
   std::optional<std::vector<OffsetEncoding>> offsetEncoding;
 
+  /// Supported encodings for LSP positions, in order of preference.
+  /// general.positionEncodings
+  std::optional<std::vector<OffsetEncoding>> PositionEncodings;
+
   /// The content format that should be used for Hover requests.
   /// textDocument.hover.contentEncoding
   MarkupKind HoverContentFormat = MarkupKind::PlainText;
@@ -721,6 +733,8 @@ struct DidOpenTextDocumentParams {
 };
 bool fromJSON(const llvm::json::Value &, DidOpenTextDocumentParams &,
               llvm::json::Path);
+/// Move the text extracted from the message, see `extractTexts`.
+bool takeTexts(DidOpenTextDocumentParams &, std::vector<std::string> &);
 
 struct DidCloseTextDocumentParams {
   /// The document that was closed.
@@ -772,6 +786,8 @@ struct DidChangeTextDocumentParams {
 };
 bool fromJSON(const llvm::json::Value &, DidChangeTextDocumentParams &,
               llvm::json::Path);
+/// Move texts of content changes, in order, see `extractTexts`.
+bool takeTexts(DidChangeTextDocumentParams &, std::vector<std::string> &);
 
 enum class FileChangeType {
   /// The file got created.
@@ -953,6 +969,62 @@ struct PublishDiagnosticsParams {
 };
 llvm::json::Value toJSON(const PublishDiagnosticsParams &);
 
+/// Parameters of `textDocument/diagnostic` (pull diagnostics).
+struct DocumentDiagnosticParams {
+  /// The text document.
+  TextDocumentIdentifier textDocument;
+  /// The additional identifier provided during registration.
+  std::optional<std::string> identifier;
+  /// The result id of a previous response if provided.
+  std::optional<std::string> previousResultId;
+};
+bool fromJSON(const llvm::json::Value &, DocumentDiagnosticParams &,
+              llvm::json::Path);
+
+/// A full, or unchanged (if \p items are the same as the ones of the previous
+/// result id) document diagnostic report.
+struct DocumentDiagnosticReport {
+  /// "full" or "unchanged".
+  std::string kind = "full";
+  /// Compared with `previousResultId` of the next request.
+  std::optional<std::string> resultId;
+  /// Diagnostics of the document, omitted if unchanged.
+  std::vector<Diagnostic> items;
+};
+llvm::json::Value toJSON(const DocumentDiagnosticReport &);
+
+/// A previous result id in a workspace pull request.
+struct PreviousResultId {
+  /// The URI for which the client knows a result id.
+  URIForFile uri;
+  /// The value of the previous result id.
+  std::string value;
+};
+bool fromJSON(const llvm::json::Value &, PreviousResultId &, llvm::json::Path);
+
+/// Parameters of `workspace/diagnostic`.
+struct WorkspaceDiagnosticParams {
+  /// The additional identifier provided during registration.
+  std::optional<std::string> identifier;
+  /// The currently known diagnostic reports with their previous result ids.
+  std::vector<PreviousResultId> previousResultIds;
+};
+bool fromJSON(const llvm::json::Value &, WorkspaceDiagnosticParams &,
+              llvm::json::Path);
+
+struct WorkspaceDocumentDiagnosticReport : DocumentDiagnosticReport {
+  /// The URI for which diagnostic information is reported.
+  URIForFile uri;
+  /// The version number for which the diagnostics are reported.
+  std::optional<int64_t> version;
+};
+llvm::json::Value toJSON(const WorkspaceDocumentDiagnosticReport &);
+
+struct WorkspaceDiagnosticReport {
+  std::vector<WorkspaceDocumentDiagnosticReport> items;
+};
+llvm::json::Value toJSON(const WorkspaceDiagnosticReport &);
+
 struct CodeActionContext {
   /// An array of diagnostics known on the client side overlapping the range
   /// provided to the `textDocument/codeAction` request. They are provided so
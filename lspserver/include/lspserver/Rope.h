@@ -0,0 +1,78 @@
+#pragma once
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace lspserver {
+
+/// Immutable text, stored as a balanced tree (treap) of chunks.
+///
+/// Edits take O(log n), and return new ropes sharing unchanged chunks with
+/// the old one. Copying a rope is cheap, so that snapshots of drafts can be
+/// passed around (to the parser, to workers) without copying the text.
+class Rope {
+public:
+  /// Nodes of the tree, see Rope.cpp.
+  struct Node;
+  using NodePtr = std::shared_ptr<const Node>;
+
+private:
+  NodePtr Root;
+
+  explicit Rope(NodePtr Root) : Root(std::move(Root)) {}
+
+public:
+  static constexpr size_t npos = std::string::npos;
+
+  /// Texts are split into chunks of this size. Small edits are glued with
+  /// neighbouring chunks, up to half of this size.
+  static constexpr size_t MaxChunk = 1024;
+
+  Rope() = default;
+
+  explicit Rope(llvm::StringRef Text);
+
+  /// Like the constructor, but chunks refer to \p Text instead of copies.
+  /// It is kept as long as one of them is, even after edits.
+  static Rope adopt(std::string Text);
+
+  [[nodiscard]] size_t size() const;
+
+  [[nodiscard]] bool empty() const { return size() == 0; }
+
+  /// Number of '\n' in the text.
+  [[nodiscard]] size_t newlines() const;
+
+  /// Number of chunks, i.e. nodes of the tree.
+  [[nodiscard]] size_t chunks() const;
+
+  /// The last character. The rope must not be empty.
+  [[nodiscard]] char back() const;
+
+  /// Replace [Offset, Offset + Length) by \p Text. The range is clamped to
+  /// the text.
+  [[nodiscard]] Rope replace(size_t Offset, size_t Length,
+                             llvm::StringRef Text) const;
+
+  [[nodiscard]] Rope substr(size_t Offset, size_t Length = npos) const;
+
+  /// Offset of the first character of line \p Line (0-based), or std::nullopt
+  /// if there are not so many lines.
+  [[nodiscard]] std::optional<size_t> lineOffset(size_t Line) const;
+
+  /// Invoke \p CB on chunks, in order, until it returns true.
+  /// \returns true if stopped by \p CB.
+  bool forEachChunk(llvm::function_ref<bool(llvm::StringRef)> CB) const;
+
+  void appendTo(std::string &Out) const;
+
+  [[nodiscard]] std::string str() const;
+};
+
+} // namespace lspserver
@@ -13,6 +13,7 @@
 #pragma once
 
 #include "Protocol.h"
+#include "Rope.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Support/Error.h"
@@ -34,14 +35,15 @@ public:
   Key &operator=(Key &&) = delete;
 };
 
-// This context variable controls the behavior of functions in this file
-// that convert between LSP offsets and native clang byte offsets.
-// If not set, defaults to UTF-16 for backwards-compatibility.
-extern Key<OffsetEncoding> kCurrentOffsetEncoding;
+/// The encoding of LSP positions, used by functions in this file to convert
+/// between LSP offsets and byte offsets. It is negotiated with the client in
+/// "initialize", and defaults to UTF-16 as specified by LSP.
+OffsetEncoding lspEncoding();
 
-// Counts the number of UTF-16 code units needed to represent a string (LSP
-// specifies string lengths in UTF-16 code units).
-// Use of UTF-16 may be overridden by kCurrentOffsetEncoding.
+void setLSPEncoding(OffsetEncoding Encoding);
+
+// Counts the number of code units needed to represent a string, in the
+// encoding of lspEncoding(). For UTF-8 this is just the size of the string.
 size_t lspLength(llvm::StringRef Code);
 
 /// Turn a [line, column] pair into an offset in Code.
@@ -55,10 +57,25 @@ llvm::Expected<size_t>
 positionToOffset(llvm::StringRef Code, Position P,
                  bool AllowColumnsBeyondLineLength = true);
 
+/// Text of line \p Line (0-based) without the newline, or std::nullopt if
+/// the line number is out of range. Lines are found in O(log n).
+std::optional<std::string> getLine(const Rope &Code, size_t Line);
+
+/// Like above, but on a rope. Only the requested line is flattened.
+llvm::Expected<size_t>
+positionToOffset(const Rope &Code, Position P,
+                 bool AllowColumnsBeyondLineLength = true);
+
 /// Turn an offset in Code into a [line, column] pair.
 /// The offset must be in range [0, Code.size()].
 Position offsetToPosition(llvm::StringRef Code, size_t Offset);
 
+/// The word of \p Line around the byte \p Offset, i.e. the longest range
+/// containing it without any of \p Delimiters. \p Offset may be the end of
+/// the line.
+llvm::StringRef wordAround(llvm::StringRef Line, size_t Offset,
+                           llvm::StringRef Delimiters);
+
 // Expand range `A` to also contain `B`.
 void unionRanges(Range &A, Range B);
 
@@ -66,6 +83,11 @@ void unionRanges(Range &A, Range B);
 llvm::Error applyChange(std::string &Contents,
                         const TextDocumentContentChangeEvent &Change);
 
+/// Apply an incremental update to a rope, in O(log n) plus the length of
+/// touched lines.
+llvm::Error applyChange(Rope &Contents,
+                        const TextDocumentContentChangeEvent &Change);
+
 /// Collects words from the source code.
 /// Unlike collectIdentifiers:
 /// - also finds text in comments:
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/JSON.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/// Spans of requests, written in Chrome trace format (viewable in Perfetto or
+/// chrome://tracing).
+///
+/// Events of all processes (forked workers) are appended to the same file,
+/// and related by request ids and flows. Everything is a no-op unless tracing
+/// is enabled.
+namespace lspserver::trace {
+
+using Clock = std::chrono::steady_clock;
+
+/// Start writing events to \p Path. The file is a JSON array which is never
+/// terminated, as permitted by the format. Processes forked after this write
+/// to the same file.
+llvm::Error enable(llvm::StringRef Path);
+
+/// Stop writing events and close the file. Events being written concurrently
+/// may be lost.
+void disable();
+
+/// Whether tracing is enabled, checked before doing anything.
+bool enabled();
+
+/// Name this process in the trace, e.g. "eval worker".
+void nameProcess(llvm::StringRef Name);
+
+/// \returns an id, unique among processes of the session.
+uint64_t newID();
+
+/// The request handled by a thread. Events carry it, so that events of a
+/// request could be found in all processes.
+struct Context {
+  /// The client request (or notification), 0 if none.
+  uint64_t Request = 0;
+  /// The IPC call being handled, see `flowEnd`.
+  uint64_t Flow = 0;
+};
+
+/// The context of this thread.
+const Context &current();
+
+/// Set the context of this thread, until destroyed.
+class ContextScope {
+  Context Saved;
+
+public:
+  explicit ContextScope(Context C);
+  ~ContextScope();
+
+  ContextScope(const ContextScope &) = delete;
+  ContextScope &operator=(const ContextScope &) = delete;
+};
+
+/// A span of this thread, from construction to destruction.
+class Span {
+  bool Active;
+  std::string Name;
+  Clock::time_point Start;
+
+public:
+  explicit Span(llvm::StringRef Name);
+  /// A span started at \p Start, e.g. before forking, which the child process
+  /// should not report.
+  Span(llvm::StringRef Name, Clock::time_point Start);
+  ~Span();
+
+  Span(const Span &) = delete;
+  Span &operator=(const Span &) = delete;
+
+  /// Attached to the event.
+  llvm::json::Object Args;
+};
+
+/// A span that may end on another thread, e.g. a request waiting for workers.
+/// Ends when destroyed, if not ended before.
+class AsyncSpan {
+  bool Active = false;
+  std::string Name;
+  Clock::time_point Start;
+  uint64_t Request = 0;
+
+public:
+  AsyncSpan() = default;
+  explicit AsyncSpan(llvm::StringRef Name);
+  ~AsyncSpan() { end(); }
+
+  AsyncSpan(AsyncSpan &&Other) noexcept;
+  AsyncSpan &operator=(AsyncSpan &&Other) noexcept;
+
+  void end();
+
+  /// Attached to the event.
+  llvm::json::Object Args;
+};
+
+/// An arrow from the enclosing span of this thread, to the span where
+/// `flowEnd` is called with the same \p ID, maybe in another process.
+void flowBegin(uint64_t ID);
+
+void flowEnd(uint64_t ID);
+
+} // namespace lspserver::trace
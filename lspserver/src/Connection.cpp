@@ -1,13 +1,21 @@
 #include "lspserver/Connection.h"
 #include "lspserver/Logger.h"
 #include "lspserver/Protocol.h"
+#include "lspserver/Trace.h"
 
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/ConvertUTF.h>
+#include <llvm/Support/FormatVariadic.h>
 
 #include <sys/stat.h>
 
+#include <cassert>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <memory>
 #include <optional>
 #include <system_error>
@@ -74,25 +82,319 @@ void OutboundPort::reply(llvm::json::Value ID,
   }
 }
 
+void OutboundPort::replyRaw(llvm::json::Value ID,
+                            llvm::Expected<RawJSON> Result) {
+  if (!Result)
+    return reply(std::move(ID), Result.takeError());
+  if (Pretty) {
+    auto Parsed = llvm::json::parse(Result->Text);
+    if (!Parsed)
+      return reply(std::move(ID), Parsed.takeError());
+    return reply(std::move(ID), std::move(*Parsed));
+  }
+  vlog(">>> reply({0}) {1}", ID, Result->Text);
+  std::lock_guard<std::mutex> Guard(Mutex);
+  trace::Span Tracer("send");
+  OutputBuffer.clear();
+  llvm::raw_svector_ostream SVecOS(OutputBuffer);
+  llvm::json::OStream JOS(SVecOS);
+  JOS.object([&]() {
+    JOS.attribute("jsonrpc", "2.0");
+    JOS.attribute("id", ID);
+    JOS.attributeBegin("result");
+    JOS.rawValue(Result->Text);
+    JOS.attributeEnd();
+  });
+  flushOutput();
+}
+
+void OutboundPort::flushOutput() {
+  Outs << "Content-Length: " << OutputBuffer.size() << "\r\n\r\n"
+       << OutputBuffer;
+  Outs.flush();
+}
+
 void OutboundPort::sendMessage(llvm::json::Value Message) {
   // Make sure our outputs are not interleaving between messages (json)
-  vlog(">>> {0}", Message);
   std::lock_guard<std::mutex> Guard(Mutex);
+  // Serialization and writing, e.g. of large replies.
+  trace::Span Tracer("send");
   OutputBuffer.clear();
   llvm::raw_svector_ostream SVecOS(OutputBuffer);
   SVecOS << (Pretty ? llvm::formatv("{0:2}", Message)
                     : llvm::formatv("{0}", Message));
-  Outs << "Content-Length: " << OutputBuffer.size() << "\r\n\r\n"
-       << OutputBuffer;
-  Outs.flush();
+  // Logged as rendered, instead of serializing the message again.
+  vlog(">>> {0}", llvm::StringRef(OutputBuffer.data(), OutputBuffer.size()));
+  flushOutput();
+}
+
+namespace {
+
+bool parseHex4(llvm::StringRef S, size_t At, uint32_t &Out) {
+  if (At + 4 > S.size())
+    return false;
+  return !S.substr(At, 4).getAsInteger(16, Out);
+}
+
+/// Decode the body of a JSON string literal \p Literal into \p Out.
+/// \returns false on anything the JSON parser rejects: invalid escapes
+/// (including unpaired surrogates), unescaped control characters, and invalid
+/// UTF-8. Such messages are left to the parser, which reports them.
+bool decodeString(llvm::StringRef Literal, std::string &Out) {
+  Out.clear();
+  Out.reserve(Literal.size());
+  for (size_t I = 0; I < Literal.size();) {
+    size_t Escape = std::min(Literal.find('\\', I), Literal.size());
+    llvm::StringRef Chunk = Literal.slice(I, Escape);
+    if (llvm::any_of(Chunk, [](char C) {
+          return static_cast<unsigned char>(C) < 0x20;
+        }))
+      return false;
+    Out.append(Chunk.begin(), Chunk.end());
+    if (Escape == Literal.size())
+      break;
+    if (Escape + 1 == Literal.size())
+      return false;
+    I = Escape + 2;
+    switch (char C = Literal[Escape + 1]) {
+    case '"':
+    case '\\':
+    case '/':
+      Out += C;
+      break;
+    case 'b':
+      Out += '\b';
+      break;
+    case 'f':
+      Out += '\f';
+      break;
+    case 'n':
+      Out += '\n';
+      break;
+    case 'r':
+      Out += '\r';
+      break;
+    case 't':
+      Out += '\t';
+      break;
+    case 'u': {
+      uint32_t CodePoint;
+      if (!parseHex4(Literal, I, CodePoint))
+        return false;
+      I += 4;
+      if (CodePoint >= 0xD800 && CodePoint < 0xDC00) {
+        // A high surrogate, must be followed by a low one.
+        uint32_t Low;
+        if (!Literal.substr(I).startswith("\\u") ||
+            !parseHex4(Literal, I + 2, Low) || Low < 0xDC00 || Low >= 0xE000)
+          return false;
+        I += 6;
+        CodePoint = 0x10000 + ((CodePoint - 0xD800) << 10) + (Low - 0xDC00);
+      } else if (CodePoint >= 0xDC00 && CodePoint < 0xE000) {
+        return false;
+      }
+      char Buf[UNI_MAX_UTF8_BYTES_PER_CODE_POINT];
+      char *End = Buf;
+      if (!llvm::ConvertCodePointToUTF8(CodePoint, End))
+        return false;
+      Out.append(Buf, End);
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  // Escapes are always encoded correctly, the rest is copied as it is.
+  return llvm::json::isUTF8(Out);
+}
+
+} // namespace
+
+namespace {
+
+/// [Begin, End) of a value in the raw message.
+using Span = std::pair<size_t, size_t>;
+
+/// Values of a message found by `scanMessage`.
+struct MessageSpans {
+  std::optional<llvm::StringRef> Method;
+  /// params.textDocument.text
+  std::vector<Span> OpenTexts;
+  /// params.contentChanges[].text
+  std::vector<Span> ChangeTexts;
+  /// The result of replies.
+  std::optional<Span> Result;
+};
+
+/// A minimal tokenizer, only tracking keys of enclosing containers. Values
+/// are validated later, by the JSON parser.
+bool scanMessage(llvm::StringRef JSON, MessageSpans &Spans) {
+  struct Frame {
+    bool IsObject;
+    /// The key of this container in the parent object, or "" in arrays.
+    llvm::StringRef Key;
+  };
+  llvm::SmallVector<Frame, 8> Stack;
+  llvm::StringRef Key;
+  bool ExpectKey = false;
+  std::optional<size_t> ResultBegin;
+
+  auto AtResult = [&]() {
+    return Stack.size() == 1 && Key == "result" && !ExpectKey &&
+           !Spans.Result && !ResultBegin;
+  };
+  auto IsOpenText = [&]() {
+    return Stack.size() == 3 && Stack[1].Key == "params" &&
+           Stack[2].Key == "textDocument" && Stack[2].IsObject;
+  };
+  auto IsChangeText = [&]() {
+    return Stack.size() == 4 && Stack[1].Key == "params" &&
+           Stack[2].Key == "contentChanges" && !Stack[2].IsObject &&
+           Stack[3].IsObject;
+  };
+
+  for (size_t I = 0; I < JSON.size(); I++) {
+    switch (char C = JSON[I]) {
+    case '{':
+    case '[':
+      if (AtResult())
+        ResultBegin = I;
+      Stack.push_back({C == '{', Key});
+      ExpectKey = C == '{';
+      Key = {};
+      break;
+    case '}':
+    case ']':
+      if (Stack.empty())
+        return false;
+      Stack.pop_back();
+      ExpectKey = false;
+      if (ResultBegin && !Spans.Result && Stack.size() == 1)
+        Spans.Result = Span(*ResultBegin, I + 1);
+      break;
+    case ',':
+      ExpectKey = !Stack.empty() && Stack.back().IsObject;
+      Key = {};
+      break;
+    case ':':
+      ExpectKey = false;
+      break;
+    case '"': {
+      size_t End = I + 1;
+      for (; End < JSON.size() && JSON[End] != '"'; End++) {
+        if (JSON[End] == '\\')
+          End++;
+      }
+      if (End >= JSON.size())
+        return false;
+      llvm::StringRef Literal = JSON.slice(I + 1, End);
+      if (ExpectKey)
+        Key = Literal;
+      else if (AtResult())
+        Spans.Result = Span(I, End + 1);
+      else if (Stack.size() == 1 && Key == "method")
+        Spans.Method = Literal;
+      else if (Key == "text" && IsOpenText())
+        Spans.OpenTexts.emplace_back(I, End + 1);
+      else if (Key == "text" && IsChangeText())
+        Spans.ChangeTexts.emplace_back(I, End + 1);
+      I = End;
+      break;
+    }
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+      break;
+    default: // Numbers, and literals.
+      if (AtResult()) {
+        size_t End = JSON.find_first_of(",}] \t\r\n", I);
+        if (End == llvm::StringRef::npos)
+          return false;
+        Spans.Result = Span(I, End);
+        I = End - 1;
+      }
+      break;
+    }
+  }
+  return Stack.empty();
+}
+
+/// Replace sorted, disjoint \p Spans of \p JSONString by \p With, which is
+/// not longer than any of them. The rest is moved forward, in place.
+void replaceSpans(std::string &JSONString, llvm::ArrayRef<Span> Spans,
+                  llvm::StringRef With) {
+  size_t Out = 0;
+  size_t In = 0;
+  for (auto [Begin, End] : Spans) {
+    assert(End - Begin >= With.size());
+    std::memmove(&JSONString[Out], &JSONString[In], Begin - In);
+    Out += Begin - In;
+    std::memcpy(&JSONString[Out], With.data(), With.size());
+    Out += With.size();
+    In = End;
+  }
+  std::memmove(&JSONString[Out], &JSONString[In], JSONString.size() - In);
+  JSONString.resize(Out + JSONString.size() - In);
+}
+
+bool spliceTexts(std::string &JSONString, const MessageSpans &Spans,
+                 MessageTexts &Texts) {
+  const std::vector<Span> *Found;
+  if (Spans.Method == "textDocument/didOpen")
+    Found = &Spans.OpenTexts;
+  else if (Spans.Method == "textDocument/didChange")
+    Found = &Spans.ChangeTexts;
+  else
+    return false;
+  if (Found->empty())
+    return false;
+
+  MessageTexts Decoded(Found->size());
+  for (size_t I = 0; I < Found->size(); I++) {
+    auto [Begin, End] = (*Found)[I];
+    llvm::StringRef Literal(JSONString.data() + Begin + 1, End - Begin - 2);
+    if (!decodeString(Literal, Decoded[I]))
+      return false;
+  }
+  replaceSpans(JSONString, *Found, "\"\"");
+  Texts = std::move(Decoded);
+  return true;
+}
+
+bool spliceResult(std::string &JSONString, const MessageSpans &Spans,
+                  RawJSON &Result) {
+  if (Spans.Method || !Spans.Result)
+    return false;
+  auto [Begin, End] = *Spans.Result;
+  Result = RawJSON(JSONString.substr(Begin, End - Begin));
+  replaceSpans(JSONString, *Spans.Result, "0");
+  return true;
+}
+
+} // namespace
+
+RawJSON::RawJSON(const llvm::json::Value &V)
+    : Text(llvm::formatv("{0}", V).str()) {}
+
+bool extractTexts(std::string &JSONString, MessageTexts &Texts) {
+  MessageSpans Spans;
+  return scanMessage(JSONString, Spans) &&
+         spliceTexts(JSONString, Spans, Texts);
 }
 
-bool InboundPort::dispatch(llvm::json::Value Message, MessageHandler &Handler) {
+bool extractResult(std::string &JSONString, RawJSON &Result) {
+  MessageSpans Spans;
+  return scanMessage(JSONString, Spans) &&
+         spliceResult(JSONString, Spans, Result);
+}
+
+bool InboundPort::dispatch(InboundMessage Message, MessageHandler &Handler) {
   // Message must be an object with "jsonrpc":"2.0".
-  auto *Object = Message.getAsObject();
+  auto *Object = Message.JSON.getAsObject();
   if (!Object ||
       Object->getString("jsonrpc") != std::optional<llvm::StringRef>("2.0")) {
-    elog("Not a JSON-RPC 2.0 message: {0:2}", Message);
+    elog("Not a JSON-RPC 2.0 message: {0:2}", Message.JSON);
     return false;
   }
   // ID may be any JSON value. If absent, this is a notification.
@@ -102,16 +404,18 @@ bool InboundPort::dispatch(llvm::json::Value Message, MessageHandler &Handler) {
   auto Method = Object->getString("method");
   if (!Method) { // This is a response.
     if (!ID) {
-      elog("No method and no response ID: {0:2}", Message);
+      elog("No method and no response ID: {0:2}", Message.JSON);
       return false;
     }
     if (auto *Err = Object->getObject("error"))
       // TODO: Logging & reply errors.
       return Handler.onReply(std::move(*ID), decodeError(*Err));
+    if (Message.Result)
+      return Handler.onReply(std::move(*ID), std::move(*Message.Result));
     // Result should be given, use null if not.
-    llvm::json::Value Result = nullptr;
+    RawJSON Result;
     if (auto *R = Object->get("result"))
-      Result = std::move(*R);
+      Result = RawJSON(*R);
     return Handler.onReply(std::move(*ID), std::move(Result));
   }
   // Params should be given, use null if not.
@@ -121,7 +425,8 @@ bool InboundPort::dispatch(llvm::json::Value Message, MessageHandler &Handler) {
 
   if (ID)
     return Handler.onCall(*Method, std::move(Params), std::move(*ID));
-  return Handler.onNotify(*Method, std::move(Params));
+  return Handler.onNotify(*Method, std::move(Params),
+                          std::move(Message.Texts));
 }
 
 bool readLine(int fd, llvm::SmallString<128> &Line) {
@@ -215,24 +520,111 @@ bool InboundPort::readMessage(std::string &JSONString) {
   }
 }
 
-void InboundPort::loop(MessageHandler &Handler) {
+std::optional<InboundMessage> InboundPort::readJSON() {
   std::string JSONString;
-  llvm::SmallString<128> Line;
+  if (!readMessage(JSONString))
+    return std::nullopt;
+  vlog("<<< {0}", JSONString);
+  InboundMessage Message;
+  // Documents are not parsed into the DOM, which only keeps small metadata.
+  // Results of replies are not parsed either, until the receiver needs them.
+  MessageSpans Spans;
+  if (scanMessage(JSONString, Spans)) {
+    RawJSON Result;
+    if (spliceResult(JSONString, Spans, Result))
+      Message.Result = std::move(Result);
+    else
+      spliceTexts(JSONString, Spans, Message.Texts);
+  }
+  auto ExpectedParsedJSON = llvm::json::parse(JSONString);
+  if (!ExpectedParsedJSON) {
+    auto Err = ExpectedParsedJSON.takeError();
+    elog("The received json cannot be parsed, reason: {0}", Err);
+    return std::nullopt;
+  }
+  Message.JSON = std::move(*ExpectedParsedJSON);
+  return Message;
+}
 
-  for (;;) {
-    if (readMessage(JSONString)) {
-      vlog("<<< {0}", JSONString);
-      if (auto ExpectedParsedJSON = llvm::json::parse(JSONString)) {
-        if (!dispatch(*ExpectedParsedJSON, Handler))
+std::optional<InboundMessage> InboundPort::popMessage() {
+  if (!Queue) {
+    Queue = std::make_shared<MessageQueue>();
+    // The reader owns a copy of this port, it only shares the queue with us.
+    std::thread([Q = Queue, Reader = InboundPort(In, StreamStyle)]() mutable {
+      for (;;) {
+        auto Message = Reader.readJSON();
+        std::lock_guard Guard(Q->Lock);
+        if (!Message) {
+          Q->Closed = true;
+          Q->CV.notify_all();
           return;
-      } else {
-        auto Err = ExpectedParsedJSON.takeError();
-        elog("The received json cannot be parsed, reason: {0}", Err);
-        return;
+        }
+        const auto *Object = Message->JSON.getAsObject();
+        if (Object && Object->getString("method") == "$/cancelRequest") {
+          // Handlers may poll this while running.
+          if (const auto *Params = Object->getObject("params")) {
+            if (const auto *ID = Params->get("id")) {
+              auto It = Q->Calls.find(llvm::formatv("{0}", *ID).str());
+              if (It != Q->Calls.end()) {
+                It->second = true;
+                Q->Cancellations++;
+              }
+            }
+          }
+          continue;
+        }
+        if (Object && Object->get("method")) {
+          if (const auto *ID = Object->get("id"))
+            Q->Calls.emplace(llvm::formatv("{0}", *ID).str(), false);
+        }
+        Q->Messages.emplace_back(std::move(*Message));
+        Q->CV.notify_all();
       }
-    } else {
+    }).detach();
+  }
+  std::unique_lock Lock(Queue->Lock);
+  Queue->CV.wait(
+      Lock, [this]() { return !Queue->Messages.empty() || Queue->Closed; });
+  if (Queue->Messages.empty())
+    return std::nullopt;
+  auto Message = std::move(Queue->Messages.front());
+  Queue->Messages.pop_front();
+  return Message;
+}
+
+bool InboundPort::anyQueued(
+    llvm::function_ref<bool(const llvm::json::Object &)> Pred) {
+  if (!Queue)
+    return false;
+  std::lock_guard Guard(Queue->Lock);
+  for (const auto &Message : Queue->Messages) {
+    if (const auto *Object = Message.JSON.getAsObject();
+        Object && Pred(*Object))
+      return true;
+  }
+  return false;
+}
+
+bool InboundPort::isCancelled(const llvm::json::Value &ID) {
+  if (!cancellations())
+    return false;
+  std::lock_guard Guard(Queue->Lock);
+  auto It = Queue->Calls.find(llvm::formatv("{0}", ID).str());
+  return It != Queue->Calls.end() && It->second;
+}
+
+void InboundPort::answered(const llvm::json::Value &ID) {
+  if (!Queue)
+    return;
+  std::lock_guard Guard(Queue->Lock);
+  Queue->Calls.erase(llvm::formatv("{0}", ID).str());
+}
+
+void InboundPort::loop(MessageHandler &Handler) {
+  for (;;) {
+    auto Message = ReadAhead ? popMessage() : readJSON();
+    if (!Message || !dispatch(std::move(*Message), Handler))
       return;
-    }
   }
 }
 
@@ -15,9 +15,26 @@
 
 namespace lspserver {
 
+const std::shared_ptr<const std::string> &DraftStore::flatten(Draft &D) {
+  if (!D.Contents)
+    D.Contents = std::make_shared<const std::string>(D.Text.str());
+  return D.Contents;
+}
+
 std::optional<DraftStore::Draft> DraftStore::getDraft(PathRef File) const {
   std::lock_guard<std::mutex> Lock(Mutex);
 
+  auto It = Drafts.find(File);
+  if (It == Drafts.end())
+    return std::nullopt;
+
+  flatten(It->second.D);
+  return It->second.D;
+}
+
+std::optional<DraftStore::Draft> DraftStore::peekDraft(PathRef File) const {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
   auto It = Drafts.find(File);
   if (It == Drafts.end())
     return std::nullopt;
@@ -83,12 +100,18 @@ static void updateVersion(DraftStore::Draft &D,
 
 std::string DraftStore::addDraft(PathRef File, llvm::StringRef Version,
                                  llvm::StringRef Contents) {
+  return addDraft(File, Version, Rope(Contents));
+}
+
+std::string DraftStore::addDraft(PathRef File, llvm::StringRef Version,
+                                 Rope Text) {
   std::lock_guard<std::mutex> Lock(Mutex);
 
   auto &D = Drafts[File];
   updateVersion(D.D, Version);
   std::time(&D.MTime);
-  D.D.Contents = std::make_shared<std::string>(Contents);
+  D.D.Text = std::move(Text);
+  D.D.Contents = nullptr;
   return D.D.Version;
 }
 
@@ -127,10 +150,10 @@ public:
 llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> DraftStore::asVFS() const {
   auto MemFS = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
   std::lock_guard<std::mutex> Guard(Mutex);
-  for (const auto &Draft : Drafts)
+  for (auto &Draft : Drafts)
     MemFS->addFile(Draft.getKey(), Draft.getValue().MTime,
                    std::make_unique<SharedStringBuffer>(
-                       Draft.getValue().D.Contents, Draft.getKey()));
+                       flatten(Draft.getValue().D), Draft.getKey()));
   return MemFS;
 }
 
@@ -1,26 +1,49 @@
 #include "lspserver/LSPServer.h"
 #include "lspserver/Connection.h"
 #include "lspserver/Function.h"
+#include "lspserver/Protocol.h"
+#include "lspserver/Trace.h"
 
 #include <llvm/ADT/FunctionExtras.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/Support/Compiler.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/JSON.h>
 
+#include <algorithm>
 #include <mutex>
+#include <optional>
 #include <stdexcept>
 
 namespace lspserver {
 
+namespace {
+
+/// The context of an incoming message. Calls of peers may continue a request,
+/// then the context has been set by the caller.
+trace::Context traceContext() {
+  trace::Context Ctx = trace::current();
+  if (trace::enabled() && !Ctx.Request)
+    Ctx.Request = trace::newID();
+  return Ctx;
+}
+
+} // namespace
+
 void LSPServer::run() { In->loop(*this); }
 
-bool LSPServer::onNotify(llvm::StringRef Method, llvm::json::Value Params) {
+bool LSPServer::onNotify(llvm::StringRef Method, llvm::json::Value Params,
+                         MessageTexts Texts) {
   log("<-- {0}", Method);
   if (Method == "exit")
     return false;
+  trace::ContextScope Scope(traceContext());
+  trace::Span Tracer(Method);
   auto Handler = Registry.NotificationHandlers.find(Method);
   if (Handler != Registry.NotificationHandlers.end()) {
-    Handler->second(std::move(Params));
+    auto Start = Clock::now();
+    Handler->second(std::move(Params), std::move(Texts));
+    onHandled(Method, Clock::now() - Start, /*Failed=*/false);
   } else {
     log("unhandled notification {0}", Method);
   }
@@ -30,11 +53,30 @@ bool LSPServer::onNotify(llvm::StringRef Method, llvm::json::Value Params) {
 bool LSPServer::onCall(llvm::StringRef Method, llvm::json::Value Params,
                        llvm::json::Value ID) {
   log("<-- {0}({1})", Method, ID);
+  auto Start = Clock::now();
+  if (isStale(Method, Params) || isCancelled(ID)) {
+    log("--> reply:{0}({1}) dropped, the request is stale", Method, ID);
+    In->answered(ID);
+    Out->reply(std::move(ID),
+               llvm::make_error<LSPError>("the request is stale",
+                                          ErrorCode::RequestCancelled));
+    onHandled(Method, Clock::now() - Start, /*Failed=*/true);
+    return true;
+  }
+  trace::ContextScope Scope(traceContext());
+  trace::Span Tracer(Method);
+  if (trace::current().Flow)
+    trace::flowEnd(trace::current().Flow);
+  // From receipt to reply, including time spent in queues and workers.
+  trace::AsyncSpan Pending(Method);
   auto Handler = Registry.MethodHandlers.find(Method);
   if (Handler != Registry.MethodHandlers.end())
     Handler->second(std::move(Params),
-                    [=, Method = std::string(Method),
-                     this](llvm::Expected<llvm::json::Value> Response) mutable {
+                    [=, Method = std::string(Method), this,
+                     Pending = std::move(Pending)](
+                        llvm::Expected<llvm::json::Value> Response) mutable {
+                      bool Failed = !Response;
+                      In->answered(ID);
                       if (Response) {
                         log("--> reply:{0}({1})", Method, ID);
                         Out->reply(std::move(ID), std::move(Response));
@@ -44,57 +86,251 @@ bool LSPServer::onCall(llvm::StringRef Method, llvm::json::Value Params,
                             Err);
                         Out->reply(std::move(ID), std::move(Err));
                       }
+                      Pending.end();
+                      onHandled(Method, Clock::now() - Start, Failed);
                     });
+  else if (auto Raw = Registry.RawMethodHandlers.find(Method);
+           Raw != Registry.RawMethodHandlers.end())
+    Raw->second(std::move(Params),
+                [=, Method = std::string(Method), this,
+                 Pending = std::move(Pending)](
+                    llvm::Expected<RawJSON> Response) mutable {
+                  bool Failed = !Response;
+                  In->answered(ID);
+                  if (Response) {
+                    log("--> reply:{0}({1}) raw", Method, ID);
+                    Out->replyRaw(std::move(ID), std::move(Response));
+                  } else {
+                    llvm::Error Err = Response.takeError();
+                    log("--> reply:{0}({1}) error: {2}", Method, ID, Err);
+                    Out->reply(std::move(ID), std::move(Err));
+                  }
+                  Pending.end();
+                  onHandled(Method, Clock::now() - Start, Failed);
+                });
   else
     return false;
   return true;
 }
 
 bool LSPServer::onReply(llvm::json::Value ID,
-                        llvm::Expected<llvm::json::Value> Result) {
+                        llvm::Expected<RawJSON> Result) {
   log("<-- reply({0})", ID);
-  std::optional<Callback<llvm::json::Value>> CB;
+  std::optional<Callback<RawJSON>> CB;
+  OutboundPort *Port = nullptr;
+  std::vector<QueuedCall> Admitted;
 
   if (auto OptI = ID.getAsInteger()) {
     if (LLVM_UNLIKELY(*OptI > INT_MAX))
       throw std::logic_error("jsonrpc: id is too large (> INT_MAX)");
     std::lock_guard<std::mutex> Guard(PendingCallsLock);
     auto I = static_cast<int>(*OptI);
-    if (PendingCalls.contains(I)) {
-      CB = std::move(PendingCalls[I]);
-      PendingCalls.erase(I);
+    if (auto It = CallPorts.find(I); It != CallPorts.end()) {
+      Port = It->second;
+      auto &Table = PendingCalls[Port];
+      if (auto Call = Table.Sent.find(I); Call != Table.Sent.end()) {
+        CB = std::move(Call->second.CB);
+        Table.Sent.erase(Call);
+        CallPorts.erase(It);
+        Admitted = admitQueued(Table);
+      }
     }
   } else {
     throw std::logic_error("jsonrpc: not an integer message ID");
   }
   if (LLVM_UNLIKELY(!CB)) {
-    elog("received a reply with ID {0}, but there was no such call", ID);
-    // Ignore this error
+    // Calls that have passed their deadline are forgotten.
+    log("received a reply with ID {0}, but there was no such call", ID);
     return true;
   }
+  sendQueued(Port, std::move(Admitted));
   // Invoke the callback outside of the critical zone, because we just do not
   // need to lock PendingCalls.
   (*CB)(std::move(Result));
+  expireCalls();
   return true;
 }
 
-int LSPServer::bindReply(Callback<llvm::json::Value> CB) {
-  std::lock_guard<std::mutex> _(PendingCallsLock);
-  int Ret = TopID++;
-  PendingCalls[Ret] = std::move(CB);
-
-  // Check the limit
-  if (PendingCalls.size() > MaxPendingCalls) {
-    auto Begin = PendingCalls.begin();
-    auto [ID, OldestCallback] =
-        std::tuple{Begin->first, std::move(Begin->second)};
-    OldestCallback(
-        error("failed to receive a client reply for request ({0})", ID));
-    elog("more than {0} outstanding LSP calls, forgetting about {1}",
-         MaxPendingCalls, ID);
-    PendingCalls.erase(Begin);
+/// \returns "textDocument.uri" in \p Params, if any.
+static std::optional<llvm::StringRef>
+getDocumentURI(const llvm::json::Value &Params) {
+  if (const auto *Object = Params.getAsObject())
+    if (const auto *TextDocument = Object->getObject("textDocument"))
+      return TextDocument->getString("uri");
+  return std::nullopt;
+}
+
+bool LSPServer::isSuperseded(llvm::StringRef Method,
+                             const llvm::json::Value &Params) {
+  auto URI = getDocumentURI(Params);
+  if (!URI)
+    return false;
+  return In->anyQueued([&](const llvm::json::Object &Message) {
+    if (!Message.get("id") || Message.getString("method") != Method)
+      return false;
+    const auto *QueuedParams = Message.get("params");
+    return QueuedParams && getDocumentURI(*QueuedParams) == URI;
+  });
+}
+
+std::vector<LSPServer::QueuedCall>
+LSPServer::admitQueued(CallTable &Table) {
+  std::vector<QueuedCall> Admitted;
+  while (!Table.Queued.empty() && Table.Sent.size() < Table.Limit) {
+    auto &Front = Table.Queued.front();
+    Table.Sent[Front.ID] = std::move(Front.Call);
+    Admitted.emplace_back(std::move(Front));
+    Table.Queued.pop_front();
+  }
+  return Admitted;
+}
+
+void LSPServer::sendQueued(OutboundPort *O, std::vector<QueuedCall> Calls) {
+  for (auto &Call : Calls) {
+    log("--> call {0}({1}) dequeued", Call.Method, Call.ID);
+    O->call(Call.Method, std::move(Call.Params), Call.ID);
+  }
+}
+
+llvm::json::Value
+LSPServer::callMethod(llvm::StringRef Method, llvm::json::Value Params,
+                      Callback<RawJSON> CB, OutboundPort *O,
+                      std::optional<Clock::time_point> Deadline) {
+  if (!Deadline)
+    Deadline = Clock::now() + DefaultCallTimeout;
+  int ID;
+  bool Send;
+  {
+    std::lock_guard<std::mutex> _(PendingCallsLock);
+    ID = TopID++;
+    auto &Table = PendingCalls[O];
+    CallPorts[ID] = O;
+    NextExpiry = std::min(NextExpiry, *Deadline);
+    // Keep the order of calls, queued ones go first.
+    Send = Table.Queued.empty() && Table.Sent.size() < Table.Limit;
+    if (Send) {
+      Table.Sent[ID] = {std::move(CB), *Deadline};
+    } else {
+      log("--> call {0}({1}) queued, {2} calls in flight", Method, ID,
+          Table.Sent.size());
+      Table.Queued.push_back(
+          {ID, Method.str(), std::move(Params), {std::move(CB), *Deadline}});
+    }
+  }
+  if (Send) {
+    log("--> call {0}({1})", Method, ID);
+    O->call(Method, Params, ID);
+  }
+  return ID;
+}
+
+void LSPServer::cancelCall(const llvm::json::Value &ID, OutboundPort *O) {
+  if (!O)
+    O = Out.get();
+  if (auto OptI = ID.getAsInteger()) {
+    std::lock_guard<std::mutex> _(PendingCallsLock);
+    auto &Queued = PendingCalls[O].Queued;
+    auto It = llvm::find_if(
+        Queued, [&](const QueuedCall &Call) { return Call.ID == *OptI; });
+    if (It != Queued.end()) {
+      log("--> cancel ({0}), not sent yet", ID);
+      Dropped.emplace_back([CB = std::move(It->Call.CB)]() mutable {
+        CB(llvm::make_error<LSPError>("the call is cancelled",
+                                      ErrorCode::RequestCancelled));
+      });
+      CallPorts.erase(It->ID);
+      Queued.erase(It);
+      return;
+    }
+  }
+  log("--> cancel ({0})", ID);
+  O->notify("$/cancelRequest", llvm::json::Object{{"id", ID}});
+}
+
+void LSPServer::setCallLimit(OutboundPort *O, size_t Limit) {
+  std::vector<QueuedCall> Admitted;
+  {
+    std::lock_guard<std::mutex> _(PendingCallsLock);
+    auto &Table = PendingCalls[O];
+    Table.Limit = Limit;
+    Admitted = admitQueued(Table);
+  }
+  sendQueued(O, std::move(Admitted));
+}
+
+void LSPServer::forgetCalls(OutboundPort *O) {
+  std::lock_guard<std::mutex> Guard(PendingCallsLock);
+  auto It = PendingCalls.find(O);
+  if (It == PendingCalls.end())
+    return;
+  auto &Table = It->second;
+  for (auto &[ID, Call] : Table.Sent) {
+    CallPorts.erase(ID);
+    Dropped.emplace_back([ID = ID, CB = std::move(Call.CB)]() mutable {
+      CB(error("the peer is gone before replying ({0})", ID));
+    });
+  }
+  for (auto &[ID, Method, Params, Call] : Table.Queued) {
+    CallPorts.erase(ID);
+    Dropped.emplace_back([ID = ID, CB = std::move(Call.CB)]() mutable {
+      CB(error("the peer is gone before the call ({0})", ID));
+    });
+  }
+  PendingCalls.erase(It);
+}
+
+void LSPServer::expireCalls() {
+  std::vector<llvm::unique_function<void()>> Failures;
+  std::vector<std::pair<OutboundPort *, llvm::json::Value>> Cancelled;
+  std::vector<std::pair<OutboundPort *, std::vector<QueuedCall>>> Admitted;
+  {
+    std::lock_guard<std::mutex> _(PendingCallsLock);
+    auto Now = Clock::now();
+    Failures = std::move(Dropped);
+    Dropped.clear();
+    if (Now >= NextExpiry) {
+      NextExpiry = Clock::time_point::max();
+      auto Expire = [&](int ID, PendingCall &Call) {
+        CallPorts.erase(ID);
+        Failures.emplace_back([ID, CB = std::move(Call.CB)]() mutable {
+          elog("no reply for call ({0}) before its deadline", ID);
+          CB(error("failed to receive a reply for call ({0}) in time", ID));
+        });
+      };
+      for (auto &[Port, Table] : PendingCalls) {
+        for (auto It = Table.Sent.begin(); It != Table.Sent.end();) {
+          if (It->second.Deadline > Now) {
+            NextExpiry = std::min(NextExpiry, It->second.Deadline);
+            ++It;
+            continue;
+          }
+          Expire(It->first, It->second);
+          Cancelled.emplace_back(Port, It->first);
+          It = Table.Sent.erase(It);
+        }
+        for (auto It = Table.Queued.begin(); It != Table.Queued.end();) {
+          if (It->Call.Deadline > Now) {
+            NextExpiry = std::min(NextExpiry, It->Call.Deadline);
+            ++It;
+            continue;
+          }
+          Expire(It->ID, It->Call);
+          It = Table.Queued.erase(It);
+        }
+        if (auto Calls = admitQueued(Table); !Calls.empty())
+          Admitted.emplace_back(Port, std::move(Calls));
+      }
+    }
+  }
+  // The peer may still be working on calls sent, they are useless now.
+  for (auto &[Port, ID] : Cancelled) {
+    log("--> cancel ({0}), deadline passed", ID);
+    Port->notify("$/cancelRequest", llvm::json::Object{{"id", ID}});
   }
-  return Ret;
+  for (auto &[Port, Calls] : Admitted)
+    sendQueued(Port, std::move(Calls));
+  for (auto &Fail : Failures)
+    Fail();
 }
 
 } // namespace lspserver
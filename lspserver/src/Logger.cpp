@@ -8,16 +8,22 @@
 
 #include "lspserver/Logger.h"
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/Support/Chrono.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/FormatVariadic.h>
 #include <llvm/Support/raw_ostream.h>
 
-#include <boost/interprocess/sync/named_mutex.hpp>
-#include <boost/interprocess/sync/scoped_lock.hpp>
-
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <mutex>
+#include <thread>
+#include <vector>
 
+#include <pthread.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -34,6 +40,8 @@ LoggingSession::LoggingSession(Logger &Instance) {
 
 LoggingSession::~LoggingSession() { L = nullptr; }
 
+bool detail::enabled(Logger::Level Level) { return !L || L->enabled(Level); }
+
 void detail::logImpl(Logger::Level Level, const char *Fmt,
                      const llvm::formatv_object_base &Message) {
   if (L)
@@ -53,23 +61,6 @@ const char *detail::debugType(const char *Filename) {
   return Filename;
 }
 
-void StreamLogger::log(Logger::Level Level, const char *Fmt,
-                       const llvm::formatv_object_base &Message) {
-  using namespace boost::interprocess;
-  if (Level < MinLevel)
-    return;
-  llvm::sys::TimePoint<> Timestamp = std::chrono::system_clock::now();
-  struct ShmLockGuard {
-    decltype(ShmLock) Lock;
-    ShmLockGuard(decltype(Lock) L) : Lock(L) { pthread_mutex_lock(Lock); }
-    ~ShmLockGuard() { pthread_mutex_unlock(Lock); }
-  } Guard(ShmLock);
-
-  Logs << llvm::formatv("{0}[{1:%H:%M:%S.%L}] {2}: {3}\n", indicator(Level),
-                        Timestamp, getpid(), Message);
-  Logs.flush();
-}
-
 namespace {
 // Like llvm::StringError but with fewer options and no gratuitous copies.
 class SimpleStringError : public llvm::ErrorInfo<SimpleStringError> {
@@ -92,9 +83,260 @@ llvm::Error detail::error(std::error_code EC, std::string &&Msg) {
   return llvm::make_error<SimpleStringError>(EC, std::move(Msg));
 }
 
+namespace {
+
+/// A rendered message.
+struct Record {
+  Logger::Level Level;
+  llvm::sys::TimePoint<> Timestamp;
+  /// The format string, messages are rate limited by it.
+  const char *Fmt;
+  std::string Text;
+};
+
+/// Messages of a thread. The thread is the only producer, and the writer
+/// (holding DrainLock) is the only consumer.
+class Ring {
+  std::array<Record, StreamLogger::RingSize> Slots;
+  alignas(64) std::atomic<size_t> Head = 0;
+  alignas(64) std::atomic<size_t> Tail = 0;
+
+public:
+  /// Messages dropped because the ring is full.
+  std::atomic<size_t> Dropped = 0;
+
+  void push(Record &&R) {
+    size_t H = Head.load(std::memory_order_relaxed);
+    if (H - Tail.load(std::memory_order_acquire) == Slots.size()) {
+      Dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    Slots[H % Slots.size()] = std::move(R);
+    Head.store(H + 1, std::memory_order_release);
+  }
+
+  [[nodiscard]] bool empty() const {
+    return Head.load(std::memory_order_acquire) ==
+           Tail.load(std::memory_order_relaxed);
+  }
+
+  void drain(std::vector<Record> &Out) {
+    size_t T = Tail.load(std::memory_order_relaxed);
+    size_t H = Head.load(std::memory_order_acquire);
+    for (; T != H; T++)
+      Out.emplace_back(std::move(Slots[T % Slots.size()]));
+    Tail.store(T, std::memory_order_release);
+  }
+};
+
+/// The ring of this thread, and the writer it is registered to.
+thread_local std::shared_ptr<Ring> ThreadRing;
+thread_local uint64_t ThreadRingOwner = 0;
+
+} // namespace
+
+struct StreamLogger::Writer {
+  llvm::raw_ostream &Logs;
+
+  /// Serializes batches of all processes, in shared memory.
+  pthread_mutex_t *ShmLock;
+
+  /// Identifies this writer for thread-local rings.
+  uint64_t ID;
+
+  pid_t Pid = getpid();
+
+  std::mutex RingsLock;
+  std::vector<std::shared_ptr<Ring>> Rings; // GUARDED_BY(RingsLock)
+
+  /// Held while draining rings, there is a single consumer.
+  std::mutex DrainLock;
+
+  struct RateStatus {
+    int64_t Second = 0;
+    unsigned Count = 0;
+    size_t Suppressed = 0;
+  };
+  llvm::DenseMap<const char *, RateStatus> Rates; // GUARDED_BY(DrainLock)
+
+  std::atomic<bool> Stop = false;
+  std::unique_ptr<std::thread> Thread;
+
+  /// Set in forked children, the writer thread is started by the first
+  /// message. Children that exec (or never log) do not start it at all.
+  std::atomic<bool> Restart = false;
+
+  Writer(llvm::raw_ostream &Logs, pthread_mutex_t *ShmLock)
+      : Logs(Logs), ShmLock(ShmLock), ID(nextID()) {}
+
+  static uint64_t nextID() {
+    static std::atomic<uint64_t> Next = 1;
+    return Next++;
+  }
+
+  Ring &ring() {
+    if (LLVM_UNLIKELY(ThreadRingOwner != ID)) {
+      ThreadRing = std::make_shared<Ring>();
+      ThreadRingOwner = ID;
+      std::lock_guard<std::mutex> Guard(RingsLock);
+      Rings.emplace_back(ThreadRing);
+    }
+    return *ThreadRing;
+  }
+
+  /// \returns false if the message is suppressed by the rate limit.
+  bool admit(const Record &R) {
+    if (R.Level >= Logger::Error)
+      return true;
+    auto Second = std::chrono::duration_cast<std::chrono::seconds>(
+                      R.Timestamp.time_since_epoch())
+                      .count();
+    auto &Status = Rates[R.Fmt];
+    if (Status.Second != Second) {
+      Status.Second = Second;
+      Status.Count = 0;
+    }
+    if (Status.Count++ < RateLimit)
+      return true;
+    Status.Suppressed++;
+    return false;
+  }
+
+  void writeLine(llvm::raw_ostream &OS, Logger::Level Level,
+                 llvm::sys::TimePoint<> Timestamp, llvm::StringRef Text) {
+    OS << llvm::formatv("{0}[{1:%H:%M:%S.%L}] {2}: {3}\n", indicator(Level),
+                        Timestamp, Pid, Text);
+  }
+
+  /// Write messages of all rings, in order. Requires DrainLock.
+  void drain() {
+    std::vector<std::shared_ptr<Ring>> Snapshot;
+    {
+      std::lock_guard<std::mutex> Guard(RingsLock);
+      // Threads of rings referenced only here have exited.
+      llvm::erase_if(Rings, [](const std::shared_ptr<Ring> &R) {
+        return R.use_count() == 1 && R->empty();
+      });
+      Snapshot = Rings;
+    }
+    std::vector<Record> Records;
+    size_t Dropped = 0;
+    for (const auto &R : Snapshot) {
+      R->drain(Records);
+      Dropped += R->Dropped.exchange(0, std::memory_order_relaxed);
+    }
+    std::stable_sort(Records.begin(), Records.end(),
+                     [](const Record &A, const Record &B) {
+                       return A.Timestamp < B.Timestamp;
+                     });
+
+    std::string Buffer;
+    llvm::raw_string_ostream OS(Buffer);
+    auto Now = std::chrono::system_clock::now();
+    for (const auto &R : Records) {
+      if (admit(R))
+        writeLine(OS, R.Level, R.Timestamp, R.Text);
+    }
+    auto Second = std::chrono::duration_cast<std::chrono::seconds>(
+                      Now.time_since_epoch())
+                      .count();
+    for (auto &[Fmt, Status] : Rates) {
+      if (Status.Suppressed && Status.Second != Second) {
+        writeLine(OS, Logger::Info, Now,
+                  llvm::formatv("suppressed {0} messages like \"{1}\"",
+                                Status.Suppressed, Fmt)
+                      .str());
+        Status.Suppressed = 0;
+      }
+    }
+    if (Dropped)
+      writeLine(OS, Logger::Error, Now,
+                llvm::formatv("dropped {0} messages, the log writer is behind",
+                              Dropped)
+                    .str());
+    if (Buffer.empty())
+      return;
+
+    lockShared();
+    Logs << Buffer;
+    Logs.flush();
+    pthread_mutex_unlock(ShmLock);
+  }
+
+  void lockShared() {
+    [[maybe_unused]] int Err = pthread_mutex_lock(ShmLock);
+#ifndef __APPLE__
+    // The owner died while writing, the lock is ours and the stream is usable.
+    if (Err == EOWNERDEAD)
+      pthread_mutex_consistent(ShmLock);
+#endif
+  }
+
+  void run() {
+    while (!Stop.load(std::memory_order_relaxed)) {
+      std::this_thread::sleep_for(WriteInterval);
+      std::lock_guard<std::mutex> Guard(DrainLock);
+      drain();
+    }
+  }
+
+  void start() { Thread = std::make_unique<std::thread>(&Writer::run, this); }
+
+  /// Start the writer thread of a forked child, once.
+  void restart() {
+    if (LLVM_UNLIKELY(Restart.load(std::memory_order_relaxed)) &&
+        Restart.exchange(false))
+      start();
+  }
+};
+
+namespace {
+
+/// The writer of the active StreamLogger, for fork handlers.
+std::atomic<StreamLogger::Writer *> ForkWriter = nullptr;
+
+/// Buffered messages are written before forking. In the child, only the
+/// forking thread exists, the writer thread is started again on demand.
+void registerForkHandlers() {
+  static std::once_flag Once;
+  std::call_once(Once, [] {
+    pthread_atfork(
+        [] {
+          if (auto *W = ForkWriter.load()) {
+            W->DrainLock.lock();
+            W->drain();
+            W->RingsLock.lock();
+          }
+        },
+        [] {
+          if (auto *W = ForkWriter.load()) {
+            W->RingsLock.unlock();
+            W->DrainLock.unlock();
+          }
+        },
+        [] {
+          auto *W = ForkWriter.load();
+          if (!W)
+            return;
+          W->Pid = getpid();
+          // Messages of other threads were written by the parent already.
+          W->Rings.clear();
+          if (ThreadRingOwner == W->ID)
+            W->Rings.emplace_back(ThreadRing);
+          W->RingsLock.unlock();
+          W->DrainLock.unlock();
+          // The thread does not exist in this process.
+          (void)W->Thread.release();
+          W->Restart = true;
+        });
+  });
+}
+
+} // namespace
+
 StreamLogger::StreamLogger(llvm::raw_ostream &Logs, Logger::Level MinLevel)
-    : MinLevel(MinLevel), Logs(Logs) {
-  ShmLock =
+    : MinLevel(MinLevel) {
+  auto *ShmLock =
       (pthread_mutex_t *)mmap(nullptr, getpagesize(), PROT_READ | PROT_WRITE,
                               MAP_SHARED | MAP_ANON, -1, 0);
 
@@ -106,5 +348,36 @@ StreamLogger::StreamLogger(llvm::raw_ostream &Logs, Logger::Level MinLevel)
 #endif
   pthread_mutex_init(ShmLock, &Attr);
   pthread_mutexattr_destroy(&Attr);
+
+  W = std::make_unique<Writer>(Logs, ShmLock);
+  W->start();
+  registerForkHandlers();
+  ForkWriter = W.get();
+}
+
+StreamLogger::~StreamLogger() {
+  ForkWriter = nullptr;
+  W->Stop = true;
+  if (W->Thread)
+    W->Thread->join();
+  flush();
+  pthread_mutex_destroy(W->ShmLock);
 }
+
+void StreamLogger::log(Logger::Level Level, const char *Fmt,
+                       const llvm::formatv_object_base &Message) {
+  if (Level < MinLevel)
+    return;
+  W->restart();
+  W->ring().push({Level, std::chrono::system_clock::now(), Fmt, Message.str()});
+  // Errors are written immediately, they may precede a crash.
+  if (Level >= Error)
+    flush();
+}
+
+void StreamLogger::flush() {
+  std::lock_guard<std::mutex> Guard(W->DrainLock);
+  W->drain();
+}
+
 } // namespace lspserver
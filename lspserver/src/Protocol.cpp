@@ -322,6 +322,8 @@ bool fromJSON(const llvm::json::Value &Params, ClientCapabilities &R,
       if (auto RelatedInfo = Diagnostics->getBoolean("relatedInformation"))
         R.DiagnosticRelatedInformation = *RelatedInfo;
     }
+    if (TextDocument->getObject("diagnostic"))
+      R.DiagnosticPull = true;
     if (auto *References = TextDocument->getObject("references"))
       if (auto ContainerSupport = References->getBoolean("container"))
         R.ReferenceContainer = *ContainerSupport;
@@ -416,6 +418,10 @@ bool fromJSON(const llvm::json::Value &Params, ClientCapabilities &R,
       if (auto RefreshSupport = SemanticTokens->getBoolean("refreshSupport"))
         R.SemanticTokenRefreshSupport = *RefreshSupport;
     }
+    if (auto *Diagnostics = Workspace->getObject("diagnostics")) {
+      if (auto RefreshSupport = Diagnostics->getBoolean("refreshSupport"))
+        R.DiagnosticRefresh = *RefreshSupport;
+    }
     if (auto *WorkspaceEdit = Workspace->getObject("workspaceEdit")) {
       if (auto DocumentChanges = WorkspaceEdit->getBoolean("documentChanges"))
         R.DocumentChanges = *DocumentChanges;
@@ -435,6 +441,12 @@ bool fromJSON(const llvm::json::Value &Params, ClientCapabilities &R,
       if (auto Cancel = StaleRequestSupport->getBoolean("cancel"))
         R.CancelsStaleRequests = *Cancel;
     }
+    if (auto *PositionEncodings = General->get("positionEncodings")) {
+      R.PositionEncodings.emplace();
+      if (!fromJSON(*PositionEncodings, *R.PositionEncodings,
+                    P.field("general").field("positionEncodings")))
+        return false;
+    }
   }
   if (auto *OffsetEncoding = O->get("offsetEncoding")) {
     R.offsetEncoding.emplace();
@@ -515,6 +527,15 @@ bool fromJSON(const llvm::json::Value &Params, DidOpenTextDocumentParams &R,
   return O && O.map("textDocument", R.textDocument);
 }
 
+bool takeTexts(DidOpenTextDocumentParams &R, std::vector<std::string> &Texts) {
+  if (Texts.empty())
+    return true;
+  if (Texts.size() != 1)
+    return false;
+  R.textDocument.text = std::move(Texts.front());
+  return true;
+}
+
 bool fromJSON(const llvm::json::Value &Params, DidCloseTextDocumentParams &R,
               llvm::json::Path P) {
   llvm::json::ObjectMapper O(Params, P);
@@ -536,6 +557,17 @@ bool fromJSON(const llvm::json::Value &Params, DidChangeTextDocumentParams &R,
          mapOptOrNull(Params, "forceRebuild", R.forceRebuild, P);
 }
 
+bool takeTexts(DidChangeTextDocumentParams &R,
+               std::vector<std::string> &Texts) {
+  if (Texts.empty())
+    return true;
+  if (Texts.size() != R.contentChanges.size())
+    return false;
+  for (size_t I = 0; I < Texts.size(); I++)
+    R.contentChanges[I].text = std::move(Texts[I]);
+  return true;
+}
+
 bool fromJSON(const llvm::json::Value &E, FileChangeType &Out,
               llvm::json::Path P) {
   if (auto T = E.getAsInteger()) {
@@ -655,6 +687,49 @@ llvm::json::Value toJSON(const PublishDiagnosticsParams &PDP) {
   return Result;
 }
 
+bool fromJSON(const llvm::json::Value &Params, DocumentDiagnosticParams &R,
+              llvm::json::Path P) {
+  llvm::json::ObjectMapper O(Params, P);
+  return O && O.map("textDocument", R.textDocument) &&
+         O.mapOptional("identifier", R.identifier) &&
+         O.mapOptional("previousResultId", R.previousResultId);
+}
+
+llvm::json::Value toJSON(const DocumentDiagnosticReport &DDR) {
+  llvm::json::Object Result{{"kind", DDR.kind}};
+  if (DDR.resultId)
+    Result["resultId"] = *DDR.resultId;
+  if (DDR.kind != "unchanged")
+    Result["items"] = DDR.items;
+  return Result;
+}
+
+bool fromJSON(const llvm::json::Value &Params, PreviousResultId &R,
+              llvm::json::Path P) {
+  llvm::json::ObjectMapper O(Params, P);
+  return O && O.map("uri", R.uri) && O.map("value", R.value);
+}
+
+bool fromJSON(const llvm::json::Value &Params, WorkspaceDiagnosticParams &R,
+              llvm::json::Path P) {
+  llvm::json::ObjectMapper O(Params, P);
+  return O && O.mapOptional("identifier", R.identifier) &&
+         O.map("previousResultIds", R.previousResultIds);
+}
+
+llvm::json::Value toJSON(const WorkspaceDocumentDiagnosticReport &WDR) {
+  auto Result = toJSON(static_cast<const DocumentDiagnosticReport &>(WDR));
+  auto &O = *Result.getAsObject();
+  O["uri"] = WDR.uri;
+  // Required by the specification, null if unknown.
+  O["version"] = WDR.version ? llvm::json::Value(*WDR.version) : nullptr;
+  return Result;
+}
+
+llvm::json::Value toJSON(const WorkspaceDiagnosticReport &WDR) {
+  return llvm::json::Object{{"items", WDR.items}};
+}
+
 bool fromJSON(const llvm::json::Value &Params, CodeActionContext &R,
               llvm::json::Path P) {
   llvm::json::ObjectMapper O(Params, P);
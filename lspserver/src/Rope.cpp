@@ -0,0 +1,214 @@
+#include "lspserver/Rope.h"
+
+#include <llvm/Support/ErrorHandling.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <utility>
+
+namespace lspserver {
+
+struct Rope::Node {
+  NodePtr Left;
+  NodePtr Right;
+  /// Chunks of a text refer to its buffer, without copying it.
+  std::shared_ptr<const std::string> Buffer;
+  llvm::StringRef Chunk;
+  /// Treap priority, parents have higher priorities than children.
+  uint64_t Priority;
+  /// Aggregates of the subtree.
+  size_t Size;
+  size_t Newlines;
+  size_t Count;
+};
+
+namespace {
+
+using NodePtr = Rope::NodePtr;
+
+/// Pseudo-random priorities (splitmix64 of a counter), without locking.
+uint64_t nextPriority() {
+  static std::atomic<uint64_t> Counter = 0;
+  uint64_t Z = (Counter += 0x9e3779b97f4a7c15);
+  Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+  Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+  return Z ^ (Z >> 31);
+}
+
+size_t sizeOf(const NodePtr &T) { return T ? T->Size : 0; }
+size_t newlinesOf(const NodePtr &T) { return T ? T->Newlines : 0; }
+size_t countOf(const NodePtr &T) { return T ? T->Count : 0; }
+
+using BufferPtr = std::shared_ptr<const std::string>;
+
+NodePtr make(NodePtr Left, BufferPtr Buffer, llvm::StringRef Chunk,
+             NodePtr Right, uint64_t Priority) {
+  size_t Size = sizeOf(Left) + Chunk.size() + sizeOf(Right);
+  size_t Newlines =
+      newlinesOf(Left) + newlinesOf(Right) + Chunk.count('\n');
+  size_t Count = countOf(Left) + 1 + countOf(Right);
+  return std::make_shared<const Rope::Node>(
+      Rope::Node{std::move(Left), std::move(Right), std::move(Buffer), Chunk,
+                 Priority, Size, Newlines, Count});
+}
+
+/// Like `make`, with the chunk of \p T.
+NodePtr remake(NodePtr Left, const Rope::Node &T, NodePtr Right) {
+  return make(std::move(Left), T.Buffer, T.Chunk, std::move(Right),
+              T.Priority);
+}
+
+NodePtr merge(NodePtr A, NodePtr B) {
+  if (!A)
+    return B;
+  if (!B)
+    return A;
+  if (A->Priority > B->Priority)
+    return remake(A->Left, *A, merge(A->Right, std::move(B)));
+  return remake(merge(std::move(A), B->Left), *B, B->Right);
+}
+
+/// Split \p T into the first \p Offset bytes, and the rest.
+std::pair<NodePtr, NodePtr> split(const NodePtr &T, size_t Offset) {
+  if (!T)
+    return {};
+  size_t LeftSize = sizeOf(T->Left);
+  if (Offset <= LeftSize) {
+    auto [L, R] = split(T->Left, Offset);
+    return {std::move(L), remake(std::move(R), *T, T->Right)};
+  }
+  size_t ChunkEnd = LeftSize + T->Chunk.size();
+  if (Offset >= ChunkEnd) {
+    auto [L, R] = split(T->Right, Offset - ChunkEnd);
+    return {remake(T->Left, *T, std::move(L)), std::move(R)};
+  }
+  // Split inside the chunk, the suffix becomes a new node. Both of them still
+  // refer to the buffer.
+  size_t At = Offset - LeftSize;
+  auto L = make(T->Left, T->Buffer, T->Chunk.take_front(At), nullptr,
+                T->Priority);
+  auto R = make(nullptr, T->Buffer, T->Chunk.drop_front(At), nullptr,
+                nextPriority());
+  return {std::move(L), merge(std::move(R), T->Right)};
+}
+
+NodePtr build(std::string Text) {
+  auto Buffer = std::make_shared<const std::string>(std::move(Text));
+  llvm::StringRef Whole = *Buffer;
+  NodePtr Result;
+  for (size_t I = 0; I < Whole.size(); I += Rope::MaxChunk)
+    Result = merge(std::move(Result),
+                   make(nullptr, Buffer, Whole.substr(I, Rope::MaxChunk),
+                        nullptr, nextPriority()));
+  return Result;
+}
+
+const Rope::Node *first(const NodePtr &T) {
+  const Rope::Node *N = T.get();
+  while (N && N->Left)
+    N = N->Left.get();
+  return N;
+}
+
+const Rope::Node *last(const NodePtr &T) {
+  const Rope::Node *N = T.get();
+  while (N && N->Right)
+    N = N->Right.get();
+  return N;
+}
+
+bool forEach(const NodePtr &T, llvm::function_ref<bool(llvm::StringRef)> CB) {
+  if (!T)
+    return false;
+  return forEach(T->Left, CB) || CB(T->Chunk) || forEach(T->Right, CB);
+}
+
+} // namespace
+
+Rope::Rope(llvm::StringRef Text) : Root(build(Text.str())) {}
+
+Rope Rope::adopt(std::string Text) { return Rope(build(std::move(Text))); }
+
+size_t Rope::size() const { return sizeOf(Root); }
+
+size_t Rope::newlines() const { return newlinesOf(Root); }
+
+size_t Rope::chunks() const { return countOf(Root); }
+
+char Rope::back() const {
+  assert(!empty() && "back() of an empty rope");
+  return last(Root)->Chunk.back();
+}
+
+Rope Rope::replace(size_t Offset, size_t Length, llvm::StringRef Text) const {
+  Offset = std::min(Offset, size());
+  auto [L, Rest] = split(Root, Offset);
+  auto R = split(Rest, Length).second;
+
+  // Glue small neighbouring chunks with the new text, so that typing does
+  // not fragment the tree into tiny chunks.
+  std::string Mid = Text.str();
+  if (const auto *Prev = last(L);
+      Prev && Prev->Chunk.size() + Mid.size() <= MaxChunk / 2) {
+    Mid.insert(0, Prev->Chunk);
+    L = split(L, sizeOf(L) - Prev->Chunk.size()).first;
+  }
+  if (const auto *Next = first(R);
+      Next && Next->Chunk.size() + Mid.size() <= MaxChunk / 2) {
+    Mid += Next->Chunk;
+    R = split(R, Next->Chunk.size()).second;
+  }
+  return Rope(merge(merge(std::move(L), build(std::move(Mid))), std::move(R)));
+}
+
+Rope Rope::substr(size_t Offset, size_t Length) const {
+  auto [L, Rest] = split(Root, Offset);
+  return Rope(split(Rest, Length).first);
+}
+
+std::optional<size_t> Rope::lineOffset(size_t Line) const {
+  if (Line == 0)
+    return 0;
+  if (Line > newlines())
+    return std::nullopt;
+  // Find the Line-th newline (1-based), the line starts after it.
+  size_t Base = 0;
+  const Node *N = Root.get();
+  while (N) {
+    size_t LeftNewlines = newlinesOf(N->Left);
+    if (Line <= LeftNewlines) {
+      N = N->Left.get();
+      continue;
+    }
+    Line -= LeftNewlines;
+    Base += sizeOf(N->Left);
+    for (size_t I = 0; I < N->Chunk.size(); I++) {
+      if (N->Chunk[I] == '\n' && --Line == 0)
+        return Base + I + 1;
+    }
+    Base += N->Chunk.size();
+    N = N->Right.get();
+  }
+  llvm_unreachable("newline counts are inconsistent");
+}
+
+bool Rope::forEachChunk(llvm::function_ref<bool(llvm::StringRef)> CB) const {
+  return forEach(Root, CB);
+}
+
+void Rope::appendTo(std::string &Out) const {
+  Out.reserve(Out.size() + size());
+  forEachChunk([&](llvm::StringRef Chunk) {
+    Out.append(Chunk.data(), Chunk.size());
+    return false;
+  });
+}
+
+std::string Rope::str() const {
+  std::string Result;
+  appendTo(Result);
+  return Result;
+}
+
+} // namespace lspserver
@@ -2,11 +2,44 @@
 #include "lspserver/Logger.h"
 #include <llvm/Support/Errc.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
 namespace lspserver {
 
-/// TODO: support more encodings (from clangd, using Context)
-static OffsetEncoding lspEncoding() { return OffsetEncoding::UTF16; }
+/// Set once in "initialize", but read from any thread.
+static std::atomic<OffsetEncoding> CurrentEncoding = OffsetEncoding::UTF16;
+
+OffsetEncoding lspEncoding() {
+  return CurrentEncoding.load(std::memory_order_relaxed);
+}
+
+void setLSPEncoding(OffsetEncoding Encoding) {
+  assert(Encoding != OffsetEncoding::UnsupportedEncoding);
+  CurrentEncoding.store(Encoding, std::memory_order_relaxed);
+}
 
+/// Length of the ASCII prefix of \p U8, checking 8 bytes at a time.
+static size_t asciiPrefix(llvm::StringRef U8) {
+  constexpr uint64_t HighBits = 0x8080808080808080ULL;
+  size_t I = 0;
+  for (; I + sizeof(uint64_t) <= U8.size(); I += sizeof(uint64_t)) {
+    uint64_t Word;
+    std::memcpy(&Word, U8.data() + I, sizeof(Word));
+    if (Word & HighBits)
+      break;
+  }
+  while (I < U8.size() && !(static_cast<unsigned char>(U8[I]) & 0x80))
+    ++I;
+  return I;
+}
+
+/// Invoke CB(UTF8Length, UTF16Length) for codepoints of \p U8.
+/// Runs of ASCII characters are reported at once, as CB(N, N): whenever both
+/// lengths are equal, each byte is a codepoint of one code unit.
 template <typename Callback>
 static bool iterateCodepoints(llvm::StringRef U8, const Callback &CB) {
   bool LoggedInvalid = false;
@@ -14,10 +47,11 @@ static bool iterateCodepoints(llvm::StringRef U8, const Callback &CB) {
   // Astral codepoints are encoded as 4 bytes in UTF-8, starting with 11110xxx.
   for (size_t I = 0; I < U8.size();) {
     unsigned char C = static_cast<unsigned char>(U8[I]);
-    if (LLVM_LIKELY(!(C & 0x80))) { // ASCII character.
-      if (CB(1, 1))
+    if (LLVM_LIKELY(!(C & 0x80))) { // ASCII characters.
+      size_t Run = asciiPrefix(U8.drop_front(I));
+      if (CB(Run, Run))
         return true;
-      ++I;
+      I += Run;
       continue;
     }
     // This convenient property of UTF-8 holds for all non-ASCII characters.
@@ -61,7 +95,7 @@ size_t lspLength(llvm::StringRef Code) {
     break;
   case OffsetEncoding::UTF32:
     iterateCodepoints(Code, [&](int U8Len, int U16Len) {
-      ++Count;
+      Count += U8Len == U16Len ? U8Len : 1;
       return false;
     });
     break;
@@ -87,6 +121,8 @@ static size_t measureUnits(llvm::StringRef U8, int Units, OffsetEncoding Enc,
     break;
   case OffsetEncoding::UTF16:
     Valid = iterateCodepoints(U8, [&](int U8Len, int U16Len) {
+      if (U8Len == U16Len) // ASCII run, may end in the middle.
+        U8Len = U16Len = std::min(U8Len, Units);
       Result += U8Len;
       Units -= U16Len;
       return Units <= 0;
@@ -96,8 +132,11 @@ static size_t measureUnits(llvm::StringRef U8, int Units, OffsetEncoding Enc,
     break;
   case OffsetEncoding::UTF32:
     Valid = iterateCodepoints(U8, [&](int U8Len, int U16Len) {
+      int Codepoints = 1;
+      if (U8Len == U16Len) // ASCII run, may end in the middle.
+        U8Len = Codepoints = std::min(U8Len, Units);
       Result += U8Len;
-      Units--;
+      Units -= Codepoints;
       return Units <= 0;
     });
     break;
@@ -141,6 +180,50 @@ llvm::Expected<size_t> positionToOffset(llvm::StringRef Code, Position P,
   return StartOfLine + ByteInLine;
 }
 
+std::optional<std::string> getLine(const Rope &Code, size_t Line) {
+  auto StartOfLine = Code.lineOffset(Line);
+  if (!StartOfLine)
+    return std::nullopt;
+  auto NextLine = Code.lineOffset(Line + 1);
+  size_t EndOfLine = NextLine ? *NextLine - 1 : Code.size();
+  return Code.substr(*StartOfLine, EndOfLine - *StartOfLine).str();
+}
+
+llvm::Expected<size_t> positionToOffset(const Rope &Code, Position P,
+                                        bool AllowColumnsBeyondLineLength) {
+  if (P.line < 0)
+    return error(llvm::errc::invalid_argument,
+                 "Line value can't be negative ({0})", P.line);
+  if (P.character < 0)
+    return error(llvm::errc::invalid_argument,
+                 "Character value can't be negative ({0})", P.character);
+  auto StartOfLine = Code.lineOffset(P.line);
+  if (!StartOfLine)
+    return error(llvm::errc::invalid_argument,
+                 "Line value is out of range ({0})", P.line);
+
+  OffsetEncoding Encoding = lspEncoding();
+  bool Valid;
+  size_t ByteInLine;
+  if (Encoding == OffsetEncoding::UTF8) {
+    // P.character is already in bytes, only the line length is needed.
+    auto NextLine = Code.lineOffset(P.line + 1);
+    size_t EndOfLine = NextLine ? *NextLine - 1 : Code.size();
+    size_t Length = EndOfLine - *StartOfLine;
+    Valid = static_cast<size_t>(P.character) <= Length;
+    ByteInLine = std::min(static_cast<size_t>(P.character), Length);
+  } else {
+    // P.character may be in UTF-16, transcode the line.
+    ByteInLine = measureUnits(*getLine(Code, P.line), P.character, Encoding,
+                              Valid);
+  }
+  if (!Valid && !AllowColumnsBeyondLineLength)
+    return error(llvm::errc::invalid_argument,
+                 "{0} offset {1} is invalid for line {2}", Encoding,
+                 P.character, P.line);
+  return *StartOfLine + ByteInLine;
+}
+
 Position offsetToPosition(llvm::StringRef Code, size_t Offset) {
   Offset = std::min(Code.size(), Offset);
   llvm::StringRef Before = Code.substr(0, Offset);
@@ -153,6 +236,18 @@ Position offsetToPosition(llvm::StringRef Code, size_t Offset) {
   return Pos;
 }
 
+llvm::StringRef wordAround(llvm::StringRef Line, size_t Offset,
+                           llvm::StringRef Delimiters) {
+  Offset = std::min(Line.size(), Offset);
+  size_t From = Offset;
+  size_t To = Offset;
+  while (From > 0 && !Delimiters.contains(Line[From - 1]))
+    From--;
+  while (To < Line.size() && !Delimiters.contains(Line[To]))
+    To++;
+  return Line.slice(From, To);
+}
+
 // Workaround for editors that have buggy handling of newlines at end of file.
 //
 // The editor is supposed to expose document contents over LSP as an exact
@@ -187,6 +282,22 @@ static void inferFinalNewline(llvm::Expected<size_t> &Err,
   Err = Contents.size();
 }
 
+static void inferFinalNewline(llvm::Expected<size_t> &Err, Rope &Contents,
+                              const Position &Pos) {
+  if (Err)
+    return;
+  if (!Contents.empty() && Contents.back() == '\n')
+    return;
+  if (Pos.character != 0)
+    return;
+  if (static_cast<size_t>(Pos.line) != Contents.newlines() + 1)
+    return;
+  log("Editor sent invalid change coordinates, inferring newline at EOF");
+  Contents = Contents.replace(Contents.size(), 0, "\n");
+  consumeError(Err.takeError());
+  Err = Contents.size();
+}
+
 llvm::Error applyChange(std::string &Contents,
                         const TextDocumentContentChangeEvent &Change) {
   if (!Change.range) {
@@ -231,4 +342,49 @@ llvm::Error applyChange(std::string &Contents,
 
   return llvm::Error::success();
 }
+
+llvm::Error applyChange(Rope &Contents,
+                        const TextDocumentContentChangeEvent &Change) {
+  if (!Change.range) {
+    Contents = Rope(Change.text);
+    return llvm::Error::success();
+  }
+
+  const Position &Start = Change.range->start;
+  llvm::Expected<size_t> StartIndex = positionToOffset(Contents, Start, false);
+  inferFinalNewline(StartIndex, Contents, Start);
+  if (!StartIndex)
+    return StartIndex.takeError();
+
+  const Position &End = Change.range->end;
+  llvm::Expected<size_t> EndIndex = positionToOffset(Contents, End, false);
+  inferFinalNewline(EndIndex, Contents, End);
+  if (!EndIndex)
+    return EndIndex.takeError();
+
+  if (*EndIndex < *StartIndex)
+    return error(llvm::errc::invalid_argument,
+                 "Range's end position ({0}) is before start position ({1})",
+                 End, Start);
+
+  // See above, the replaced text is flattened only if we need to verify it,
+  // and it is not in UTF-8.
+  if (Change.rangeLength) {
+    ssize_t ComputedRangeLength =
+        lspEncoding() == OffsetEncoding::UTF8
+            ? *EndIndex - *StartIndex
+            : lspLength(
+                  Contents.substr(*StartIndex, *EndIndex - *StartIndex).str());
+    if (ComputedRangeLength != *Change.rangeLength)
+      return error(llvm::errc::invalid_argument,
+                   "Change's rangeLength ({0}) doesn't match the "
+                   "computed range length ({1}).",
+                   *Change.rangeLength, ComputedRangeLength);
+  }
+
+  Contents =
+      Contents.replace(*StartIndex, *EndIndex - *StartIndex, Change.text);
+
+  return llvm::Error::success();
+}
 } // namespace lspserver
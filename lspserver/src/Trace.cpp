@@ -0,0 +1,188 @@
+#include "lspserver/Trace.h"
+#include "lspserver/Logger.h"
+
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace lspserver::trace {
+
+namespace {
+
+/// The trace file, shared by forked processes. -1 if tracing is disabled.
+std::atomic<int> TraceFD = -1;
+
+thread_local Context ThreadContext;
+
+int64_t micros(Clock::time_point T) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             T.time_since_epoch())
+      .count();
+}
+
+/// Ids are formatted as strings, they do not fit in doubles.
+std::string formatID(uint64_t ID) { return llvm::formatv("{0:x}", ID); }
+
+/// Append \p Event to the file. Each event is a single write(), appended
+/// atomically (O_APPEND) among processes.
+void emit(llvm::json::Object Event) {
+  int FD = TraceFD.load(std::memory_order_relaxed);
+  if (FD < 0)
+    return;
+  Event["pid"] = getpid();
+  Event["tid"] = static_cast<int64_t>(llvm::get_threadid());
+  std::string Line;
+  llvm::raw_string_ostream OS(Line);
+  OS << llvm::json::Value(std::move(Event)) << ",\n";
+  OS.flush();
+  if (::write(FD, Line.data(), Line.size()) < 0)
+    elog("cannot write the trace: {0}", std::strerror(errno));
+}
+
+void attachRequest(llvm::json::Object &Args, uint64_t Request) {
+  if (Request)
+    Args["request"] = formatID(Request);
+}
+
+} // namespace
+
+llvm::Error enable(llvm::StringRef Path) {
+  int FD = ::open(Path.str().c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (FD < 0)
+    return error("cannot open the trace file {0}: {1}", Path,
+                 std::strerror(errno));
+  if (::write(FD, "[\n", 2) < 0) {
+    ::close(FD);
+    return error("cannot write the trace file {0}: {1}", Path,
+                 std::strerror(errno));
+  }
+  if (int Old = TraceFD.exchange(FD); Old >= 0)
+    ::close(Old);
+  log("tracing into {0}", Path);
+  return llvm::Error::success();
+}
+
+void disable() {
+  if (int Old = TraceFD.exchange(-1); Old >= 0)
+    ::close(Old);
+}
+
+bool enabled() { return TraceFD.load(std::memory_order_relaxed) >= 0; }
+
+void nameProcess(llvm::StringRef Name) {
+  if (!enabled())
+    return;
+  emit(llvm::json::Object{{"ph", "M"},
+                          {"name", "process_name"},
+                          {"args", llvm::json::Object{{"name", Name}}}});
+}
+
+uint64_t newID() {
+  static std::atomic<uint32_t> Counter = 0;
+  // Forked processes continue the counter, the pid makes ids unique.
+  return (static_cast<uint64_t>(getpid()) << 32) | ++Counter;
+}
+
+const Context &current() { return ThreadContext; }
+
+ContextScope::ContextScope(Context C)
+    : Saved(std::exchange(ThreadContext, C)) {}
+
+ContextScope::~ContextScope() { ThreadContext = Saved; }
+
+Span::Span(llvm::StringRef Name) : Span(Name, Clock::now()) {}
+
+Span::Span(llvm::StringRef Name, Clock::time_point Start)
+    : Active(enabled()), Start(Start) {
+  if (Active)
+    this->Name = Name.str();
+}
+
+Span::~Span() {
+  if (!Active)
+    return;
+  auto End = Clock::now();
+  attachRequest(Args, ThreadContext.Request);
+  emit(llvm::json::Object{{"ph", "X"},
+                          {"name", std::move(Name)},
+                          {"ts", micros(Start)},
+                          {"dur", micros(End) - micros(Start)},
+                          {"args", std::move(Args)}});
+}
+
+AsyncSpan::AsyncSpan(llvm::StringRef Name) : Active(enabled()) {
+  if (!Active)
+    return;
+  this->Name = Name.str();
+  Start = Clock::now();
+  Request = ThreadContext.Request;
+}
+
+AsyncSpan::AsyncSpan(AsyncSpan &&Other) noexcept
+    : Active(std::exchange(Other.Active, false)), Name(std::move(Other.Name)),
+      Start(Other.Start), Request(Other.Request), Args(std::move(Other.Args)) {
+}
+
+AsyncSpan &AsyncSpan::operator=(AsyncSpan &&Other) noexcept {
+  if (this != &Other) {
+    end();
+    Active = std::exchange(Other.Active, false);
+    Name = std::move(Other.Name);
+    Start = Other.Start;
+    Request = Other.Request;
+    Args = std::move(Other.Args);
+  }
+  return *this;
+}
+
+void AsyncSpan::end() {
+  if (!std::exchange(Active, false))
+    return;
+  auto End = Clock::now();
+  attachRequest(Args, Request);
+  // Async events are grouped by ids, each span is a track of its own.
+  auto ID = formatID(newID());
+  emit(llvm::json::Object{{"ph", "b"},
+                          {"cat", "async"},
+                          {"id", ID},
+                          {"name", Name},
+                          {"ts", micros(Start)},
+                          {"args", std::move(Args)}});
+  emit(llvm::json::Object{{"ph", "e"},
+                          {"cat", "async"},
+                          {"id", std::move(ID)},
+                          {"name", std::move(Name)},
+                          {"ts", micros(End)}});
+}
+
+void flowBegin(uint64_t ID) {
+  if (!enabled())
+    return;
+  emit(llvm::json::Object{{"ph", "s"},
+                          {"cat", "flow"},
+                          {"name", "ipc"},
+                          {"id", formatID(ID)},
+                          {"ts", micros(Clock::now())}});
+}
+
+void flowEnd(uint64_t ID) {
+  if (!enabled())
+    return;
+  emit(llvm::json::Object{{"ph", "f"},
+                          {"bp", "e"},
+                          {"cat", "flow"},
+                          {"name", "ipc"},
+                          {"id", formatID(ID)},
+                          {"ts", micros(Clock::now())}});
+}
+
+} // namespace lspserver::trace
@@ -18,6 +18,9 @@ class EvalAST : public ParseAST {
   /// Rewrite the AST to our own nodes, used for collecting information
   void rewriteAST();
 
+protected:
+  void measure() override;
+
 public:
   EvalAST(std::unique_ptr<ParseData> D) : ParseAST(std::move(D)) {
     rewriteAST();
@@ -30,6 +33,9 @@ public:
 
   [[nodiscard]] nix::Expr *root() const override { return Root; }
 
+  /// Also counts values and environments recorded so far.
+  [[nodiscard]] MemoryUsage memoryUsage() const override;
+
   /// Inject myself into nix cache.
   void injectAST(nix::EvalState &State, lspserver::PathRef Path) const;
 
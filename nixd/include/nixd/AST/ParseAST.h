@@ -4,6 +4,7 @@
 
 #include "nixd/Expr/Nodes.h"
 #include "nixd/Parser/Parser.h"
+#include "nixd/Support/MemoryUsage.h"
 #include "nixd/Support/Position.h"
 
 #include <nix/nixexpr.hh>
@@ -27,12 +28,22 @@ protected:
   std::map<Definition, std::vector<const nix::ExprVar *>> References;
   std::map<const nix::ExprVar *, Definition> Definitions;
 
+  /// Estimated by `staticAnalysis`, so that `memoryUsage` is cheap.
+  MemoryUsage Usage;
+
+  virtual void measure();
+
 public:
   [[nodiscard]] const nix::PosTable &positions() const { return *Data->PTable; }
   [[nodiscard]] const nix::SymbolTable &symbols() const {
     return *Data->STable;
   }
 
+  /// Errors found while parsing, the AST is still usable.
+  [[nodiscard]] const std::vector<nix::ErrorInfo> &errors() const {
+    return Data->error;
+  }
+
   void bindVars(const nix::StaticEnv &Env) {
     if (auto *Root = dynamic_cast<nodes::StaticBindable *>(Data->result)) {
       Root->bindVarsStatic(symbols(), positions(), Env);
@@ -47,6 +58,7 @@ public:
   void staticAnalysis() {
     ParentMap = getParentMap(root());
     prepareDefRef();
+    measure();
   }
   ParseAST(std::unique_ptr<ParseData> D) : Data(std::move(D)) {}
 
@@ -54,6 +66,12 @@ public:
 
   [[nodiscard]] virtual nix::Expr *root() const { return Data->result; }
 
+  /// Number of nodes, available after `staticAnalysis`.
+  [[nodiscard]] size_t nodes() const { return ParentMap.size(); }
+
+  /// Approximate memory used by the AST, available after `staticAnalysis`.
+  [[nodiscard]] virtual MemoryUsage memoryUsage() const { return Usage; }
+
   [[nodiscard]] virtual nix::PosIdx getPos(const void *Ptr) const {
     return Data->locations.at(Ptr);
   }
@@ -11,6 +11,34 @@ namespace nixd {
 using ExprCallback = std::function<void(nix::Expr *, nix::EvalState &,
                                         nix::Env &, nix::Value &)>;
 
+/// Notified around evaluations of our expressions, e.g. for profiling.
+class EvalObserver {
+public:
+  virtual ~EvalObserver() = default;
+  virtual void enter(const nix::Expr *E) = 0;
+  virtual void leave() = 0;
+};
+
+/// The observer of evaluations on this thread, nullptr if none.
+extern thread_local EvalObserver *CurrentEvalObserver;
+
+/// Notify the observer of this thread, if any, while alive.
+class ObservedEval {
+  EvalObserver *Observer = CurrentEvalObserver;
+
+public:
+  explicit ObservedEval(const nix::Expr *E) {
+    if (Observer)
+      Observer->enter(E);
+  }
+  ~ObservedEval() {
+    if (Observer)
+      Observer->leave();
+  }
+  ObservedEval(const ObservedEval &) = delete;
+  ObservedEval &operator=(const ObservedEval &) = delete;
+};
+
 // Nix expression subclass, that will call a readonly callback for analysis.
 #define NIX_EXPR(EXPR)                                                         \
   struct Callback##EXPR : nix::EXPR {                                          \
@@ -2,8 +2,22 @@
 
 #include <nix/eval.hh>
 
+#include <optional>
+#include <string>
+
 // Our extension to nix::EvalState.
 namespace nix {
 /// Similar to nix forceValue, but allow a depth limit
 void forceValueDepth(EvalState &State, Value &v, int depth);
+
+/// Let nix print statistics to a file of this process. Counters are private,
+/// printStats() is the only way to read them, and it reads where to print
+/// from the environment. Must be called before other threads start.
+void initEvalStats();
+
+/// Counters of \p State (thunks, values, environments, ...), in JSON, as
+/// printed by nix with NIX_SHOW_STATS. Cumulative since \p State was created.
+/// \returns std::nullopt if nix did not print them, or initEvalStats() was
+/// not called.
+std::optional<std::string> evalStats(EvalState &State);
 } // namespace nix
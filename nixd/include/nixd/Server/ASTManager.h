@@ -1,13 +1,21 @@
 #pragma once
 
 #include "nixd/AST/ParseAST.h"
+#include "nixd/Support/LatencyHistogram.h"
+#include "nixd/Support/MemoryUsage.h"
+#include "nixd/Support/Scheduler.h"
 
-#include <llvm/ADT/FunctionExtras.h>
+#include "lspserver/Rope.h"
 
-#include <boost/asio/thread_pool.hpp>
+#include <llvm/ADT/FunctionExtras.h>
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <set>
 #include <string>
 
 namespace nixd {
@@ -17,32 +25,146 @@ public:
   using VersionTy = int64_t;
   using ActionTy =
       llvm::unique_function<void(const ParseAST &AST, VersionTy &Version)>;
-  using CachedASTTy = std::pair<std::unique_ptr<ParseAST>, VersionTy>;
+
+  /// Published ASTs are immutable, and shared by readers.
+  using ASTPtr = std::shared_ptr<const ParseAST>;
+  using CachedASTTy = std::pair<ASTPtr, VersionTy>;
+
+  struct FeatureCacheStats {
+    std::atomic<uint64_t> Hits = 0;
+    std::atomic<uint64_t> Misses = 0;
+    /// Results dropped because the AST changed.
+    std::atomic<uint64_t> Invalidations = 0;
+  };
+
+  struct ASTCacheStats {
+    /// Actions invoked on cached ASTs, without waiting for parsing.
+    std::atomic<uint64_t> Hits = 0;
+    std::atomic<uint64_t> Misses = 0;
+  };
+
+  /// Cached ASTs, for statistics.
+  struct CacheUsage {
+    size_t Files = 0;
+    size_t Nodes = 0;
+  };
 
 private:
-  boost::asio::thread_pool &Pool;
+  Scheduler &Pool;
 
   std::multimap<std::string, ActionTy> Actions; // GUARDED_BY(ActionsLock)
   std::mutex ActionsLock;
 
   /// Path -> {AST, Version}
+  /// The lock only guards the map, snapshots are used without locking.
   std::map<std::string, CachedASTTy> ASTCache; // GUARDED_BY(ASTCacheLock)
   std::mutex ASTCacheLock;
 
+  struct FeatureResult {
+    std::shared_ptr<const void> Value;
+    /// Approximate size of the result, including the key.
+    uint64_t Bytes = 0;
+  };
+
+  /// Memoized results of AST-based features, computed on one AST version.
+  struct FeatureResults {
+    VersionTy Version{};
+    /// Request kind & params -> result (of the type used by the kind).
+    std::map<std::string, FeatureResult> Results;
+  };
+
+  /// Path -> results on the cached AST.
+  // GUARDED_BY(ASTCacheLock)
+  std::map<std::string, FeatureResults> FeatureCache;
+
+  FeatureCacheStats Stats;
+
+  ASTCacheStats CacheStats;
+
+  LatencyHistogram ParseLatency;
+
+  std::shared_ptr<const void> lookupFeature(const std::string &Path,
+                                            VersionTy Version,
+                                            const std::string &Key);
+
+  /// Store the result if \p Version is still the latest AST of \p Path.
+  void storeFeature(const std::string &Path, VersionTy Version,
+                    std::string Key, std::shared_ptr<const void> Result,
+                    uint64_t Bytes);
+
+  /// Invoke (and remove) pending actions of \p Path, without holding locks.
   void invokeActions(const ParseAST &AST, const std::string &Path,
                      VersionTy Version);
 
   bool checkCacheAndInvoke(const std::string &Path, VersionTy Version);
 
 public:
-  ASTManager(boost::asio::thread_pool &Pool) : Pool(Pool) {}
+  ASTManager(Scheduler &Pool) : Pool(Pool) {}
 
   /// Store the action in a local structure, the action will be invoked when the
   /// task finished.
   void withAST(const std::string &Path, VersionTy Version, ActionTy Action);
 
-  void schedParse(const std::string &Content, const std::string &Path,
+  /// Get the latest AST snapshot of \p Path, if any. Never blocks on parsing.
+  std::optional<CachedASTTy> getAST(const std::string &Path);
+
+  /// Like `withAST`, but memoize the result of \p Compute, keyed by \p Key
+  /// (the request kind & params) on the AST version. Repeated requests on an
+  /// unchanged AST are answered without traversing it.
+  /// The cache of a file is dropped when a newer AST is published.
+  template <class T>
+  void withCachedAST(const std::string &Path, VersionTy Version,
+                     std::string Key,
+                     llvm::unique_function<T(const ParseAST &AST)> Compute,
+                     llvm::unique_function<void(const T &Result)> Then);
+
+  [[nodiscard]] const FeatureCacheStats &featureCacheStats() const {
+    return Stats;
+  }
+
+  [[nodiscard]] const ASTCacheStats &astCacheStats() const {
+    return CacheStats;
+  }
+
+  [[nodiscard]] const LatencyHistogram &parseLatency() const {
+    return ParseLatency;
+  }
+
+  [[nodiscard]] CacheUsage cacheUsage();
+
+  /// Approximate memory of cached ASTs and feature results, for each file.
+  /// Cheap, sizes of ASTs are estimated once parsed.
+  [[nodiscard]] std::map<std::string, MemoryUsage> memoryUsage();
+
+  /// Release about \p Target bytes: cached ASTs (and their feature results)
+  /// of files not in \p Keep first, then feature results of other files,
+  /// largest first. Snapshots taken by readers stay alive until they finish.
+  /// \returns approximate bytes released.
+  uint64_t evict(const std::set<std::string> &Keep, uint64_t Target);
+
+  /// Parse the snapshot \p Text, it is flattened on the pool thread.
+  void schedParse(lspserver::Rope Text, const std::string &Path,
                   VersionTy Version);
 };
 
+template <class T>
+void ASTManager::withCachedAST(
+    const std::string &Path, VersionTy Version, std::string Key,
+    llvm::unique_function<T(const ParseAST &AST)> Compute,
+    llvm::unique_function<void(const T &Result)> Then) {
+  if (auto Cached = lookupFeature(Path, Version, Key)) {
+    Then(*std::static_pointer_cast<const T>(Cached));
+    return;
+  }
+  withAST(Path, Version,
+          [=, this, Key = std::move(Key), Compute = std::move(Compute),
+           Then = std::move(Then)](const ParseAST &AST,
+                                   VersionTy &ASTVersion) mutable {
+            auto Result = std::make_shared<const T>(Compute(AST));
+            auto Bytes = sizeof(T) + memoryOf(*Result);
+            storeFeature(Path, ASTVersion, std::move(Key), Result, Bytes);
+            Then(*Result);
+          });
+}
+
 } // namespace nixd
@@ -5,7 +5,12 @@
 #include "nixd/Parser/Require.h"
 #include "nixd/Server/ASTManager.h"
 #include "nixd/Support/Diagnostic.h"
+#include "nixd/Support/EditHistory.h"
+#include "nixd/Support/Gather.h"
 #include "nixd/Support/JSONSerialization.h"
+#include "nixd/Support/LatencyHistogram.h"
+#include "nixd/Support/ResponseCache.h"
+#include "nixd/Support/Scheduler.h"
 
 #include "lspserver/Connection.h"
 #include "lspserver/DraftStore.h"
@@ -15,24 +20,33 @@
 #include "lspserver/Path.h"
 #include "lspserver/Protocol.h"
 #include "lspserver/SourceCode.h"
+#include "lspserver/Trace.h"
 
 #include <llvm/ADT/FunctionExtras.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/thread.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <semaphore>
+#include <set>
 #include <shared_mutex>
 #include <stdexcept>
 #include <thread>
+#include <type_traits>
 
 #include <pthread.h>
 
@@ -51,33 +65,116 @@ public:
   using WorkspaceVersionTy = ipc::WorkspaceVersionTy;
 
   struct Proc {
-    std::unique_ptr<nix::Pipe> ToPipe;
-    std::unique_ptr<nix::Pipe> FromPipe;
-    std::unique_ptr<lspserver::OutboundPort> OutPort;
-    std::unique_ptr<llvm::raw_ostream> OwnedStream;
+    /// The port of a channel, shared with its dispatcher thread, which may
+    /// outlive the channel (detached). Cleared when the channel is destroyed,
+    /// so that the address is not used once it may be reused.
+    struct PortRef {
+      std::mutex Lock;
+      lspserver::OutboundPort *Port; // GUARDED_BY(Lock)
+    };
+
+    /// Pipes & ports connected to a single process.
+    struct Channel {
+      std::unique_ptr<nix::Pipe> ToPipe;
+      std::unique_ptr<nix::Pipe> FromPipe;
+      std::unique_ptr<lspserver::OutboundPort> OutPort;
+      std::unique_ptr<llvm::raw_ostream> OwnedStream;
+      std::shared_ptr<PortRef> Ref;
+
+      std::thread InputDispatcher;
+
+      /// Number of requests sent to this channel, but not answered yet.
+      /// Shared with reply callbacks, which may outlive the channel.
+      std::shared_ptr<std::atomic<size_t>> Pending =
+          std::make_shared<std::atomic<size_t>>(0);
+
+      enum class State {
+        /// Replicas are forked after the worker finished evaluation.
+        Forking,
+        /// Requests are routed here. Replicas are ready once they announced
+        /// themselves ("nixd/ipc/replicaReady").
+        Ready,
+        /// The replica is shallow, the worker evaluated deeply since.
+        Retired,
+      };
+      std::atomic<State> Status = State::Forking;
+    };
+
+    /// The first channel is connected to the worker itself, others are
+    /// connected to read-only replicas, forked by the worker after it finished
+    /// evaluation.
+    std::vector<std::unique_ptr<Channel>> Channels;
 
     nix::Pid Pid;
     WorkspaceVersionTy WorkspaceVersion;
-    std::thread InputDispatcher;
 
     std::counting_semaphore<> &Smp;
 
     bool WaitWorker;
 
-    [[nodiscard]] nix::AutoCloseFD to() const {
-      return ToPipe->writeSide.get();
-    };
-    [[nodiscard]] nix::AutoCloseFD from() const {
-      return FromPipe->readSide.get();
-    };
+    /// Latencies of requests served by this worker generation.
+    /// Shared with reply callbacks, which may outlive the process.
+    std::shared_ptr<LatencyStats> Latency = std::make_shared<LatencyStats>();
+
+    /// Answers of this worker generation, see `Server::responseKeyOf`.
+    /// Dropped with the generation.
+    std::shared_ptr<ResponseCache> Responses =
+        std::make_shared<ResponseCache>();
+
+    /// Versions of documents this generation was forked with.
+    std::map<std::string, int64_t> FileVersions;
+
+    /// Documents injected into the evaluation without parse errors, reported
+    /// by the worker. std::nullopt if not reported yet.
+    std::optional<std::set<std::string>> Injected;
+
+    /// The worker finished a deep evaluation, which its replicas (forked
+    /// before) do not have.
+    std::atomic<bool> Deepened = false;
+
+    /// When fork() was called, see `EvalLatency`.
+    std::chrono::steady_clock::time_point Forked;
+
+    /// The worker finished its first evaluation ("nixd/ipc/finished").
+    std::atomic<bool> Finished = false;
+
+    /// Statistics of nix, reported by the worker after each phase.
+    /// Guarded by the lock of the worker list.
+    std::map<std::string, ipc::EvalStats> Phases;
+
+    /// Pick the ready channel that has least pending requests. The worker
+    /// itself is always ready.
+    [[nodiscard]] Channel &pick() const {
+      Channel *Result = Channels.front().get();
+      for (const auto &C : Channels) {
+        if (C->Status == Channel::State::Ready &&
+            C->Pending->load() < Result->Pending->load())
+          Result = C.get();
+      }
+      return *Result;
+    }
+
+    /// Replicas were forked before the deep evaluation, stop routing
+    /// requests to them, including the ones not ready yet.
+    void deepen() {
+      Deepened = true;
+      for (size_t I = 1; I < Channels.size(); I++)
+        Channels[I]->Status = Channel::State::Retired;
+    }
 
     ~Proc() {
-      if (WaitWorker) {
-        auto Th = InputDispatcher.native_handle();
-        pthread_cancel(Th);
-        InputDispatcher.join();
-      } else
-        InputDispatcher.detach();
+      for (auto &C : Channels) {
+        {
+          std::lock_guard Guard(C->Ref->Lock);
+          C->Ref->Port = nullptr;
+        }
+        if (WaitWorker) {
+          auto Th = C->InputDispatcher.native_handle();
+          pthread_cancel(Th);
+          C->InputDispatcher.join();
+        } else
+          C->InputDispatcher.detach();
+      }
     }
   };
 
@@ -87,6 +184,8 @@ public:
     /// Child process
     Evaluator,
     OptionProvider,
+    /// Evaluates the target once, while profiling, see "nixd/profileEval".
+    Profiler,
   };
 
   template <class ReplyTy> struct ReplyRAII {
@@ -110,7 +209,7 @@ public:
       llvm::unique_function<void(ReplyRAII<ReplyTy> &&RR, const ParseAST &AST,
                                  ASTManager::VersionTy Version)>
           Action) noexcept {
-    if (auto Draft = DraftMgr.getDraft(Path)) {
+    if (auto Draft = DraftMgr.peekDraft(Path)) {
       auto Version = EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
       ASTMgr.withAST(
           Path, Version,
@@ -123,6 +222,27 @@ public:
     }
   }
 
+  /// Like `withParseAST`, but the result of \p Compute is memoized for the
+  /// AST version, see `ASTManager::withCachedAST`.
+  template <class ReplyTy, class T = ReplyTy>
+  void withCachedParseAST(
+      ReplyRAII<ReplyTy> &&RR, const std::string &Path, std::string Key,
+      llvm::unique_function<T(const ParseAST &AST)> Compute,
+      llvm::unique_function<void(ReplyRAII<ReplyTy> &&RR, const T &Result)>
+          Action) noexcept {
+    if (auto Draft = DraftMgr.peekDraft(Path)) {
+      auto Version = EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
+      ASTMgr.withCachedAST<T>(
+          Path, Version, std::move(Key), std::move(Compute),
+          [RR = std::move(RR),
+           Action = std::move(Action)](const T &Result) mutable {
+            Action(std::move(RR), Result);
+          });
+    } else {
+      RR.Response = lspserver::error("no draft available (removed before?)");
+    }
+  }
+
 private:
   bool WaitWorker = false;
 
@@ -130,6 +250,18 @@ private:
 
   using WorkerContainer = std::deque<std::unique_ptr<Proc>>;
 
+  /// Remove old workers beyond \p Size. The newest generation injected each
+  /// document is kept even beyond the size, so that requests could be
+  /// answered (as stale) while newer generations cannot parse the document.
+  /// Such pinned workers are not counted against \p Size (`eval.workers`),
+  /// there is at most one per open document.
+  void trimWorkers(WorkerContainer &Workers, size_t Size);
+
+  /// Calls in flight to each worker channel. More calls are queued, so that a
+  /// saturated worker is not flooded, while older generations may answer them
+  /// meanwhile (see `askWorkers`).
+  static constexpr size_t WorkerCallLimit = 16;
+
   using WC = std::tuple<const WorkerContainer &, std::shared_mutex &, size_t>;
 
   WorkspaceVersionTy WorkspaceVersion = 1;
@@ -143,8 +275,29 @@ private:
   std::shared_mutex OptionWorkerLock;
   WorkerContainer OptionWorkers; // GUARDED_BY(OptionWorkerLock)
 
+  /// At most one, dropped once it replied.
+  std::shared_mutex ProfileWorkerLock;
+  WorkerContainer ProfileWorkers; // GUARDED_BY(ProfileWorkerLock)
+
+  /// Identifies the profile in progress.
+  uint64_t ProfileID = 0; // GUARDED_BY(ProfileWorkerLock)
+
+  /// Hotspots of the last profile, for inlay hints, by file.
+  struct ProfileHintsTy {
+    std::vector<ipc::Hotspot> Hotspots;
+
+    /// Version of the file profiled, hints are not shown after changes.
+    int64_t Version;
+  };
+  std::mutex ProfileLock;
+  std::map<std::string, ProfileHintsTy> ProfileHints; // GUARDED_BY(ProfileLock)
+
   EvalDraftStore DraftMgr;
 
+  /// Edits of each document, for remapping positions between versions.
+  std::mutex HistoryLock;
+  std::map<std::string, EditHistory> Histories; // GUARDED_BY(HistoryLock)
+
   ASTManager ASTMgr;
 
   lspserver::ClientCapabilities ClientCaps;
@@ -153,11 +306,24 @@ private:
 
   std::shared_ptr<const std::string> getDraft(lspserver::PathRef File) const;
 
-  void addDocument(lspserver::PathRef File, llvm::StringRef Contents,
+  /// Text of \p File to transcode positions of nix with (`transcodePos`),
+  /// from its draft or the disk. Null if UTF-8 is negotiated, or it is not
+  /// readable.
+  std::shared_ptr<const std::string> sourceOf(lspserver::PathRef File) const;
+
+  /// Transcode ranges of diagnostics, made by `insertDiagnostic`.
+  lspserver::PublishDiagnosticsParams
+  transcodeDiagnostics(lspserver::PublishDiagnosticsParams Params) const;
+
+  void addDocument(lspserver::PathRef File, lspserver::Rope Text,
                    llvm::StringRef Version);
 
   void removeDocument(lspserver::PathRef File) {
     DraftMgr.removeDraft(File);
+    {
+      std::lock_guard _(HistoryLock);
+      Histories.erase(File.str());
+    }
     updateWorkspaceVersion();
   }
 
@@ -172,13 +338,131 @@ private:
                              lspserver::Callback<configuration::TopLevel>)>
       WorkspaceConfiguration;
 
+  /// Asks clients pulling diagnostics to pull them again.
+  llvm::unique_function<void(const std::nullptr_t &,
+                             lspserver::Callback<std::nullptr_t>)>
+      WorkspaceDiagnosticRefresh;
+
+  /// Minimum interval between bursts of "textDocument/publishDiagnostics",
+  /// changes in between are coalesced. Disabled for lit tests.
+  static constexpr auto DiagnosticInterval = std::chrono::milliseconds(100);
+
   std::mutex DiagStatusLock;
   struct DiagnosticStatus {
-    std::vector<lspserver::PublishDiagnosticsParams> ClientDiags;
+    /// Diagnostics of the parser, published as soon as parsing finished.
+    std::map<std::string, lspserver::PublishDiagnosticsParams> Static;
+    /// Diagnostics reported by eval workers, merged with static ones.
+    std::map<std::string, lspserver::PublishDiagnosticsParams> Eval;
+    /// Diagnostics published (or going to be published, or pulled), keyed by
+    /// URIs.
+    std::map<std::string, lspserver::PublishDiagnosticsParams> Published;
+    /// Result ids of published diagnostics, for pull requests.
+    /// "draftVersion:generation:revision", the revision is bumped on each
+    /// change, because a generation may report more than once.
+    std::map<std::string, std::string> ResultIds;
+    uint64_t Revision = 0;
+    /// Changed diagnostics, waiting for the rate limit.
+    std::map<std::string, lspserver::PublishDiagnosticsParams> Pending;
+    /// Diagnostics changed, clients pulling them should be refreshed.
+    bool RefreshPending = false;
+    std::chrono::steady_clock::time_point LastFlush;
+    bool FlushScheduled = false;
+    /// Pending diagnostics should be sent once DiagStatusLock is released.
+    bool FlushDue = false;
     WorkspaceVersionTy WorkspaceVersion = 0;
   } DiagStatus; // GUARDED_BY(DiagStatusLock)
 
-  boost::asio::thread_pool Pool;
+  /// Orders batches of diagnostics sent to the client, see
+  /// `flushDiagnostics`.
+  std::mutex DiagSendLock;
+
+  /// Publish \p Params, if they differ from the published ones of the URI.
+  /// Must hold DiagStatusLock, they are sent by `flushDiagnostics`.
+  void publishDiagnostics(lspserver::PublishDiagnosticsParams Params);
+
+  /// Send pending diagnostics (or a refresh request, if the client pulls
+  /// them) if they are due. \p StatusGuard holds DiagStatusLock, it is
+  /// released before writing to the client.
+  void flushDiagnostics(std::unique_lock<std::mutex> StatusGuard);
+
+  /// Report published diagnostics of \p URI, "unchanged" if the result id is
+  /// still \p PreviousResultId. Must hold DiagStatusLock.
+  lspserver::DocumentDiagnosticReport
+  diagnosticReport(const std::string &URI,
+                   const std::optional<std::string> &PreviousResultId);
+
+  /// Merge static & eval diagnostics of \p URI, and publish them.
+  /// Must hold DiagStatusLock.
+  void publishMerged(const std::string &URI);
+
+  /// Publish parse errors of \p AST, without waiting for workers.
+  void onStaticDiagnostic(lspserver::PathRef File, const ParseAST &AST,
+                          ASTManager::VersionTy Version);
+
+  /// Controller tasks, scheduled by priority classes.
+  Scheduler Pool;
+
+  /// Timers of asynchronous requests, never blocked by other tasks.
+  boost::asio::thread_pool TimerPool{1};
+
+  /// Number of requests to workers, whose continuation is not finished yet.
+  std::atomic<size_t> PendingAsks = 0;
+
+  /// Latencies of IPC requests, of all worker generations.
+  LatencyStats MethodLatency;
+
+  /// Latencies of requests & notifications from the client, and of requests
+  /// replied with errors.
+  LatencyStats RequestLatency;
+  LatencyStats FailedRequests;
+
+  /// Duration of fork() calls, and of evaluations from fork() to finish.
+  LatencyHistogram ForkLatency;
+  LatencyHistogram EvalLatency;
+
+  const std::chrono::steady_clock::time_point Started =
+      std::chrono::steady_clock::now();
+
+  /// Seconds between stats dumps, see `scheduleStatsDump`. 0 disables them.
+  std::atomic<int> StatsDumpInterval = 0;
+
+  /// Checks whether stats should be dumped, and memory usage (see
+  /// `checkMemory`), every second. Only touched by the timer thread, like
+  /// `LastStatsDump`. It re-arms itself until ~Server stops `TimerPool`.
+  boost::asio::steady_timer StatsTimer{TimerPool};
+  std::chrono::steady_clock::time_point LastStatsDump;
+
+  void scheduleStatsDump();
+
+  /// Bytes of `memory.highWaterMark`, 0 disables it.
+  std::atomic<uint64_t> HighWaterMark = 0;
+
+  /// Documents crossed the high-water mark, and did not fall below the
+  /// low-water mark since. Only touched by the timer thread.
+  bool MemoryPressure = false;
+
+  /// Fires once the workspace has been idle, for tiered evaluation.
+  boost::asio::steady_timer IdleTimer{TimerPool}; // GUARDED_BY(EvalWorkerLock)
+
+  /// Flushes pending diagnostics, see `DiagnosticInterval`.
+  // GUARDED_BY(DiagStatusLock)
+  boost::asio::steady_timer DiagnosticTimer{TimerPool};
+
+  /// Interval of failing IPC calls that have passed their deadlines.
+  static constexpr auto CallExpiryInterval = std::chrono::milliseconds(200);
+
+  /// Fires every `CallExpiryInterval`, only touched by the timer thread.
+  boost::asio::steady_timer CallExpiryTimer{TimerPool};
+
+  void scheduleCallExpiry();
+
+  /// The deep evaluation in progress.
+  struct DeepEvalTy {
+    WorkspaceVersionTy WorkspaceVersion;
+    llvm::json::Value ID;
+  };
+  std::mutex DeepEvalLock;
+  std::optional<DeepEvalTy> DeepEval; // GUARDED_BY(DeepEvalLock)
 
   //---------------------------------------------------------------------------/
   // Worker members
@@ -195,6 +479,12 @@ private:
 
   llvm::unique_function<void(const ipc::Diagnostics &)> EvalDiagnostic;
 
+  /// Diagnostics of injecting files, reported again by deep evaluations.
+  ipc::Diagnostics InjectionDiagnostics;
+
+  /// {stdin, stdout} file descriptors of replicas, not forked yet.
+  std::vector<std::pair<int, int>> ReplicaFDs;
+
   std::unique_ptr<IValueEvalResult> IER;
 
 public:
@@ -203,6 +493,11 @@ public:
 
   ~Server() override {
     if (WaitWorker) {
+      // Continuations of requests run on the pool, and may still send replies
+      // or ask again.
+      Pool.wait();
+      while (auto N = PendingAsks.load())
+        PendingAsks.wait(N);
       Pool.join();
       std::lock_guard Guard(EvalWorkerLock);
       // Ensure that all workers are finished eval, or being killed
@@ -210,6 +505,10 @@ public:
         FinishSmp.acquire();
       }
     }
+    // Timers re-arm themselves and use members, stop them before those are
+    // destroyed. Requests waited above may need `CallExpiryTimer`.
+    TimerPool.stop();
+    TimerPool.join();
     for (auto &Worker : EvalWorkers) {
       Worker.reset();
     }
@@ -230,7 +529,7 @@ public:
 
   void updateWorkspaceVersion();
 
-  void onDocumentDidOpen(const lspserver::DidOpenTextDocumentParams &Params);
+  void onDocumentDidOpen(lspserver::DidOpenTextDocumentParams &&Params);
 
   void
   onDocumentDidChange(const lspserver::DidChangeTextDocumentParams &Params);
@@ -245,10 +544,21 @@ public:
   void clearDiagnostic(const lspserver::URIForFile &FileUri);
 
   void onDecalration(const lspserver::TextDocumentPositionParams &,
-                     lspserver::Callback<llvm::json::Value>);
+                     lspserver::Callback<lspserver::RawJSON>);
 
   void onDefinition(const lspserver::TextDocumentPositionParams &,
-                    lspserver::Callback<llvm::json::Value>);
+                    lspserver::Callback<lspserver::RawJSON>);
+
+  void onDocumentDiagnostic(
+      const lspserver::DocumentDiagnosticParams &,
+      lspserver::Callback<lspserver::DocumentDiagnosticReport>);
+
+  /// Replies at once, even if no report changed. Requests are not held until
+  /// a change (long polling): clients are asked to pull again by
+  /// "workspace/diagnostic/refresh" instead, see `flushDiagnostics`.
+  void onWorkspaceDiagnostic(
+      const lspserver::WorkspaceDiagnosticParams &,
+      lspserver::Callback<lspserver::WorkspaceDiagnosticReport>);
 
   void
   onDocumentLink(const lspserver::DocumentLinkParams &,
@@ -259,7 +569,7 @@ public:
                    lspserver::Callback<std::vector<lspserver::DocumentSymbol>>);
 
   void onHover(const lspserver::TextDocumentPositionParams &,
-               lspserver::Callback<lspserver::Hover>);
+               lspserver::Callback<lspserver::Serialized<lspserver::Hover>>);
 
   void onCompletion(const lspserver::CompletionParams &,
                     lspserver::Callback<lspserver::CompletionList>);
@@ -297,38 +607,198 @@ public:
 
   // Controller
 
+  /// Fork a worker process, running \p WorkerAction, and push it into
+  /// \p WorkerPool. Pipes for \p Replicas processes are created, the worker
+  /// could clone itself later to serve requests in parallel (`forkReplicas`).
   void forkWorker(llvm::unique_function<void()> WorkerAction,
-                  std::deque<std::unique_ptr<Proc>> &WorkerPool, size_t Size);
+                  std::deque<std::unique_ptr<Proc>> &WorkerPool, size_t Size,
+                  size_t Replicas = 1);
 
   void onEvalDiagnostic(const ipc::Diagnostics &);
 
+  /// Ask the newest evaluator to evaluate deeper, if the workspace is still at
+  /// \p Version (i.e. idle since then).
+  void startDeepEval(WorkspaceVersionTy Version);
+
+  /// Cancel the deep evaluation in progress, because editing resumed.
+  void cancelDeepEval();
+
   void onFinished(const ipc::WorkerMessage &);
 
+  void onReplicaReady(const ipc::ReplicaReady &);
+
+  void onEvalStats(const ipc::EvalStats &);
+
+  /// Statistics of the controller and its workers, see "nixd/stats".
+  llvm::json::Object collectStats();
+
+  void onStats(const std::nullptr_t &, lspserver::Callback<llvm::json::Value>);
+
+  /// Evaluate the target in a new worker, while profiling expressions of open
+  /// files, see `EvalProfiler`.
+  void onProfileEval(const ProfileEvalParams &,
+                     lspserver::Callback<llvm::json::Value>);
+
+  /// Approximate memory of documents in the controller: drafts, ASTs and
+  /// cached feature results.
+  std::map<std::string, MemoryUsage> documentMemory();
+
+  /// Evict caches if documents use more than `HighWaterMark`, down to a
+  /// low-water mark: ASTs of closed documents, then results of features.
+  /// Answers of workers are dropped too, once per crossing.
+  void checkMemory();
+
+  /// Memory used for each document, by the controller and evaluators.
+  void onMemoryUsage(const std::nullptr_t &,
+                     lspserver::Callback<llvm::json::Value>);
+
+  /// Evaluation time of hotspots found by the last profile.
+  void onInlayHint(const lspserver::InlayHintsParams &,
+                   lspserver::Callback<std::vector<lspserver::InlayHint>>);
+
+  void onHandled(llvm::StringRef Method, Clock::duration Elapsed,
+                 bool Failed) override;
+
+  /// Minimum number of samples, before we trust observed latencies.
+  static constexpr uint64_t MinLatencySamples = 16;
+
+  /// Time we wait for replies of \p Method, derived from observed latencies.
+  /// \p Fallback is used before there are enough samples.
+  std::chrono::microseconds timeoutOf(llvm::StringRef Method,
+                                      std::chrono::microseconds Fallback);
+
+  /// Time we wait for a worker generation, before asking another one.
+  /// Uses the p90 latency of the generation, or of all generations.
+  std::chrono::microseconds hedgeDelayOf(LatencyStats &Generation,
+                                         llvm::StringRef Method,
+                                         std::chrono::microseconds Fallback);
+
+  /// Describe a request on the AST node under the cursor, for caching
+  /// answers of worker generations. Positions in the same node (of the same
+  /// file version) share the key.
+  /// \returns std::nullopt if the request cannot be cached.
+  template <class Arg>
+  std::optional<std::string> responseKeyOf(llvm::StringRef Method,
+                                           const Arg &Params) {
+    return std::nullopt;
+  }
+
+  std::optional<std::string>
+  responseKeyOf(llvm::StringRef Method,
+                const lspserver::TextDocumentPositionParams &Params,
+                bool AtEnd = false);
+
+  std::optional<std::string>
+  responseKeyOf(llvm::StringRef Method,
+                const lspserver::CompletionParams &Params) {
+    // Member completion looks up the node before the dot.
+    bool Member = Params.context.triggerCharacter == ".";
+    return responseKeyOf(Method, Params, Member);
+  }
+
+  /// A position in a document version.
+  struct DocumentPosition {
+    std::string File;
+    int64_t Version;
+    lspserver::Position Pos;
+  };
+
+  /// Translate \p DP into the document version evaluated by \p Worker.
+  /// \returns std::nullopt if the worker cannot answer requests on it, e.g.
+  /// the document was not parsed, or edits since then are unknown.
+  std::optional<DocumentPosition> positionIn(const Proc &Worker,
+                                             const DocumentPosition &DP);
+
+  /// Answers of older document versions are stale. Positions in them are
+  /// remapped into the current version \p Current, hovers tell the version
+  /// they were evaluated on. Incomplete completion lists make the client ask
+  /// again, for a fresh answer.
+  template <class Resp>
+  void markStale(Resp &R, const DocumentPosition &Current, int64_t Evaluated) {
+  }
+
+  void markStale(lspserver::Hover &R, const DocumentPosition &Current,
+                 int64_t Evaluated);
+
+  void markStale(lspserver::CompletionList &R, const DocumentPosition &Current,
+                 int64_t Evaluated);
+
+  void markStale(lspserver::Location &R, const DocumentPosition &Current,
+                 int64_t Evaluated);
+
+  /// Answers forwarded as they are, decoded only if they are stale.
+  template <class T>
+  void markStale(lspserver::Serialized<T> &R, const DocumentPosition &Current,
+                 int64_t Evaluated) {
+    auto Decoded = R.decode();
+    if (!Decoded) {
+      lspserver::elog("cannot mark a stale answer: {0}", Decoded.takeError());
+      return;
+    }
+    markStale(*Decoded, Current, Evaluated);
+    R = lspserver::Serialized<T>(*Decoded);
+  }
+
+  /// Ask workers, newest first, until one of them answers. The request is
+  /// sent to an older generation only if the newer one is slower than its
+  /// p90 latency. \p Timeout (in microseconds) is the initial timeout, used
+  /// until we observed enough latencies to derive one.
+  ///
+  /// Nothing blocks while waiting, \p Then is invoked with responses sorted by
+  /// generations (oldest first), as an interactive task of the pool.
+  ///
+  /// Answers of requests on AST nodes are cached per generation, repeated
+  /// requests are answered without IPC.
+  ///
+  /// Positions are remapped for generations evaluated an older version of the
+  /// document, their answers are marked as stale (see `markStale`).
   template <class Resp, class Arg>
-  auto askWorkers(const WorkerContainer &Workers, std::shared_mutex &WorkerLock,
+  void askWorkers(const WorkerContainer &Workers, std::shared_mutex &WorkerLock,
                   llvm::StringRef IPCMethod, const Arg &Params,
-                  unsigned Timeout);
+                  unsigned Timeout,
+                  llvm::unique_function<void(std::vector<Resp>)> Then);
 
   template <class Resp, class Arg>
-  auto askWC(llvm::StringRef IPCMethod, const Arg &Params, WC CL)
-      -> std::vector<Resp> {
+  void askWC(llvm::StringRef IPCMethod, const Arg &Params,
+             llvm::unique_function<void(std::vector<Resp>)> Then, WC CL) {
     auto &[W, L, T] = CL;
-    return askWorkers<Resp>(W, L, IPCMethod, Params, T);
+    askWorkers<Resp>(W, L, IPCMethod, Params, T, std::move(Then));
   }
 
   template <class Resp, class Arg, class... A>
-  auto askWC(llvm::StringRef IPCMethod, const Arg &Params, WC CL, A... Rest)
-      -> std::vector<Resp> {
-    auto Vec = askWC<Resp>(IPCMethod, Params, CL);
-    if (Vec.empty())
-      return askWC<Resp>(IPCMethod, Params, Rest...);
-    return Vec;
+  void askWC(llvm::StringRef IPCMethod, const Arg &Params,
+             llvm::unique_function<void(std::vector<Resp>)> Then, WC CL,
+             A... Rest) {
+    askWC<Resp>(
+        IPCMethod, Params,
+        [=, Then = std::move(Then), this](std::vector<Resp> Vec) mutable {
+          if (Vec.empty())
+            return askWC<Resp>(IPCMethod, Params, std::move(Then), Rest...);
+          Then(std::move(Vec));
+        },
+        CL);
   }
 
   // Worker
 
   void initWorker();
 
+  /// Report statistics of \p State, after a \p Phase started at \p Start, to
+  /// the controller and the log.
+  void reportEvalStats(llvm::StringRef Phase, nix::EvalState &State,
+                       std::chrono::steady_clock::time_point Start);
+
+  /// Workers drop requests that have passed their deadline, or that are
+  /// superseded by a queued request of the same method, on the same file.
+  bool isStale(llvm::StringRef Method,
+               const llvm::json::Value &Params) override;
+
+  /// Workers interrupt evaluation if the deadline of the request passed,
+  /// because the controller does not wait for the reply anymore, or if the
+  /// controller cancelled the request.
+  bool onCall(llvm::StringRef Method, llvm::json::Value Params,
+              llvm::json::Value ID) override;
+
   // Worker::Nix::Option
 
   void forkOptionWorker();
@@ -341,10 +811,22 @@ public:
   void onOptionCompletion(const ipc::AttrPathParams &,
                           lspserver::Callback<llvm::json::Value>);
 
+  // Worker::Nix::Profiler
+
+  void switchToProfiler();
+
+  void onEvalProfile(const ipc::ProfileParams &,
+                     lspserver::Callback<ipc::ProfileResult>);
+
   // Worker::Nix::Eval
 
   void switchToEvaluator();
 
+  /// Clone this (evaluated) worker into read-only replicas, sharing the
+  /// evaluated heap copy-on-write. Each replica serves requests on its own
+  /// pipes, created by the controller.
+  void forkReplicas();
+
   template <class ReplyTy>
   void withAST(
       const std::string &, ReplyRAII<ReplyTy>,
@@ -360,62 +842,170 @@ public:
 
   void onEvalCompletion(const lspserver::CompletionParams &,
                         lspserver::Callback<llvm::json::Value>);
+
+  void onEvalDeep(const ipc::DeepEvalParams &,
+                  lspserver::Callback<llvm::json::Value>);
+
+  void onEvalMemoryUsage(const std::nullptr_t &,
+                         lspserver::Callback<std::vector<ipc::DocumentMemory>>);
 };
 
 template <class Resp, class Arg>
-auto Server::askWorkers(
-    const std::deque<std::unique_ptr<Server::Proc>> &Workers,
-    std::shared_mutex &WorkerLock, llvm::StringRef IPCMethod, const Arg &Params,
-    unsigned Timeout) {
-  // For all active workers, send the completion request
-  auto ListStoreOptional = std::make_shared<std::vector<std::optional<Resp>>>(
-      Workers.size(), std::nullopt);
-  auto Sema = std::make_shared<std::counting_semaphore<>>(0);
-  auto ListStoreLock = std::make_shared<std::mutex>();
-
-  size_t I = 0;
-  {
-    std::shared_lock RLock(WorkerLock);
-    for (const auto &Worker : Workers) {
-      auto Request = mkOutMethod<Arg, Resp>(IPCMethod, Worker->OutPort.get());
-      Request(Params, [I, ListStoreOptional, ListStoreLock,
-                       Sema](llvm::Expected<Resp> Result) {
-        // The worker answered our request, fill the completion lists then.
-        if (Result) {
-          std::lock_guard Guard(*ListStoreLock);
-          (*ListStoreOptional)[I] = Result.get();
-        } else {
-          lspserver::vlog("worker {0} reported error: {1}", I,
-                          Result.takeError());
-        }
-        Sema->release();
-      });
-      I++;
+void Server::askWorkers(const WorkerContainer &Workers,
+                        std::shared_mutex &WorkerLock,
+                        llvm::StringRef IPCMethod, const Arg &Params,
+                        unsigned Timeout,
+                        llvm::unique_function<void(std::vector<Resp>)> Then) {
+  using std::chrono::microseconds;
+  /// Responses, with the workspace version of the answering worker.
+  using Answer = std::pair<WorkspaceVersionTy, Resp>;
+  using G = Gather<Answer>;
+
+  auto Start = G::Clock::now();
+  auto Deadline = Start + timeoutOf(IPCMethod, microseconds(Timeout));
+
+  auto Key = responseKeyOf(IPCMethod, Params);
+
+  // Pending calls are failed after the deadline, unless we wait for workers.
+  auto CallDeadline = WaitWorker ? Clock::time_point::max() : Deadline;
+
+  // Requests on positions are remapped for older document versions.
+  std::optional<DocumentPosition> Doc;
+  if constexpr (std::is_base_of_v<lspserver::TextDocumentPositionParams,
+                                  Arg>) {
+    auto File = Params.textDocument.uri.file().str();
+    if (auto Draft = DraftMgr.peekDraft(File)) {
+      auto Version = EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
+      Doc = DocumentPosition{std::move(File), Version, Params.position};
     }
   }
 
-  std::future<void> F =
-      std::async([Sema, Size = I, Timeout, WaitWorker = this->WaitWorker]() {
-        for (size_t I = 0; I < Size; I++) {
-          if (WaitWorker)
-            Sema->acquire();
-          else
-            Sema->try_acquire_for(std::chrono::microseconds(Timeout / Size));
+  // Workers may stop working on the request once we have stopped waiting.
+  llvm::json::Value ParamsJSON(Params);
+  if (!WaitWorker)
+    ParamsJSON = ipc::withDeadline(std::move(ParamsJSON), Deadline);
+
+  // Hedged requests are sent on timer threads, answers are delivered on the
+  // pool.
+  auto Context = lspserver::trace::current();
+  lspserver::trace::AsyncSpan Asking(("ask " + IPCMethod).str());
+
+  // Send the request to the newest worker not asked yet.
+  auto Ask = [&Workers, &WorkerLock, IPCMethod, Timeout, this, Key, Doc,
+              CallDeadline, Context, ParamsJSON = std::move(ParamsJSON),
+              Asked = std::set<WorkspaceVersionTy>()](G::ReplyFn Reply) mutable
+      -> std::optional<G::Clock::duration> {
+    lspserver::trace::ContextScope Scope(Context);
+    std::shared_lock RLock(WorkerLock);
+    for (const auto &Worker : llvm::reverse(Workers)) {
+      if (!Asked.insert(Worker->WorkspaceVersion).second)
+        continue;
+      auto WorkerParams = ParamsJSON;
+      std::optional<int64_t> Evaluated;
+      if (Doc) {
+        auto WorkerDoc = positionIn(*Worker, *Doc);
+        if (!WorkerDoc)
+          continue;
+        if (WorkerDoc->Version != Doc->Version) {
+          (*WorkerParams.getAsObject())["position"] = WorkerDoc->Pos;
+          Evaluated = WorkerDoc->Version;
+        }
+      }
+      // Stale answers are cached as they are, and marked on delivery.
+      auto Deliver = [this, Doc, Evaluated,
+                      Version = Worker->WorkspaceVersion](Resp R) {
+        if (Evaluated)
+          markStale(R, *Doc, *Evaluated);
+        return Answer{Version, std::move(R)};
+      };
+      if (Key) {
+        if (auto Cached = Worker->Responses->lookup<Resp>(*Key)) {
+          Reply(Deliver(*Cached));
+          return hedgeDelayOf(*Worker->Latency, IPCMethod,
+                              microseconds(Timeout));
         }
-      });
+      }
+      // Spans of the worker are linked to this one.
+      lspserver::trace::AsyncSpan Call(IPCMethod);
+      if (lspserver::trace::enabled()) {
+        auto Flow = lspserver::trace::newID();
+        lspserver::trace::flowBegin(Flow);
+        WorkerParams = ipc::withTrace(std::move(WorkerParams),
+                                      {Context.Request, Flow});
+        Call.Args["worker"] = static_cast<int64_t>(Worker->WorkspaceVersion);
+      }
+      auto &C = Worker->pick();
+      auto Request = mkOutMethod<llvm::json::Value, Resp>(
+          IPCMethod, C.OutPort.get(), CallDeadline);
+      (*C.Pending)++;
+      Request(WorkerParams,
+              [this, Reply = std::move(Reply), Pending = C.Pending,
+               Latency = Worker->Latency, Version = Worker->WorkspaceVersion,
+               Responses = Worker->Responses, Key, Method = IPCMethod.str(),
+               Deliver = std::move(Deliver), Call = std::move(Call),
+               Sent = G::Clock::now()](llvm::Expected<Resp> Result) mutable {
+                Call.end();
+                (*Pending)--;
+                if (!Result) {
+                  lspserver::vlog("worker {0} reported error: {1}", Version,
+                                  Result.takeError());
+                  return Reply(std::nullopt);
+                }
+                auto Elapsed = std::chrono::duration_cast<microseconds>(
+                    G::Clock::now() - Sent);
+                (*Latency)[Method].record(Elapsed);
+                MethodLatency[Method].record(Elapsed);
+                if (Key)
+                  Responses->insert(*Key,
+                                    std::make_shared<const Resp>(*Result));
+                Reply(Deliver(std::move(Result.get())));
+              });
+      return hedgeDelayOf(*Worker->Latency, IPCMethod, microseconds(Timeout));
+    }
+    return std::nullopt;
+  };
 
-  F.wait();
+  auto Finish = [this, Then = std::move(Then), Method = IPCMethod.str(),
+                 Start, Deadline, Context, Asking = std::move(Asking)](
+                    std::vector<Answer> Answers) mutable {
+    lspserver::trace::ContextScope Scope(Context);
+    Asking.Args["answers"] = static_cast<int64_t>(Answers.size());
+    Asking.end();
+    if (Answers.empty() && G::Clock::now() >= Deadline) {
+      // Nobody answered in time. Count it, otherwise the deadline
+      // would never grow for slow evaluations.
+      MethodLatency[Method].record(
+          std::chrono::duration_cast<microseconds>(Deadline - Start));
+    }
 
-  std::lock_guard Guard(*ListStoreLock);
-  std::vector<Resp> AnsweredResp;
-  AnsweredResp.reserve(ListStoreOptional->size());
-  // Then, filter out un-answered response
-  for (const auto &R : *ListStoreOptional) {
-    if (R.has_value())
-      AnsweredResp.push_back(*R);
-  }
+    // Callers expect responses from older workers first.
+    std::stable_sort(Answers.begin(), Answers.end(),
+                     [](const auto &A, const auto &B) {
+                       return A.first < B.first;
+                     });
+    std::vector<Resp> AnsweredResp;
+    AnsweredResp.reserve(Answers.size());
+    for (auto &[_, R] : Answers)
+      AnsweredResp.emplace_back(std::move(R));
+
+    Then(std::move(AnsweredResp));
+    if (--PendingAsks == 0)
+      PendingAsks.notify_all();
+  };
 
-  return AnsweredResp;
+  PendingAsks++;
+  G::start(TimerPool.get_executor(), std::move(Ask), Deadline,
+           /*AskAll=*/WaitWorker,
+           [this, Finish = std::move(Finish)](
+               std::vector<Answer> Answers) mutable {
+             // Delivered on the timer thread, or on the dispatcher thread of a
+             // worker. Merging answers may take a while, block neither.
+             Pool.post(Priority::Interactive,
+                       [Finish = std::move(Finish),
+                        Answers = std::move(Answers)]() mutable {
+                         Finish(std::move(Answers));
+                       });
+           });
 }
 
 template <class ReplyTy>
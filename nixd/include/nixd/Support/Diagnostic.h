@@ -19,10 +19,20 @@ inline lspserver::Diagnostic mkDiagnosic(const nix::Trace &T,
   return mkDiagnosic(T.pos.get(), T.hint.str(), Serverity);
 }
 
+/// Maximum number of diagnostics made from traces of a single error.
+constexpr size_t MaxTraceDiagnostics = 32;
+
 // Maps filepath -> diagnostics
+// Traces are deduplicated (deep recursions repeat the same frames), and capped
+// by `MaxTraceDiagnostics`.
 std::map<std::string, std::vector<lspserver::Diagnostic>>
 mkDiagnostics(const nix::BaseError &);
 
+/// Append diagnostics of \p More that are not in \p Diags yet, i.e. with the
+/// same range, message and severity, in O(n log n).
+void mergeDiagnostics(std::vector<lspserver::Diagnostic> &Diags,
+                      const std::vector<lspserver::Diagnostic> &More);
+
 void insertDiagnostic(
     const nix::BaseError &E,
     std::map<std::string, lspserver::PublishDiagnosticsParams> &R,
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "lspserver/Protocol.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+
+namespace nixd {
+
+/// Edits applied to a document, used to remap positions between versions.
+///
+/// Positions before an edit are unchanged, positions after it are shifted.
+/// Positions inside the replaced text are moved to its start, so that they
+/// still point to the same token in common cases (e.g. typing in a name).
+class EditHistory {
+public:
+  using VersionTy = int64_t;
+
+  /// Maximum number of version steps kept, older ones are dropped.
+  static constexpr size_t MaxSteps = 256;
+
+private:
+  /// A single replacement. The replaced text was [Start, OldEnd), the
+  /// inserted text is [Start, NewEnd).
+  struct Edit {
+    lspserver::Position Start;
+    lspserver::Position OldEnd;
+    lspserver::Position NewEnd;
+  };
+
+  /// Edits turning version `From` into version `To`. Full replacements of the
+  /// document cannot be remapped, and have no edits.
+  struct Step {
+    VersionTy From;
+    VersionTy To;
+    std::optional<std::vector<Edit>> Edits;
+  };
+
+  std::deque<Step> Steps;
+
+  static lspserver::Position map(lspserver::Position P,
+                                 const lspserver::Position &Start,
+                                 const lspserver::Position &OldEnd,
+                                 const lspserver::Position &NewEnd);
+
+public:
+  /// Record \p Changes, turning version \p From into version \p To.
+  void record(VersionTy From, VersionTy To,
+              const std::vector<lspserver::TextDocumentContentChangeEvent>
+                  &Changes);
+
+  /// Forget all versions, e.g. the document is reopened.
+  void clear() { Steps.clear(); }
+
+  /// Remap position \p P from version \p From into version \p To, in either
+  /// direction.
+  /// \returns std::nullopt if edits between these versions are unknown.
+  [[nodiscard]] std::optional<lspserver::Position>
+  remap(lspserver::Position P, VersionTy From, VersionTy To) const;
+
+  [[nodiscard]] std::optional<lspserver::Range>
+  remap(const lspserver::Range &R, VersionTy From, VersionTy To) const;
+};
+
+} // namespace nixd
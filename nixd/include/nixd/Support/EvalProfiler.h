@@ -0,0 +1,78 @@
+#pragma once
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace nixd {
+
+/// Aggregates nested frames, e.g. evaluations of expressions, into a tree of
+/// call stacks, see "nixd/profileEval".
+///
+/// Not thread-safe, a profiler observes frames of a single thread.
+class EvalProfiler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// Identifies frames, e.g. an expression.
+  using Key = const void *;
+
+  /// Frames of the same key, entered from the same stack.
+  struct Node {
+    Key K = nullptr;
+    Node *Parent = nullptr;
+    std::map<Key, std::unique_ptr<Node>> Children;
+
+    /// Time spent in the frame, including callees.
+    Clock::duration Inclusive{};
+
+    /// Times entered.
+    uint64_t Count = 0;
+
+    /// Time spent in the frame itself.
+    [[nodiscard]] Clock::duration exclusive() const;
+  };
+
+  /// A key, summed over all stacks.
+  struct Totals {
+    /// Recursive frames are only counted by the outermost one.
+    Clock::duration Inclusive{};
+    Clock::duration Exclusive{};
+    uint64_t Count = 0;
+  };
+
+private:
+  Node Root;
+  Node *Current = &Root;
+  std::vector<Clock::time_point> Starts;
+
+public:
+  void enter(Key K, Clock::time_point Now = Clock::now());
+
+  /// Leave the innermost frame. Ignored if there is none.
+  void leave(Clock::time_point Now = Clock::now());
+
+  /// Frames not left yet.
+  [[nodiscard]] size_t depth() const { return Starts.size(); }
+
+  [[nodiscard]] const Node &root() const { return Root; }
+
+  /// Time spent in outermost frames.
+  [[nodiscard]] Clock::duration total() const;
+
+  [[nodiscard]] std::map<Key, Totals> totals() const;
+
+  /// Write stacks in the "folded" format of flamegraph.pl, one line for each
+  /// stack: labels of frames from the outermost one, separated by ';', and the
+  /// exclusive time of the innermost frame, in microseconds.
+  void writeFolded(llvm::raw_ostream &OS,
+                   llvm::function_ref<std::string(Key)> Label) const;
+};
+
+} // namespace nixd
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <llvm/ADT/FunctionExtras.h>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace nixd {
+
+/// Ask a sequence of sources for answers, without blocking any thread.
+///
+/// Sources are asked one by one. Another source is asked only if previous
+/// ones did not answer after a (source-specific) hedge delay, or all of them
+/// failed. The continuation is invoked exactly once, with the first answer,
+/// or with nothing at the deadline.
+///
+/// Timers are scheduled on the given executor, which should not be blocked by
+/// long-running tasks. Sources are asked without holding the lock, they may
+/// block on writing requests.
+template <class T>
+class Gather : public std::enable_shared_from_this<Gather<T>> {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// Replied by sources, std::nullopt if the source failed.
+  using ReplyFn = llvm::unique_function<void(std::optional<T>)>;
+
+  /// Ask the next source, which must call the reply function exactly once.
+  /// \returns the hedge delay of the source, or std::nullopt if there is no
+  /// source left (and nothing was asked).
+  using AskFn =
+      llvm::unique_function<std::optional<Clock::duration>(ReplyFn Reply)>;
+
+  /// Receives answers, in the order they arrived.
+  using ThenFn = llvm::unique_function<void(std::vector<T>)>;
+
+private:
+  std::mutex Lock;
+  AskFn Ask;                       // GUARDED_BY(Lock)
+  ThenFn Then;                     // GUARDED_BY(Lock)
+  boost::asio::steady_timer Timer; // GUARDED_BY(Lock)
+  Clock::time_point Deadline;
+  bool AskAll;
+
+  std::vector<T> Answers; // GUARDED_BY(Lock)
+  size_t Asked = 0;       // GUARDED_BY(Lock)
+  size_t Replied = 0;     // GUARDED_BY(Lock)
+  bool Exhausted = false; // GUARDED_BY(Lock)
+  bool Finished = false;  // GUARDED_BY(Lock)
+  /// `Ask` is taken out, and invoked without holding the lock.
+  bool Asking = false; // GUARDED_BY(Lock)
+
+  /// Incremented for each timer arming, expired timers are ignored.
+  size_t TimerSeq = 0; // GUARDED_BY(Lock)
+
+  /// The thread running `Ask`, replies from it are deferred to the executor,
+  /// sources may not be asked reentrantly.
+  std::atomic<std::thread::id> AskingThread;
+
+  template <class Executor>
+  Gather(const Executor &E, AskFn Ask, Clock::time_point Deadline, bool AskAll,
+         ThenFn Then)
+      : Ask(std::move(Ask)), Then(std::move(Then)), Timer(E),
+        Deadline(Deadline), AskAll(AskAll) {}
+
+  /// Take the continuation if we are done, must be invoked after unlocking.
+  [[nodiscard]] ThenFn finish() {
+    if (Finished)
+      return nullptr;
+    Finished = true;
+    Timer.cancel();
+    // Drop sources, they may hold resources.
+    Ask = nullptr;
+    return std::move(Then);
+  }
+
+  void arm(Clock::time_point When) {
+    Timer.expires_at(When);
+    Timer.async_wait([Self = this->shared_from_this(),
+                      Seq = ++TimerSeq](const boost::system::error_code &) {
+      Self->onTimer(Seq);
+    });
+  }
+
+  /// Ask the next source (or all of them), and arm the timer for hedging.
+  /// \p Guard is unlocked while asking.
+  void askNext(std::unique_lock<std::mutex> &Guard) {
+    while (!Asking && !Finished && !Exhausted) {
+      Asking = true;
+      auto AskSource = std::move(Ask);
+      Guard.unlock();
+      AskingThread = std::this_thread::get_id();
+      auto Delay =
+          AskSource([Self = this->shared_from_this()](std::optional<T> R) {
+            if (Self->AskingThread.load() != std::this_thread::get_id())
+              return Self->onReply(std::move(R));
+            // Replied synchronously, the source is still being asked.
+            boost::asio::post(Self->Timer.get_executor(),
+                              [Self, R = std::move(R)]() mutable {
+                                Self->onReply(std::move(R));
+                              });
+          });
+      AskingThread = std::thread::id();
+      Guard.lock();
+      Asking = false;
+      // Answered meanwhile, drop sources.
+      if (Finished)
+        return;
+      Ask = std::move(AskSource);
+      if (!Delay) {
+        Exhausted = true;
+        if (!AskAll)
+          arm(Deadline);
+        return;
+      }
+      Asked++;
+      if (AskAll)
+        continue;
+      arm(std::min(Deadline, Clock::now() + *Delay));
+      // Unless all asked sources failed while asking, wait for the timer.
+      if (!Answers.empty() || Replied < Asked)
+        return;
+    }
+  }
+
+  [[nodiscard]] bool done() const {
+    if (AskAll)
+      return Exhausted && Replied == Asked;
+    return !Answers.empty() || (Exhausted && Replied == Asked);
+  }
+
+  void onReply(std::optional<T> R) {
+    ThenFn Continuation;
+    std::vector<T> Result;
+    {
+      std::unique_lock Guard(Lock);
+      Replied++;
+      if (Finished)
+        return;
+      if (R)
+        Answers.emplace_back(std::move(*R));
+      // All asked sources failed, do not wait for the hedge delay.
+      if (!AskAll && !Exhausted && Answers.empty() && Replied == Asked)
+        askNext(Guard);
+      if (done()) {
+        Continuation = finish();
+        Result = std::move(Answers);
+      }
+    }
+    if (Continuation)
+      Continuation(std::move(Result));
+  }
+
+  void onTimer(size_t Seq) {
+    ThenFn Continuation;
+    std::vector<T> Result;
+    {
+      std::unique_lock Guard(Lock);
+      if (Finished || Seq != TimerSeq)
+        return;
+      if (Clock::now() < Deadline && !Exhausted)
+        askNext(Guard);
+      if (Clock::now() >= Deadline || done()) {
+        Continuation = finish();
+        Result = std::move(Answers);
+      }
+    }
+    if (Continuation)
+      Continuation(std::move(Result));
+  }
+
+public:
+  /// Start gathering, \p Then is invoked on the thread of the last reply, or
+  /// on the timer executor \p E.
+  ///
+  /// If \p AskAll is set, all sources are asked at once, and we wait for all
+  /// of them, regardless of the deadline.
+  template <class Executor>
+  static void start(const Executor &E, AskFn Ask, Clock::time_point Deadline,
+                    bool AskAll, ThenFn Then) {
+    std::shared_ptr<Gather> G(
+        new Gather(E, std::move(Ask), Deadline, AskAll, std::move(Then)));
+    ThenFn Continuation;
+    std::vector<T> Result;
+    {
+      std::unique_lock Guard(G->Lock);
+      G->askNext(Guard);
+      if (G->done()) {
+        Continuation = G->finish();
+        Result = std::move(G->Answers);
+      }
+    }
+    if (Continuation)
+      Continuation(std::move(Result));
+  }
+};
+
+} // namespace nixd
@@ -1,7 +1,11 @@
+#include "nixd/Support/MemoryUsage.h"
+
 #include "lspserver/Protocol.h"
+#include "lspserver/Trace.h"
 
 #include <llvm/Support/JSON.h>
 
+#include <chrono>
 #include <list>
 #include <optional>
 #include <thread>
@@ -66,6 +70,20 @@ struct TopLevel {
     /// Number of workers forking
     /// defaults to std::thread::hardware_concurrency
     int workers = static_cast<int>(std::thread::hardware_concurrency());
+    /// Number of processes serving requests for each evaluation.
+    /// Evaluated workers fork read-only replicas, sharing their heap.
+    int replicas = 1;
+
+    /// Evaluate shallowly on changes, and deeply ("depth") once the workspace
+    /// has been idle for a while.
+    struct Tiered {
+      bool enable = false;
+      /// The depth evaluated on each change.
+      int shallowDepth = 0;
+      /// Milliseconds without changes before the deep evaluation.
+      int idleDelay = 1000;
+    };
+    Tiered tiered;
   };
 
   Eval eval;
@@ -81,18 +99,70 @@ struct TopLevel {
   };
 
   Options options;
+
+  struct Scheduler {
+    /// Maximum number of concurrent controller tasks, for each priority class.
+    /// Less urgent classes are counted in limits of more urgent ones.
+    /// Zero means the default: all threads, half of them, and a quarter.
+    int interactive = 0;
+    int background = 0;
+    int indexing = 0;
+  };
+  Scheduler scheduler;
+
+  struct Trace {
+    /// Write spans of requests to this file, in Chrome trace format.
+    /// Empty means no tracing.
+    std::string file;
+  };
+  Trace trace;
+
+  struct Stats {
+    /// Log statistics (see "nixd/stats") every this many seconds.
+    /// Zero means never.
+    int dumpInterval = 0;
+  };
+  Stats stats;
+
+  struct Memory {
+    /// Evict caches once documents use more than this many MiB, see
+    /// "nixd/memoryUsage". Zero means never.
+    int highWaterMark = 0;
+  };
+  Memory memory;
 };
+bool fromJSON(const llvm::json::Value &Params, TopLevel::Eval::Tiered &R,
+              llvm::json::Path P);
 bool fromJSON(const llvm::json::Value &Params, TopLevel::Eval &R,
               llvm::json::Path P);
 bool fromJSON(const llvm::json::Value &Params, TopLevel::Formatting &R,
               llvm::json::Path P);
 bool fromJSON(const llvm::json::Value &Params, TopLevel::Options &R,
               llvm::json::Path P);
+bool fromJSON(const llvm::json::Value &Params, TopLevel::Scheduler &R,
+              llvm::json::Path P);
+bool fromJSON(const llvm::json::Value &Params, TopLevel::Trace &R,
+              llvm::json::Path P);
+bool fromJSON(const llvm::json::Value &Params, TopLevel::Stats &R,
+              llvm::json::Path P);
+bool fromJSON(const llvm::json::Value &Params, TopLevel::Memory &R,
+              llvm::json::Path P);
 bool fromJSON(const llvm::json::Value &Params, TopLevel &R, llvm::json::Path P);
 bool fromJSON(const llvm::json::Value &Params, InstallableConfigurationItem &R,
               llvm::json::Path P);
 } // namespace configuration
 
+/// Params of "nixd/profileEval".
+struct ProfileEvalParams {
+  /// Depth of the evaluation, "eval.depth" by default.
+  std::optional<int> depth;
+
+  /// Where to write folded stacks, a temporary file if empty.
+  std::string output;
+};
+
+bool fromJSON(const llvm::json::Value &, ProfileEvalParams &, llvm::json::Path);
+
 namespace ipc {
 
 using WorkspaceVersionTy = uint64_t;
@@ -109,6 +179,9 @@ llvm::json::Value toJSON(const WorkerMessage &);
 /// <----
 struct Diagnostics : WorkerMessage {
   std::vector<lspserver::PublishDiagnosticsParams> Params;
+
+  /// Files injected into the evaluation, i.e. parsed without errors.
+  std::vector<std::string> Injected;
 };
 
 bool fromJSON(const llvm::json::Value &, lspserver::PublishDiagnosticsParams &,
@@ -117,6 +190,126 @@ bool fromJSON(const llvm::json::Value &, lspserver::PublishDiagnosticsParams &,
 bool fromJSON(const llvm::json::Value &, Diagnostics &, llvm::json::Path);
 llvm::json::Value toJSON(const Diagnostics &);
 
+/// Sent by a replica once it was forked, requests could be routed to it.
+/// <----
+struct ReplicaReady : WorkerMessage {
+  /// Index of the channel connected to the replica, the worker is 0.
+  int64_t Channel;
+};
+
+bool fromJSON(const llvm::json::Value &, ReplicaReady &, llvm::json::Path);
+llvm::json::Value toJSON(const ReplicaReady &);
+
+/// Statistics of the Boehm garbage collector.
+struct GCStats {
+  /// Bytes in the heap, including free ones.
+  int64_t HeapSize = 0;
+  int64_t FreeBytes = 0;
+
+  /// Bytes allocated since the process started.
+  int64_t TotalBytes = 0;
+
+  int64_t Collections = 0;
+
+  /// Time spent in full collections, in milliseconds.
+  int64_t Time = 0;
+};
+
+bool fromJSON(const llvm::json::Value &, GCStats &, llvm::json::Path);
+llvm::json::Value toJSON(const GCStats &);
+
+/// Sent by workers after a phase, e.g. evaluating the target, so that
+/// expensive targets can be diagnosed. Counters are cumulative since the
+/// worker was forked, including the ones of the controller.
+/// <----
+struct EvalStats : WorkerMessage {
+  /// "inject", "eval", "deep" or "options".
+  std::string Phase;
+
+  /// Generations of eval workers and option workers are not distinct.
+  int64_t Pid;
+
+  /// Wall time of the phase, in milliseconds.
+  int64_t Elapsed;
+
+  /// Counters of nix::EvalState, in the format of NIX_SHOW_STATS. Null if
+  /// unavailable.
+  llvm::json::Value Nix = nullptr;
+
+  GCStats GC;
+};
+
+bool fromJSON(const llvm::json::Value &, EvalStats &, llvm::json::Path);
+llvm::json::Value toJSON(const EvalStats &);
+
+/// Sent to an evaluator, evaluate the target deeper, and report diagnostics
+/// again. The evaluation is interrupted if the request is cancelled.
+/// ---->
+struct DeepEvalParams {
+  int Depth;
+};
+
+bool fromJSON(const llvm::json::Value &, DeepEvalParams &, llvm::json::Path);
+llvm::json::Value toJSON(const DeepEvalParams &);
+
+/// Sent to a profiler, evaluate the target while profiling.
+/// ---->
+struct ProfileParams {
+  int Depth = 0;
+
+  /// Where to write folded stacks.
+  std::string Output;
+};
+
+bool fromJSON(const llvm::json::Value &, ProfileParams &, llvm::json::Path);
+llvm::json::Value toJSON(const ProfileParams &);
+
+/// Evaluation time of an expression, in microseconds.
+struct Hotspot {
+  lspserver::Location Location;
+
+  /// Name of the function, if the expression is the body of one, or the kind
+  /// of the expression.
+  std::string Name;
+
+  int64_t Inclusive;
+  int64_t Exclusive;
+
+  /// Times evaluated, e.g. forced thunks or called functions.
+  int64_t Count;
+};
+
+bool fromJSON(const llvm::json::Value &, Hotspot &, llvm::json::Path);
+llvm::json::Value toJSON(const Hotspot &);
+
+/// <----
+struct ProfileResult {
+  /// Time of the evaluation spent in open files, in microseconds.
+  int64_t Total = 0;
+
+  /// Slowest expressions, by inclusive time.
+  std::vector<Hotspot> Hotspots;
+
+  /// Path of folded stacks, written by the profiler.
+  std::string Output;
+
+  /// Error message of the evaluation, if any.
+  std::string Error;
+};
+
+bool fromJSON(const llvm::json::Value &, ProfileResult &, llvm::json::Path);
+llvm::json::Value toJSON(const ProfileResult &);
+
+/// Memory used for a document by an evaluator.
+/// <----
+struct DocumentMemory {
+  std::string Path;
+  MemoryUsage Usage;
+};
+
+bool fromJSON(const llvm::json::Value &, DocumentMemory &, llvm::json::Path);
+llvm::json::Value toJSON(const DocumentMemory &);
+
 struct AttrPathParams {
   std::string Path;
 };
@@ -125,5 +318,23 @@ bool fromJSON(const llvm::json::Value &, AttrPathParams &, llvm::json::Path);
 
 llvm::json::Value toJSON(const AttrPathParams &);
 
+/// Requests to workers may carry a deadline, the controller will not wait for
+/// replies after it. Monotonic clocks are shared by processes on the machine.
+using DeadlineTy = std::chrono::steady_clock::time_point;
+
+/// Attach \p Deadline to request params \p Params, which must be an object.
+llvm::json::Value withDeadline(llvm::json::Value Params, DeadlineTy Deadline);
+
+/// \returns the deadline attached to \p Params, or std::nullopt if none.
+std::optional<DeadlineTy> getDeadline(const llvm::json::Value &Params);
+
+/// Attach the request \p Context to \p Params, so that spans of workers join
+/// the trace of the controller.
+llvm::json::Value withTrace(llvm::json::Value Params,
+                            const lspserver::trace::Context &Context);
+
+/// \returns the request context attached to \p Params, or an empty one.
+lspserver::trace::Context getTrace(const llvm::json::Value &Params);
+
 } // namespace ipc
 } // namespace nixd
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/JSON.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+namespace nixd {
+
+/// Lock-free histogram of latencies, in microseconds.
+///
+/// Buckets are logarithmic: each power of two is split into `SubBuckets`
+/// linear buckets, so percentiles have at most 1/SubBuckets relative error.
+class LatencyHistogram {
+public:
+  using Duration = std::chrono::microseconds;
+
+  static constexpr size_t SubBuckets = 4;
+
+  /// Latencies larger than 2^MaxOctave microseconds fall in the last bucket.
+  static constexpr size_t MaxOctave = 40;
+
+  static constexpr size_t NumBuckets = MaxOctave * SubBuckets;
+
+private:
+  std::array<std::atomic<uint64_t>, NumBuckets> Buckets{};
+  std::atomic<uint64_t> Count = 0;
+  std::atomic<uint64_t> Sum = 0;
+
+public:
+  static size_t bucketOf(Duration D);
+
+  /// \returns the largest latency that falls in \p Bucket.
+  static Duration upperBound(size_t Bucket);
+
+  void record(Duration D);
+
+  [[nodiscard]] uint64_t count() const { return Count.load(); }
+
+  /// Sum of recorded latencies.
+  [[nodiscard]] Duration sum() const { return Duration(Sum.load()); }
+
+  /// \returns the latency that \p P (in [0, 1]) of samples are not slower
+  /// than, or std::nullopt if there are less than \p MinSamples samples.
+  [[nodiscard]] std::optional<Duration>
+  percentile(double P, uint64_t MinSamples = 1) const;
+};
+
+/// Latency histograms, keyed by method names.
+class LatencyStats {
+  std::mutex Lock;
+  llvm::StringMap<std::unique_ptr<LatencyHistogram>> Map; // GUARDED_BY(Lock)
+
+public:
+  /// Get the histogram of \p Method, create one if not exist.
+  /// References are stable until the stats object is destroyed.
+  LatencyHistogram &operator[](llvm::StringRef Method);
+
+  void forEach(
+      llvm::function_ref<void(llvm::StringRef, const LatencyHistogram &)> F);
+};
+
+/// {"count", "mean", "p50", "p90", "p99"}, in microseconds.
+llvm::json::Value toJSON(const LatencyHistogram &H);
+
+/// Histograms keyed by methods.
+llvm::json::Value toJSON(LatencyStats &Stats);
+
+} // namespace nixd
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <llvm/Support/JSON.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nixd {
+
+/// Approximate memory used for a document, in bytes.
+struct MemoryUsage {
+  /// Nodes of the AST, and tables of the parser.
+  uint64_t AST = 0;
+
+  /// Static analysis: parents, definitions and references.
+  uint64_t Analysis = 0;
+
+  /// Values and environments recorded by the evaluation.
+  uint64_t Eval = 0;
+
+  /// Text of the draft.
+  uint64_t Draft = 0;
+
+  /// Cached results of features, e.g. document symbols.
+  uint64_t Features = 0;
+
+  [[nodiscard]] uint64_t total() const {
+    return AST + Analysis + Eval + Draft + Features;
+  }
+
+  MemoryUsage &operator+=(const MemoryUsage &RHS) {
+    AST += RHS.AST;
+    Analysis += RHS.Analysis;
+    Eval += RHS.Eval;
+    Draft += RHS.Draft;
+    Features += RHS.Features;
+    return *this;
+  }
+};
+
+llvm::json::Value toJSON(const MemoryUsage &);
+bool fromJSON(const llvm::json::Value &, MemoryUsage &, llvm::json::Path);
+
+// Heap bytes owned by an object, not including the object itself.
+// Allocator overhead is not counted, except for nodes of trees.
+
+template <class T> uint64_t memoryOf(const T &) { return 0; }
+
+inline uint64_t memoryOf(const std::string &S) {
+  // Short strings are stored inline, up to the capacity of an empty one.
+  if (S.capacity() <= std::string().capacity())
+    return 0;
+  return S.capacity() + 1;
+}
+
+/// Entries of std::map are nodes of a red-black tree: the value, three
+/// pointers and the color.
+template <class K, class V> constexpr uint64_t mapEntrySize() {
+  return sizeof(std::pair<const K, V>) + 32;
+}
+
+template <class T> uint64_t memoryOf(const std::vector<T> &V);
+
+template <class K, class V> uint64_t memoryOf(const std::map<K, V> &M);
+
+template <class T> uint64_t memoryOf(const std::vector<T> &V) {
+  uint64_t Result = V.capacity() * sizeof(T);
+  for (const auto &E : V)
+    Result += memoryOf(E);
+  return Result;
+}
+
+template <class K, class V> uint64_t memoryOf(const std::map<K, V> &M) {
+  uint64_t Result = M.size() * mapEntrySize<K, V>();
+  for (const auto &[Key, Value] : M)
+    Result += memoryOf(Key) + memoryOf(Value);
+  return Result;
+}
+
+} // namespace nixd
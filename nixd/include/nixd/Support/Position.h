@@ -4,6 +4,7 @@
 #include "nixd/Parser/Parser.h"
 
 #include "lspserver/Protocol.h"
+#include "lspserver/SourceCode.h"
 
 #include <nix/nixexpr.hh>
 
@@ -44,6 +45,8 @@ struct Range {
   operator lspserver::Range() const { return toLSPRange(*this); }
 };
 
+/// Nix columns count bytes, so these are exact positions if UTF-8 is
+/// negotiated (see lspserver::lspEncoding()). Otherwise, see `transcodePos`.
 inline lspserver::Position toLSPPos(const nix::AbstractPos &P) {
   return {static_cast<int>(std::max(1U, P.line) - 1),
           static_cast<int>(std::max(1U, P.column) - 1)};
@@ -58,6 +61,30 @@ inline lspserver::Range toLSPRange(const Range &R) {
   return {toLSPPos(R.Begin), toLSPPos(R.End)};
 }
 
+/// Transcode \p P, made by `toLSPPos`, into the negotiated encoding, with
+/// \p Code, the text of its file. Only the line of \p P is measured.
+inline lspserver::Position transcodePos(lspserver::Position P,
+                                        llvm::StringRef Code) {
+  if (lspserver::lspEncoding() == lspserver::OffsetEncoding::UTF8)
+    return P;
+  size_t Start = 0;
+  for (int I = 0; I < P.line; I++) {
+    Start = Code.find('\n', Start);
+    if (Start == llvm::StringRef::npos)
+      return P;
+    Start++;
+  }
+  llvm::StringRef Line = Code.substr(Start).split('\n').first;
+  P.character = static_cast<int>(
+      lspserver::lspLength(Line.take_front(std::max(P.character, 0))));
+  return P;
+}
+
+inline lspserver::Range transcodeRange(const lspserver::Range &R,
+                                       llvm::StringRef Code) {
+  return {transcodePos(R.start, Code), transcodePos(R.end, Code)};
+}
+
 inline std::string pathOf(const nix::PosAdapter &Pos) {
   if (const auto &Path = std::get_if<nix::SourcePath>(&Pos.origin)) {
     return Path->to_string();
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <llvm/Support/JSON.h>
+
+#include <cstdint>
+#include <optional>
+
+#include <sys/types.h>
+
+namespace nixd {
+
+/// Resource usage of a process.
+struct ProcessStats {
+  /// Resident set size, in bytes.
+  uint64_t RSS = 0;
+
+  /// Page faults served without I/O. Forked workers take one for each page
+  /// written, copied from the parent.
+  uint64_t MinorFaults = 0;
+
+  uint64_t MajorFaults = 0;
+};
+
+/// Read usage of \p Pid from /proc.
+/// \returns std::nullopt if unavailable, e.g. not Linux, or the process exited.
+std::optional<ProcessStats> readProcessStats(pid_t Pid);
+
+llvm::json::Value toJSON(const ProcessStats &S);
+
+} // namespace nixd
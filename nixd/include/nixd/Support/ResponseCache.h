@@ -0,0 +1,61 @@
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace nixd {
+
+/// Thread-safe LRU cache of responses, keyed by strings describing requests.
+///
+/// Values are type-erased, a key must always be used with the same type.
+class ResponseCache {
+public:
+  using ValueTy = std::shared_ptr<const void>;
+
+private:
+  size_t Capacity;
+
+  std::mutex Lock;
+
+  /// Most recently used first.
+  std::list<std::pair<std::string, ValueTy>> Entries; // GUARDED_BY(Lock)
+
+  llvm::StringMap<decltype(Entries)::iterator> Index; // GUARDED_BY(Lock)
+
+  std::atomic<uint64_t> Hits = 0;
+  std::atomic<uint64_t> Misses = 0;
+
+public:
+  explicit ResponseCache(size_t Capacity = 1024) : Capacity(Capacity) {}
+
+  /// \returns the cached value of \p Key, or nullptr.
+  ValueTy lookup(llvm::StringRef Key);
+
+  template <class T> std::shared_ptr<const T> lookup(llvm::StringRef Key) {
+    return std::static_pointer_cast<const T>(lookup(Key));
+  }
+
+  /// Insert or replace the value of \p Key, evicting the least recently used
+  /// entry if we are full.
+  void insert(llvm::StringRef Key, ValueTy Value);
+
+  /// Drop all entries, e.g. answers are not up-to-date anymore.
+  void clear();
+
+  [[nodiscard]] size_t size();
+
+  [[nodiscard]] uint64_t hits() const { return Hits.load(); }
+
+  [[nodiscard]] uint64_t misses() const { return Misses.load(); }
+};
+
+} // namespace nixd
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <llvm/ADT/FunctionExtras.h>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace nixd {
+
+/// Priority classes of scheduled tasks, more urgent first.
+enum class Priority {
+  /// The user is waiting for the result, e.g. completion, hover.
+  Interactive,
+  /// Requested, but bulky, e.g. document symbols, formatting.
+  Background,
+  /// Nobody is waiting, e.g. parsing documents.
+  Indexing,
+};
+
+constexpr size_t NumPriorities = 3;
+
+/// Thread pool scheduling tasks by priority classes.
+///
+/// Each thread owns a deque per class. Tasks posted from a pool thread go to
+/// its own deque (LIFO for the owner), others are distributed round-robin.
+/// Idle threads steal from other deques (FIFO). Threads always pick the most
+/// urgent class having runnable tasks, but less urgent classes can only occupy
+/// a limited number of threads, so that bulk work cannot starve interactive
+/// requests.
+class Scheduler {
+public:
+  using Task = llvm::unique_function<void()>;
+
+  using LimitsTy = std::array<size_t, NumPriorities>;
+
+  /// Default limits of \p Threads: all threads for interactive tasks, half of
+  /// them for background tasks, and a quarter of them for indexing (at least
+  /// one).
+  static LimitsTy defaultLimits(size_t Threads);
+
+private:
+  struct Worker {
+    std::mutex Lock;
+    std::array<std::deque<Task>, NumPriorities> Queues; // GUARDED_BY(Lock)
+  };
+
+  std::vector<std::unique_ptr<Worker>> Workers;
+  std::vector<std::thread> Threads;
+
+  /// Slot accounting of classes.
+  std::mutex SlotLock;
+
+  /// Maximum number of running tasks for each class, see `setLimits`.
+  LimitsTy Limits; // GUARDED_BY(SlotLock)
+
+  /// Running[C]: running tasks of class C, or less urgent ones.
+  LimitsTy Running{}; // GUARDED_BY(SlotLock)
+
+  /// Whether some thread could not take a task, because of the limits.
+  bool Denied = false; // GUARDED_BY(SlotLock)
+
+  /// Tasks posted, but not finished yet.
+  std::atomic<size_t> Outstanding = 0;
+
+  /// Used for posting from outside the pool.
+  std::atomic<size_t> NextWorker = 0;
+
+  /// Sleeping threads wait for new tasks, or for class slots.
+  std::mutex SleepLock;
+  std::condition_variable SleepCV;
+  size_t Epoch = 0;  // GUARDED_BY(SleepLock)
+  bool Stop = false; // GUARDED_BY(SleepLock)
+
+  /// Waiting for all tasks being finished.
+  std::condition_variable IdleCV;
+
+  /// The process created these threads, forked children do not have them.
+  pid_t OwnerPID;
+
+  /// Wake up sleeping threads, because something changed.
+  void notify();
+
+  /// Take a slot of class \p C, if limits allow.
+  bool reserve(size_t C);
+
+  void release(size_t C);
+
+  /// Try to take a slot of class \p P, and a task of the class, from worker
+  /// \p Self first, then from others.
+  bool tryRun(size_t Self, Priority P);
+
+  void run(size_t Self);
+
+public:
+  explicit Scheduler(size_t Threads = std::thread::hardware_concurrency(),
+                     LimitsTy Limits = {});
+
+  ~Scheduler();
+
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  [[nodiscard]] size_t size() const { return Threads.size(); }
+
+  /// Set concurrency limits for each class, zeros are replaced by defaults.
+  /// Limits are cumulative, the limit of a class also counts tasks of less
+  /// urgent classes. For example, {8, 4, 1} means at most 4 threads run
+  /// background or indexing tasks, so 4 threads are always available for
+  /// interactive tasks.
+  void setLimits(LimitsTy NewLimits);
+
+  void post(Priority P, Task T);
+
+  struct Load {
+    /// Tasks waiting in queues of each class.
+    LimitsTy Queued{};
+    /// Running tasks of each class, or less urgent ones (as in limits).
+    LimitsTy Running{};
+    LimitsTy Limits{};
+  };
+
+  /// A snapshot of queues, for statistics.
+  [[nodiscard]] Load load();
+
+  /// Wait until all tasks, including tasks posted by them, are finished.
+  /// Must not be called from pool threads.
+  void wait();
+
+  /// Wait for all tasks, and stop threads.
+  void join();
+};
+
+} // namespace nixd
@@ -2,8 +2,27 @@
 #include "nixd/Expr/CallbackExpr.h"
 #include "nixd/Nix/EvalState.h"
 
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+
 namespace nixd {
 
+namespace {
+
+/// Size of the dynamic type of \p E, a node created by `rewriteCallback`.
+size_t sizeOfCallback(const nix::Expr *E) {
+  static const std::unordered_map<std::type_index, size_t> Sizes = {
+#define NIX_EXPR(EXPR) {typeid(Callback##EXPR), sizeof(Callback##EXPR)},
+#include "nixd/Expr/Nodes.inc"
+#undef NIX_EXPR
+  };
+  auto It = Sizes.find(typeid(*E));
+  return It != Sizes.end() ? It->second : sizeof(nix::Expr);
+}
+
+} // namespace
+
 void EvalAST::rewriteAST() {
   auto EvalCallback = [this](const nix::Expr *Expr, const nix::EvalState &,
                              nix::Env &ExprEnv, nix::Value &ExprValue) {
@@ -24,6 +43,22 @@ void EvalAST::rewriteAST() {
   }
 }
 
+void EvalAST::measure() {
+  ParseAST::measure();
+  Usage.AST += memoryOf(Cxt.Nodes) + memoryOf(Locations);
+  for (const auto &Node : Cxt.Nodes)
+    Usage.AST += sizeOfCallback(Node.get());
+}
+
+MemoryUsage EvalAST::memoryUsage() const {
+  auto Result = ParseAST::memoryUsage();
+  // Values are copied into the map, environments are owned by the GC.
+  Result.Eval =
+      ValueMap.size() * mapEntrySize<const nix::Expr *, nix::Value>() +
+      EnvMap.size() * mapEntrySize<const nix::Expr *, nix::Env *>();
+  return Result;
+}
+
 nix::Value EvalAST::getValue(const nix::Expr *Expr) const {
   if (const auto *EV = dynamic_cast<const nix::ExprVar *>(Expr)) {
     if (!EV->fromWith) {
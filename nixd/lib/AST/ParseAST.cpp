@@ -5,9 +5,50 @@
 #include <nix/symbol-table.hh>
 
 #include <optional>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
 
 namespace nixd {
 
+namespace {
+
+/// Size of the dynamic type of \p E, a node created by the parser. A single
+/// lookup, instead of a dynamic_cast for each node class.
+size_t sizeOfNode(const nix::Expr *E) {
+  static const std::unordered_map<std::type_index, size_t> Sizes = {
+      {typeid(nodes::ExprError), sizeof(nodes::ExprError)},
+#define NIX_EXPR(EXPR) {typeid(nodes::EXPR), sizeof(nodes::EXPR)},
+#include "nixd/Expr/Nodes.inc"
+#undef NIX_EXPR
+  };
+  auto It = Sizes.find(typeid(*E));
+  return It != Sizes.end() ? It->second : sizeof(nix::Expr);
+}
+
+template <class T> uint64_t contextBytes(const Context<T> &Cxt) {
+  uint64_t Result = memoryOf(Cxt.Nodes);
+  for (const auto &Node : Cxt.Nodes)
+    Result += sizeof(T) + memoryOf(*Node);
+  return Result;
+}
+
+} // namespace
+
+void ParseAST::measure() {
+  Usage = {};
+  Usage.AST = memoryOf(Data->ctx.Nodes) + memoryOf(Data->end) +
+              memoryOf(Data->locations) + Data->STable->totalSize();
+  for (const auto &Node : Data->ctx.Nodes)
+    Usage.AST += sizeOfNode(Node.get());
+  Usage.AST += contextBytes(Data->PFCtx) + contextBytes(Data->FCtx) +
+               contextBytes(Data->FsCtx) + contextBytes(Data->APCtx) +
+               contextBytes(Data->ANCtx) + contextBytes(Data->SPCtx) +
+               contextBytes(Data->ISPCtx);
+  Usage.Analysis =
+      memoryOf(ParentMap) + memoryOf(References) + memoryOf(Definitions);
+}
+
 std::optional<ParseAST::Definition>
 ParseAST::lookupDef(lspserver::Position Desired) const {
   for (const auto &[Def, _] : References) {
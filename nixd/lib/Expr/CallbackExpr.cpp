@@ -3,11 +3,14 @@
 #include "nixd/Expr/Nodes.h"
 
 #include <nix/nixexpr.hh>
+#include <nix/util.hh>
 
 #include <memory>
 
 namespace nixd {
 
+thread_local EvalObserver *CurrentEvalObserver = nullptr;
+
 #define NIX_EXPR(EXPR)                                                         \
   Callback##EXPR *Callback##EXPR::create(ASTContext &Cxt, const nix::EXPR &E,  \
                                          ExprCallback ECB) {                   \
@@ -45,6 +48,8 @@ rewriteCallback(ASTContext &Cxt, ExprCallback ECB, const nix::Expr *Root,
 #define NIX_EXPR(EXPR)                                                         \
   void Callback##EXPR::eval(nix::EvalState &State, nix::Env &Env,              \
                             nix::Value &V) {                                   \
+    nix::checkInterrupt();                                                     \
+    ObservedEval Observed(this);                                               \
     nix::EXPR::eval(State, Env, V);                                            \
     ECB(this, State, Env, V);                                                  \
   }
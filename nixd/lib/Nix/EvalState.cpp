@@ -1,5 +1,11 @@
 #include "nixd/Nix/EvalState.h"
 
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <cstdlib>
+
 namespace nix {
 
 void forceValueDepth(EvalState &State, Value &v, int depth) {
@@ -13,6 +19,8 @@ void forceValueDepth(EvalState &State, Value &v, int depth) {
     if (!seen.insert(&v).second)
       return;
 
+    checkInterrupt();
+
     State.forceValue(v, [&]() { return v.determinePos(noPos); });
 
     if (v.type() == nAttrs) {
@@ -36,4 +44,33 @@ void forceValueDepth(EvalState &State, Value &v, int depth) {
 
   recurse(v, depth);
 }
+
+namespace {
+/// Where printStats() writes, set by initEvalStats().
+std::string StatsPath;
+} // namespace
+
+void initEvalStats() {
+  llvm::SmallString<128> Path;
+  llvm::sys::fs::getPotentiallyUniqueTempFileName("nixd-stats", "json", Path);
+  StatsPath = Path.str().str();
+  setenv("NIX_SHOW_STATS", "1", 1);
+  setenv("NIX_SHOW_STATS_PATH", StatsPath.c_str(), 1);
+}
+
+std::optional<std::string> evalStats(EvalState &State) {
+  if (StatsPath.empty())
+    return std::nullopt;
+  try {
+    State.printStats();
+  } catch (...) {
+    return std::nullopt;
+  }
+  auto Buffer = llvm::MemoryBuffer::getFile(StatsPath);
+  llvm::sys::fs::remove(StatsPath);
+  if (!Buffer || (*Buffer)->getBuffer().trim().empty())
+    return std::nullopt;
+  return (*Buffer)->getBuffer().str();
+}
+
 } // namespace nix
@@ -1,9 +1,14 @@
 #include "nixd/Server/ASTManager.h"
 #include "nixd/Parser/Require.h"
 
-#include <boost/asio/post.hpp>
+#include "lspserver/Trace.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <optional>
+#include <tuple>
+#include <vector>
 
 namespace nixd {
 
@@ -13,7 +18,137 @@ void ASTManager::withAST(const std::string &Path, VersionTy Version,
     std::lock_guard _(ActionsLock);
     Actions.insert({Path, std::move(Action)});
   }
-  checkCacheAndInvoke(Path, Version);
+  if (checkCacheAndInvoke(Path, Version))
+    CacheStats.Hits++;
+  else
+    CacheStats.Misses++;
+}
+
+std::optional<ASTManager::CachedASTTy>
+ASTManager::getAST(const std::string &Path) {
+  std::lock_guard _(ASTCacheLock);
+  if (auto It = ASTCache.find(Path); It != ASTCache.end())
+    return It->second;
+  return std::nullopt;
+}
+
+ASTManager::CacheUsage ASTManager::cacheUsage() {
+  CacheUsage Usage;
+  std::lock_guard _(ASTCacheLock);
+  for (const auto &Entry : ASTCache) {
+    Usage.Files++;
+    if (const auto &AST = Entry.second.first)
+      Usage.Nodes += AST->nodes();
+  }
+  return Usage;
+}
+
+std::map<std::string, MemoryUsage> ASTManager::memoryUsage() {
+  std::map<std::string, MemoryUsage> Result;
+  std::lock_guard _(ASTCacheLock);
+  for (const auto &[Path, Cached] : ASTCache) {
+    if (const auto &AST = Cached.first)
+      Result[Path] = AST->memoryUsage();
+  }
+  for (const auto &[Path, Features] : FeatureCache) {
+    auto &Usage = Result[Path];
+    for (const auto &[_, R] : Features.Results)
+      Usage.Features += R.Bytes;
+  }
+  return Result;
+}
+
+uint64_t ASTManager::evict(const std::set<std::string> &Keep,
+                           uint64_t Target) {
+  uint64_t Released = 0;
+  auto FeatureBytes = [](const FeatureResults &Entry) {
+    uint64_t Bytes = 0;
+    for (const auto &[_, R] : Entry.Results)
+      Bytes += R.Bytes;
+    return Bytes;
+  };
+  // Destroyed after unlocking, parsing tasks are not blocked meanwhile.
+  std::vector<std::shared_ptr<const void>> Values;
+  std::vector<ASTPtr> ASTs;
+  std::lock_guard _(ASTCacheLock);
+
+  // Documents that are not open are parsed again when they are needed.
+  std::vector<std::pair<uint64_t, std::string>> Closed;
+  for (const auto &[Path, Cached] : ASTCache) {
+    if (Keep.contains(Path))
+      continue;
+    uint64_t Bytes = 0;
+    if (const auto &AST = Cached.first) {
+      auto Usage = AST->memoryUsage();
+      Bytes += Usage.AST + Usage.Analysis;
+    }
+    if (auto It = FeatureCache.find(Path); It != FeatureCache.end())
+      Bytes += FeatureBytes(It->second);
+    Closed.emplace_back(Bytes, Path);
+  }
+  std::sort(Closed.begin(), Closed.end(), std::greater<>());
+  for (const auto &[Bytes, Path] : Closed) {
+    if (Released >= Target)
+      return Released;
+    ASTs.emplace_back(std::move(ASTCache.at(Path).first));
+    ASTCache.erase(Path);
+    if (auto It = FeatureCache.find(Path); It != FeatureCache.end()) {
+      for (auto &[_, R] : It->second.Results)
+        Values.emplace_back(std::move(R.Value));
+      FeatureCache.erase(It);
+    }
+    Released += Bytes;
+  }
+
+  // Results are computed again, on the next request.
+  std::vector<std::tuple<uint64_t, std::string, std::string>> Results;
+  for (const auto &[Path, Entry] : FeatureCache) {
+    for (const auto &[Key, R] : Entry.Results)
+      Results.emplace_back(R.Bytes, Path, Key);
+  }
+  std::sort(Results.begin(), Results.end(), std::greater<>());
+  for (const auto &[Bytes, Path, Key] : Results) {
+    if (Released >= Target)
+      break;
+    auto Entry = FeatureCache.find(Path);
+    auto It = Entry->second.Results.find(Key);
+    Values.emplace_back(std::move(It->second.Value));
+    Entry->second.Results.erase(It);
+    if (Entry->second.Results.empty())
+      FeatureCache.erase(Entry);
+    Released += Bytes;
+  }
+  return Released;
+}
+
+std::shared_ptr<const void>
+ASTManager::lookupFeature(const std::string &Path, VersionTy Version,
+                          const std::string &Key) {
+  std::lock_guard _(ASTCacheLock);
+  if (auto It = FeatureCache.find(Path);
+      It != FeatureCache.end() && It->second.Version >= Version) {
+    if (auto R = It->second.Results.find(Key); R != It->second.Results.end()) {
+      Stats.Hits++;
+      return R->second.Value;
+    }
+  }
+  Stats.Misses++;
+  return nullptr;
+}
+
+void ASTManager::storeFeature(const std::string &Path, VersionTy Version,
+                              std::string Key,
+                              std::shared_ptr<const void> Result,
+                              uint64_t Bytes) {
+  std::lock_guard _(ASTCacheLock);
+  auto It = ASTCache.find(Path);
+  if (It == ASTCache.end() || It->second.second != Version)
+    return;
+  auto &Entry = FeatureCache[Path];
+  if (Entry.Version != Version)
+    Entry = FeatureResults{Version, {}};
+  Bytes += Key.size();
+  Entry.Results[std::move(Key)] = FeatureResult{std::move(Result), Bytes};
 }
 
 void ASTManager::invokeActions(const ParseAST &AST, const std::string &Path,
@@ -38,51 +173,60 @@ void ASTManager::invokeActions(const ParseAST &AST, const std::string &Path,
 
 bool ASTManager::checkCacheAndInvoke(const std::string &Path,
                                      VersionTy Version) {
-  auto CheckCache = [this](const std::string &Path, VersionTy Version)
-      -> std::optional<std::pair<ParseAST *, ASTManager::VersionTy>> {
-    if (ASTCache.contains(Path)) {
-      auto &[CachedAST, CachedVersion] = ASTCache.at(Path);
-      if (CachedVersion >= Version)
-        return std::pair{CachedAST.get(), CachedVersion};
-    }
-    return std::nullopt;
-  };
-  std::lock_guard _(ASTCacheLock);
-  if (const auto Cache = CheckCache(Path, Version)) {
-    auto [AST, CachedVersion] = *Cache;
-    // The AST pointer must be guarded by the cache lock
-    invokeActions(*AST, Path, CachedVersion);
-    return true;
-  }
-  return false;
+  auto Cache = getAST(Path);
+  if (!Cache || Cache->second < Version)
+    return false;
+  // The snapshot keeps the AST alive, even if a newer one is published.
+  auto [AST, CachedVersion] = std::move(*Cache);
+  invokeActions(*AST, Path, CachedVersion);
+  return true;
 }
 
-void ASTManager::schedParse(const std::string &Content, const std::string &Path,
+void ASTManager::schedParse(lspserver::Rope Text, const std::string &Path,
                             VersionTy Version) {
   auto Task = [=, this]() {
     try {
       if (checkCacheAndInvoke(Path, Version))
         return;
-      auto ParseData = parse(Content, Path);
-      auto NewAST = std::make_unique<ParseAST>((std::move(ParseData)));
+      lspserver::trace::Span Tracer("parse");
+      Tracer.Args["size"] = static_cast<int64_t>(Text.size());
+      auto Start = std::chrono::steady_clock::now();
+      // The parser needs two trailing bytes, see `parse`.
+      std::string Content;
+      Content.reserve(Text.size() + 2);
+      Text.appendTo(Content);
+      auto ParseData = parse(std::move(Content), Path);
+      auto NewAST = std::make_shared<ParseAST>((std::move(ParseData)));
 
       // TODO: use AST builder to unify these stuff
       NewAST->bindVars();
       NewAST->staticAnalysis();
+      ParseLatency.record(
+          std::chrono::duration_cast<LatencyHistogram::Duration>(
+              std::chrono::steady_clock::now() - Start));
 
-      invokeActions(*NewAST, Path, Version);
-
-      // Update the cache
+      // Publish the snapshot before invoking actions. Actions added after
+      // this will find it in the cache.
       {
         std::lock_guard _(ASTCacheLock);
-        ASTCache[Path] = std::make_pair(std::move(NewAST), Version);
+        auto &Cached = ASTCache[Path];
+        // Parsing tasks may finish out of order, keep the newest one.
+        if (!Cached.first || Cached.second <= Version) {
+          Cached = std::make_pair(NewAST, Version);
+          if (auto It = FeatureCache.find(Path); It != FeatureCache.end()) {
+            Stats.Invalidations += It->second.Results.size();
+            FeatureCache.erase(It);
+          }
+        }
       }
+
+      invokeActions(*NewAST, Path, Version);
     } catch (...) {
       // TODO: do something here?
     }
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Indexing, std::move(Task));
 }
 
 } // namespace nixd
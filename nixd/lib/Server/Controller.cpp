@@ -15,18 +15,23 @@
 #include "lspserver/Path.h"
 #include "lspserver/Protocol.h"
 #include "lspserver/SourceCode.h"
+#include "lspserver/Trace.h"
 #include "lspserver/URI.h"
 
 #include <llvm/ADT/FunctionExtras.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/FormatVariadic.h>
 #include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/ScopedPrinter.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include <boost/iostreams/stream.hpp>
 #include <boost/process.hpp>
 
+#include <algorithm>
 #include <cstdint>
 #include <exception>
 #include <filesystem>
@@ -35,9 +40,11 @@
 #include <mutex>
 #include <optional>
 #include <semaphore>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <variant>
 
@@ -47,15 +54,23 @@ namespace nixd {
 
 void Server::forkWorker(llvm::unique_function<void()> WorkerAction,
                         std::deque<std::unique_ptr<Proc>> &WorkerPool,
-                        size_t Size) {
+                        size_t Size, size_t Replicas) {
   if (Role != ServerRole::Controller)
     return;
-  auto To = std::make_unique<nix::Pipe>();
-  auto From = std::make_unique<nix::Pipe>();
 
-  To->create();
-  From->create();
+  // {To, From} pipes, for the worker and each of its replicas.
+  std::vector<std::pair<std::unique_ptr<nix::Pipe>, std::unique_ptr<nix::Pipe>>>
+      Pipes;
+  for (size_t I = 0; I < std::max<size_t>(Replicas, 1); I++) {
+    auto To = std::make_unique<nix::Pipe>();
+    auto From = std::make_unique<nix::Pipe>();
 
+    To->create();
+    From->create();
+    Pipes.emplace_back(std::move(To), std::move(From));
+  }
+
+  auto ForkStart = std::chrono::steady_clock::now();
   auto ForkPID = fork();
   if (ForkPID == -1) {
     lspserver::elog("Cannot create child worker process");
@@ -67,79 +82,347 @@ void Server::forkWorker(llvm::unique_function<void()> WorkerAction,
     // the best response.
     auto ChildPID = getpid();
     lspserver::elog("created child worker process {0}", ChildPID);
+    // Replicas join the group of the worker, and are killed with it.
+    setpgid(0, 0);
 
     // Redirect stdin & stdout to our pipes, instead of LSP clients
+    auto &[To, From] = Pipes.front();
     dup2(To->readSide.get(), 0);
     dup2(From->writeSide.get(), 1);
 
+    // Keep replica pipes open, they will be used after the worker finished.
+    ReplicaFDs.clear();
+    for (size_t I = 1; I < Pipes.size(); I++) {
+      auto &[RTo, RFrom] = Pipes[I];
+      ReplicaFDs.emplace_back(RTo->readSide.release(),
+                              RFrom->writeSide.release());
+    }
+
     WorkerAction();
 
     // Communicate the controller in stadnard mode, instead of lit testing
     switchStreamStyle(lspserver::JSONStreamStyle::Standard);
 
-  } else {
-
-    auto WorkerInputDispatcher =
-        std::thread([In = From->readSide.get(), this]() {
-          // Start a thread that handles outputs from WorkerProc, and call the
-          // Controller Callback
-          auto IPort = std::make_unique<lspserver::InboundPort>(In);
+    // Read requests ahead, so that superseded ones could be dropped.
+    switchReadAhead(true);
 
-          // The loop will exit when the worker process close the pipe.
-          IPort->loop(*this);
-        });
-
-    auto ProcFdStream =
-        std::make_unique<llvm::raw_fd_ostream>(To->writeSide.get(), false);
-
-    auto OutPort =
-        std::make_unique<lspserver::OutboundPort>(*ProcFdStream, false);
+  } else {
+    lspserver::trace::Span Tracer("forkWorker", ForkStart);
+    // Either of us may run first, see the child.
+    setpgid(ForkPID, ForkPID);
+    ForkLatency.record(std::chrono::duration_cast<LatencyHistogram::Duration>(
+        std::chrono::steady_clock::now() - ForkStart));
+    std::vector<std::unique_ptr<Proc::Channel>> Channels;
+    for (auto &[To, From] : Pipes) {
+      auto ProcFdStream =
+          std::make_unique<llvm::raw_fd_ostream>(To->writeSide.get(), false);
+
+      auto OutPort =
+          std::make_unique<lspserver::OutboundPort>(*ProcFdStream, false);
+      setCallLimit(OutPort.get(), WorkerCallLimit);
+
+      auto Ref = std::make_shared<Proc::PortRef>();
+      Ref->Port = OutPort.get();
+
+      auto WorkerInputDispatcher =
+          std::thread([In = From->readSide.get(), Ref, this]() {
+            // Start a thread that handles outputs from WorkerProc, and call the
+            // Controller Callback
+            auto IPort = std::make_unique<lspserver::InboundPort>(In);
+
+            // The loop will exit when the worker process close the pipe.
+            IPort->loop(*this);
+
+            // The worker exited, or crashed. Calls to it are never answered.
+            // The channel is not destroyed meanwhile, if it still exists.
+            std::lock_guard Guard(Ref->Lock);
+            if (Ref->Port)
+              forgetCalls(Ref->Port);
+          });
+
+      Channels.emplace_back(std::unique_ptr<Proc::Channel>(new Proc::Channel{
+          .ToPipe = std::move(To),
+          .FromPipe = std::move(From),
+          .OutPort = std::move(OutPort),
+          .OwnedStream = std::move(ProcFdStream),
+          .Ref = std::move(Ref),
+          .InputDispatcher = std::move(WorkerInputDispatcher)}));
+    }
+    Channels.front()->Status = Proc::Channel::State::Ready;
 
     auto WorkerProc = std::unique_ptr<Proc>(
-        new Proc{.ToPipe = std::move(To),
-                 .FromPipe = std::move(From),
-                 .OutPort = std::move(OutPort),
-                 .OwnedStream = std::move(ProcFdStream),
+        new Proc{.Channels = std::move(Channels),
                  .Pid = ForkPID,
                  .WorkspaceVersion = WorkspaceVersion,
-                 .InputDispatcher = std::move(WorkerInputDispatcher),
                  .Smp = std::ref(FinishSmp),
-                 .WaitWorker = WaitWorker});
+                 .WaitWorker = WaitWorker,
+                 .Forked = ForkStart});
+    WorkerProc->Pid.setSeparatePG(true);
+
+    for (const auto &File : DraftMgr.getActiveFiles()) {
+      if (auto Draft = DraftMgr.peekDraft(File))
+        WorkerProc->FileVersions[File] =
+            EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
+    }
 
     WorkerPool.emplace_back(std::move(WorkerProc));
-    if (WorkerPool.size() > Size && !WaitWorker)
-      WorkerPool.pop_front();
+    if (!WaitWorker)
+      trimWorkers(WorkerPool, Size);
+  }
+}
+
+void Server::trimWorkers(WorkerContainer &Workers, size_t Size) {
+  while (Workers.size() > Size) {
+    // Documents injected by newer generations, or not open anymore.
+    std::set<std::string> Covered;
+    auto Pinned = [&](const Proc &Worker) {
+      bool Pin = false;
+      if (Worker.Injected) {
+        for (const auto &File : *Worker.Injected) {
+          if (DraftMgr.peekDraft(File) && Covered.insert(File).second)
+            Pin = true;
+        }
+      }
+      return Pin;
+    };
+    std::optional<size_t> Victim;
+    // Never retire the newest one.
+    Pinned(*Workers.back());
+    for (size_t I = Workers.size() - 1; I-- > 0;) {
+      if (!Pinned(*Workers[I]))
+        Victim = I;
+    }
+    if (!Victim)
+      break;
+    for (const auto &C : Workers[*Victim]->Channels)
+      forgetCalls(C->OutPort.get());
+    Workers.erase(Workers.begin() + *Victim);
+  }
+}
+
+std::chrono::microseconds
+Server::timeoutOf(llvm::StringRef Method, std::chrono::microseconds Fallback) {
+  auto P99 = MethodLatency[Method].percentile(0.99, MinLatencySamples);
+  if (!P99)
+    return Fallback;
+  // Leave some room for occasionally slow requests, but do not drift too far
+  // away from the initial guess.
+  return std::clamp(*P99 * 2, Fallback / 10, Fallback * 4);
+}
+
+std::chrono::microseconds
+Server::hedgeDelayOf(LatencyStats &Generation, llvm::StringRef Method,
+                     std::chrono::microseconds Fallback) {
+  if (auto P90 = Generation[Method].percentile(0.9, MinLatencySamples))
+    return *P90;
+  if (auto P90 = MethodLatency[Method].percentile(0.9, MinLatencySamples))
+    return *P90;
+  return Fallback / 2;
+}
+
+std::optional<std::string>
+Server::responseKeyOf(llvm::StringRef Method,
+                      const lspserver::TextDocumentPositionParams &Params,
+                      bool AtEnd) {
+  auto Path = Params.textDocument.uri.file().str();
+  auto Draft = DraftMgr.peekDraft(Path);
+  if (!Draft)
+    return std::nullopt;
+  auto Version = EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
+  // The node is identified in the AST of the requested version only.
+  auto Cached = ASTMgr.getAST(Path);
+  if (!Cached || Cached->second != Version)
+    return std::nullopt;
+  const auto &AST = *Cached->first;
+  try {
+    const auto *Node = AtEnd ? AST.lookupEnd(Params.position)
+                             : AST.lookupContainMin(Params.position);
+    if (!Node)
+      return std::nullopt;
+    auto Range = AST.lRange(Node);
+    if (!Range)
+      return std::nullopt;
+    return llvm::formatv("{0}:{1}:{2}:{3}:{4}", Method, Path, Version,
+                         Range->start, Range->end)
+        .str();
+  } catch (...) {
+    return std::nullopt;
+  }
+}
+
+std::optional<Server::DocumentPosition>
+Server::positionIn(const Proc &Worker, const DocumentPosition &DP) {
+  if (Worker.Injected && !Worker.Injected->contains(DP.File))
+    return std::nullopt;
+  auto It = Worker.FileVersions.find(DP.File);
+  if (It == Worker.FileVersions.end())
+    return std::nullopt;
+  if (It->second == DP.Version)
+    return DP;
+  std::lock_guard _(HistoryLock);
+  auto History = Histories.find(DP.File);
+  if (History == Histories.end())
+    return std::nullopt;
+  if (auto Pos = History->second.remap(DP.Pos, DP.Version, It->second))
+    return DocumentPosition{DP.File, It->second, *Pos};
+  return std::nullopt;
+}
+
+void Server::markStale(lspserver::Hover &R, const DocumentPosition &Current,
+                       int64_t Evaluated) {
+  if (R.range) {
+    std::lock_guard _(HistoryLock);
+    if (auto It = Histories.find(Current.File); It != Histories.end())
+      R.range = It->second.remap(*R.range, Evaluated, Current.Version);
+  }
+  if (!R.contents.value.empty())
+    R.contents.value +=
+        llvm::formatv("\n\n*Evaluated on version {0}*", Evaluated);
+}
+
+void Server::markStale(lspserver::CompletionList &R,
+                       const DocumentPosition &Current, int64_t Evaluated) {
+  // Ask the client to request again, we may have fresh results then.
+  R.isIncomplete = true;
+}
+
+void Server::markStale(lspserver::Location &R, const DocumentPosition &Current,
+                       int64_t Evaluated) {
+  if (R.uri.file() != Current.File)
+    return;
+  std::lock_guard _(HistoryLock);
+  if (auto It = Histories.find(Current.File); It != Histories.end()) {
+    if (auto Range = It->second.remap(R.range, Evaluated, Current.Version))
+      R.range = *Range;
   }
 }
 
 void Server::updateWorkspaceVersion() {
   if (Role != ServerRole::Controller)
     return;
-  WorkspaceVersion++;
+  // Editing resumed, the deep evaluation of the previous version is useless.
+  cancelDeepEval();
   std::lock_guard EvalGuard(EvalWorkerLock);
+  WorkspaceVersion++;
   // The eval worker
   forkWorker([this]() { switchToEvaluator(); }, EvalWorkers,
-             Config.eval.workers);
+             Config.eval.workers, Config.eval.replicas);
+
+  // Forked workers continue here.
+  if (Role != ServerRole::Controller || !Config.eval.tiered.enable)
+    return;
+  IdleTimer.expires_after(
+      std::chrono::milliseconds(Config.eval.tiered.idleDelay));
+  IdleTimer.async_wait(
+      [this, Version = WorkspaceVersion](const boost::system::error_code &EC) {
+        if (!EC)
+          startDeepEval(Version);
+      });
 }
 
-void Server::addDocument(lspserver::PathRef File, llvm::StringRef Contents,
+void Server::startDeepEval(WorkspaceVersionTy Version) {
+  std::shared_lock Guard(EvalWorkerLock);
+  if (Version != WorkspaceVersion || EvalWorkers.empty())
+    return;
+  auto &Worker = EvalWorkers.back();
+  if (Worker->WorkspaceVersion != Version)
+    return;
+  lspserver::log("workspace {0} is idle, evaluating deeply", Version);
+  // Only the worker itself evaluates, replicas are forked already.
+  auto *Port = Worker->Channels.front()->OutPort.get();
+  std::lock_guard DeepGuard(DeepEvalLock);
+  auto ID = callOutMethod<ipc::DeepEvalParams, std::nullptr_t>(
+      "nixd/ipc/eval/deep", ipc::DeepEvalParams{Config.eval.depth},
+      [this, Version](llvm::Expected<std::nullptr_t> Result) {
+        {
+          std::lock_guard DeepGuard(DeepEvalLock);
+          if (DeepEval && DeepEval->WorkspaceVersion == Version)
+            DeepEval.reset();
+        }
+        if (!Result) {
+          lspserver::log("deep evaluation of workspace {0}: {1}", Version,
+                         Result.takeError());
+          return;
+        }
+        std::shared_lock Guard(EvalWorkerLock);
+        for (const auto &Worker : EvalWorkers) {
+          if (Worker->WorkspaceVersion != Version)
+            continue;
+          // Answers cached before are shallow.
+          Worker->deepen();
+          Worker->Responses->clear();
+        }
+      },
+      Port, /*Deadline=*/Clock::time_point::max());
+  DeepEval = DeepEvalTy{Version, std::move(ID)};
+}
+
+void Server::scheduleCallExpiry() {
+  CallExpiryTimer.expires_after(CallExpiryInterval);
+  CallExpiryTimer.async_wait([this](const boost::system::error_code &EC) {
+    if (EC)
+      return;
+    expireCalls();
+    scheduleCallExpiry();
+  });
+}
+
+void Server::cancelDeepEval() {
+  std::shared_lock Guard(EvalWorkerLock);
+  std::lock_guard DeepGuard(DeepEvalLock);
+  if (!DeepEval)
+    return;
+  for (const auto &Worker : EvalWorkers) {
+    if (Worker->WorkspaceVersion == DeepEval->WorkspaceVersion)
+      cancelCall(DeepEval->ID, Worker->Channels.front()->OutPort.get());
+  }
+  DeepEval.reset();
+}
+
+void Server::addDocument(lspserver::PathRef File, lspserver::Rope Text,
                          llvm::StringRef Version) {
   using namespace lspserver;
   auto IVersion = DraftStore::decodeVersion(Version);
-  // Since this file is updated, we first clear its diagnostic
-  PublishDiagnosticsParams Notification;
-  Notification.uri = URIForFile::canonicalize(File, File);
-  Notification.diagnostics = {};
-  Notification.version = IVersion;
-  PublishDiagnostic(Notification);
+  {
+    // Positions of eval diagnostics are outdated, drop them. Static ones are
+    // replaced once the new content is parsed.
+    std::lock_guard Guard(DiagStatusLock);
+    DiagStatus.Eval.erase(URIForFile::canonicalize(File, File).uri());
+  }
 
-  DraftMgr.addDraft(File, Version, Contents);
-  ASTMgr.schedParse(Contents.str(), File.str(), IVersion.value_or(0));
+  DraftMgr.addDraft(File, Version, Text);
+  ASTMgr.schedParse(std::move(Text), File.str(), IVersion.value_or(0));
+  ASTMgr.withAST(File.str(), IVersion.value_or(0),
+                 [this, File = File.str()](const ParseAST &AST,
+                                           ASTManager::VersionTy &Version) {
+                   onStaticDiagnostic(File, AST, Version);
+                 });
   updateWorkspaceVersion();
 }
 
 void Server::updateConfig(configuration::TopLevel &&NewConfig) {
   Config = std::move(NewConfig);
+  // The worker itself serves requests, and more replicas than cores only
+  // share them.
+  Config.eval.replicas = std::clamp(
+      Config.eval.replicas, 1,
+      std::max(static_cast<int>(std::thread::hardware_concurrency()), 1));
+  auto Limit = [](int N) { return static_cast<size_t>(std::max(N, 0)); };
+  Pool.setLimits({Limit(Config.scheduler.interactive),
+                  Limit(Config.scheduler.background),
+                  Limit(Config.scheduler.indexing)});
+  StatsDumpInterval = std::max(Config.stats.dumpInterval, 0);
+  // In MiB.
+  HighWaterMark =
+      static_cast<uint64_t>(std::max(Config.memory.highWaterMark, 0)) << 20;
+  // The command line option takes precedence, and files of a session are not
+  // switched, workers forked before would still write to the previous one.
+  if (!Config.trace.file.empty() && !lspserver::trace::enabled()) {
+    if (auto Err = lspserver::trace::enable(Config.trace.file))
+      lspserver::elog("{0}", std::move(Err));
+    else
+      lspserver::trace::nameProcess("controller");
+  }
   forkOptionWorker();
   updateWorkspaceVersion();
 }
@@ -201,6 +484,27 @@ Server::getDraft(lspserver::PathRef File) const {
   return std::move(Draft->Contents);
 }
 
+std::shared_ptr<const std::string>
+Server::sourceOf(lspserver::PathRef File) const {
+  if (lspserver::lspEncoding() == lspserver::OffsetEncoding::UTF8)
+    return nullptr;
+  if (auto Draft = getDraft(File))
+    return Draft;
+  auto Buffer = llvm::MemoryBuffer::getFile(File);
+  if (!Buffer)
+    return nullptr;
+  return std::make_shared<const std::string>((*Buffer)->getBuffer().str());
+}
+
+lspserver::PublishDiagnosticsParams
+Server::transcodeDiagnostics(lspserver::PublishDiagnosticsParams Params) const {
+  if (auto Source = sourceOf(Params.uri.file())) {
+    for (auto &Diag : Params.diagnostics)
+      Diag.range = transcodeRange(Diag.range, *Source);
+  }
+  return Params;
+}
+
 Server::Server(std::unique_ptr<lspserver::InboundPort> In,
                std::unique_ptr<lspserver::OutboundPort> Out, int WaitWorker)
     : LSPServer(std::move(In), std::move(Out)), WaitWorker(WaitWorker),
@@ -235,6 +539,8 @@ Server::Server(std::unique_ptr<lspserver::InboundPort> In,
 
   PublishDiagnostic = mkOutNotifiction<lspserver::PublishDiagnosticsParams>(
       "textDocument/publishDiagnostics");
+  Registry.addMethod("textDocument/diagnostic", this,
+                     &Server::onDocumentDiagnostic);
 
   // Workspace
   Registry.addNotification("workspace/didChangeConfiguration", this,
@@ -242,6 +548,10 @@ Server::Server(std::unique_ptr<lspserver::InboundPort> In,
   WorkspaceConfiguration =
       mkOutMethod<lspserver::ConfigurationParams, configuration::TopLevel>(
           "workspace/configuration");
+  Registry.addMethod("workspace/diagnostic", this,
+                     &Server::onWorkspaceDiagnostic);
+  WorkspaceDiagnosticRefresh = mkOutMethod<std::nullptr_t, std::nullptr_t>(
+      "workspace/diagnostic/refresh");
 
   /// IPC
   Registry.addNotification("nixd/ipc/diagnostic", this,
@@ -253,8 +563,17 @@ Server::Server(std::unique_ptr<lspserver::InboundPort> In,
                      &Server::onOptionDeclaration);
 
   Registry.addNotification("nixd/ipc/finished", this, &Server::onFinished);
+  Registry.addNotification("nixd/ipc/replicaReady", this,
+                           &Server::onReplicaReady);
+  Registry.addNotification("nixd/ipc/evalStats", this, &Server::onEvalStats);
 
-  readJSONConfig();
+  Registry.addMethod("nixd/stats", this, &Server::onStats);
+  Registry.addMethod("nixd/profileEval", this, &Server::onProfileEval);
+  Registry.addMethod("nixd/memoryUsage", this, &Server::onMemoryUsage);
+  Registry.addMethod("textDocument/inlayHint", this, &Server::onInlayHint);
+
+  scheduleCallExpiry();
+  scheduleStatsDump();
 }
 
 //-----------------------------------------------------------------------------/
@@ -263,7 +582,29 @@ Server::Server(std::unique_ptr<lspserver::InboundPort> In,
 void Server::onInitialize(const lspserver::InitializeParams &InitializeParams,
                           lspserver::Callback<llvm::json::Value> Reply) {
   ClientCaps = InitializeParams.capabilities;
+
+  // Nix columns are in bytes, so prefer UTF-8 if the client offers it, and
+  // positions need no transcoding. Otherwise fall back to UTF-16, which all
+  // clients must support.
+  auto Offers = [](const auto &Encodings) {
+    return Encodings &&
+           llvm::is_contained(*Encodings, lspserver::OffsetEncoding::UTF8);
+  };
+  lspserver::OffsetEncoding Encoding =
+      Offers(ClientCaps.PositionEncodings) || Offers(ClientCaps.offsetEncoding)
+          ? lspserver::OffsetEncoding::UTF8
+          : lspserver::OffsetEncoding::UTF16;
+  lspserver::setLSPEncoding(Encoding);
+
+  // Workers are forked with the configuration, after the negotiation, so
+  // that they transcode positions for it too.
+  readJSONConfig();
+  // Forked workers continue here.
+  if (Role != ServerRole::Controller)
+    return;
+
   llvm::json::Object ServerCaps{
+      {"positionEncoding", Encoding},
       {"textDocumentSync",
        llvm::json::Object{
            {"openClose", true},
@@ -275,44 +616,58 @@ void Server::onInitialize(const lspserver::InitializeParams &InitializeParams,
       {"documentLinkProvider", llvm::json::Object{{"resolveProvider", false}}},
       {"documentSymbolProvider", true},
       {"hoverProvider", true},
+      {"inlayHintProvider", true},
       {"documentFormattingProvider", true},
       {
           "completionProvider",
           llvm::json::Object{{"triggerCharacters", {"."}}},
       },
-      {"renameProvider", llvm::json::Object{{"prepareProvider", true}}}};
+      {"renameProvider", llvm::json::Object{{"prepareProvider", true}}},
+      {"diagnosticProvider", llvm::json::Object{
+                                 {"interFileDependencies", true},
+                                 {"workspaceDiagnostics", true},
+                             }}};
 
   llvm::json::Object Result{
       {{"serverInfo",
         llvm::json::Object{{"name", "nixd"}, {"version", NIXD_VERSION}}},
        {"capabilities", std::move(ServerCaps)}}};
+  // The clangd extension, before LSP 3.17.
+  if (ClientCaps.offsetEncoding)
+    Result["offsetEncoding"] = Encoding;
   Reply(std::move(Result));
 }
 
 //-----------------------------------------------------------------------------/
 // Text Document Synchronization
 
-void Server::onDocumentDidOpen(
-    const lspserver::DidOpenTextDocumentParams &Params) {
+void Server::onDocumentDidOpen(lspserver::DidOpenTextDocumentParams &&Params) {
   lspserver::PathRef File = Params.textDocument.uri.file();
 
-  const std::string &Contents = Params.textDocument.text;
+  // The text was moved out of the message, and is not copied again.
+  auto Text = lspserver::Rope::adopt(std::move(Params.textDocument.text));
 
-  addDocument(File, Contents, encodeVersion(Params.textDocument.version));
+  {
+    std::lock_guard _(HistoryLock);
+    Histories[File.str()].clear();
+  }
+  addDocument(File, std::move(Text),
+              encodeVersion(Params.textDocument.version));
 }
 
 void Server::onDocumentDidChange(
     const lspserver::DidChangeTextDocumentParams &Params) {
   lspserver::PathRef File = Params.textDocument.uri.file();
-  auto Code = getDraft(File);
-  if (!Code) {
+  // Edits are applied to the rope, without flattening the draft.
+  auto Draft = DraftMgr.peekDraft(File);
+  if (!Draft) {
     lspserver::log("Trying to incrementally change non-added document: {0}",
                    File);
     return;
   }
-  std::string NewCode(*Code);
+  auto NewText = Draft->Text;
   for (const auto &Change : Params.contentChanges) {
-    if (auto Err = applyChange(NewCode, Change)) {
+    if (auto Err = applyChange(NewText, Change)) {
       // If this fails, we are most likely going to be not in sync anymore
       // with the client.  It is better to remove the draft and let further
       // operations fail rather than giving wrong results.
@@ -321,13 +676,19 @@ void Server::onDocumentDidChange(
       return;
     }
   }
-  addDocument(File, NewCode, encodeVersion(Params.textDocument.version));
+  if (Params.textDocument.version) {
+    auto OldVersion = EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
+    std::lock_guard _(HistoryLock);
+    Histories[File.str()].record(OldVersion, *Params.textDocument.version,
+                                 Params.contentChanges);
+  }
+  addDocument(File, std::move(NewText),
+              encodeVersion(Params.textDocument.version));
 }
 
 void Server::onDocumentDidClose(
     const lspserver::DidCloseTextDocumentParams &Params) {
   lspserver::PathRef File = Params.textDocument.uri.file();
-  auto Code = getDraft(File);
   removeDocument(File);
 }
 
@@ -335,67 +696,59 @@ void Server::onDocumentDidClose(
 // Language Features
 
 void Server::onDecalration(const lspserver::TextDocumentPositionParams &Params,
-                           lspserver::Callback<llvm::json::Value> Reply) {
+                           lspserver::Callback<lspserver::RawJSON> Reply) {
   if (!Config.options.enable) {
-    Reply(nullptr);
+    Reply(lspserver::RawJSON());
     return;
   }
 
   auto Task = [=, Reply = std::move(Reply), this]() mutable {
-    ReplyRAII<llvm::json::Value> RR(std::move(Reply));
+    ReplyRAII<lspserver::RawJSON> RR(std::move(Reply));
 
     // Set the default response to "null", instead of errors
-    RR.Response = nullptr;
+    RR.Response = lspserver::RawJSON();
 
     ipc::AttrPathParams APParams;
 
     // Try to get current attribute path, expand the position
 
-    auto Code = llvm::StringRef(
-        *DraftMgr.getDraft(Params.textDocument.uri.file())->Contents);
-    auto ExpectedOffset = positionToOffset(Code, Params.position);
+    // Only the line is needed, get it from the rope without flattening.
+    auto Draft = DraftMgr.peekDraft(Params.textDocument.uri.file());
+    if (!Draft)
+      return;
+    auto Line = getLine(Draft->Text, Params.position.line);
+    if (!Line)
+      return;
+    llvm::StringRef Code = *Line;
+    lspserver::Position InLine{0, Params.position.character};
+    auto ExpectedOffset = positionToOffset(Code, InLine);
 
-    if (!ExpectedOffset)
+    if (!ExpectedOffset) {
       RR.Response = ExpectedOffset.takeError();
+      return;
+    }
 
-    auto Offset = ExpectedOffset.get();
-    auto From = Offset;
-    auto To = Offset;
-
-    std::string Punc = "\r\n\t ;";
-
-    auto IsPunc = [&Punc](char C) {
-      for (const auto Char : Punc) {
-        if (Char == C)
-          return true;
-      }
-      return false;
-    };
-
-    for (; From >= 0 && !IsPunc(Code[From]);)
-      From--;
-    for (; To < Code.size() && !IsPunc(Code[To]);)
-      To++;
-
-    APParams.Path = Code.substr(From, To - From).trim(Punc);
+    APParams.Path =
+        lspserver::wordAround(Code, *ExpectedOffset, "\r\n\t ;").str();
     lspserver::log("requesting path: {0}", APParams.Path);
 
-    auto Responses = askWC<lspserver::Location>(
+    using RTy = lspserver::Serialized<lspserver::Location>;
+    askWC<RTy>(
         "nixd/ipc/option/textDocument/declaration", APParams,
+        [RR = std::move(RR)](std::vector<RTy> Responses) mutable {
+          // Forwarded as it is.
+          if (!Responses.empty())
+            RR.Response = std::move(Responses.back());
+        },
         {OptionWorkers, OptionWorkerLock, 2e4});
-
-    if (Responses.empty())
-      return;
-
-    RR.Response = std::move(Responses.back());
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Interactive, std::move(Task));
 }
 
 void Server::onDefinition(const lspserver::TextDocumentPositionParams &Params,
-                          lspserver::Callback<llvm::json::Value> Reply) {
-  using RTy = lspserver::Location;
+                          lspserver::Callback<lspserver::RawJSON> Reply) {
+  using RTy = lspserver::Serialized<lspserver::Location>;
   using namespace lspserver;
   using V = llvm::json::Value;
   using O = llvm::json::Object;
@@ -404,39 +757,48 @@ void Server::onDefinition(const lspserver::TextDocumentPositionParams &Params,
     // Firstly, ask the eval workers if there is a suitable location
     // Prefer evaluated locations because in most case this is more useful
     constexpr auto Method = "nixd/ipc/textDocument/definition";
-    auto Resp =
-        askWC<RTy>(Method, Params, WC{EvalWorkers, EvalWorkerLock, 1e6});
-    if (!Resp.empty()) {
-      Reply(latestMatchOr<RTy, V>(
-          Resp, [](const RTy &Location) -> bool { return true; }, O{}));
-      return;
-    }
-
-    // Otherwise, statically find the definition
-    const auto &URI = Params.textDocument.uri;
-    auto Path = URI.file().str();
-    const auto &Pos = Params.position;
-
-    auto Action = [=](ReplyRAII<llvm::json::Value> &&RR, const ParseAST &AST,
-                      ASTManager::VersionTy Version) {
-      try {
-        Location L;
-        auto Def = AST.def(Pos);
-        L.range = AST.defRange(Def);
-        L.uri = URI;
-        RR.Response = std::move(L);
-      } catch (std::exception &E) {
-        // Reply an error is annoying at the user interface, let's just log.
-        auto ErrMsg = stripANSI(E.what());
-        RR.Response = O{};
-        elog("static definition: {0}", std::move(ErrMsg));
+    auto Then = [=, Reply = std::move(Reply),
+                 this](std::vector<RTy> Resp) mutable {
+      // The latest answer is forwarded as it is.
+      if (!Resp.empty()) {
+        Reply(std::move(Resp.back()));
+        return;
       }
-    };
 
-    withParseAST<V>({std::move(Reply)}, Path, std::move(Action));
+      // Otherwise, statically find the definition
+      const auto &URI = Params.textDocument.uri;
+      auto Path = URI.file().str();
+      const auto &Pos = Params.position;
+
+      auto Action = [=](ReplyRAII<llvm::json::Value> &&RR, const ParseAST &AST,
+                        ASTManager::VersionTy Version) {
+        try {
+          Location L;
+          auto Def = AST.def(Pos);
+          L.range = AST.defRange(Def);
+          L.uri = URI;
+          RR.Response = std::move(L);
+        } catch (std::exception &E) {
+          // Reply an error is annoying at the user interface, let's just log.
+          auto ErrMsg = stripANSI(E.what());
+          RR.Response = O{};
+          elog("static definition: {0}", std::move(ErrMsg));
+        }
+      };
+
+      auto ReplyJSON = [Reply = std::move(Reply)](llvm::Expected<V> R) mutable {
+        if (!R)
+          return Reply(R.takeError());
+        Reply(RawJSON(*R));
+      };
+      withParseAST<V>(ReplyRAII<V>(std::move(ReplyJSON)), Path,
+                      std::move(Action));
+    };
+    askWC<RTy>(Method, Params, std::move(Then),
+               WC{EvalWorkers, EvalWorkerLock, 1e6});
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Interactive, std::move(Task));
 }
 
 void Server::onDocumentLink(
@@ -444,16 +806,17 @@ void Server::onDocumentLink(
     lspserver::Callback<std::vector<lspserver::DocumentLink>> Reply) {
   auto Task = [=, Reply = std::move(Reply), this]() mutable {
     auto Path = Params.textDocument.uri.file().str();
-    auto Action = [File = Path](ReplyRAII<ParseAST::Links> &&RR,
-                                const ParseAST &AST,
-                                ASTManager::VersionTy Version) {
-      RR.Response = AST.documentLink(File);
+    auto Compute = [File = Path](const ParseAST &AST) {
+      return AST.documentLink(File);
     };
+    auto Action = [](ReplyRAII<ParseAST::Links> &&RR,
+                     const ParseAST::Links &Links) { RR.Response = Links; };
     auto RR = ReplyRAII<ParseAST::Links>(std::move(Reply));
-    withParseAST<ParseAST::Links>(std::move(RR), Path, std::move(Action));
+    withCachedParseAST<ParseAST::Links>(std::move(RR), Path, "documentLink",
+                                        std::move(Compute), std::move(Action));
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Background, std::move(Task));
 }
 
 void Server::onDocumentSymbol(
@@ -461,31 +824,37 @@ void Server::onDocumentSymbol(
     lspserver::Callback<std::vector<lspserver::DocumentSymbol>> Reply) {
 
   auto Task = [=, Reply = std::move(Reply), this]() mutable {
-    auto Action = [](ReplyRAII<ParseAST::Symbols> &&RR, const ParseAST &AST,
-                     ASTManager::VersionTy Version) {
-      RR.Response = AST.documentSymbol();
+    auto Compute = [](const ParseAST &AST) { return AST.documentSymbol(); };
+    auto Action = [](ReplyRAII<ParseAST::Symbols> &&RR,
+                     const ParseAST::Symbols &Symbols) {
+      RR.Response = Symbols;
     };
     auto RR = ReplyRAII<ParseAST::Symbols>(std::move(Reply));
     auto Path = Params.textDocument.uri.file().str();
-    withParseAST<ParseAST::Symbols>(std::move(RR), Path, std::move(Action));
+    withCachedParseAST<ParseAST::Symbols>(std::move(RR), Path, "documentSymbol",
+                                          std::move(Compute),
+                                          std::move(Action));
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Background, std::move(Task));
 }
 
-void Server::onHover(const lspserver::TextDocumentPositionParams &Params,
-                     lspserver::Callback<lspserver::Hover> Reply) {
-  using RTy = lspserver::Hover;
+void Server::onHover(
+    const lspserver::TextDocumentPositionParams &Params,
+    lspserver::Callback<lspserver::Serialized<lspserver::Hover>> Reply) {
+  using RTy = lspserver::Serialized<lspserver::Hover>;
   constexpr auto Method = "nixd/ipc/textDocument/hover";
   auto Task = [=, Reply = std::move(Reply), this]() mutable {
-    auto Resp =
-        askWC<RTy>(Method, Params, WC{EvalWorkers, EvalWorkerLock, 2e6});
-    Reply(latestMatchOr<lspserver::Hover>(Resp, [](const lspserver::Hover &H) {
-      return H.contents.value.length() != 0;
-    }));
+    // Workers reply errors if there is nothing to hover, so that the latest
+    // answer can be forwarded as it is.
+    auto Then = [Reply = std::move(Reply)](std::vector<RTy> Resp) mutable {
+      Reply(Resp.empty() ? RTy(lspserver::Hover{}) : std::move(Resp.back()));
+    };
+    askWC<RTy>(Method, Params, std::move(Then),
+               WC{EvalWorkers, EvalWorkerLock, 2e6});
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Interactive, std::move(Task));
 }
 
 void Server::onCompletion(
@@ -496,68 +865,86 @@ void Server::onCompletion(
   using namespace lspserver;
   constexpr auto Method = "nixd/ipc/textDocument/completion";
   auto Task = [=, Reply = std::move(Reply), this]() mutable {
-    auto Resp = askWC<RTy>(Method, Params, {EvalWorkers, EvalWorkerLock, 2e6});
-    std::optional<RTy> R;
-    if (!Resp.empty())
-      R = std::move(Resp.back());
-    else {
-      // Statically construct the completion list.
-      std::binary_semaphore Smp(0);
-      try {
-        auto Path = Params.textDocument.uri.file();
-        auto Action = [&Smp, &Resp, Pos = Params.position](
-                          const ParseAST &AST, ASTManager::VersionTy Version) {
-          auto Items = AST.completion(Pos);
-          Resp.emplace_back(CompletionList{false, Items});
-          Smp.release();
-        };
-        if (auto Draft = DraftMgr.getDraft(Path)) {
-          auto Version =
-              EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
-          ASTMgr.withAST(Path.str(), Version, std::move(Action));
-          Smp.acquire();
-        }
-      } catch (std::exception &E) {
-        lspserver::elog("completion/parseAST: {0}", stripANSI(E.what()));
-      } catch (...) {
+    // Merge option completions (if enabled) into \p R, and reply.
+    auto ReplyWithOptions = [=, Reply = std::move(Reply),
+                             this](std::optional<RTy> R) mutable {
+      if (!EnableOption) {
+        Reply(R ? std::move(*R) : RTy{});
+        return;
       }
-    }
-
-    if (EnableOption) {
       ipc::AttrPathParams APParams;
 
       if (Params.context.triggerCharacter == ".") {
         // Get nixpkgs options
-        auto Code = llvm::StringRef(
-            *DraftMgr.getDraft(Params.textDocument.uri.file())->Contents);
-        auto ExpectedPosition = positionToOffset(Code, Params.position);
-
-        // get the attr path
-        auto TruncateBackCode = Code.substr(0, ExpectedPosition.get());
-
-        auto [_, AttrPath] = TruncateBackCode.rsplit(" ");
-        APParams.Path = AttrPath.str();
+        auto Draft = DraftMgr.peekDraft(Params.textDocument.uri.file());
+        auto Line = Draft ? getLine(Draft->Text, Params.position.line)
+                          : std::nullopt;
+        if (Line) {
+          llvm::StringRef Code = *Line;
+          // get the attr path, on this line
+          lspserver::Position InLine{0, Params.position.character};
+          auto ExpectedPosition = positionToOffset(Code, InLine);
+          auto TruncateBackCode = Code.substr(0, ExpectedPosition.get());
+
+          auto [_, AttrPath] = TruncateBackCode.rsplit(" ");
+          APParams.Path = AttrPath.str();
+        }
       }
 
-      auto RespOption = askWC<lspserver::CompletionList>(
+      askWC<lspserver::CompletionList>(
           "nixd/ipc/textDocument/completion/options", APParams,
+          [R = std::move(R), Reply = std::move(Reply)](
+              std::vector<lspserver::CompletionList> RespOption) mutable {
+            if (!RespOption.empty()) {
+              if (R) {
+                // Merge response and option response.
+                auto O = RespOption.back().items;
+                R->items.insert(R->items.end(), O.begin(), O.end());
+              } else {
+                R = std::move(RespOption.back());
+              }
+            }
+            Reply(R ? std::move(*R) : RTy{});
+          },
           {OptionWorkers, OptionWorkerLock, 1e5});
-      if (!RespOption.empty()) {
-        if (R) {
-          // Merge response and option response.
-          auto O = RespOption.back().items;
-          R->items.insert(R->items.end(), O.begin(), O.end());
-        } else {
-          R = std::move(RespOption.back());
+    };
+
+    auto Then = [=, ReplyWithOptions = std::move(ReplyWithOptions),
+                 this](std::vector<RTy> Resp) mutable {
+      if (!Resp.empty())
+        return ReplyWithOptions(std::move(Resp.back()));
+
+      // Statically construct the completion list.
+      auto Path = Params.textDocument.uri.file();
+      auto Draft = DraftMgr.peekDraft(Path);
+      if (!Draft)
+        return ReplyWithOptions(std::nullopt);
+      auto Compute = [Pos = Params.position](
+                         const ParseAST &AST) -> std::optional<RTy> {
+        try {
+          return CompletionList{false, AST.completion(Pos)};
+        } catch (std::exception &E) {
+          lspserver::elog("completion/parseAST: {0}", stripANSI(E.what()));
+        } catch (...) {
         }
-      }
-    }
-    if (R)
-      Reply(std::move(*R));
-    else
-      Reply(RTy{});
+        return std::nullopt;
+      };
+      auto Action = [ReplyWithOptions = std::move(ReplyWithOptions)](
+                        const std::optional<RTy> &R) mutable {
+        ReplyWithOptions(R);
+      };
+      auto Version = EvalDraftStore::decodeVersion(Draft->Version).value_or(0);
+      auto Key = llvm::formatv("completion:{0}:{1}", Params.position.line,
+                               Params.position.character)
+                     .str();
+      ASTMgr.withCachedAST<std::optional<RTy>>(
+          Path.str(), Version, std::move(Key), std::move(Compute),
+          std::move(Action));
+    };
+    askWC<RTy>(Method, Params, std::move(Then),
+               {EvalWorkers, EvalWorkerLock, 2e6});
   };
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Interactive, std::move(Task));
 }
 
 void Server::onRename(const lspserver::RenameParams &Params,
@@ -583,34 +970,40 @@ void Server::onRename(const lspserver::RenameParams &Params,
         std::move(Action));
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Interactive, std::move(Task));
 }
 
 void Server::onPrepareRename(
     const lspserver::TextDocumentPositionParams &Params,
     lspserver::Callback<llvm::json::Value> Reply) {
   auto Task = [Params, Reply = std::move(Reply), this]() mutable {
+    using RangeTy = std::optional<lspserver::Range>;
     auto Path = Params.textDocument.uri.file().str();
-    auto Action = [Params](ReplyRAII<llvm::json::Value> &&RR,
-                           const ParseAST &AST, ASTManager::VersionTy Version) {
-      auto Pos = Params.position;
+    auto Compute = [Pos = Params.position](const ParseAST &AST) -> RangeTy {
       if (auto Edits = AST.rename(Pos, "")) {
         for (const auto &Edit : *Edits) {
-          if (Edit.range.contains(Pos)) {
-            RR.Response = Edit.range;
-            return;
-          }
+          if (Edit.range.contains(Pos))
+            return Edit.range;
         }
       }
+      return std::nullopt;
+    };
+    auto Action = [](ReplyRAII<llvm::json::Value> &&RR, const RangeTy &Range) {
+      if (Range) {
+        RR.Response = *Range;
+        return;
+      }
       RR.Response = lspserver::error("no rename edits available");
-      return;
     };
-    withParseAST<llvm::json::Value>(
-        ReplyRAII<llvm::json::Value>(std::move(Reply)), Path,
-        std::move(Action));
+    auto Key = llvm::formatv("prepareRename:{0}:{1}", Params.position.line,
+                             Params.position.character)
+                   .str();
+    withCachedParseAST<llvm::json::Value, RangeTy>(
+        ReplyRAII<llvm::json::Value>(std::move(Reply)), Path, std::move(Key),
+        std::move(Compute), std::move(Action));
   };
 
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Interactive, std::move(Task));
 }
 
 void Server::clearDiagnostic(lspserver::PathRef Path) {
@@ -622,34 +1015,277 @@ void Server::clearDiagnostic(const lspserver::URIForFile &FileUri) {
   lspserver::PublishDiagnosticsParams Notification;
   Notification.uri = FileUri;
   Notification.diagnostics = {};
-  PublishDiagnostic(Notification);
+  std::unique_lock Guard(DiagStatusLock);
+  DiagStatus.Static.erase(FileUri.uri());
+  DiagStatus.Eval.erase(FileUri.uri());
+  publishDiagnostics(std::move(Notification));
+  flushDiagnostics(std::move(Guard));
+}
+
+void Server::onStaticDiagnostic(lspserver::PathRef File, const ParseAST &AST,
+                                ASTManager::VersionTy Version) {
+  std::map<std::string, lspserver::PublishDiagnosticsParams> DiagMap;
+  for (const auto &ErrInfo : AST.errors())
+    insertDiagnostic(ErrInfo, DiagMap, Version);
+
+  lspserver::PublishDiagnosticsParams Params;
+  Params.uri = lspserver::URIForFile::canonicalize(File, File);
+  Params.version = Version;
+  if (auto It = DiagMap.find(File.str()); It != DiagMap.end())
+    Params.diagnostics = std::move(It->second.diagnostics);
+  Params = transcodeDiagnostics(std::move(Params));
+
+  std::unique_lock Guard(DiagStatusLock);
+  auto URI = Params.uri.uri();
+  auto &Static = DiagStatus.Static;
+  // Parsing tasks may finish out of order.
+  if (auto It = Static.find(URI);
+      It != Static.end() && It->second.version > Version)
+    return;
+  Static[URI] = std::move(Params);
+  publishMerged(URI);
+  flushDiagnostics(std::move(Guard));
+}
+
+void Server::publishMerged(const std::string &URI) {
+  auto Static = DiagStatus.Static.find(URI);
+  auto Eval = DiagStatus.Eval.find(URI);
+  bool HasStatic = Static != DiagStatus.Static.end();
+  bool HasEval = Eval != DiagStatus.Eval.end();
+
+  // Eval diagnostics about an older version than the parsed one.
+  if (HasStatic && HasEval && Eval->second.version &&
+      Eval->second.version < Static->second.version)
+    HasEval = false;
+
+  lspserver::PublishDiagnosticsParams Merged;
+  if (HasStatic) {
+    Merged = Static->second;
+  } else if (HasEval) {
+    Merged = Eval->second;
+  } else if (auto It = DiagStatus.Published.find(URI);
+             It != DiagStatus.Published.end()) {
+    Merged = It->second;
+    Merged.diagnostics.clear();
+  } else {
+    return;
+  }
+
+  // Parse errors are reported by both sides.
+  if (HasStatic && HasEval)
+    mergeDiagnostics(Merged.diagnostics, Eval->second.diagnostics);
+  publishDiagnostics(std::move(Merged));
+}
+
+void Server::publishDiagnostics(lspserver::PublishDiagnosticsParams Params) {
+  auto URI = Params.uri.uri();
+  auto &Published = DiagStatus.Published;
+  if (auto It = Published.find(URI);
+      It != Published.end() && toJSON(It->second) == toJSON(Params))
+    return;
+  DiagStatus.ResultIds[URI] =
+      llvm::formatv("{0}:{1}:{2}", Params.version.value_or(0),
+                    DiagStatus.WorkspaceVersion, ++DiagStatus.Revision);
+  Published[URI] = Params;
+  if (ClientCaps.DiagnosticPull) {
+    // Clients pull diagnostics (of visible documents), do not push them.
+    if (!ClientCaps.DiagnosticRefresh)
+      return;
+    DiagStatus.RefreshPending = true;
+  } else {
+    DiagStatus.Pending[URI] = std::move(Params);
+  }
+
+  if (DiagStatus.FlushScheduled)
+    return;
+  auto Next = DiagStatus.LastFlush + DiagnosticInterval;
+  if (WaitWorker || std::chrono::steady_clock::now() >= Next) {
+    DiagStatus.FlushDue = true;
+    return;
+  }
+  // Trailing flush, so that the last change of a burst is not lost.
+  DiagStatus.FlushScheduled = true;
+  DiagnosticTimer.expires_at(Next);
+  DiagnosticTimer.async_wait([this](const boost::system::error_code &EC) {
+    if (EC)
+      return;
+    std::unique_lock Guard(DiagStatusLock);
+    DiagStatus.FlushScheduled = false;
+    DiagStatus.FlushDue = true;
+    flushDiagnostics(std::move(Guard));
+  });
+}
+
+void Server::flushDiagnostics(std::unique_lock<std::mutex> StatusGuard) {
+  if (!std::exchange(DiagStatus.FlushDue, false))
+    return;
+  DiagStatus.LastFlush = std::chrono::steady_clock::now();
+  auto Pending = std::exchange(DiagStatus.Pending, {});
+  bool Refresh = std::exchange(DiagStatus.RefreshPending, false);
+  // Batches are sent in the order they were taken, but changes of diagnostics
+  // are not blocked by writing to the client.
+  std::lock_guard SendGuard(DiagSendLock);
+  StatusGuard.unlock();
+  for (const auto &[_, Params] : Pending)
+    PublishDiagnostic(Params);
+  if (Refresh)
+    WorkspaceDiagnosticRefresh(nullptr, [](llvm::Expected<std::nullptr_t> R) {
+      if (!R)
+        lspserver::elog("cannot refresh diagnostics: {0}", R.takeError());
+    });
+}
+
+lspserver::DocumentDiagnosticReport Server::diagnosticReport(
+    const std::string &URI,
+    const std::optional<std::string> &PreviousResultId) {
+  lspserver::DocumentDiagnosticReport Report;
+  auto Id = DiagStatus.ResultIds.find(URI);
+  if (Id == DiagStatus.ResultIds.end())
+    return Report;
+  Report.resultId = Id->second;
+  if (PreviousResultId == Id->second) {
+    Report.kind = "unchanged";
+    return Report;
+  }
+  Report.items = DiagStatus.Published.at(URI).diagnostics;
+  return Report;
+}
+
+void Server::onDocumentDiagnostic(
+    const lspserver::DocumentDiagnosticParams &Params,
+    lspserver::Callback<lspserver::DocumentDiagnosticReport> Reply) {
+  using RTy = lspserver::DocumentDiagnosticReport;
+  auto Path = Params.textDocument.uri.file().str();
+  auto Action = [=, this](ReplyRAII<RTy> &&RR, const ParseAST &,
+                          ASTManager::VersionTy) {
+    // Static diagnostics of this version are ready, see `addDocument`.
+    std::lock_guard Guard(DiagStatusLock);
+    RR.Response = diagnosticReport(Params.textDocument.uri.uri(),
+                                   Params.previousResultId);
+  };
+  withParseAST<RTy>(ReplyRAII<RTy>(std::move(Reply)), Path, std::move(Action));
+}
+
+void Server::onWorkspaceDiagnostic(
+    const lspserver::WorkspaceDiagnosticParams &Params,
+    lspserver::Callback<lspserver::WorkspaceDiagnosticReport> Reply) {
+  std::map<std::string, std::string> Previous;
+  for (const auto &Id : Params.previousResultIds)
+    Previous[Id.uri.uri()] = Id.value;
+
+  lspserver::WorkspaceDiagnosticReport Result;
+  std::lock_guard Guard(DiagStatusLock);
+  for (const auto &[URI, Published] : DiagStatus.Published) {
+    std::optional<std::string> PreviousResultId;
+    if (auto It = Previous.find(URI); It != Previous.end())
+      PreviousResultId = It->second;
+    lspserver::WorkspaceDocumentDiagnosticReport Report;
+    static_cast<lspserver::DocumentDiagnosticReport &>(Report) =
+        diagnosticReport(URI, PreviousResultId);
+    Report.uri = Published.uri;
+    Report.version = Published.version;
+    Result.items.emplace_back(std::move(Report));
+  }
+  Reply(std::move(Result));
 }
 
 void Server::onEvalDiagnostic(const ipc::Diagnostics &Diag) {
   lspserver::log("received diagnostic from worker: {0}", Diag.WorkspaceVersion);
 
   {
-    std::lock_guard<std::mutex> Guard(DiagStatusLock);
-    if (DiagStatus.WorkspaceVersion > Diag.WorkspaceVersion) {
+    std::unique_lock Guard(DiagStatusLock);
+    if (DiagStatus.WorkspaceVersion <= Diag.WorkspaceVersion) {
+      DiagStatus.WorkspaceVersion = Diag.WorkspaceVersion;
+
+      // Workers may report a file more than once, merge them.
+      std::map<std::string, lspserver::PublishDiagnosticsParams> Fresh;
+      for (const auto &Params : Diag.Params) {
+        auto [It, Inserted] = Fresh.try_emplace(Params.uri.uri(), Params);
+        if (!Inserted)
+          mergeDiagnostics(It->second.diagnostics, Params.diagnostics);
+      }
+
+      // Files that are not reported anymore are updated too.
+      std::set<std::string> Changed;
+      for (const auto &[URI, _] : DiagStatus.Eval)
+        Changed.insert(URI);
+      for (const auto &[URI, _] : Fresh)
+        Changed.insert(URI);
+      DiagStatus.Eval = std::move(Fresh);
+      for (const auto &URI : Changed)
+        publishMerged(URI);
+    } else {
       // Skip this diagnostic, because it is outdated.
-      return;
+      lspserver::log("skipped outdated diagnostics");
     }
+    flushDiagnostics(std::move(Guard));
+  }
 
-    // Update client diagnostics
-    DiagStatus.WorkspaceVersion = Diag.WorkspaceVersion;
-
-    for (const auto &PublishedDiags : DiagStatus.ClientDiags)
-      clearDiagnostic(PublishedDiags.uri);
+  // Retired workers are destroyed with their dispatcher threads, including the
+  // one running this handler. Like "finished", do it on the pool.
+  Pool.post(Priority::Indexing, [this, Version = Diag.WorkspaceVersion,
+                                 Injected = Diag.Injected]() {
+    std::lock_guard Guard(EvalWorkerLock);
+    for (auto &Worker : EvalWorkers) {
+      if (Worker->WorkspaceVersion == Version)
+        Worker->Injected.emplace(Injected.begin(), Injected.end());
+    }
+    // Previous generations may not be needed for stale answers anymore.
+    if (!WaitWorker)
+      trimWorkers(EvalWorkers, std::max(Config.eval.workers, 1));
+  });
+}
 
-    DiagStatus.ClientDiags = Diag.Params;
+void Server::onFinished(const ipc::WorkerMessage &Params) {
+  // Not on this thread, the destructor may hold EvalWorkerLock, waiting for
+  // FinishSmp.
+  Pool.post(Priority::Indexing, [this, Version = Params.WorkspaceVersion,
+                                 Now = std::chrono::steady_clock::now()]() {
+    std::shared_lock Guard(EvalWorkerLock);
+    for (const auto &Worker : EvalWorkers) {
+      if (Worker->WorkspaceVersion != Version ||
+          Worker->Finished.exchange(true))
+        continue;
+      EvalLatency.record(std::chrono::duration_cast<LatencyHistogram::Duration>(
+          Now - Worker->Forked));
+    }
+  });
+  FinishSmp.release();
+}
 
-    for (const auto &Diag : Diag.Params) {
-      PublishDiagnostic(Diag);
+void Server::onReplicaReady(const ipc::ReplicaReady &Params) {
+  // Like "finished", do not block the dispatcher of the replica.
+  Pool.post(Priority::Indexing, [this, Params]() {
+    std::shared_lock Guard(EvalWorkerLock);
+    for (const auto &Worker : EvalWorkers) {
+      if (Worker->WorkspaceVersion != Params.WorkspaceVersion ||
+          Params.Channel <= 0 ||
+          static_cast<size_t>(Params.Channel) >= Worker->Channels.size())
+        continue;
+      // Fails if the deep evaluation retired the replica, it is shallow.
+      auto Expected = Proc::Channel::State::Forking;
+      Worker->Channels[Params.Channel]->Status.compare_exchange_strong(
+          Expected, Proc::Channel::State::Ready);
     }
-  }
+  });
 }
 
-void Server::onFinished(const ipc::WorkerMessage &) { FinishSmp.release(); }
+void Server::onEvalStats(const ipc::EvalStats &Params) {
+  // Like "finished", do not block the dispatcher of the worker.
+  // Replicas are forked after the evaluation and never report, only pids of
+  // workers are matched.
+  Pool.post(Priority::Indexing, [this, Params]() {
+    auto Record = [&](std::shared_mutex &Lock, WorkerContainer &Workers) {
+      std::lock_guard Guard(Lock);
+      for (auto &Worker : Workers) {
+        if (static_cast<pid_t>(Worker->Pid) == Params.Pid)
+          Worker->Phases[Params.Phase] = Params;
+      }
+    };
+    Record(EvalWorkerLock, EvalWorkers);
+    Record(OptionWorkerLock, OptionWorkers);
+  });
+}
 
 void Server::onFormat(
     const lspserver::DocumentFormattingParams &Params,
@@ -702,6 +1338,6 @@ void Server::onFormat(
       Reply(lspserver::error("no formatting response received"));
     }
   };
-  boost::asio::post(Pool, std::move(Task));
+  Pool.post(Priority::Background, std::move(Task));
 }
 } // namespace nixd
@@ -10,6 +10,7 @@
 #include "lspserver/Logger.h"
 #include "lspserver/Protocol.h"
 #include "lspserver/SourceCode.h"
+#include "lspserver/Trace.h"
 
 #include <nix/error.hh>
 #include <nix/eval.hh>
@@ -19,6 +20,7 @@
 #include <llvm/ADT/StringRef.h>
 
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <iterator>
 #include <memory>
@@ -27,11 +29,20 @@
 #include <string>
 #include <string_view>
 
+#include <csignal>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
 namespace nixd {
 
 void Server::switchToEvaluator() {
   initWorker();
   Role = ServerRole::Evaluator;
+  lspserver::trace::nameProcess(
+      llvm::formatv("eval worker {0}", WorkspaceVersion).str());
   EvalDiagnostic = mkOutNotifiction<ipc::Diagnostics>("nixd/ipc/diagnostic");
 
   Registry.addMethod("nixd/ipc/textDocument/completion", this,
@@ -40,9 +51,51 @@ void Server::switchToEvaluator() {
   Registry.addMethod("nixd/ipc/textDocument/definition", this,
                      &Server::onEvalDefinition);
 
+  Registry.addMethod("nixd/ipc/eval/deep", this, &Server::onEvalDeep);
+
+  Registry.addMethod("nixd/ipc/memoryUsage", this, &Server::onEvalMemoryUsage);
+
   evalInstallable();
   mkOutNotifiction<ipc::WorkerMessage>("nixd/ipc/finished")(
       ipc::WorkerMessage{WorkspaceVersion});
+  forkReplicas();
+}
+
+void Server::forkReplicas() {
+  assert(Role == ServerRole::Evaluator && "only evaluators have replicas");
+  auto CloseAll = [this]() {
+    for (auto [In, Out] : ReplicaFDs) {
+      close(In);
+      close(Out);
+    }
+    ReplicaFDs.clear();
+  };
+  // Do not let buffered outputs be written twice.
+  llvm::outs().flush();
+  for (size_t I = 0; I < ReplicaFDs.size(); I++) {
+    auto [In, Out] = ReplicaFDs[I];
+    auto ForkPID = fork();
+    if (ForkPID == -1) {
+      lspserver::elog("cannot create eval replica process");
+    } else if (ForkPID == 0) {
+#ifdef __linux__
+      // Replicas are killed with the process group of the evaluator, by the
+      // controller. Also die if the evaluator crashes.
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+      dup2(In, 0);
+      dup2(Out, 1);
+      CloseAll();
+      lspserver::trace::nameProcess(
+          llvm::formatv("eval replica {0}", WorkspaceVersion).str());
+      lspserver::log("created eval replica process {0}", getpid());
+      // Channels of replicas follow the one of the worker.
+      mkOutNotifiction<ipc::ReplicaReady>("nixd/ipc/replicaReady")(
+          ipc::ReplicaReady{{WorkspaceVersion}, static_cast<int64_t>(I + 1)});
+      return;
+    }
+  }
+  CloseAll();
 }
 
 void Server::evalInstallable() {
@@ -50,12 +103,19 @@ void Server::evalInstallable() {
   auto Session = std::make_unique<IValueEvalSession>();
 
   auto I = Config.eval.target;
-  auto Depth = Config.eval.depth;
+  // Tiered evaluation goes deeper later, see `onEvalDeep`.
+  auto Depth = Config.eval.tiered.enable ? Config.eval.tiered.shallowDepth
+                                         : Config.eval.depth;
 
   if (!I.empty())
     Session->parseArgs(I.nArgs());
 
-  auto ILR = DraftMgr.injectFiles(Session->getState());
+  auto Start = std::chrono::steady_clock::now();
+  auto ILR = [&] {
+    lspserver::trace::Span Tracer("injectFiles");
+    return DraftMgr.injectFiles(Session->getState());
+  }();
+  reportEvalStats("inject", *Session->getState(), Start);
 
   ipc::Diagnostics Diagnostics;
   std::map<std::string, lspserver::PublishDiagnosticsParams> DiagMap;
@@ -64,9 +124,28 @@ void Server::evalInstallable() {
                      decltype(DraftMgr)::decodeVersion(ErrInfo.Version));
   }
   Diagnostics.WorkspaceVersion = WorkspaceVersion;
-  EvalDiagnostic(Diagnostics);
+  for (const auto &[File, AST] : ILR.Forest) {
+    if (std::none_of(ILR.InjectionErrors.begin(), ILR.InjectionErrors.end(),
+                     [&](const auto &E) { return E.ActiveFile == File; }))
+      Diagnostics.Injected.emplace_back(File);
+  }
+  // DiagMap stays in bytes, errors of the evaluation are merged into it.
+  auto Transcoded = [this](const auto &V) {
+    return transcodeDiagnostics(V.second);
+  };
+  std::transform(DiagMap.begin(), DiagMap.end(),
+                 std::back_inserter(InjectionDiagnostics.Params), Transcoded);
+  InjectionDiagnostics.WorkspaceVersion = WorkspaceVersion;
+  InjectionDiagnostics.Injected = Diagnostics.Injected;
+  // Report injected files before the (long) evaluation. Diagnostics are
+  // published by differences, so report injection errors too, instead of
+  // nothing, to avoid clearing and restoring them.
+  EvalDiagnostic(InjectionDiagnostics);
+  Start = std::chrono::steady_clock::now();
   try {
     if (!I.empty()) {
+      lspserver::trace::Span Tracer("evalInstallable");
+      Tracer.Args["depth"] = Depth;
       Session->eval(I.installable, Depth);
       lspserver::log("evaluation done on worspace version: {0}",
                      WorkspaceVersion);
@@ -75,9 +154,10 @@ void Server::evalInstallable() {
     insertDiagnostic(BE, DiagMap);
   } catch (...) {
   }
+  if (!I.empty())
+    reportEvalStats("eval", *Session->getState(), Start);
   std::transform(DiagMap.begin(), DiagMap.end(),
-                 std::back_inserter(Diagnostics.Params),
-                 [](const auto &V) { return V.second; });
+                 std::back_inserter(Diagnostics.Params), Transcoded);
   EvalDiagnostic(Diagnostics);
   IER = std::make_unique<IValueEvalResult>(std::move(ILR.Forest),
                                            std::move(Session));
@@ -122,6 +202,8 @@ void Server::onEvalDefinition(
                       std::get_if<nix::SourcePath>(&Pos.origin)) {
                 auto Path = SourcePath->to_string();
                 lspserver::Position Position = toLSPPos(State->positions[P]);
+                if (auto Source = sourceOf(Path))
+                  Position = transcodePos(Position, *Source);
                 RR.Response = Location{URIForFile::canonicalize(Path, Path),
                                        {Position, Position}};
                 return;
@@ -147,7 +229,11 @@ void Server::onEvalHover(const lspserver::TextDocumentPositionParams &Params,
         RR.Response = Hover{{MarkupKind::Markdown, ""}, std::nullopt};
         auto &HoverText = RR.Response->contents.value;
         try {
-          auto Value = AST->getValueEval(Node, *IER->Session->getState());
+          auto Value = [&] {
+            lspserver::trace::Span Tracer("getValueEval");
+            return AST->getValueEval(Node, *IER->Session->getState());
+          }();
+          lspserver::trace::Span Tracer("printValue");
           std::stringstream Res{};
           nix::nixd::PrintDepth = 3;
           Value.print(IER->Session->getState()->symbols, Res);
@@ -155,9 +241,11 @@ void Server::onEvalHover(const lspserver::TextDocumentPositionParams &Params,
               llvm::formatv("## {0} \n Value: `{1}`", ExprName, Res.str());
         } catch (const std::out_of_range &) {
           // No such value, just reply dummy item
-          std::stringstream NodeOut;
-          Node->show(IER->Session->getState()->symbols, NodeOut);
-          lspserver::vlog("no associated value on node {0}!", NodeOut.str());
+          if (lspserver::vlogEnabled()) {
+            std::stringstream NodeOut;
+            Node->show(IER->Session->getState()->symbols, NodeOut);
+            lspserver::vlog("no associated value on node {0}!", NodeOut.str());
+          }
           HoverText = llvm::formatv("`{0}`", ExprName);
         }
       });
@@ -263,4 +351,39 @@ void Server::onEvalCompletion(const lspserver::CompletionParams &Params,
                           std::move(Action));
 }
 
+void Server::onEvalDeep(const ipc::DeepEvalParams &Params,
+                        lspserver::Callback<llvm::json::Value> Reply) {
+  const auto &I = Config.eval.target;
+  if (!IER || I.empty()) {
+    Reply(nullptr);
+    return;
+  }
+  std::map<std::string, lspserver::PublishDiagnosticsParams> DiagMap;
+  auto Start = std::chrono::steady_clock::now();
+  try {
+    lspserver::trace::Span Tracer("evalDeep");
+    Tracer.Args["depth"] = Params.Depth;
+    IER->Session->eval(I.installable, Params.Depth);
+    lspserver::log("deep evaluation done on workspace version: {0}",
+                   WorkspaceVersion);
+  } catch (nix::Interrupted &E) {
+    Reply(lspserver::error("deep evaluation interrupted: {0}",
+                           stripANSI(E.what())));
+    return;
+  } catch (nix::BaseError &BE) {
+    insertDiagnostic(BE, DiagMap);
+  } catch (...) {
+  }
+  reportEvalStats("deep", *IER->Session->getState(), Start);
+  // Errors of the shallow evaluation should be found again.
+  auto Diagnostics = InjectionDiagnostics;
+  std::transform(DiagMap.begin(), DiagMap.end(),
+                 std::back_inserter(Diagnostics.Params),
+                 [this](const auto &V) {
+                   return transcodeDiagnostics(V.second);
+                 });
+  EvalDiagnostic(Diagnostics);
+  Reply(nullptr);
+}
+
 } // namespace nixd
@@ -0,0 +1,198 @@
+#include "nixd/Server/Server.h"
+#include "nixd/Support/MemoryUsage.h"
+
+#include "lspserver/Logger.h"
+#include "lspserver/Protocol.h"
+
+#include <llvm/Support/JSON.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <utility>
+
+namespace nixd {
+
+namespace {
+
+/// Evaluators are busy while evaluating, do not wait for them.
+constexpr auto MemoryUsageTimeout = std::chrono::seconds(1);
+
+int64_t bytes(uint64_t N) { return static_cast<int64_t>(N); }
+
+/// Caches are evicted down to this, once documents use more than \p High.
+uint64_t lowWaterMark(uint64_t High) { return High / 4 * 3; }
+
+} // namespace
+
+void Server::onEvalMemoryUsage(
+    const std::nullptr_t &,
+    lspserver::Callback<std::vector<ipc::DocumentMemory>> Reply) {
+  std::vector<ipc::DocumentMemory> Result;
+  // Drafts are shared with the controller, until they are changed.
+  if (IER) {
+    for (const auto &[Path, AST] : IER->Forest)
+      Result.emplace_back(ipc::DocumentMemory{Path, AST->memoryUsage()});
+  }
+  Reply(std::move(Result));
+}
+
+std::map<std::string, MemoryUsage> Server::documentMemory() {
+  auto Result = ASTMgr.memoryUsage();
+  for (const auto &File : DraftMgr.getActiveFiles()) {
+    auto Draft = DraftMgr.peekDraft(File);
+    if (!Draft)
+      continue;
+    auto &Usage = Result[File];
+    Usage.Draft = Draft->Text.size();
+    if (Draft->Contents)
+      Usage.Draft += memoryOf(*Draft->Contents);
+  }
+  return Result;
+}
+
+void Server::checkMemory() {
+  auto High = HighWaterMark.load();
+  if (High == 0)
+    return;
+  MemoryUsage Total;
+  for (const auto &[_, Usage] : documentMemory())
+    Total += Usage;
+  auto Low = lowWaterMark(High);
+  if (Total.total() <= Low)
+    MemoryPressure = false;
+  if (Total.total() <= High)
+    return;
+
+  // Release down to the low-water mark, so that it is not crossed again by
+  // the next few edits. Open documents are parsed again on changes, they are
+  // not evicted and may exceed it alone.
+  auto Active = DraftMgr.getActiveFiles();
+  std::set<std::string> Open(Active.begin(), Active.end());
+  auto Released = ASTMgr.evict(Open, Total.total() - Low);
+
+  // Answers of workers are not counted, drop them once per crossing.
+  if (!std::exchange(MemoryPressure, true)) {
+    auto ClearResponses = [](const WorkerContainer &Workers) {
+      for (const auto &Worker : Workers)
+        Worker->Responses->clear();
+    };
+    {
+      std::shared_lock Guard(EvalWorkerLock);
+      ClearResponses(EvalWorkers);
+    }
+    {
+      std::shared_lock Guard(OptionWorkerLock);
+      ClearResponses(OptionWorkers);
+    }
+  }
+  if (Released > 0)
+    lspserver::log("memory: documents use {0} bytes, above the high-water mark "
+                   "({1} bytes), evicted caches of {2} bytes",
+                   Total.total(), High, Released);
+}
+
+void Server::onMemoryUsage(const std::nullptr_t &,
+                           lspserver::Callback<llvm::json::Value> Reply) {
+  using Answer =
+      std::pair<WorkspaceVersionTy, std::vector<ipc::DocumentMemory>>;
+  using G = Gather<Answer>;
+
+  auto Deadline = G::Clock::now() + MemoryUsageTimeout;
+  auto Ask = [this, Deadline, Asked = std::set<WorkspaceVersionTy>()](
+                 G::ReplyFn Reply) mutable
+      -> std::optional<G::Clock::duration> {
+    std::shared_lock Guard(EvalWorkerLock);
+    for (const auto &Worker : EvalWorkers) {
+      // Replicas share the heap of the worker.
+      if (!Worker->Finished || !Asked.insert(Worker->WorkspaceVersion).second)
+        continue;
+      callOutMethod<std::nullptr_t, std::vector<ipc::DocumentMemory>>(
+          "nixd/ipc/memoryUsage", nullptr,
+          [Reply = std::move(Reply), Version = Worker->WorkspaceVersion](
+              llvm::Expected<std::vector<ipc::DocumentMemory>> R) mutable {
+            if (!R) {
+              lspserver::vlog("worker {0} reported error: {1}", Version,
+                              R.takeError());
+              return Reply(std::nullopt);
+            }
+            Reply(Answer{Version, std::move(*R)});
+          },
+          Worker->Channels.front()->OutPort.get(), Deadline);
+      return G::Clock::duration::zero();
+    }
+    return std::nullopt;
+  };
+
+  auto Then = [this, Reply = std::move(Reply)](
+                  std::vector<Answer> Answers) mutable {
+    struct Document {
+      MemoryUsage Controller;
+      std::vector<std::pair<WorkspaceVersionTy, MemoryUsage>> Workers;
+      uint64_t Total = 0;
+    };
+    std::map<std::string, Document> Documents;
+    for (const auto &[File, Usage] : documentMemory()) {
+      auto &Doc = Documents[File];
+      Doc.Controller = Usage;
+      Doc.Total += Usage.total();
+    }
+    std::sort(Answers.begin(), Answers.end(),
+              [](const Answer &A, const Answer &B) {
+                return A.first < B.first;
+              });
+    for (const auto &[Version, Memory] : Answers) {
+      for (const auto &D : Memory) {
+        auto &Doc = Documents[D.Path];
+        Doc.Workers.emplace_back(Version, D.Usage);
+        Doc.Total += D.Usage.total();
+      }
+    }
+
+    std::vector<std::pair<std::string, Document>> Sorted(
+        std::make_move_iterator(Documents.begin()),
+        std::make_move_iterator(Documents.end()));
+    std::stable_sort(Sorted.begin(), Sorted.end(),
+                     [](const auto &A, const auto &B) {
+                       return A.second.Total > B.second.Total;
+                     });
+    llvm::json::Array Result;
+    uint64_t Total = 0;
+    for (const auto &[File, Doc] : Sorted) {
+      llvm::json::Array Workers;
+      for (const auto &[Version, Usage] : Doc.Workers) {
+        auto W = toJSON(Usage);
+        (*W.getAsObject())["generation"] = static_cast<int64_t>(Version);
+        Workers.emplace_back(std::move(W));
+      }
+      Result.emplace_back(llvm::json::Object{
+          {"uri", lspserver::URIForFile::canonicalize(File, File)},
+          {"controller", Doc.Controller},
+          {"workers", std::move(Workers)},
+          {"total", bytes(Doc.Total)},
+      });
+      Total += Doc.Total;
+    }
+    Reply(llvm::json::Object{
+        {"documents", std::move(Result)},
+        {"total", bytes(Total)},
+        {"highWaterMark", bytes(HighWaterMark.load())},
+    });
+  };
+
+  // Not on the timer thread, nor on the dispatcher thread of a worker.
+  G::start(TimerPool.get_executor(), std::move(Ask), Deadline,
+           /*AskAll=*/true,
+           [this, Then = std::move(Then)](std::vector<Answer> Answers) mutable {
+             Pool.post(Priority::Background,
+                       [Then = std::move(Then),
+                        Answers = std::move(Answers)]() mutable {
+                         Then(std::move(Answers));
+                       });
+           });
+}
+
+} // namespace nixd
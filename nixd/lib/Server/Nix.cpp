@@ -1,8 +1,18 @@
+#include "nixd/Nix/EvalState.h"
 #include "nixd/Server/Server.h"
 
 #include <nix/eval-inline.hh>
 #include <nix/shared.hh>
 
+#include <gc/gc.h>
+
+#include <llvm/ADT/ScopeExit.h>
+
+#include <chrono>
+#include <exception>
+
+#include <unistd.h>
+
 namespace nix {
 
 // Copy-paste from nix source code, do not know why it is inlined.
@@ -67,7 +77,80 @@ void Server::initWorker() {
   nix::initNix();
   nix::initLibStore();
   nix::initPlugins();
+  // Evaluators may fork read-only replicas, let the collector be aware of it.
+  GC_set_handle_fork(1);
   nix::initGC();
+  // For the time in collections, see `reportEvalStats`.
+  GC_start_performance_measurement();
+  // Only the forking thread exists yet, the environment is safe to change.
+  nix::initEvalStats();
+}
+
+void Server::reportEvalStats(llvm::StringRef Phase, nix::EvalState &State,
+                             std::chrono::steady_clock::time_point Start) {
+  ipc::EvalStats Stats;
+  Stats.WorkspaceVersion = WorkspaceVersion;
+  Stats.Phase = Phase.str();
+  Stats.Pid = getpid();
+  Stats.Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - Start)
+                      .count();
+  if (auto JSON = nix::evalStats(State)) {
+    if (auto V = llvm::json::parse(*JSON))
+      Stats.Nix = std::move(*V);
+    else
+      lspserver::elog("cannot parse nix statistics: {0}", V.takeError());
+  }
+  Stats.GC = {
+      .HeapSize = static_cast<int64_t>(GC_get_heap_size()),
+      .FreeBytes = static_cast<int64_t>(GC_get_free_bytes()),
+      .TotalBytes = static_cast<int64_t>(GC_get_total_bytes()),
+      .Collections = static_cast<int64_t>(GC_get_gc_no()),
+      .Time = static_cast<int64_t>(GC_get_full_gc_total_time()),
+  };
+  lspserver::log("{0} statistics of workspace version {1}: {2}", Phase,
+                 WorkspaceVersion, toJSON(Stats));
+  mkOutNotifiction<ipc::EvalStats>("nixd/ipc/evalStats")(Stats);
+}
+
+bool Server::isStale(llvm::StringRef Method, const llvm::json::Value &Params) {
+  if (Role == ServerRole::Controller)
+    return false;
+  if (auto Deadline = ipc::getDeadline(Params);
+      Deadline && std::chrono::steady_clock::now() > *Deadline)
+    return true;
+  return isSuperseded(Method, Params);
+}
+
+bool Server::onCall(llvm::StringRef Method, llvm::json::Value Params,
+                    llvm::json::Value ID) {
+  if (Role == ServerRole::Controller)
+    return LSPServer::onCall(Method, std::move(Params), std::move(ID));
+
+  // Handlers run synchronously on this thread, so the check is only active
+  // while serving this request, even if the handler throws. Throw by ourselves
+  // instead of returning true, nix only throws "Interrupted" once per thread.
+  auto Restore = llvm::make_scope_exit(
+      [Previous = std::move(nix::interruptCheck)]() mutable {
+        nix::interruptCheck = std::move(Previous);
+      });
+  nix::interruptCheck = [this, ID, Deadline = ipc::getDeadline(Params),
+                         Seen = cancellations()]() mutable -> bool {
+    if (std::uncaught_exceptions())
+      return false;
+    if (Deadline && std::chrono::steady_clock::now() > *Deadline)
+      throw nix::Interrupted("evaluation interrupted, deadline exceeded");
+    // Cancellations are rare, look them up only if there are new ones.
+    if (auto N = cancellations(); N != Seen) {
+      Seen = N;
+      if (isCancelled(ID))
+        throw nix::Interrupted("evaluation interrupted, request cancelled");
+    }
+    return false;
+  };
+  // Spans of the request join the trace of the controller.
+  lspserver::trace::ContextScope Scope(ipc::getTrace(Params));
+  return LSPServer::onCall(Method, std::move(Params), std::move(ID));
 }
 
 } // namespace nixd
@@ -3,6 +3,7 @@
 #include "nixd/Server/Server.h"
 #include "nixd/Support/Diagnostic.h"
 
+#include <chrono>
 #include <mutex>
 
 namespace nixd {
@@ -80,6 +81,7 @@ void Server::onOptionDeclaration(
 void Server::switchToOptionProvider() {
   initWorker();
   Role = ServerRole::OptionProvider;
+  lspserver::trace::nameProcess("option worker");
 
   if (!Config.options.enable)
     return;
@@ -92,7 +94,10 @@ void Server::switchToOptionProvider() {
     auto I = Config.options.target;
     auto SessionOption = std::make_unique<IValueEvalSession>();
     SessionOption->parseArgs(I.nArgs());
+    auto Start = std::chrono::steady_clock::now();
+    lspserver::trace::Span Tracer("evalOptions");
     OptionAttrSet = SessionOption->eval(I.installable);
+    reportEvalStats("options", *SessionOption->getState(), Start);
     OptionIES = std::move(SessionOption);
     lspserver::log("options are ready");
   } catch (std::exception &E) {
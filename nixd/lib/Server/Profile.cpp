@@ -0,0 +1,292 @@
+#include "nixd/Expr/CallbackExpr.h"
+#include "nixd/Expr/Expr.h"
+#include "nixd/Server/Server.h"
+#include "nixd/Support/Diagnostic.h"
+#include "nixd/Support/EvalProfiler.h"
+
+#include "lspserver/Logger.h"
+#include "lspserver/Protocol.h"
+#include "lspserver/Trace.h"
+
+#include <nix/error.hh>
+#include <nix/nixexpr.hh>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+namespace nixd {
+
+namespace {
+
+/// Hotspots replied, the folded stacks have all of them.
+constexpr size_t MaxHotspots = 100;
+
+class ProfileObserver : public EvalObserver {
+  EvalProfiler &Profiler;
+
+public:
+  ProfileObserver(EvalProfiler &Profiler) : Profiler(Profiler) {}
+  void enter(const nix::Expr *E) override { Profiler.enter(E); }
+  void leave() override { Profiler.leave(); }
+};
+
+int64_t micros(EvalProfiler::Clock::duration D) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(D).count();
+}
+
+/// The function if \p E is the body of one, or the kind of \p E.
+std::string nameOf(const ParseAST &AST, const nix::Expr *E,
+                   const nix::SymbolTable &Symbols) {
+  try {
+    const auto *Lambda = dynamic_cast<const nix::ExprLambda *>(AST.parent(E));
+    if (Lambda && Lambda->body == E) {
+      if (Lambda->name)
+        return "'" + std::string(Symbols[Lambda->name]) + "'";
+      return "anonymous function";
+    }
+  } catch (std::out_of_range &) {
+  }
+  return getExprName(E);
+}
+
+} // namespace
+
+void Server::switchToProfiler() {
+  initWorker();
+  Role = ServerRole::Profiler;
+  lspserver::trace::nameProcess("profiler");
+  Registry.addMethod("nixd/ipc/eval/profile", this, &Server::onEvalProfile);
+}
+
+void Server::onEvalProfile(const ipc::ProfileParams &Params,
+                           lspserver::Callback<ipc::ProfileResult> Reply) {
+  const auto &I = Config.eval.target;
+  auto Session = std::make_unique<IValueEvalSession>();
+  Session->parseArgs(I.nArgs());
+  auto ILR = DraftMgr.injectFiles(Session->getState());
+
+  ipc::ProfileResult Result;
+  EvalProfiler Profiler;
+  {
+    lspserver::trace::Span Tracer("evalProfile");
+    ProfileObserver Observer(Profiler);
+    CurrentEvalObserver = &Observer;
+    try {
+      Session->eval(I.installable, Params.Depth);
+    } catch (nix::Interrupted &E) {
+      CurrentEvalObserver = nullptr;
+      Reply(lspserver::error("profiling interrupted: {0}",
+                             stripANSI(E.what())));
+      return;
+    } catch (nix::BaseError &BE) {
+      Result.Error = stripANSI(BE.what());
+    } catch (...) {
+    }
+    CurrentEvalObserver = nullptr;
+  }
+
+  auto &State = *Session->getState();
+  struct Site {
+    std::string File;
+    const EvalAST *AST;
+    lspserver::Range Range;
+  };
+  std::map<EvalProfiler::Key, std::optional<Site>> Sites;
+  auto SiteOf = [&](EvalProfiler::Key K) -> const std::optional<Site> & {
+    auto [It, Inserted] = Sites.try_emplace(K);
+    if (!Inserted)
+      return It->second;
+    for (const auto &[File, AST] : ILR.Forest) {
+      if (auto Range = AST->lRange(K)) {
+        It->second = Site{File, &*AST, *Range};
+        break;
+      }
+    }
+    return It->second;
+  };
+  auto NameOf = [&](EvalProfiler::Key K) {
+    const auto *E = static_cast<const nix::Expr *>(K);
+    const auto &S = SiteOf(K);
+    if (!S)
+      return std::string(getExprName(E));
+    return nameOf(*S->AST, E, State.symbols);
+  };
+
+  auto Output = Params.Output;
+  if (Output.empty()) {
+    llvm::SmallString<128> Path;
+    if (!llvm::sys::fs::createTemporaryFile("nixd-profile", "folded", Path))
+      Output = Path.str().str();
+  }
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Output, EC);
+  if (EC) {
+    Reply(lspserver::error("cannot write profile to {0}: {1}", Output,
+                           EC.message()));
+    return;
+  }
+  Profiler.writeFolded(OS, [&](EvalProfiler::Key K) {
+    const auto &S = SiteOf(K);
+    if (!S)
+      return NameOf(K);
+    return llvm::formatv("{0} {1}:{2}:{3}", NameOf(K), S->File,
+                         S->Range.start.line + 1, S->Range.start.character + 1)
+        .str();
+  });
+  Result.Output = Output;
+
+  Result.Total = micros(Profiler.total());
+  std::map<std::string, std::shared_ptr<const std::string>> Sources;
+  for (const auto &[K, T] : Profiler.totals()) {
+    const auto &S = SiteOf(K);
+    if (!S)
+      continue;
+    auto [It, Inserted] = Sources.try_emplace(S->File);
+    if (Inserted)
+      It->second = sourceOf(S->File);
+    auto Range = It->second ? transcodeRange(S->Range, *It->second) : S->Range;
+    Result.Hotspots.emplace_back(ipc::Hotspot{
+        .Location = {lspserver::URIForFile::canonicalize(S->File, S->File),
+                     Range},
+        .Name = NameOf(K),
+        .Inclusive = micros(T.Inclusive),
+        .Exclusive = micros(T.Exclusive),
+        .Count = static_cast<int64_t>(T.Count)});
+  }
+  std::sort(Result.Hotspots.begin(), Result.Hotspots.end(),
+            [](const ipc::Hotspot &A, const ipc::Hotspot &B) {
+              return A.Inclusive > B.Inclusive;
+            });
+  if (Result.Hotspots.size() > MaxHotspots)
+    Result.Hotspots.resize(MaxHotspots);
+  Reply(std::move(Result));
+}
+
+void Server::onProfileEval(const ProfileEvalParams &Params,
+                           lspserver::Callback<llvm::json::Value> Reply) {
+  if (Config.eval.target.empty()) {
+    Reply(lspserver::error("no evaluation target to profile"));
+    return;
+  }
+  ipc::ProfileParams IPCParams{
+      .Depth = Params.depth.value_or(Config.eval.depth),
+      .Output = Params.output,
+  };
+
+  // Fork without holding the lock, it is only taken to publish the worker.
+  WorkerContainer Forked;
+  forkWorker([this]() { switchToProfiler(); }, Forked, 1);
+  // The forked worker continues here.
+  if (Role != ServerRole::Controller)
+    return;
+  if (Forked.empty()) {
+    Reply(lspserver::error("cannot create the profiler"));
+    return;
+  }
+  auto *Port = Forked.back()->Channels.front()->OutPort.get();
+  auto Versions = Forked.back()->FileVersions;
+
+  uint64_t ID;
+  WorkerContainer Replaced;
+  {
+    std::lock_guard Guard(ProfileWorkerLock);
+    // A new profile replaces the one in progress, which fails.
+    for (const auto &Worker : ProfileWorkers) {
+      for (const auto &C : Worker->Channels)
+        forgetCalls(C->OutPort.get());
+    }
+    Replaced.swap(ProfileWorkers);
+    ProfileWorkers = std::move(Forked);
+    ID = ++ProfileID;
+  }
+
+  auto Done = [this, ID, Versions = std::move(Versions),
+               Reply = std::move(Reply)](
+                  llvm::Expected<ipc::ProfileResult> Result) mutable {
+    // Not on the dispatcher thread of the worker, it is joined by the
+    // destructor.
+    Pool.post(Priority::Background, [this, ID]() {
+      std::lock_guard Guard(ProfileWorkerLock);
+      if (ProfileID == ID)
+        ProfileWorkers.clear();
+    });
+    if (!Result) {
+      Reply(Result.takeError());
+      return;
+    }
+    {
+      std::lock_guard Guard(ProfileLock);
+      ProfileHints.clear();
+      for (const auto &H : Result->Hotspots) {
+        auto File = H.Location.uri.file().str();
+        auto &Hints = ProfileHints[File];
+        Hints.Hotspots.emplace_back(H);
+        Hints.Version = Versions[File];
+      }
+    }
+    llvm::json::Array Hotspots;
+    for (const auto &H : Result->Hotspots) {
+      Hotspots.emplace_back(llvm::json::Object{
+          {"location", H.Location},
+          {"name", H.Name},
+          {"inclusive", H.Inclusive},
+          {"exclusive", H.Exclusive},
+          {"count", H.Count},
+      });
+    }
+    llvm::json::Object Response{
+        {"total", Result->Total},
+        {"output", Result->Output},
+        {"hotspots", std::move(Hotspots)},
+    };
+    if (!Result->Error.empty())
+      Response["error"] = Result->Error;
+    Reply(std::move(Response));
+  };
+  callOutMethod<ipc::ProfileParams, ipc::ProfileResult>(
+      "nixd/ipc/eval/profile", IPCParams, std::move(Done), Port,
+      /*Deadline=*/Clock::time_point::max());
+}
+
+void Server::onInlayHint(
+    const lspserver::InlayHintsParams &Params,
+    lspserver::Callback<std::vector<lspserver::InlayHint>> Reply) {
+  auto File = Params.textDocument.uri.file().str();
+  std::vector<lspserver::InlayHint> Hints;
+  auto Draft = DraftMgr.peekDraft(File);
+  std::lock_guard Guard(ProfileLock);
+  auto It = ProfileHints.find(File);
+  if (!Draft || It == ProfileHints.end() ||
+      EvalDraftStore::decodeVersion(Draft->Version).value_or(0) !=
+          It->second.Version) {
+    Reply(std::move(Hints));
+    return;
+  }
+  for (const auto &H : It->second.Hotspots) {
+    const auto &Range = H.Location.range;
+    // Hints are placed at the end.
+    if (Params.range && !Params.range->contains(Range.end))
+      continue;
+    lspserver::InlayHint Hint;
+    Hint.position = Range.end;
+    Hint.range = Range;
+    // Hints of other kinds, not types nor parameters.
+    Hint.kind = lspserver::InlayHintKind::Designator;
+    Hint.label = llvm::formatv("{0:f1}ms ({1}x)", H.Inclusive / 1000.0,
+                               H.Count);
+    Hint.paddingLeft = true;
+    Hints.emplace_back(std::move(Hint));
+  }
+  Reply(std::move(Hints));
+}
+
+} // namespace nixd
@@ -0,0 +1,175 @@
+#include "nixd/Server/Server.h"
+#include "nixd/Support/ProcessStats.h"
+
+#include "lspserver/Logger.h"
+
+#include <llvm/Support/JSON.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+
+#include <unistd.h>
+
+namespace nixd {
+
+namespace {
+
+/// Counters are unsigned, JSON integers are not.
+int64_t count(uint64_t N) { return static_cast<int64_t>(N); }
+
+llvm::json::Value toJSONOrNull(const std::optional<ProcessStats> &Usage) {
+  if (Usage)
+    return *Usage;
+  return nullptr;
+}
+
+} // namespace
+
+llvm::json::Object Server::collectStats() {
+  using llvm::json::Array;
+  using llvm::json::Object;
+
+  auto Usage = ASTMgr.cacheUsage();
+  const auto &Cache = ASTMgr.astCacheStats();
+  const auto &Features = ASTMgr.featureCacheStats();
+  Object AST{
+      {"files", count(Usage.Files)},
+      {"nodes", count(Usage.Nodes)},
+      {"hits", count(Cache.Hits)},
+      {"misses", count(Cache.Misses)},
+      {"parse", toJSON(ASTMgr.parseLatency())},
+      {"featureCache",
+       Object{{"hits", count(Features.Hits)},
+              {"misses", count(Features.Misses)},
+              {"invalidations", count(Features.Invalidations)}}},
+  };
+
+  auto Load = Pool.load();
+  auto Classes = [](const Scheduler::LimitsTy &PerClass) {
+    Array Result;
+    for (auto N : PerClass)
+      Result.emplace_back(count(N));
+    return Result;
+  };
+  Object Scheduling{
+      {"threads", count(Pool.size())},
+      {"queued", Classes(Load.Queued)},
+      {"running", Classes(Load.Running)},
+      {"limits", Classes(Load.Limits)},
+      {"pendingAsks", count(PendingAsks)},
+  };
+
+  Array Workers;
+  std::map<std::string, int64_t> States;
+  auto Describe = [&](llvm::StringRef Kind, Proc &Worker) {
+    size_t Pending = 0;
+    for (const auto &C : Worker.Channels)
+      Pending += C->Pending->load();
+    Object W{
+        {"kind", Kind},
+        {"generation", count(Worker.WorkspaceVersion)},
+        {"pid", static_cast<pid_t>(Worker.Pid)},
+        // Replicas are forked by the worker, their pids are not known here.
+        {"replicas", count(Worker.Channels.size() - 1)},
+        {"pending", count(Pending)},
+        {"responseCache",
+         Object{{"entries", count(Worker.Responses->size())},
+                {"hits", count(Worker.Responses->hits())},
+                {"misses", count(Worker.Responses->misses())}}},
+        {"latency", toJSON(*Worker.Latency)},
+        {"process", toJSONOrNull(readProcessStats(Worker.Pid))},
+    };
+    Object Phases;
+    for (const auto &[Phase, Stats] : Worker.Phases) {
+      Phases[Phase] = Object{{"elapsed", Stats.Elapsed},
+                             {"nix", Stats.Nix},
+                             {"gc", toJSON(Stats.GC)}};
+    }
+    W["phases"] = std::move(Phases);
+    if (Kind == "eval") {
+      llvm::StringRef State = Worker.Deepened   ? "deep"
+                              : Worker.Finished ? "ready"
+                                                : "evaluating";
+      W["state"] = State;
+      States[State.str()]++;
+    }
+    Workers.emplace_back(std::move(W));
+  };
+  {
+    std::shared_lock Guard(EvalWorkerLock);
+    for (const auto &Worker : EvalWorkers)
+      Describe("eval", *Worker);
+  }
+  {
+    std::shared_lock Guard(OptionWorkerLock);
+    for (const auto &Worker : OptionWorkers)
+      Describe("option", *Worker);
+  }
+  {
+    std::shared_lock Guard(ProfileWorkerLock);
+    for (const auto &Worker : ProfileWorkers)
+      Describe("profile", *Worker);
+  }
+  Object StateCounts;
+  for (const auto &[State, N] : States)
+    StateCounts[State] = N;
+
+  MemoryUsage Memory;
+  for (const auto &[_, Usage] : documentMemory())
+    Memory += Usage;
+
+  auto Uptime = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::steady_clock::now() - Started);
+  return Object{
+      {"uptime", Uptime.count()},
+      {"requests", toJSON(RequestLatency)},
+      {"failedRequests", toJSON(FailedRequests)},
+      {"ipc", toJSON(MethodLatency)},
+      {"ast", std::move(AST)},
+      {"memory", Memory},
+      {"fork", toJSON(ForkLatency)},
+      {"eval", toJSON(EvalLatency)},
+      {"scheduler", std::move(Scheduling)},
+      {"workers", std::move(Workers)},
+      {"workerStates", std::move(StateCounts)},
+      {"process", toJSONOrNull(readProcessStats(getpid()))},
+  };
+}
+
+void Server::onStats(const std::nullptr_t &,
+                     lspserver::Callback<llvm::json::Value> Reply) {
+  // Not on the dispatcher thread, collecting takes the locks of workers and
+  // reads /proc. Nobody is blocked by a late answer.
+  Pool.post(Priority::Background, [this, Reply = std::move(Reply)]() mutable {
+    Reply(collectStats());
+  });
+}
+
+void Server::onHandled(llvm::StringRef Method, Clock::duration Elapsed,
+                       bool Failed) {
+  auto D = std::chrono::duration_cast<LatencyHistogram::Duration>(Elapsed);
+  RequestLatency[Method].record(D);
+  if (Failed)
+    FailedRequests[Method].record(D);
+}
+
+void Server::scheduleStatsDump() {
+  // Check every second, so that configuring the interval takes effect soon.
+  StatsTimer.expires_after(std::chrono::seconds(1));
+  StatsTimer.async_wait([this](const boost::system::error_code &EC) {
+    if (EC)
+      return;
+    auto Interval = std::chrono::seconds(StatsDumpInterval.load());
+    auto Now = std::chrono::steady_clock::now();
+    if (Interval.count() > 0 && Now - LastStatsDump >= Interval) {
+      LastStatsDump = Now;
+      lspserver::log("stats: {0}", llvm::json::Value(collectStats()));
+    }
+    checkMemory();
+    scheduleStatsDump();
+  });
+}
+
+} // namespace nixd
@@ -8,8 +8,11 @@
 #include <nix/ansicolor.hh>
 #include <nix/error.hh>
 
+#include <algorithm>
 #include <exception>
 #include <optional>
+#include <set>
+#include <tuple>
 
 #define FOREACH_ANSI_COLOR(FUNC)                                               \
   FUNC(ANSI_NORMAL)                                                            \
@@ -50,14 +53,40 @@ mkDiagnostics(const nix::BaseError &Err) {
       mkDiagnosic(ErrPos.get(), Err.info().msg.str()));
 
   if (Err.hasTrace()) {
+    std::set<std::tuple<std::string, std::string, int, int>> Seen;
     for (const auto &T : Err.info().traces) {
-      Result[pathOf(T.pos.get())].emplace_back(mkDiagnosic(T, /* Info */ 3));
+      if (Seen.size() >= MaxTraceDiagnostics)
+        break;
+      auto Path = pathOf(T.pos.get());
+      auto Diag = mkDiagnosic(T, /* Info */ 3);
+      const auto &Start = Diag.range.start;
+      if (!Seen.insert({Path, Diag.message, Start.line, Start.character})
+               .second)
+        continue;
+      Result[Path].emplace_back(std::move(Diag));
     }
   }
 
   return Result;
 }
 
+void mergeDiagnostics(std::vector<lspserver::Diagnostic> &Diags,
+                      const std::vector<lspserver::Diagnostic> &More) {
+  using Key = std::tuple<int, int, int, int, std::string, int>;
+  auto KeyOf = [](const lspserver::Diagnostic &D) {
+    const auto &R = D.range;
+    return Key{R.start.line, R.start.character, R.end.line, R.end.character,
+               D.message, D.severity};
+  };
+  std::set<Key> Seen;
+  for (const auto &D : Diags)
+    Seen.insert(KeyOf(D));
+  for (const auto &D : More) {
+    if (Seen.insert(KeyOf(D)).second)
+      Diags.emplace_back(D);
+  }
+}
+
 void insertDiagnostic(
     const nix::BaseError &E,
     std::map<std::string, lspserver::PublishDiagnosticsParams> &R,
@@ -66,8 +95,8 @@ void insertDiagnostic(
   for (const auto &[Path, DiagVec] : ErrMap) {
     try {
       if (R.contains(Path)) {
-        auto &Diag = R.at(Path).diagnostics;
-        Diag.insert(Diag.end(), DiagVec.begin(), DiagVec.end());
+        // Errors may share traces, do not report them twice.
+        mergeDiagnostics(R.at(Path).diagnostics, DiagVec);
       } else {
         lspserver::PublishDiagnosticsParams Params;
         Params.uri = lspserver::URIForFile::canonicalize(Path, Path);
@@ -0,0 +1,89 @@
+#include "nixd/Support/EditHistory.h"
+
+#include "lspserver/SourceCode.h"
+
+#include <llvm/ADT/STLExtras.h>
+
+#include <algorithm>
+
+namespace nixd {
+
+using lspserver::Position;
+
+Position EditHistory::map(Position P, const Position &Start,
+                          const Position &OldEnd, const Position &NewEnd) {
+  if (P < Start)
+    return P;
+  if (P < OldEnd)
+    return Start;
+  if (P.line == OldEnd.line)
+    return {NewEnd.line, NewEnd.character + (P.character - OldEnd.character)};
+  return {P.line + (NewEnd.line - OldEnd.line), P.character};
+}
+
+void EditHistory::record(
+    VersionTy From, VersionTy To,
+    const std::vector<lspserver::TextDocumentContentChangeEvent> &Changes) {
+  Step S{From, To, std::vector<Edit>{}};
+  for (const auto &Change : Changes) {
+    if (!Change.range) {
+      S.Edits = std::nullopt;
+      break;
+    }
+    llvm::StringRef Text = Change.text;
+    auto Lines = static_cast<int>(Text.count('\n'));
+    auto LastLine = Text.rsplit('\n').second;
+    if (Lines == 0)
+      LastLine = Text;
+    auto Last = static_cast<int>(lspserver::lspLength(LastLine));
+    const auto &Start = Change.range->start;
+    Position NewEnd = Lines == 0 ? Position{Start.line, Start.character + Last}
+                                 : Position{Start.line + Lines, Last};
+    S.Edits->emplace_back(Edit{Start, Change.range->end, NewEnd});
+  }
+  Steps.emplace_back(std::move(S));
+  if (Steps.size() > MaxSteps)
+    Steps.pop_front();
+}
+
+std::optional<Position> EditHistory::remap(Position P, VersionTy From,
+                                           VersionTy To) const {
+  if (From == To)
+    return P;
+  if (From < To) {
+    // Replay steps from `From`, forward.
+    auto It = std::find_if(Steps.begin(), Steps.end(),
+                           [&](const Step &S) { return S.From == From; });
+    for (VersionTy V = From; V != To; ++It) {
+      if (It == Steps.end() || It->From != V || !It->Edits)
+        return std::nullopt;
+      for (const auto &E : *It->Edits)
+        P = map(P, E.Start, E.OldEnd, E.NewEnd);
+      V = It->To;
+    }
+    return P;
+  }
+  // Undo steps reaching `From`, backward.
+  auto It = std::find_if(Steps.rbegin(), Steps.rend(),
+                         [&](const Step &S) { return S.To == From; });
+  for (VersionTy V = From; V != To; ++It) {
+    if (It == Steps.rend() || It->To != V || !It->Edits)
+      return std::nullopt;
+    for (const auto &E : llvm::reverse(*It->Edits))
+      P = map(P, E.Start, E.NewEnd, E.OldEnd);
+    V = It->From;
+  }
+  return P;
+}
+
+std::optional<lspserver::Range>
+EditHistory::remap(const lspserver::Range &R, VersionTy From,
+                   VersionTy To) const {
+  auto Start = remap(R.start, From, To);
+  auto End = remap(R.end, From, To);
+  if (!Start || !End)
+    return std::nullopt;
+  return lspserver::Range{*Start, *End};
+}
+
+} // namespace nixd
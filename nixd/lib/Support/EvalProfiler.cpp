@@ -0,0 +1,93 @@
+#include "nixd/Support/EvalProfiler.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace nixd {
+
+EvalProfiler::Clock::duration EvalProfiler::Node::exclusive() const {
+  auto Result = Inclusive;
+  for (const auto &[_, Child] : Children)
+    Result -= Child->Inclusive;
+  return std::max(Result, Clock::duration::zero());
+}
+
+void EvalProfiler::enter(Key K, Clock::time_point Now) {
+  auto &Child = Current->Children[K];
+  if (!Child) {
+    Child = std::make_unique<Node>();
+    Child->K = K;
+    Child->Parent = Current;
+  }
+  Child->Count++;
+  Current = Child.get();
+  Starts.emplace_back(Now);
+}
+
+void EvalProfiler::leave(Clock::time_point Now) {
+  if (Starts.empty())
+    return;
+  Current->Inclusive += Now - Starts.back();
+  Starts.pop_back();
+  Current = Current->Parent;
+}
+
+EvalProfiler::Clock::duration EvalProfiler::total() const {
+  Clock::duration Result{};
+  for (const auto &[_, Child] : Root.Children)
+    Result += Child->Inclusive;
+  return Result;
+}
+
+std::map<EvalProfiler::Key, EvalProfiler::Totals>
+EvalProfiler::totals() const {
+  std::map<Key, Totals> Result;
+  // Keys of frames on the stack, and how many times.
+  std::map<Key, size_t> Active;
+  std::function<void(const Node &)> Visit = [&](const Node &N) {
+    auto &T = Result[N.K];
+    T.Count += N.Count;
+    T.Exclusive += N.exclusive();
+    if (Active[N.K]++ == 0)
+      T.Inclusive += N.Inclusive;
+    for (const auto &[_, Child] : N.Children)
+      Visit(*Child);
+    Active[N.K]--;
+  };
+  for (const auto &[_, Child] : Root.Children)
+    Visit(*Child);
+  return Result;
+}
+
+void EvalProfiler::writeFolded(
+    llvm::raw_ostream &OS, llvm::function_ref<std::string(Key)> Label) const {
+  std::map<Key, std::string> Labels;
+  auto LabelOf = [&](Key K) -> const std::string & {
+    auto [It, Inserted] = Labels.try_emplace(K);
+    if (Inserted) {
+      // Separators of the format.
+      It->second = Label(K);
+      std::replace(It->second.begin(), It->second.end(), ';', ',');
+      std::replace(It->second.begin(), It->second.end(), '\n', ' ');
+    }
+    return It->second;
+  };
+  std::string Stack;
+  std::function<void(const Node &)> Visit = [&](const Node &N) {
+    auto Size = Stack.size();
+    if (Size)
+      Stack += ';';
+    Stack += LabelOf(N.K);
+    auto US =
+        std::chrono::duration_cast<std::chrono::microseconds>(N.exclusive());
+    if (US.count() > 0)
+      OS << Stack << ' ' << US.count() << '\n';
+    for (const auto &[_, Child] : N.Children)
+      Visit(*Child);
+    Stack.resize(Size);
+  };
+  for (const auto &[_, Child] : Root.Children)
+    Visit(*Child);
+}
+
+} // namespace nixd
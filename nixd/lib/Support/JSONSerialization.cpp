@@ -10,11 +10,20 @@ using namespace llvm::json;
 
 namespace configuration {
 
+bool fromJSON(const Value &Params, TopLevel::Eval::Tiered &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.mapOptional("enable", R.enable) &&
+         O.mapOptional("shallowDepth", R.shallowDepth) &&
+         O.mapOptional("idleDelay", R.idleDelay);
+}
+
 bool fromJSON(const Value &Params, TopLevel::Eval &R, Path P) {
   ObjectMapper O(Params, P);
   return O && O.mapOptional("depth", R.depth) &&
          O.mapOptional("target", R.target) &&
-         O.mapOptional("workers", R.workers);
+         O.mapOptional("workers", R.workers) &&
+         O.mapOptional("replicas", R.replicas) &&
+         O.mapOptional("tiered", R.tiered);
 }
 
 bool fromJSON(const Value &Params, TopLevel::Formatting &R, Path P) {
@@ -28,6 +37,28 @@ bool fromJSON(const Value &Params, TopLevel::Options &R, Path P) {
          O.mapOptional("target", R.target);
 }
 
+bool fromJSON(const Value &Params, TopLevel::Scheduler &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.mapOptional("interactive", R.interactive) &&
+         O.mapOptional("background", R.background) &&
+         O.mapOptional("indexing", R.indexing);
+}
+
+bool fromJSON(const Value &Params, TopLevel::Trace &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.mapOptional("file", R.file);
+}
+
+bool fromJSON(const Value &Params, TopLevel::Stats &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.mapOptional("dumpInterval", R.dumpInterval);
+}
+
+bool fromJSON(const Value &Params, TopLevel::Memory &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.mapOptional("highWaterMark", R.highWaterMark);
+}
+
 bool fromJSON(const Value &Params, TopLevel &R, Path P) {
   Value X = Params;
   if (Params.kind() == Value::Array) {
@@ -38,7 +69,11 @@ bool fromJSON(const Value &Params, TopLevel &R, Path P) {
 
   return O && O.mapOptional("eval", R.eval) &&
          O.mapOptional("formatting", R.formatting) &&
-         O.mapOptional("options", R.options);
+         O.mapOptional("options", R.options) &&
+         O.mapOptional("scheduler", R.scheduler) &&
+         O.mapOptional("trace", R.trace) &&
+         O.mapOptional("stats", R.stats) &&
+         O.mapOptional("memory", R.memory);
 }
 
 bool fromJSON(const Value &Params, std::list<std::string> &R, Path P) {
@@ -54,6 +89,12 @@ bool fromJSON(const Value &Params, InstallableConfigurationItem &R, Path P) {
 
 } // namespace configuration
 
+bool fromJSON(const Value &Params, ProfileEvalParams &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.mapOptional("depth", R.depth) &&
+         O.mapOptional("output", R.output);
+}
+
 namespace ipc {
 bool fromJSON(const Value &Params, WorkerMessage &R, Path P) {
   ObjectMapper O(Params, P);
@@ -67,15 +108,120 @@ Value toJSON(const WorkerMessage &R) {
 bool fromJSON(const Value &Params, Diagnostics &R, Path P) {
   WorkerMessage &Base = R;
   ObjectMapper O(Params, P);
-  return fromJSON(Params, Base, P) && O.map("Params", R.Params);
+  return fromJSON(Params, Base, P) && O.map("Params", R.Params) &&
+         O.mapOptional("Injected", R.Injected);
 }
 
 Value toJSON(const Diagnostics &R) {
   Value Base = toJSON(WorkerMessage(R));
   Base.getAsObject()->insert({"Params", R.Params});
+  Base.getAsObject()->insert({"Injected", R.Injected});
+  return Base;
+}
+
+bool fromJSON(const Value &Params, ReplicaReady &R, Path P) {
+  WorkerMessage &Base = R;
+  ObjectMapper O(Params, P);
+  return fromJSON(Params, Base, P) && O.map("Channel", R.Channel);
+}
+
+Value toJSON(const ReplicaReady &R) {
+  Value Base = toJSON(WorkerMessage(R));
+  Base.getAsObject()->insert({"Channel", R.Channel});
+  return Base;
+}
+
+bool fromJSON(const Value &Params, GCStats &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.map("HeapSize", R.HeapSize) &&
+         O.map("FreeBytes", R.FreeBytes) &&
+         O.map("TotalBytes", R.TotalBytes) &&
+         O.map("Collections", R.Collections) && O.map("Time", R.Time);
+}
+
+Value toJSON(const GCStats &R) {
+  return Object{{"HeapSize", R.HeapSize},
+                {"FreeBytes", R.FreeBytes},
+                {"TotalBytes", R.TotalBytes},
+                {"Collections", R.Collections},
+                {"Time", R.Time}};
+}
+
+bool fromJSON(const Value &Params, EvalStats &R, Path P) {
+  WorkerMessage &Base = R;
+  ObjectMapper O(Params, P);
+  if (!fromJSON(Params, Base, P) || !O.map("Phase", R.Phase) ||
+      !O.map("Pid", R.Pid) || !O.map("Elapsed", R.Elapsed) ||
+      !O.map("GC", R.GC))
+    return false;
+  if (const auto *Nix = Params.getAsObject()->get("Nix"))
+    R.Nix = *Nix;
+  return true;
+}
+
+Value toJSON(const EvalStats &R) {
+  Value Base = toJSON(WorkerMessage(R));
+  Base.getAsObject()->insert({"Phase", R.Phase});
+  Base.getAsObject()->insert({"Pid", R.Pid});
+  Base.getAsObject()->insert({"Elapsed", R.Elapsed});
+  Base.getAsObject()->insert({"Nix", R.Nix});
+  Base.getAsObject()->insert({"GC", R.GC});
   return Base;
 }
 
+bool fromJSON(const Value &Params, ProfileParams &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.map("Depth", R.Depth) && O.map("Output", R.Output);
+}
+
+Value toJSON(const ProfileParams &R) {
+  return Object{{"Depth", R.Depth}, {"Output", R.Output}};
+}
+
+bool fromJSON(const Value &Params, Hotspot &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.map("Location", R.Location) && O.map("Name", R.Name) &&
+         O.map("Inclusive", R.Inclusive) && O.map("Exclusive", R.Exclusive) &&
+         O.map("Count", R.Count);
+}
+
+Value toJSON(const Hotspot &R) {
+  return Object{{"Location", R.Location},
+                {"Name", R.Name},
+                {"Inclusive", R.Inclusive},
+                {"Exclusive", R.Exclusive},
+                {"Count", R.Count}};
+}
+
+bool fromJSON(const Value &Params, ProfileResult &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.map("Total", R.Total) && O.map("Hotspots", R.Hotspots) &&
+         O.map("Output", R.Output) && O.mapOptional("Error", R.Error);
+}
+
+Value toJSON(const ProfileResult &R) {
+  return Object{{"Total", R.Total},
+                {"Hotspots", R.Hotspots},
+                {"Output", R.Output},
+                {"Error", R.Error}};
+}
+
+bool fromJSON(const Value &Params, DeepEvalParams &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.map("Depth", R.Depth);
+}
+
+Value toJSON(const DeepEvalParams &R) { return Object{{"Depth", R.Depth}}; }
+
+bool fromJSON(const Value &Params, DocumentMemory &R, Path P) {
+  ObjectMapper O(Params, P);
+  return O && O.map("Path", R.Path) && O.map("Usage", R.Usage);
+}
+
+Value toJSON(const DocumentMemory &R) {
+  return Object{{"Path", R.Path}, {"Usage", R.Usage}};
+}
+
 bool fromJSON(const Value &Params, AttrPathParams &R, Path P) {
   ObjectMapper O(Params, P);
   return O && O.map("Path", R.Path);
@@ -83,6 +229,41 @@ bool fromJSON(const Value &Params, AttrPathParams &R, Path P) {
 
 Value toJSON(const AttrPathParams &R) { return Object{{"Path", R.Path}}; }
 
+Value withDeadline(Value Params, DeadlineTy Deadline) {
+  using namespace std::chrono;
+  auto US = duration_cast<microseconds>(Deadline.time_since_epoch()).count();
+  Params.getAsObject()->insert({"Deadline", US});
+  return Params;
+}
+
+std::optional<DeadlineTy> getDeadline(const Value &Params) {
+  const auto *Object = Params.getAsObject();
+  if (!Object)
+    return std::nullopt;
+  if (auto US = Object->getInteger("Deadline"))
+    return DeadlineTy(std::chrono::microseconds(*US));
+  return std::nullopt;
+}
+
+Value withTrace(Value Params, const lspserver::trace::Context &Context) {
+  Params.getAsObject()->insert(
+      {"Trace", Object{{"Request", static_cast<int64_t>(Context.Request)},
+                       {"Flow", static_cast<int64_t>(Context.Flow)}}});
+  return Params;
+}
+
+lspserver::trace::Context getTrace(const Value &Params) {
+  lspserver::trace::Context Context;
+  const auto *Object = Params.getAsObject();
+  if (!Object)
+    return Context;
+  if (const auto *Trace = Object->getObject("Trace")) {
+    Context.Request = Trace->getInteger("Request").value_or(0);
+    Context.Flow = Trace->getInteger("Flow").value_or(0);
+  }
+  return Context;
+}
+
 } // namespace ipc
 
 } // namespace nixd
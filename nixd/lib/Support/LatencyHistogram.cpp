@@ -0,0 +1,96 @@
+#include "nixd/Support/LatencyHistogram.h"
+
+#include <llvm/Support/MathExtras.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace nixd {
+
+size_t LatencyHistogram::bucketOf(Duration D) {
+  auto US = static_cast<uint64_t>(std::max<Duration::rep>(D.count(), 1));
+  size_t Octave = llvm::Log2_64(US);
+  if (Octave >= MaxOctave)
+    return NumBuckets - 1;
+  // Linear position inside [2^Octave, 2^(Octave+1)).
+  size_t Sub = ((US - (uint64_t(1) << Octave)) * SubBuckets) >> Octave;
+  return Octave * SubBuckets + Sub;
+}
+
+LatencyHistogram::Duration LatencyHistogram::upperBound(size_t Bucket) {
+  size_t Octave = Bucket / SubBuckets;
+  size_t Sub = Bucket % SubBuckets;
+  uint64_t Base = uint64_t(1) << Octave;
+  // The largest US satisfying (US - Base) * SubBuckets < (Sub + 1) * Base.
+  return Duration(Base + llvm::divideCeil((Sub + 1) * Base, SubBuckets) - 1);
+}
+
+void LatencyHistogram::record(Duration D) {
+  Buckets[bucketOf(D)].fetch_add(1, std::memory_order_relaxed);
+  Count.fetch_add(1, std::memory_order_relaxed);
+  Sum.fetch_add(std::max<Duration::rep>(D.count(), 0),
+                std::memory_order_relaxed);
+}
+
+std::optional<LatencyHistogram::Duration>
+LatencyHistogram::percentile(double P, uint64_t MinSamples) const {
+  // Buckets may be updated concurrently, count them by ourselves.
+  std::array<uint64_t, NumBuckets> Snapshot;
+  uint64_t Total = 0;
+  for (size_t I = 0; I < NumBuckets; I++) {
+    Snapshot[I] = Buckets[I].load(std::memory_order_relaxed);
+    Total += Snapshot[I];
+  }
+  if (Total == 0 || Total < MinSamples)
+    return std::nullopt;
+  auto Rank = static_cast<uint64_t>(std::ceil(std::clamp(P, 0.0, 1.0) * Total));
+  Rank = std::max<uint64_t>(Rank, 1);
+  uint64_t Seen = 0;
+  for (size_t I = 0; I < NumBuckets; I++) {
+    Seen += Snapshot[I];
+    if (Seen >= Rank)
+      return upperBound(I);
+  }
+  return upperBound(NumBuckets - 1);
+}
+
+LatencyHistogram &LatencyStats::operator[](llvm::StringRef Method) {
+  std::lock_guard Guard(Lock);
+  auto &H = Map[Method];
+  if (!H)
+    H = std::make_unique<LatencyHistogram>();
+  return *H;
+}
+
+void LatencyStats::forEach(
+    llvm::function_ref<void(llvm::StringRef, const LatencyHistogram &)> F) {
+  std::lock_guard Guard(Lock);
+  for (const auto &Entry : Map)
+    F(Entry.getKey(), *Entry.getValue());
+}
+
+llvm::json::Value toJSON(const LatencyHistogram &H) {
+  auto Micros = [&](double P) -> llvm::json::Value {
+    if (auto D = H.percentile(P))
+      return D->count();
+    return nullptr;
+  };
+  auto Count = H.count();
+  return llvm::json::Object{
+      {"count", static_cast<int64_t>(Count)},
+      {"mean", Count ? H.sum().count() / static_cast<int64_t>(Count) : 0},
+      {"p50", Micros(0.5)},
+      {"p90", Micros(0.9)},
+      {"p99", Micros(0.99)},
+  };
+}
+
+llvm::json::Value toJSON(LatencyStats &Stats) {
+  llvm::json::Object Result;
+  Stats.forEach([&](llvm::StringRef Method, const LatencyHistogram &H) {
+    Result[Method] = toJSON(H);
+  });
+  return Result;
+}
+
+} // namespace nixd
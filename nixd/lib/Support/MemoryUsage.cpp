@@ -0,0 +1,36 @@
+#include "nixd/Support/MemoryUsage.h"
+
+namespace nixd {
+
+llvm::json::Value toJSON(const MemoryUsage &U) {
+  return llvm::json::Object{
+      {"ast", static_cast<int64_t>(U.AST)},
+      {"analysis", static_cast<int64_t>(U.Analysis)},
+      {"eval", static_cast<int64_t>(U.Eval)},
+      {"draft", static_cast<int64_t>(U.Draft)},
+      {"features", static_cast<int64_t>(U.Features)},
+      {"total", static_cast<int64_t>(U.total())},
+  };
+}
+
+bool fromJSON(const llvm::json::Value &Params, MemoryUsage &R,
+              llvm::json::Path P) {
+  int64_t AST;
+  int64_t Analysis;
+  int64_t Eval;
+  int64_t Draft;
+  int64_t Features;
+  llvm::json::ObjectMapper O(Params, P);
+  if (!O || !O.map("ast", AST) || !O.map("analysis", Analysis) ||
+      !O.map("eval", Eval) || !O.map("draft", Draft) ||
+      !O.map("features", Features))
+    return false;
+  R = MemoryUsage{.AST = static_cast<uint64_t>(AST),
+                  .Analysis = static_cast<uint64_t>(Analysis),
+                  .Eval = static_cast<uint64_t>(Eval),
+                  .Draft = static_cast<uint64_t>(Draft),
+                  .Features = static_cast<uint64_t>(Features)};
+  return true;
+}
+
+} // namespace nixd
@@ -0,0 +1,52 @@
+#include "nixd/Support/ProcessStats.h"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <unistd.h>
+
+namespace nixd {
+
+std::optional<ProcessStats> readProcessStats(pid_t Pid) {
+#ifdef __linux__
+  auto Buffer = llvm::MemoryBuffer::getFileAsStream(
+      "/proc/" + llvm::Twine(Pid) + "/stat");
+  if (!Buffer)
+    return std::nullopt;
+  // "pid (comm) state ppid ...", comm may contain spaces and parentheses.
+  llvm::StringRef Stat = (*Buffer)->getBuffer();
+  auto Pos = Stat.rfind(')');
+  if (Pos == llvm::StringRef::npos)
+    return std::nullopt;
+  llvm::SmallVector<llvm::StringRef, 32> Fields;
+  Stat.drop_front(Pos + 1).split(Fields, ' ', -1, /*KeepEmpty=*/false);
+  // Fields after comm, starting from "state" (3rd in proc(5)).
+  auto Field = [&](size_t N) -> std::optional<uint64_t> {
+    uint64_t Value;
+    if (N - 3 >= Fields.size() || Fields[N - 3].trim().getAsInteger(10, Value))
+      return std::nullopt;
+    return Value;
+  };
+  auto MinFlt = Field(10);
+  auto MajFlt = Field(12);
+  auto RSS = Field(24);
+  if (!MinFlt || !MajFlt || !RSS)
+    return std::nullopt;
+  return ProcessStats{.RSS = *RSS * sysconf(_SC_PAGESIZE),
+                      .MinorFaults = *MinFlt,
+                      .MajorFaults = *MajFlt};
+#else
+  return std::nullopt;
+#endif
+}
+
+llvm::json::Value toJSON(const ProcessStats &S) {
+  return llvm::json::Object{
+      {"rss", static_cast<int64_t>(S.RSS)},
+      {"minorFaults", static_cast<int64_t>(S.MinorFaults)},
+      {"majorFaults", static_cast<int64_t>(S.MajorFaults)},
+  };
+}
+
+} // namespace nixd
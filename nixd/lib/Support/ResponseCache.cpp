@@ -0,0 +1,45 @@
+#include "nixd/Support/ResponseCache.h"
+
+namespace nixd {
+
+ResponseCache::ValueTy ResponseCache::lookup(llvm::StringRef Key) {
+  std::lock_guard _(Lock);
+  auto It = Index.find(Key);
+  if (It == Index.end()) {
+    Misses++;
+    return nullptr;
+  }
+  Hits++;
+  Entries.splice(Entries.begin(), Entries, It->second);
+  return It->second->second;
+}
+
+void ResponseCache::insert(llvm::StringRef Key, ValueTy Value) {
+  std::lock_guard _(Lock);
+  if (auto It = Index.find(Key); It != Index.end()) {
+    It->second->second = std::move(Value);
+    Entries.splice(Entries.begin(), Entries, It->second);
+    return;
+  }
+  if (Capacity == 0)
+    return;
+  if (Entries.size() >= Capacity) {
+    Index.erase(Entries.back().first);
+    Entries.pop_back();
+  }
+  Entries.emplace_front(Key.str(), std::move(Value));
+  Index[Key] = Entries.begin();
+}
+
+void ResponseCache::clear() {
+  std::lock_guard _(Lock);
+  Entries.clear();
+  Index.clear();
+}
+
+size_t ResponseCache::size() {
+  std::lock_guard _(Lock);
+  return Entries.size();
+}
+
+} // namespace nixd
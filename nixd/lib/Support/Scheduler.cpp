@@ -0,0 +1,213 @@
+#include "nixd/Support/Scheduler.h"
+
+#include "lspserver/Trace.h"
+
+#include <llvm/ADT/ScopeExit.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace nixd {
+
+namespace {
+
+/// The scheduler & worker index of pool threads.
+thread_local const Scheduler *CurrentScheduler = nullptr;
+thread_local size_t CurrentWorker = 0;
+
+} // namespace
+
+Scheduler::LimitsTy Scheduler::defaultLimits(size_t Threads) {
+  return {Threads, std::max<size_t>(Threads / 2, 1),
+          std::max<size_t>(Threads / 4, 1)};
+}
+
+Scheduler::Scheduler(size_t NThreads, LimitsTy Limits) : OwnerPID(getpid()) {
+  NThreads = std::max<size_t>(NThreads, 1);
+  for (size_t I = 0; I < NThreads; I++)
+    Workers.emplace_back(std::make_unique<Worker>());
+  setLimits(Limits);
+  for (size_t I = 0; I < NThreads; I++)
+    Threads.emplace_back([this, I]() { run(I); });
+}
+
+Scheduler::~Scheduler() {
+  // Abandon pending tasks, like boost::asio::thread_pool does.
+  {
+    std::lock_guard Guard(SleepLock);
+    Stop = true;
+  }
+  SleepCV.notify_all();
+  for (auto &T : Threads) {
+    if (getpid() == OwnerPID)
+      T.join();
+    else
+      T.detach();
+  }
+}
+
+void Scheduler::setLimits(LimitsTy NewLimits) {
+  auto Defaults = defaultLimits(Workers.size());
+  {
+    std::lock_guard Guard(SlotLock);
+    for (size_t C = 0; C < NumPriorities; C++)
+      Limits[C] = NewLimits[C] ? NewLimits[C] : Defaults[C];
+  }
+  notify();
+}
+
+void Scheduler::notify() {
+  {
+    std::lock_guard Guard(SleepLock);
+    Epoch++;
+  }
+  SleepCV.notify_all();
+}
+
+void Scheduler::post(Priority P, Task T) {
+  if (lspserver::trace::enabled()) {
+    // Time spent in queues, and running, on behalf of the posting request.
+    lspserver::trace::AsyncSpan Queued("queued");
+    Queued.Args["priority"] = static_cast<int64_t>(P);
+    T = [T = std::move(T), Queued = std::move(Queued),
+         Context = lspserver::trace::current()]() mutable {
+      Queued.end();
+      lspserver::trace::ContextScope Scope(Context);
+      lspserver::trace::Span Tracer("task");
+      T();
+    };
+  }
+  Outstanding++;
+  size_t W = CurrentScheduler == this ? CurrentWorker
+                                      : NextWorker++ % Workers.size();
+  {
+    std::lock_guard Guard(Workers[W]->Lock);
+    Workers[W]->Queues[static_cast<size_t>(P)].emplace_back(std::move(T));
+  }
+  notify();
+}
+
+Scheduler::Load Scheduler::load() {
+  Load L;
+  for (auto &W : Workers) {
+    std::lock_guard Guard(W->Lock);
+    for (size_t C = 0; C < NumPriorities; C++)
+      L.Queued[C] += W->Queues[C].size();
+  }
+  std::lock_guard Guard(SlotLock);
+  L.Running = Running;
+  L.Limits = Limits;
+  return L;
+}
+
+bool Scheduler::reserve(size_t C) {
+  std::lock_guard Guard(SlotLock);
+  for (size_t K = 0; K <= C; K++) {
+    if (Running[K] >= Limits[K]) {
+      Denied = true;
+      return false;
+    }
+  }
+  for (size_t K = 0; K <= C; K++)
+    Running[K]++;
+  return true;
+}
+
+void Scheduler::release(size_t C) {
+  bool WasDenied;
+  {
+    std::lock_guard Guard(SlotLock);
+    for (size_t K = 0; K <= C; K++)
+      Running[K]--;
+    WasDenied = std::exchange(Denied, false);
+  }
+  // Wake up threads that have been denied, the slot is available now.
+  if (WasDenied)
+    notify();
+}
+
+bool Scheduler::tryRun(size_t Self, Priority P) {
+  auto C = static_cast<size_t>(P);
+
+  Task T;
+  for (size_t I = 0; I < Workers.size() && !T; I++) {
+    auto &W = *Workers[(Self + I) % Workers.size()];
+    std::lock_guard Guard(W.Lock);
+    auto &Q = W.Queues[C];
+    if (Q.empty())
+      continue;
+    // Only reserve a slot if there is a task, otherwise idle threads would
+    // deny each other.
+    if (!reserve(C))
+      return false;
+    if (I == 0) {
+      // Our own deque, the latest task is likely hot in cache.
+      T = std::move(Q.back());
+      Q.pop_back();
+    } else {
+      // Steal the oldest one.
+      T = std::move(Q.front());
+      Q.pop_front();
+    }
+  }
+
+  if (!T)
+    return false;
+
+  // Tasks must not throw, an exception escaping a worker thread calls
+  // std::terminate. The slot is released once the task returned.
+  auto Finish = llvm::make_scope_exit([this, C]() {
+    release(C);
+    if (--Outstanding == 0) {
+      std::lock_guard Guard(SleepLock);
+      IdleCV.notify_all();
+    }
+  });
+  T();
+  return true;
+}
+
+void Scheduler::run(size_t Self) {
+  CurrentScheduler = this;
+  CurrentWorker = Self;
+  for (;;) {
+    size_t Seen;
+    {
+      std::lock_guard Guard(SleepLock);
+      if (Stop)
+        return;
+      Seen = Epoch;
+    }
+    // Take the most urgent task, then rescan from the beginning.
+    bool Ran = false;
+    for (size_t C = 0; C < NumPriorities && !Ran; C++)
+      Ran = tryRun(Self, static_cast<Priority>(C));
+    if (Ran)
+      continue;
+    std::unique_lock Lock(SleepLock);
+    SleepCV.wait(Lock, [&]() { return Stop || Epoch != Seen; });
+  }
+}
+
+void Scheduler::wait() {
+  std::unique_lock Lock(SleepLock);
+  IdleCV.wait(Lock, [this]() { return Outstanding == 0; });
+}
+
+void Scheduler::join() {
+  wait();
+  {
+    std::lock_guard Guard(SleepLock);
+    Stop = true;
+  }
+  SleepCV.notify_all();
+  for (auto &T : Threads) {
+    if (getpid() == OwnerPID)
+      T.join();
+    else
+      T.detach();
+  }
+  Threads.clear();
+}
+
+} // namespace nixd
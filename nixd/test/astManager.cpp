@@ -0,0 +1,137 @@
+#include <gtest/gtest.h>
+
+#include "nixd/AST/ParseAST.h"
+#include "nixd/Parser/Parser.h"
+#include "nixd/Server/ASTManager.h"
+#include "nixd/Support/Scheduler.h"
+
+#include "lspserver/Rope.h"
+
+#include "nixutil.h"
+
+#include <set>
+#include <string>
+
+namespace nixd {
+
+namespace {
+
+const std::string Path = "/foo.nix";
+
+} // namespace
+
+TEST(ASTManager, RejectStaleVersion) {
+  InitNix INix;
+  Scheduler Pool(2);
+  ASTManager Mgr(Pool);
+
+  // Both tasks may parse concurrently, and finish in either order. Whichever
+  // it is, the older document must not replace the newer snapshot.
+  std::string Old = "{\n";
+  for (int I = 0; I < 1000; I++)
+    Old += "  a" + std::to_string(I) + " = " + std::to_string(I) + ";\n";
+  Old += "}\n";
+  Mgr.schedParse(lspserver::Rope(Old), Path, 1);
+  Mgr.schedParse(lspserver::Rope("{ b = 1; }"), Path, 2);
+  Pool.wait();
+
+  ParseAST Expected(parse(std::string("{ b = 1; }"), Path));
+  Expected.bindVars();
+  Expected.staticAnalysis();
+
+  auto Cached = Mgr.getAST(Path);
+  ASSERT_TRUE(Cached);
+  ASSERT_EQ(Cached->second, 2);
+  ASSERT_EQ(Cached->first->nodes(), Expected.nodes());
+
+  // Parsing an old version again is answered by the newer snapshot.
+  Mgr.schedParse(lspserver::Rope(Old), Path, 1);
+  Pool.wait();
+  ASSERT_EQ(Mgr.getAST(Path)->second, 2);
+
+  ASTManager::VersionTy Seen = 0;
+  Mgr.withAST(Path, 1,
+              [&](const ParseAST &, ASTManager::VersionTy &Version) {
+                Seen = Version;
+              });
+  ASSERT_EQ(Seen, 2);
+}
+
+TEST(ASTManager, FeatureCacheInvalidation) {
+  InitNix INix;
+  Scheduler Pool(2);
+  ASTManager Mgr(Pool);
+
+  int Computed = 0;
+  size_t Nodes = 0;
+  auto Request = [&](ASTManager::VersionTy Version) {
+    Mgr.withCachedAST<size_t>(
+        Path, Version, "nodes",
+        [&](const ParseAST &AST) {
+          Computed++;
+          return AST.nodes();
+        },
+        [&](const size_t &Result) { Nodes = Result; });
+  };
+
+  Mgr.schedParse(lspserver::Rope("{ a = 1; }"), Path, 1);
+  Pool.wait();
+  Request(1);
+  Request(1);
+  ASSERT_EQ(Computed, 1);
+  ASSERT_EQ(Mgr.featureCacheStats().Hits.load(), 1U);
+  auto OldNodes = Nodes;
+
+  Mgr.schedParse(lspserver::Rope("{ a = 1; b = { c = 2; }; }"), Path, 2);
+  Pool.wait();
+  ASSERT_EQ(Mgr.featureCacheStats().Invalidations.load(), 1U);
+
+  // Results of the old AST are not returned for the new version.
+  Request(2);
+  ASSERT_EQ(Computed, 2);
+  ASSERT_GT(Nodes, OldNodes);
+  Request(2);
+  ASSERT_EQ(Computed, 2);
+}
+
+TEST(ASTManager, Evict) {
+  InitNix INix;
+  Scheduler Pool(2);
+  ASTManager Mgr(Pool);
+  const std::string Open = "/open.nix";
+  const std::string Closed = "/closed.nix";
+  std::set<std::string> Keep{Open};
+
+  Mgr.schedParse(lspserver::Rope("{ a = 1; }"), Open, 1);
+  Mgr.schedParse(lspserver::Rope("{ b = 1; }"), Closed, 1);
+  Pool.wait();
+  int Computed = 0;
+  auto Request = [&]() {
+    Mgr.withCachedAST<size_t>(
+        Open, 1, "nodes",
+        [&](const ParseAST &AST) {
+          Computed++;
+          return AST.nodes();
+        },
+        [](const size_t &) {});
+  };
+  Request();
+  ASSERT_EQ(Computed, 1);
+
+  ASSERT_EQ(Mgr.evict(Keep, 0), 0U);
+
+  // ASTs of closed documents are evicted first.
+  ASSERT_GT(Mgr.evict(Keep, 1), 0U);
+  ASSERT_FALSE(Mgr.getAST(Closed));
+  ASSERT_TRUE(Mgr.getAST(Open));
+  Request();
+  ASSERT_EQ(Computed, 1);
+
+  // Then results of features, open documents are kept.
+  ASSERT_GT(Mgr.evict(Keep, 1), 0U);
+  ASSERT_TRUE(Mgr.getAST(Open));
+  Request();
+  ASSERT_EQ(Computed, 2);
+}
+
+} // namespace nixd
@@ -0,0 +1,157 @@
+#include <gtest/gtest.h>
+
+#include "lspserver/Connection.h"
+
+#include <llvm/Support/JSON.h>
+
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+namespace lspserver {
+
+TEST(Connection, ExtractOpenText) {
+  std::string Raw = R"({"jsonrpc":"2.0","params":{"textDocument":{)"
+                    R"("uri":"file:///a.nix","text":"let\n\"é\" 😀",)"
+                    R"("version":1}},"method":"textDocument/didOpen"})";
+  MessageTexts Texts;
+  ASSERT_TRUE(extractTexts(Raw, Texts));
+  ASSERT_EQ(Texts.size(), 1);
+  ASSERT_EQ(Texts[0], "let\n\"\xc3\xa9\" \xf0\x9f\x98\x80");
+
+  // The rest is still valid, the text is replaced by "".
+  auto JSON = llvm::json::parse(Raw);
+  ASSERT_TRUE(bool(JSON));
+  const auto *TD = JSON->getAsObject()->getObject("params")->getObject(
+      "textDocument");
+  ASSERT_EQ(TD->getString("text"), "");
+  ASSERT_EQ(TD->getString("uri"), "file:///a.nix");
+  ASSERT_EQ(TD->getInteger("version"), 1);
+}
+
+TEST(Connection, ExtractChangeTexts) {
+  std::string Raw = R"({ "method" : "textDocument/didChange", "params" : {
+    "textDocument" : { "uri" : "file:///a.nix", "text" : "not extracted" },
+    "contentChanges" : [
+      { "range" : { "start" : { "line" : 0, "character" : 0 },
+                    "end" : { "line" : 0, "character" : 1 } },
+        "text" : "x" },
+      { "text" : "whole\tdocument" }
+    ] }, "jsonrpc" : "2.0" })";
+  MessageTexts Texts;
+  ASSERT_TRUE(extractTexts(Raw, Texts));
+  ASSERT_EQ(Texts, (MessageTexts{"x", "whole\tdocument"}));
+  ASSERT_TRUE(bool(llvm::json::parse(Raw)));
+  ASSERT_NE(Raw.find("not extracted"), std::string::npos);
+}
+
+TEST(Connection, ExtractNothing) {
+  // Other methods, invalid escapes, unescaped control characters and invalid
+  // UTF-8 are left to the JSON parser.
+  std::string Hover = R"({"method":"textDocument/hover","params":{)"
+                      R"("textDocument":{"text":"x"}}})";
+  std::string Invalid = R"({"method":"textDocument/didOpen","params":{)"
+                        R"("textDocument":{"text":"\ud83d"}}})";
+  std::string Control = "{\"method\":\"textDocument/didOpen\",\"params\":{"
+                        "\"textDocument\":{\"text\":\"a\tb\"}}}";
+  std::string NotUTF8 = "{\"method\":\"textDocument/didOpen\",\"params\":{"
+                        "\"textDocument\":{\"text\":\"\xc3\x28\"}}}";
+  for (std::string Raw : {Hover, Invalid, Control, NotUTF8}) {
+    MessageTexts Texts;
+    ASSERT_FALSE(extractTexts(Raw, Texts));
+    ASSERT_TRUE(Texts.empty());
+  }
+  for (const auto &Raw : {Invalid, Control, NotUTF8}) {
+    std::string Copy = Raw;
+    MessageTexts Texts;
+    extractTexts(Copy, Texts);
+    ASSERT_EQ(Copy, Raw);
+  }
+  for (const auto &Raw : {Control, NotUTF8}) {
+    auto JSON = llvm::json::parse(Raw);
+    ASSERT_FALSE(bool(JSON));
+    llvm::consumeError(JSON.takeError());
+  }
+}
+
+TEST(Connection, ExtractResult) {
+  std::string Object = R"({"id":1,"jsonrpc":"2.0","result":{"a":[1,{"b":2}]}})";
+  std::string Scalar = R"({"result" : -1.5e3 , "id" : 2, "jsonrpc":"2.0"})";
+  std::string String = R"({"id":3,"result":"\"}","jsonrpc":"2.0"})";
+  std::string Call = R"({"id":4,"method":"m","params":{"result":1}})";
+
+  RawJSON Result;
+  ASSERT_TRUE(extractResult(Object, Result));
+  ASSERT_EQ(Result.Text, R"({"a":[1,{"b":2}]})");
+  ASSERT_EQ(Object, R"({"id":1,"jsonrpc":"2.0","result":0})");
+
+  ASSERT_TRUE(extractResult(Scalar, Result));
+  ASSERT_EQ(Result.Text, "-1.5e3");
+  ASSERT_TRUE(bool(llvm::json::parse(Scalar)));
+
+  ASSERT_TRUE(extractResult(String, Result));
+  ASSERT_EQ(Result.Text, R"("\"}")");
+  ASSERT_TRUE(bool(llvm::json::parse(String)));
+
+  ASSERT_FALSE(extractResult(Call, Result));
+}
+
+TEST(Connection, ReplyRaw) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  OutboundPort Port(OS);
+  Port.replyRaw(1, RawJSON(R"({"uri":"file:///a.nix"})"));
+  ASSERT_EQ(Out, "Content-Length: 57\r\n\r\n"
+                 R"({"jsonrpc":"2.0","id":1,)"
+                 R"("result":{"uri":"file:///a.nix"}})");
+}
+
+TEST(Connection, Cancel) {
+  int FDs[2];
+  ASSERT_EQ(pipe(FDs), 0);
+  InboundPort In(FDs[0]);
+  In.ReadAhead = true;
+  {
+    llvm::raw_fd_ostream To(FDs[1], /*shouldClose=*/true);
+    OutboundPort Port(To, false);
+    Port.call("a", nullptr, 1);
+    Port.notify("$/cancelRequest", llvm::json::Object{{"id", 1}});
+    // Not received, ignored.
+    Port.notify("$/cancelRequest", llvm::json::Object{{"id", 2}});
+    Port.notify("exit", nullptr);
+  }
+
+  struct Handler : MessageHandler {
+    InboundPort &In;
+    bool Called = false;
+    Handler(InboundPort &In) : In(In) {}
+    bool onNotify(llvm::StringRef Method, llvm::json::Value,
+                  MessageTexts) override {
+      return Method != "exit";
+    }
+    bool onCall(llvm::StringRef, llvm::json::Value,
+                llvm::json::Value ID) override {
+      Called = true;
+      // Wait for the reader to see all messages.
+      while (!In.anyQueued([](const llvm::json::Object &O) {
+        return O.getString("method") == "exit";
+      }))
+        std::this_thread::yield();
+      EXPECT_EQ(In.cancellations(), 1U);
+      EXPECT_TRUE(In.isCancelled(ID));
+      EXPECT_FALSE(In.isCancelled(2));
+      In.answered(ID);
+      EXPECT_FALSE(In.isCancelled(ID));
+      return true;
+    }
+    bool onReply(llvm::json::Value, llvm::Expected<RawJSON> R) override {
+      llvm::consumeError(R.takeError());
+      return true;
+    }
+  } H(In);
+  In.loop(H);
+  ASSERT_TRUE(H.Called);
+}
+
+} // namespace lspserver
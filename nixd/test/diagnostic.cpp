@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/Diagnostic.h"
+
+#include "lspserver/Protocol.h"
+
+#include <string>
+#include <vector>
+
+namespace nixd {
+
+namespace {
+
+lspserver::Diagnostic mkDiag(int Line, std::string Message, int Severity = 1) {
+  lspserver::Diagnostic D;
+  D.range = {{Line, 0}, {Line, 1}};
+  D.message = std::move(Message);
+  D.severity = Severity;
+  return D;
+}
+
+} // namespace
+
+TEST(Diagnostic, Merge) {
+  std::vector<lspserver::Diagnostic> Diags{mkDiag(0, "a"), mkDiag(1, "b")};
+  mergeDiagnostics(Diags, {mkDiag(1, "b"), mkDiag(1, "c"), mkDiag(0, "a", 3),
+                           mkDiag(2, "a"), mkDiag(1, "c")});
+  // Order is kept, the first one of equal diagnostics wins.
+  ASSERT_EQ(Diags.size(), 5U);
+  ASSERT_EQ(Diags[2].message, "c");
+  ASSERT_EQ(Diags[3].severity, 3);
+  ASSERT_EQ(Diags[4].range.start.line, 2);
+
+  mergeDiagnostics(Diags, Diags);
+  ASSERT_EQ(Diags.size(), 5U);
+}
+
+TEST(Diagnostic, MergeMany) {
+  // Deep recursions repeat the same frames.
+  std::vector<lspserver::Diagnostic> Diags;
+  std::vector<lspserver::Diagnostic> More;
+  for (int I = 0; I < 10000; I++)
+    More.emplace_back(mkDiag(I % 100, "frame"));
+  mergeDiagnostics(Diags, More);
+  ASSERT_EQ(Diags.size(), 100U);
+}
+
+} // namespace nixd
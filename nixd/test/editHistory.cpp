@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/EditHistory.h"
+
+namespace nixd {
+
+using lspserver::Position;
+using lspserver::Range;
+using lspserver::TextDocumentContentChangeEvent;
+
+static TextDocumentContentChangeEvent change(Range R, std::string Text) {
+  return {R, std::nullopt, std::move(Text)};
+}
+
+TEST(EditHistory, SameLine) {
+  EditHistory H;
+  // "let x = 1; in x" -> "let xyz = 1; in x"
+  H.record(1, 2, {change({{0, 5}, {0, 5}}, "yz")});
+
+  ASSERT_EQ(H.remap(Position{0, 2}, 1, 2), (Position{0, 2}));
+  ASSERT_EQ(H.remap(Position{0, 14}, 1, 2), (Position{0, 16}));
+  ASSERT_EQ(H.remap(Position{0, 16}, 2, 1), (Position{0, 14}));
+  // Inside the inserted text.
+  ASSERT_EQ(H.remap(Position{0, 6}, 2, 1), (Position{0, 5}));
+}
+
+TEST(EditHistory, Lines) {
+  EditHistory H;
+  // Insert two lines before line 3.
+  H.record(1, 2, {change({{3, 0}, {3, 0}}, "a\nb\n")});
+  // Join lines 0 and 1 of version 2.
+  H.record(2, 3, {change({{0, 4}, {1, 0}}, "")});
+
+  ASSERT_EQ(H.remap(Position{3, 2}, 1, 3), (Position{4, 2}));
+  ASSERT_EQ(H.remap(Position{4, 2}, 3, 1), (Position{3, 2}));
+  ASSERT_EQ(H.remap(Position{1, 3}, 1, 2), (Position{1, 3}));
+  ASSERT_EQ(H.remap(Position{1, 3}, 2, 3), (Position{0, 7}));
+  ASSERT_EQ(H.remap(Position{0, 7}, 3, 2), (Position{1, 3}));
+
+  auto R = H.remap(Range{{3, 0}, {3, 5}}, 1, 3);
+  ASSERT_TRUE(R);
+  ASSERT_EQ(*R, (Range{{4, 0}, {4, 5}}));
+}
+
+TEST(EditHistory, MultipleChanges) {
+  EditHistory H;
+  // Changes of one version are applied in order.
+  H.record(1, 2,
+           {change({{0, 0}, {0, 0}}, "ab"), change({{0, 10}, {0, 12}}, "")});
+  ASSERT_EQ(H.remap(Position{0, 20}, 1, 2), (Position{0, 20}));
+  ASSERT_EQ(H.remap(Position{0, 20}, 2, 1), (Position{0, 20}));
+  ASSERT_EQ(H.remap(Position{0, 5}, 1, 2), (Position{0, 7}));
+}
+
+TEST(EditHistory, Unknown) {
+  EditHistory H;
+  H.record(1, 2, {change({{0, 0}, {0, 0}}, "a")});
+  H.record(2, 3, {TextDocumentContentChangeEvent{std::nullopt, std::nullopt,
+                                                 "full text"}});
+  ASSERT_FALSE(H.remap(Position{0, 0}, 1, 3));
+  ASSERT_FALSE(H.remap(Position{0, 0}, 3, 2));
+  ASSERT_FALSE(H.remap(Position{0, 0}, 1, 5));
+  ASSERT_EQ(H.remap(Position{0, 0}, 1, 2), (Position{0, 1}));
+  ASSERT_EQ(H.remap(Position{0, 3}, 3, 3), (Position{0, 3}));
+
+  H.clear();
+  ASSERT_FALSE(H.remap(Position{0, 0}, 1, 2));
+}
+
+} // namespace nixd
@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/EvalProfiler.h"
+
+namespace nixd {
+
+using std::chrono::microseconds;
+
+namespace {
+
+// Keys of frames in tests.
+const int A = 0, B = 0, C = 0;
+
+EvalProfiler::Clock::time_point at(int US) {
+  return EvalProfiler::Clock::time_point(microseconds(US));
+}
+
+std::string label(EvalProfiler::Key K) {
+  if (K == &A)
+    return "a";
+  if (K == &B)
+    return "b;c";
+  return "c";
+}
+
+} // namespace
+
+TEST(EvalProfiler, Totals) {
+  EvalProfiler P;
+  // a -> b -> a (recursive), then a -> c
+  P.enter(&A, at(0));
+  P.enter(&B, at(10));
+  P.enter(&A, at(20));
+  P.leave(at(50));
+  P.leave(at(60));
+  P.enter(&C, at(70));
+  P.leave(at(100));
+  P.leave(at(100));
+  // Unbalanced leaves are ignored.
+  P.leave(at(200));
+  ASSERT_EQ(P.depth(), 0);
+  ASSERT_EQ(P.total(), microseconds(100));
+
+  auto Totals = P.totals();
+  ASSERT_EQ(Totals[&A].Count, 2);
+  ASSERT_EQ(Totals[&A].Inclusive, microseconds(100));
+  ASSERT_EQ(Totals[&A].Exclusive, microseconds(20 + 30));
+  ASSERT_EQ(Totals[&B].Inclusive, microseconds(50));
+  ASSERT_EQ(Totals[&B].Exclusive, microseconds(20));
+  ASSERT_EQ(Totals[&C].Count, 1);
+  ASSERT_EQ(Totals[&C].Exclusive, microseconds(30));
+}
+
+TEST(EvalProfiler, Folded) {
+  EvalProfiler P;
+  P.enter(&A, at(0));
+  P.enter(&B, at(10));
+  P.leave(at(40));
+  P.enter(&B, at(50));
+  P.leave(at(60));
+  P.leave(at(60));
+
+  std::string Folded;
+  llvm::raw_string_ostream OS(Folded);
+  P.writeFolded(OS, label);
+  // Separators in labels are replaced.
+  ASSERT_EQ(OS.str(), "a 20\na;b,c 40\n");
+}
+
+} // namespace nixd
@@ -0,0 +1,233 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/Gather.h"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace nixd {
+
+using namespace std::chrono_literals;
+
+using IntGather = Gather<int>;
+
+using Delay = std::optional<IntGather::Clock::duration>;
+
+/// Sources replying on their own threads. Threads are joined on destruction,
+/// so declare it after the executor of timers, they may post to it.
+class Sources {
+  std::mutex Lock;
+  std::condition_variable CV;
+  bool Released = false;            // GUARDED_BY(Lock)
+  std::vector<std::thread> Threads; // GUARDED_BY(Lock)
+
+  IntGather::Clock::duration spawn(IntGather::ReplyFn Reply,
+                                   std::optional<int> Value, bool Wait) {
+    std::lock_guard Guard(Lock);
+    Threads.emplace_back([=, this, Reply = std::move(Reply)]() mutable {
+      if (Wait) {
+        std::unique_lock WaitGuard(Lock);
+        CV.wait(WaitGuard, [this]() { return Released; });
+      }
+      Reply(Value);
+    });
+    return 20ms;
+  }
+
+public:
+  /// Reply \p Value now. \returns the hedge delay.
+  IntGather::Clock::duration reply(IntGather::ReplyFn Reply,
+                                   std::optional<int> Value) {
+    return spawn(std::move(Reply), Value, false);
+  }
+
+  /// Reply \p Value once released, i.e. slower than its hedge delay.
+  IntGather::Clock::duration replyOnRelease(IntGather::ReplyFn Reply,
+                                            std::optional<int> Value) {
+    return spawn(std::move(Reply), Value, true);
+  }
+
+  void release() {
+    {
+      std::lock_guard Guard(Lock);
+      Released = true;
+    }
+    CV.notify_all();
+  }
+
+  ~Sources() {
+    release();
+    for (auto &T : Threads)
+      T.join();
+  }
+};
+
+TEST(Gather, FirstAnswer) {
+  boost::asio::thread_pool Timers(1);
+  Sources S;
+  std::promise<std::vector<int>> P;
+  int I = 0;
+  IntGather::start(
+      Timers.get_executor(),
+      [&](IntGather::ReplyFn Reply) -> Delay {
+        if (I++ == 0)
+          return S.reply(std::move(Reply), 1);
+        return std::nullopt;
+      },
+      IntGather::Clock::now() + 10s, false,
+      [&](std::vector<int> R) { P.set_value(std::move(R)); });
+  ASSERT_EQ(P.get_future().get(), std::vector<int>{1});
+  ASSERT_EQ(I, 1);
+}
+
+TEST(Gather, Hedging) {
+  boost::asio::thread_pool Timers(1);
+  Sources S;
+  std::promise<std::vector<int>> P;
+  int I = 0;
+  IntGather::start(
+      Timers.get_executor(),
+      [&](IntGather::ReplyFn Reply) -> Delay {
+        switch (I++) {
+        case 0:
+          // Slower than its hedge delay.
+          return S.replyOnRelease(std::move(Reply), 1);
+        case 1:
+          return S.reply(std::move(Reply), 2);
+        default:
+          return std::nullopt;
+        }
+      },
+      IntGather::Clock::now() + 10s, false,
+      [&](std::vector<int> R) { P.set_value(std::move(R)); });
+  ASSERT_EQ(P.get_future().get(), std::vector<int>{2});
+}
+
+TEST(Gather, FailedSources) {
+  boost::asio::thread_pool Timers(1);
+  std::promise<std::vector<int>> P;
+  int I = 0;
+  IntGather::start(
+      Timers.get_executor(),
+      [&](IntGather::ReplyFn Reply) -> Delay {
+        if (I++ < 3) {
+          // Reply synchronously, with a failure.
+          Reply(std::nullopt);
+          return 10s;
+        }
+        return std::nullopt;
+      },
+      IntGather::Clock::now() + 20s, false,
+      [&](std::vector<int> R) { P.set_value(std::move(R)); });
+  ASSERT_TRUE(P.get_future().get().empty());
+  ASSERT_EQ(I, 4);
+}
+
+TEST(Gather, AskUnlocked) {
+  boost::asio::thread_pool Timers(1);
+  std::promise<std::vector<int>> P;
+  int I = 0;
+  IntGather::start(
+      Timers.get_executor(),
+      [&](IntGather::ReplyFn Reply) -> Delay {
+        if (I++ > 0)
+          return std::nullopt;
+        // Sources may wait for replies delivered on other threads, e.g. when
+        // writing to a full pipe.
+        std::thread([&Reply]() { Reply(1); }).join();
+        return 10s;
+      },
+      IntGather::Clock::now() + 20s, false,
+      [&](std::vector<int> R) { P.set_value(std::move(R)); });
+  ASSERT_EQ(P.get_future().get(), std::vector<int>{1});
+}
+
+TEST(Gather, Deadline) {
+  boost::asio::thread_pool Timers(1);
+  Sources S;
+  std::promise<std::vector<int>> P;
+  IntGather::start(
+      Timers.get_executor(),
+      [&](IntGather::ReplyFn Reply) -> Delay {
+        return S.replyOnRelease(std::move(Reply), 1);
+      },
+      IntGather::Clock::now() + 100ms, false,
+      [&](std::vector<int> R) { P.set_value(std::move(R)); });
+  // Not answered before the deadline.
+  ASSERT_TRUE(P.get_future().get().empty());
+}
+
+TEST(Gather, AskAll) {
+  boost::asio::thread_pool Timers(1);
+  Sources S;
+  std::promise<std::vector<int>> P;
+  int I = 0;
+  IntGather::start(
+      Timers.get_executor(),
+      [&](IntGather::ReplyFn Reply) -> Delay {
+        if (I < 3)
+          return S.reply(std::move(Reply), I++);
+        return std::nullopt;
+      },
+      IntGather::Clock::now(), true,
+      [&](std::vector<int> R) { P.set_value(std::move(R)); });
+  ASSERT_EQ(P.get_future().get().size(), 3);
+}
+
+/// Slow sources should not occupy threads of the pool starting requests.
+TEST(Gather, LoadSlowSources) {
+  boost::asio::thread_pool Timers(1);
+  Sources S;
+  boost::asio::thread_pool Pool(2);
+
+  constexpr int Requests = 200;
+  constexpr int Tasks = 1000;
+
+  std::atomic<int> Gathered = 0;
+  std::atomic<int> Finished = 0;
+  std::promise<void> TasksDone;
+  std::promise<void> AllGathered;
+
+  for (int I = 0; I < Requests; I++) {
+    boost::asio::post(Pool, [&]() {
+      IntGather::start(
+          Timers.get_executor(),
+          [&, Asked = false](IntGather::ReplyFn Reply) mutable -> Delay {
+            if (std::exchange(Asked, true))
+              return std::nullopt;
+            return S.replyOnRelease(std::move(Reply), 1);
+          },
+          IntGather::Clock::now() + 60s, false, [&](std::vector<int> R) {
+            if (++Gathered == Requests)
+              AllGathered.set_value();
+          });
+    });
+  }
+  for (int I = 0; I < Tasks; I++) {
+    boost::asio::post(Pool, [&]() {
+      if (++Finished == Tasks)
+        TasksDone.set_value();
+    });
+  }
+
+  // Other tasks are not blocked by outstanding requests, none of them is
+  // answered before the tasks finished.
+  TasksDone.get_future().wait();
+  ASSERT_EQ(Gathered, 0);
+
+  S.release();
+  AllGathered.get_future().wait();
+  Pool.join();
+  ASSERT_EQ(Gathered, Requests);
+}
+
+} // namespace nixd
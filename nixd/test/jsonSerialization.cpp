@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/JSONSerialization.h"
+
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+
+#include <string>
+
+namespace nixd {
+
+namespace {
+
+/// Serialize \p Stats as sent over the pipe, and parse it back.
+ipc::EvalStats roundTrip(const ipc::EvalStats &Stats) {
+  std::string Text = llvm::formatv("{0}", toJSON(Stats));
+  auto JSON = llvm::json::parse(Text);
+  EXPECT_TRUE(bool(JSON));
+  ipc::EvalStats Parsed;
+  llvm::json::Path::Root Root;
+  EXPECT_TRUE(fromJSON(*JSON, Parsed, Root));
+  return Parsed;
+}
+
+} // namespace
+
+TEST(JSONSerialization, EvalStats) {
+  ipc::EvalStats Stats;
+  Stats.WorkspaceVersion = 3;
+  Stats.Phase = "eval";
+  Stats.Pid = 42;
+  Stats.Elapsed = 1500;
+  Stats.Nix = llvm::json::Object{
+      {"nrThunks", 100},
+      {"values", llvm::json::Object{{"number", 7}, {"bytes", 168}}},
+  };
+  Stats.GC = {.HeapSize = 1 << 20,
+              .FreeBytes = 1 << 10,
+              .TotalBytes = 1 << 22,
+              .Collections = 2,
+              .Time = 5};
+
+  auto Parsed = roundTrip(Stats);
+  ASSERT_EQ(Parsed.WorkspaceVersion, 3);
+  ASSERT_EQ(Parsed.Phase, "eval");
+  ASSERT_EQ(Parsed.Pid, 42);
+  ASSERT_EQ(Parsed.Elapsed, 1500);
+  ASSERT_EQ(Parsed.Nix, Stats.Nix);
+  ASSERT_EQ(toJSON(Parsed.GC), toJSON(Stats.GC));
+
+  // Statistics of nix may be unavailable.
+  Stats.Nix = nullptr;
+  ASSERT_EQ(roundTrip(Stats).Nix, nullptr);
+}
+
+TEST(JSONSerialization, EvalStatsInvalid) {
+  ipc::EvalStats Parsed;
+  llvm::json::Path::Root Root;
+  ASSERT_FALSE(fromJSON(llvm::json::Object{{"WorkspaceVersion", 1}}, Parsed,
+                        Root));
+  ASSERT_FALSE(fromJSON(llvm::json::Value(1), Parsed, Root));
+}
+
+} // namespace nixd
@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/LatencyHistogram.h"
+
+namespace nixd {
+
+using std::chrono::microseconds;
+
+TEST(LatencyHistogram, Buckets) {
+  size_t Last = 0;
+  for (int64_t US = 1; US < 100000; US++) {
+    auto Bucket = LatencyHistogram::bucketOf(microseconds(US));
+    ASSERT_GE(Bucket, Last);
+    Last = Bucket;
+    auto Upper = LatencyHistogram::upperBound(Bucket).count();
+    ASSERT_GE(Upper, US);
+    ASSERT_LE(Upper, US + US / LatencyHistogram::SubBuckets);
+  }
+  ASSERT_EQ(LatencyHistogram::bucketOf(microseconds(0)), 0);
+  ASSERT_EQ(LatencyHistogram::bucketOf(microseconds(1ULL << 50)),
+            LatencyHistogram::NumBuckets - 1);
+}
+
+TEST(LatencyHistogram, Percentile) {
+  LatencyHistogram H;
+  ASSERT_FALSE(H.percentile(0.5).has_value());
+
+  for (int I = 1; I <= 100; I++)
+    H.record(microseconds(I * 1000));
+
+  ASSERT_EQ(H.count(), 100);
+  ASSERT_FALSE(H.percentile(0.5, 200).has_value());
+
+  // Relative error is bounded by bucket width.
+  auto P50 = H.percentile(0.5)->count();
+  ASSERT_GE(P50, 50000);
+  ASSERT_LE(P50, 50000 * 5 / 4);
+
+  auto P90 = H.percentile(0.9)->count();
+  ASSERT_GE(P90, 90000);
+  ASSERT_LE(P90, 90000 * 5 / 4);
+
+  ASSERT_LE(*H.percentile(0.5), *H.percentile(0.9));
+  ASSERT_LE(*H.percentile(0.9), *H.percentile(1));
+}
+
+TEST(LatencyStats, Methods) {
+  LatencyStats S;
+  S["a"].record(microseconds(10));
+  S["a"].record(microseconds(20));
+  S["b"].record(microseconds(30));
+  ASSERT_EQ(S["a"].count(), 2);
+  ASSERT_EQ(S["b"].count(), 1);
+  ASSERT_EQ(&S["a"], &S["a"]);
+}
+
+TEST(LatencyStats, JSON) {
+  LatencyStats S;
+  S["a"].record(microseconds(10));
+  S["a"].record(microseconds(30));
+  S["b"];
+  auto JSON = toJSON(S);
+  const auto *A = JSON.getAsObject()->getObject("a");
+  ASSERT_EQ(A->getInteger("count"), 2);
+  ASSERT_EQ(A->getInteger("mean"), 20);
+  ASSERT_GE(A->getInteger("p99"), 30);
+  const auto *B = JSON.getAsObject()->getObject("b");
+  ASSERT_EQ(B->getInteger("count"), 0);
+  ASSERT_EQ(B->get("p50")->kind(), llvm::json::Value::Null);
+}
+
+} // namespace nixd
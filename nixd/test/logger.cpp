@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+
+#include "lspserver/Logger.h"
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace lspserver {
+
+TEST(Logger, Levels) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  StreamLogger L(OS, Logger::Info);
+  ASSERT_FALSE(L.enabled(Logger::Verbose));
+  ASSERT_TRUE(L.enabled(Logger::Error));
+
+  L.log(Logger::Verbose, "{0}", llvm::formatv("{0}", "hidden"));
+  L.log(Logger::Info, "{0}", llvm::formatv("{0}", "shown"));
+  L.flush();
+  ASSERT_EQ(llvm::StringRef(Out).count("hidden"), 0);
+  ASSERT_EQ(llvm::StringRef(Out).count("shown"), 1);
+  ASSERT_TRUE(llvm::StringRef(Out).startswith("I["));
+}
+
+TEST(Logger, Threads) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  {
+    StreamLogger L(OS, Logger::Info);
+    std::vector<std::thread> Threads;
+    for (int I = 0; I < 4; I++) {
+      Threads.emplace_back([&L, I]() {
+        for (int J = 0; J < 20; J++)
+          L.log(Logger::Info, "thread {0}, message {1}",
+                llvm::formatv("thread {0}, message {1}", I, J));
+      });
+    }
+    for (auto &T : Threads)
+      T.join();
+  }
+  // Everything is written when the logger is destroyed.
+  ASSERT_EQ(llvm::StringRef(Out).count("message"), 80);
+  ASSERT_EQ(llvm::StringRef(Out).count("thread 3, message 19\n"), 1);
+}
+
+TEST(Logger, RateLimit) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  StreamLogger L(OS, Logger::Info);
+  for (int I = 0; I < 1000; I++)
+    L.log(Logger::Info, "chatty {0}", llvm::formatv("chatty {0}", I));
+  L.log(Logger::Error, "error", llvm::formatv("error"));
+  L.flush();
+  // At most two windows of one second.
+  ASSERT_LE(llvm::StringRef(Out).count(": chatty"),
+            2 * StreamLogger::RateLimit);
+  ASSERT_EQ(llvm::StringRef(Out).count("E["), 1);
+}
+
+TEST(Logger, Fork) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  StreamLogger L(OS, Logger::Info);
+  pid_t Child = fork();
+  ASSERT_NE(Child, -1);
+  if (Child == 0) {
+    // The writer thread of the child is started by the first message.
+    L.log(Logger::Info, "{0}", llvm::formatv("{0}", "child"));
+    std::this_thread::sleep_for(StreamLogger::WriteInterval * 10);
+    _exit(llvm::StringRef(Out).count("child") == 1 ? 0 : 1);
+  }
+  int Status;
+  ASSERT_EQ(waitpid(Child, &Status, 0), Child);
+  ASSERT_TRUE(WIFEXITED(Status));
+  ASSERT_EQ(WEXITSTATUS(Status), 0);
+}
+
+} // namespace lspserver
@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+
+#include "lspserver/Connection.h"
+#include "lspserver/LSPServer.h"
+
+#include <llvm/ADT/StringRef.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lspserver {
+
+namespace {
+
+class TestServer : public LSPServer {
+public:
+  TestServer()
+      : LSPServer(std::make_unique<InboundPort>(),
+                  std::make_unique<OutboundPort>()) {}
+
+  using LSPServer::callOutMethod;
+  using LSPServer::cancelCall;
+  using LSPServer::expireCalls;
+  using LSPServer::forgetCalls;
+  using LSPServer::onReply;
+  using LSPServer::setCallLimit;
+};
+
+/// Record results of calls, "error" for errors.
+Callback<RawJSON> record(std::vector<std::string> &Results) {
+  return [&Results](llvm::Expected<RawJSON> R) {
+    if (!R) {
+      llvm::consumeError(R.takeError());
+      Results.emplace_back("error");
+      return;
+    }
+    Results.emplace_back(R->Text);
+  };
+}
+
+} // namespace
+
+TEST(LSPServer, CallLimit) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  OutboundPort Port(OS);
+  TestServer S;
+  S.setCallLimit(&Port, 2);
+
+  std::vector<std::string> Results;
+  auto A = S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr,
+                                                    record(Results), &Port);
+  S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr, record(Results),
+                                           &Port);
+  auto C = S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr,
+                                                    record(Results), &Port);
+  // The third call waits for a slot.
+  ASSERT_EQ(llvm::StringRef(Out).count(R"("method":"m")"), 2);
+
+  S.onReply(A, RawJSON("1"));
+  ASSERT_EQ(Results, (std::vector<std::string>{"1"}));
+  ASSERT_EQ(llvm::StringRef(Out).count(R"("method":"m")"), 3);
+
+  S.onReply(C, RawJSON("3"));
+  ASSERT_EQ(Results, (std::vector<std::string>{"1", "3"}));
+}
+
+TEST(LSPServer, CallDeadline) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  OutboundPort Port(OS);
+  TestServer S;
+  S.setCallLimit(&Port, 1);
+
+  std::vector<std::string> Results;
+  auto Past = TestServer::Clock::now() - std::chrono::seconds(1);
+  // Expired once sent, the peer is asked to cancel it.
+  auto A = S.callOutMethod<std::nullptr_t, RawJSON>(
+      "m", nullptr, record(Results), &Port, Past);
+  S.expireCalls();
+  ASSERT_EQ(Results, (std::vector<std::string>{"error"}));
+  ASSERT_EQ(llvm::StringRef(Out).count(R"("method":"m")"), 1);
+  ASSERT_EQ(llvm::StringRef(Out).count("$/cancelRequest"), 1);
+
+  // Late replies are ignored.
+  S.onReply(A, RawJSON("1"));
+  ASSERT_EQ(Results.size(), 1);
+
+  // Queued calls expire without being sent.
+  S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr, record(Results),
+                                           &Port);
+  S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr, record(Results),
+                                           &Port, Past);
+  S.expireCalls();
+  ASSERT_EQ(Results, (std::vector<std::string>{"error", "error"}));
+  ASSERT_EQ(llvm::StringRef(Out).count(R"("method":"m")"), 2);
+  ASSERT_EQ(llvm::StringRef(Out).count("$/cancelRequest"), 1);
+}
+
+TEST(LSPServer, ForgetCalls) {
+  std::string Out;
+  llvm::raw_string_ostream OS(Out);
+  OutboundPort Port(OS);
+  TestServer S;
+  S.setCallLimit(&Port, 1);
+
+  std::vector<std::string> Results;
+  S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr, record(Results),
+                                           &Port);
+  auto B = S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr,
+                                                    record(Results), &Port);
+  auto C = S.callOutMethod<std::nullptr_t, RawJSON>("m", nullptr,
+                                                    record(Results), &Port);
+  // Queued calls are cancelled without notifying the peer.
+  S.cancelCall(B, &Port);
+  ASSERT_TRUE(Results.empty());
+  S.expireCalls();
+  ASSERT_EQ(Results, (std::vector<std::string>{"error"}));
+  ASSERT_EQ(llvm::StringRef(Out).count("$/cancelRequest"), 0);
+
+  S.forgetCalls(&Port);
+  S.expireCalls();
+  ASSERT_EQ(Results, (std::vector<std::string>{"error", "error", "error"}));
+  S.onReply(C, RawJSON("3"));
+  ASSERT_EQ(Results.size(), 3);
+}
+
+} // namespace lspserver
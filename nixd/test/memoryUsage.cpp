@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/MemoryUsage.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace nixd {
+
+TEST(MemoryUsage, Containers) {
+  // Short strings are stored inline.
+  ASSERT_EQ(memoryOf(std::string("short")), 0);
+  std::string Long(100, 'a');
+  ASSERT_GE(memoryOf(Long), 100);
+
+  std::vector<int> Ints;
+  Ints.reserve(10);
+  ASSERT_EQ(memoryOf(Ints), 10 * sizeof(int));
+
+  std::vector<std::string> Strings{Long, Long};
+  ASSERT_GE(memoryOf(Strings), 2 * sizeof(std::string) + 2 * memoryOf(Long));
+
+  std::map<int, std::string> Map{{1, "short"}, {2, Long}};
+  auto Entries = 2 * mapEntrySize<int, std::string>();
+  ASSERT_EQ(memoryOf(Map), Entries + memoryOf(Map.at(2)));
+}
+
+TEST(MemoryUsage, JSON) {
+  MemoryUsage U{.AST = 1, .Analysis = 2, .Eval = 3, .Draft = 4, .Features = 5};
+  U += MemoryUsage{.AST = 10};
+  ASSERT_EQ(U.total(), 25);
+
+  llvm::json::Value V = U;
+  ASSERT_EQ(*V.getAsObject()->getInteger("total"), 25);
+
+  MemoryUsage Parsed;
+  llvm::json::Path::Root Root;
+  ASSERT_TRUE(fromJSON(V, Parsed, Root));
+  ASSERT_EQ(Parsed.AST, 11);
+  ASSERT_EQ(Parsed.Features, 5);
+  ASSERT_EQ(Parsed.total(), U.total());
+}
+
+} // namespace nixd
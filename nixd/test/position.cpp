@@ -0,0 +1,32 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/Position.h"
+
+#include "lspserver/SourceCode.h"
+
+#include <llvm/ADT/ScopeExit.h>
+
+#include <string>
+
+namespace nixd {
+
+using lspserver::OffsetEncoding;
+using lspserver::Position;
+
+TEST(Position, Transcode) {
+  // "é" takes 2 bytes and 1 UTF-16 unit, "😀" takes 4 bytes and 2 UTF-16 units.
+  std::string Code = "a\xc3\xa9" "b\n\xf0\x9f\x98\x80x\n";
+  ASSERT_EQ(transcodePos({0, 4}, Code), (Position{0, 3}));
+  ASSERT_EQ(transcodePos({1, 4}, Code), (Position{1, 2}));
+  ASSERT_EQ(transcodePos({1, 0}, Code), (Position{1, 0}));
+  // Columns end at the line, and lines out of the text are kept.
+  ASSERT_EQ(transcodePos({1, 10}, Code), (Position{1, 3}));
+  ASSERT_EQ(transcodePos({5, 4}, Code), (Position{5, 4}));
+
+  lspserver::setLSPEncoding(OffsetEncoding::UTF8);
+  auto Restore = llvm::make_scope_exit(
+      []() { lspserver::setLSPEncoding(OffsetEncoding::UTF16); });
+  ASSERT_EQ(transcodePos({1, 4}, Code), (Position{1, 4}));
+}
+
+} // namespace nixd
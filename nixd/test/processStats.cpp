@@ -0,0 +1,34 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/ProcessStats.h"
+
+#include <vector>
+
+#include <unistd.h>
+
+namespace nixd {
+
+#ifdef __linux__
+
+TEST(ProcessStats, Self) {
+  auto Before = readProcessStats(getpid());
+  ASSERT_TRUE(Before.has_value());
+  ASSERT_GT(Before->RSS, 0);
+
+  // Touching fresh pages takes minor faults.
+  std::vector<char> Pages(64 * sysconf(_SC_PAGESIZE));
+  for (size_t I = 0; I < Pages.size(); I += sysconf(_SC_PAGESIZE))
+    Pages[I] = 1;
+  auto After = readProcessStats(getpid());
+  ASSERT_TRUE(After.has_value());
+  ASSERT_GT(After->MinorFaults, Before->MinorFaults);
+}
+
+#endif
+
+TEST(ProcessStats, Exited) {
+  // Pid 0 never has an entry.
+  ASSERT_FALSE(readProcessStats(0).has_value());
+}
+
+} // namespace nixd
@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/ResponseCache.h"
+
+#include <string>
+
+namespace nixd {
+
+TEST(ResponseCache, LookupInsert) {
+  ResponseCache C;
+  ASSERT_EQ(C.lookup<int>("a"), nullptr);
+  C.insert("a", std::make_shared<const int>(1));
+  C.insert("b", std::make_shared<const std::string>("b"));
+  ASSERT_EQ(*C.lookup<int>("a"), 1);
+  ASSERT_EQ(*C.lookup<std::string>("b"), "b");
+  ASSERT_EQ(C.hits(), 2);
+  ASSERT_EQ(C.misses(), 1);
+
+  // Replace.
+  C.insert("a", std::make_shared<const int>(2));
+  ASSERT_EQ(*C.lookup<int>("a"), 2);
+  ASSERT_EQ(C.size(), 2);
+}
+
+TEST(ResponseCache, EvictLeastRecentlyUsed) {
+  ResponseCache C(2);
+  C.insert("a", std::make_shared<const int>(1));
+  C.insert("b", std::make_shared<const int>(2));
+  // "b" is the least recently used one after this lookup.
+  ASSERT_NE(C.lookup("a"), nullptr);
+  C.insert("c", std::make_shared<const int>(3));
+  ASSERT_EQ(C.size(), 2);
+  ASSERT_EQ(C.lookup("b"), nullptr);
+  ASSERT_EQ(*C.lookup<int>("a"), 1);
+  ASSERT_EQ(*C.lookup<int>("c"), 3);
+}
+
+TEST(ResponseCache, Clear) {
+  ResponseCache C;
+  C.insert("a", std::make_shared<const int>(1));
+  C.clear();
+  ASSERT_EQ(C.size(), 0);
+  ASSERT_EQ(C.lookup("a"), nullptr);
+  C.insert("a", std::make_shared<const int>(2));
+  ASSERT_EQ(*C.lookup<int>("a"), 2);
+}
+
+TEST(ResponseCache, ZeroCapacity) {
+  ResponseCache C(0);
+  C.insert("a", std::make_shared<const int>(1));
+  ASSERT_EQ(C.lookup("a"), nullptr);
+  ASSERT_EQ(C.size(), 0);
+}
+
+} // namespace nixd
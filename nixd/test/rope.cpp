@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+
+#include "lspserver/Rope.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+namespace lspserver {
+
+TEST(Rope, Basic) {
+  Rope R("let x = 1;\nin x\n");
+  ASSERT_EQ(R.size(), 16);
+  ASSERT_EQ(R.newlines(), 2);
+  ASSERT_EQ(R.back(), '\n');
+
+  auto S = R.replace(4, 1, "xyz");
+  ASSERT_EQ(S.str(), "let xyz = 1;\nin x\n");
+  // Old snapshots are not changed.
+  ASSERT_EQ(R.str(), "let x = 1;\nin x\n");
+
+  ASSERT_EQ(S.lineOffset(0), 0);
+  ASSERT_EQ(S.lineOffset(1), 13);
+  ASSERT_EQ(S.lineOffset(2), 18);
+  ASSERT_EQ(S.lineOffset(3), std::nullopt);
+  ASSERT_EQ(S.substr(13, 4).str(), "in x");
+}
+
+TEST(Rope, RandomEdits) {
+  std::mt19937 Gen(42);
+  std::string Expected;
+  Rope R;
+  for (int I = 0; I < 2000; I++) {
+    size_t Offset = Gen() % (Expected.size() + 1);
+    size_t Length = std::min<size_t>(Gen() % 8, Expected.size() - Offset);
+    // Mostly typing, sometimes pasting.
+    std::string Text(Gen() % 10 == 0 ? Gen() % 3000 : Gen() % 3, 'a');
+    for (auto &C : Text)
+      C = "ab\n"[Gen() % 3];
+
+    Expected.replace(Offset, Length, Text);
+    R = R.replace(Offset, Length, Text);
+  }
+  ASSERT_EQ(R.str(), Expected);
+  ASSERT_EQ(R.newlines(), std::count(Expected.begin(), Expected.end(), '\n'));
+
+  size_t Line = 1;
+  for (size_t I = 0; I < Expected.size(); I++) {
+    if (Expected[I] == '\n')
+      ASSERT_EQ(R.lineOffset(Line++), I + 1);
+  }
+
+  // Small edits are glued, the tree is not fragmented.
+  ASSERT_LT(R.chunks(), Expected.size() / 64 + 64);
+}
+
+TEST(Rope, Adopt) {
+  std::string Text;
+  for (int I = 0; I < 500; I++)
+    Text += "line " + std::to_string(I) + "\n";
+  auto R = Rope::adopt(Text);
+  ASSERT_EQ(R.str(), Text);
+  ASSERT_EQ(R.chunks(), Text.size() / Rope::MaxChunk + 1);
+  ASSERT_EQ(R.newlines(), 500U);
+
+  // Chunks split by edits still refer to the text.
+  auto S = R.replace(1500, 10, "x");
+  std::string Expected = Text;
+  Expected.replace(1500, 10, "x");
+  ASSERT_EQ(S.str(), Expected);
+  ASSERT_EQ(S.substr(1490, 20).str(), Expected.substr(1490, 20));
+  ASSERT_EQ(R.str(), Text);
+}
+
+} // namespace lspserver
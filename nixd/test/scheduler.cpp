@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include "nixd/Support/Scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nixd {
+
+using namespace std::chrono_literals;
+
+TEST(Scheduler, RunAll) {
+  Scheduler S(4);
+  std::atomic<int> Count = 0;
+  for (int I = 0; I < 1000; I++) {
+    S.post(static_cast<Priority>(I % NumPriorities), [&]() {
+      // Tasks posted by tasks.
+      S.post(Priority::Interactive, [&]() { Count++; });
+      Count++;
+    });
+  }
+  S.wait();
+  ASSERT_EQ(Count, 2000);
+}
+
+TEST(Scheduler, Limits) {
+  Scheduler S(4, {4, 2, 1});
+  std::atomic<int> Running = 0;
+  std::atomic<int> MaxRunning = 0;
+  for (int I = 0; I < 20; I++) {
+    S.post(Priority::Indexing, [&]() {
+      int R = ++Running;
+      int M = MaxRunning;
+      while (R > M && !MaxRunning.compare_exchange_weak(M, R))
+        ;
+      std::this_thread::sleep_for(1ms);
+      Running--;
+    });
+  }
+  S.wait();
+  ASSERT_EQ(MaxRunning, 1);
+}
+
+TEST(Scheduler, DefaultLimits) {
+  // Parsing is not serialized on larger machines.
+  Scheduler S(8);
+  auto Limits = S.load().Limits;
+  ASSERT_EQ(Limits[static_cast<size_t>(Priority::Interactive)], 8);
+  ASSERT_EQ(Limits[static_cast<size_t>(Priority::Background)], 4);
+  ASSERT_EQ(Limits[static_cast<size_t>(Priority::Indexing)], 2);
+
+  Scheduler Single(1);
+  ASSERT_EQ(Single.load().Limits[static_cast<size_t>(Priority::Indexing)], 1);
+}
+
+/// Interactive tasks are not delayed by running, nor by queued, bulk tasks.
+TEST(Scheduler, InteractiveFirst) {
+  Scheduler S(2, {2, 1, 1});
+
+  // Keep the only slot of bulk tasks busy, until the interactive task ran.
+  std::atomic<bool> Started = false;
+  std::atomic<bool> Release = false;
+  S.post(Priority::Background, [&]() {
+    Started = true;
+    while (!Release)
+      std::this_thread::yield();
+  });
+  while (!Started)
+    std::this_thread::yield();
+
+  std::mutex OrderLock;
+  std::vector<Priority> Order;
+  auto Record = [&](Priority P) {
+    std::lock_guard Guard(OrderLock);
+    Order.emplace_back(P);
+  };
+  for (int I = 0; I < 10; I++) {
+    auto P = I % 2 ? Priority::Background : Priority::Indexing;
+    S.post(P, [&, P]() { Record(P); });
+  }
+  S.post(Priority::Interactive, [&]() {
+    Record(Priority::Interactive);
+    Release = true;
+  });
+  S.wait();
+
+  ASSERT_EQ(Order.size(), 11U);
+  ASSERT_EQ(Order.front(), Priority::Interactive);
+}
+
+} // namespace nixd
@@ -0,0 +1,170 @@
+#include <gtest/gtest.h>
+
+#include "lspserver/Rope.h"
+#include "lspserver/SourceCode.h"
+
+#include <llvm/ADT/ScopeExit.h>
+
+#include <string>
+
+namespace lspserver {
+
+namespace {
+
+/// Switch the encoding for a test, UTF-16 is restored afterwards.
+[[nodiscard]] auto withEncoding(OffsetEncoding Encoding) {
+  setLSPEncoding(Encoding);
+  return llvm::make_scope_exit([]() { setLSPEncoding(OffsetEncoding::UTF16); });
+}
+
+size_t offsetOf(llvm::StringRef Code, int Line, int Character) {
+  auto Offset = positionToOffset(Code, Position{Line, Character},
+                                 /*AllowColumnsBeyondLineLength=*/false);
+  if (!Offset) {
+    ADD_FAILURE() << llvm::toString(Offset.takeError());
+    return Code.size() + 1;
+  }
+  return *Offset;
+}
+
+bool isInvalid(llvm::StringRef Code, int Line, int Character) {
+  auto Offset = positionToOffset(Code, Position{Line, Character},
+                                 /*AllowColumnsBeyondLineLength=*/false);
+  if (Offset)
+    return false;
+  llvm::consumeError(Offset.takeError());
+  return true;
+}
+
+// "é" takes 2 bytes and 1 UTF-16 unit, "😀" takes 4 bytes and 2 UTF-16 units.
+const std::string Mixed = "ab\xc3\xa9" "cd\xf0\x9f\x98\x80" "ef";
+
+} // namespace
+
+TEST(SourceCode, LSPLength) {
+  ASSERT_EQ(lspLength(""), 0U);
+  ASSERT_EQ(lspLength("abc"), 3U);
+  ASSERT_EQ(lspLength(Mixed), 9U);
+  {
+    auto Restore = withEncoding(OffsetEncoding::UTF8);
+    ASSERT_EQ(lspLength(Mixed), 12U);
+  }
+  {
+    auto Restore = withEncoding(OffsetEncoding::UTF32);
+    ASSERT_EQ(lspLength(Mixed), 8U);
+  }
+}
+
+TEST(SourceCode, MixedLine) {
+  ASSERT_EQ(offsetOf(Mixed, 0, 2), 2U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 3), 4U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 5), 6U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 7), 10U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 8), 11U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 9), 12U);
+  ASSERT_TRUE(isInvalid(Mixed, 0, 10));
+
+  // Lines after the first one are not affected by encodings.
+  std::string Code = Mixed + "\nx\xc3\xa9y";
+  ASSERT_EQ(offsetOf(Code, 1, 2), 13U + 3);
+  ASSERT_EQ(offsetToPosition(Code, 13 + 3), (Position{1, 2}));
+  ASSERT_EQ(offsetToPosition(Code, 10), (Position{0, 7}));
+}
+
+TEST(SourceCode, ASCIIRuns) {
+  // Runs are measured 8 bytes at a time, ending at and around words.
+  std::string Line(20, 'a');
+  for (int I = 0; I <= 20; I++)
+    ASSERT_EQ(offsetOf(Line, 0, I), static_cast<size_t>(I));
+  ASSERT_EQ(lspLength(Line), 20U);
+
+  // A non-ASCII character right after the first word, and inside the second.
+  std::string Split = std::string(8, 'a') + "\xc3\xa9" + std::string(5, 'b') +
+                      "\xf0\x9f\x98\x80" + std::string(9, 'c');
+  ASSERT_EQ(offsetOf(Split, 0, 8), 8U);
+  ASSERT_EQ(offsetOf(Split, 0, 9), 10U);
+  ASSERT_EQ(offsetOf(Split, 0, 12), 13U);
+  ASSERT_EQ(offsetOf(Split, 0, 14), 15U);
+  ASSERT_EQ(offsetOf(Split, 0, 16), 19U);
+  ASSERT_EQ(offsetOf(Split, 0, 20), 23U);
+  ASSERT_EQ(lspLength(Split), 25U);
+  ASSERT_EQ(offsetToPosition(Split, 13), (Position{0, 12}));
+}
+
+TEST(SourceCode, SurrogatePairs) {
+  std::string Line = "a\xf0\x9f\x98\x80\xf0\x9f\x98\x80z";
+  ASSERT_EQ(offsetOf(Line, 0, 1), 1U);
+  ASSERT_EQ(offsetOf(Line, 0, 3), 5U);
+  ASSERT_EQ(offsetOf(Line, 0, 5), 9U);
+  ASSERT_EQ(offsetOf(Line, 0, 6), 10U);
+  // In the middle of a pair.
+  ASSERT_TRUE(isInvalid(Line, 0, 2));
+  ASSERT_TRUE(isInvalid(Line, 0, 4));
+  ASSERT_EQ(offsetToPosition(Line, 9), (Position{0, 5}));
+}
+
+TEST(SourceCode, UTF32) {
+  auto Restore = withEncoding(OffsetEncoding::UTF32);
+  ASSERT_EQ(offsetOf(Mixed, 0, 3), 4U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 5), 6U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 6), 10U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 8), 12U);
+  ASSERT_TRUE(isInvalid(Mixed, 0, 9));
+  ASSERT_EQ(offsetToPosition(Mixed, 10), (Position{0, 6}));
+}
+
+TEST(SourceCode, UTF8) {
+  auto Restore = withEncoding(OffsetEncoding::UTF8);
+  ASSERT_EQ(offsetOf(Mixed, 0, 4), 4U);
+  ASSERT_EQ(offsetOf(Mixed, 0, 12), 12U);
+  ASSERT_TRUE(isInvalid(Mixed, 0, 13));
+  ASSERT_EQ(offsetToPosition(Mixed, 10), (Position{0, 10}));
+}
+
+TEST(SourceCode, ColumnsBeyondLine) {
+  auto Offset = positionToOffset("abc\nd", Position{0, 10});
+  ASSERT_TRUE(bool(Offset));
+  ASSERT_EQ(*Offset, 3U);
+  ASSERT_TRUE(isInvalid("abc\nd", 0, 10));
+  ASSERT_TRUE(isInvalid("abc\nd", 2, 0));
+}
+
+TEST(SourceCode, RopeLines) {
+  // Lines across chunk boundaries, and a character split by one.
+  std::string Text = std::string(Rope::MaxChunk - 1, 'x') + "\xc3\xa9" + "y\n" +
+                     std::string(2 * Rope::MaxChunk, 'z') + "\n\nlast";
+  Rope R(Text);
+  ASSERT_GT(R.chunks(), 1U);
+
+  ASSERT_EQ(getLine(R, 0), Text.substr(0, Rope::MaxChunk + 2));
+  ASSERT_EQ(getLine(R, 1), std::string(2 * Rope::MaxChunk, 'z'));
+  ASSERT_EQ(getLine(R, 2), "");
+  ASSERT_EQ(getLine(R, 3), "last");
+  ASSERT_EQ(getLine(R, 4), std::nullopt);
+
+  // The rope agrees with the flat text.
+  int AfterSplit = Rope::MaxChunk;
+  for (auto P : {Position{0, 0}, Position{0, AfterSplit}, Position{1, 1500},
+                 Position{3, 2}, Position{3, 4}}) {
+    auto Flat = positionToOffset(Text, P, false);
+    auto InRope = positionToOffset(R, P, false);
+    ASSERT_TRUE(bool(Flat));
+    ASSERT_TRUE(bool(InRope));
+    ASSERT_EQ(*Flat, *InRope);
+  }
+  auto Offset = positionToOffset(R, Position{0, AfterSplit}, false);
+  ASSERT_TRUE(bool(Offset));
+  ASSERT_EQ(*Offset, Rope::MaxChunk + 1);
+}
+
+TEST(SourceCode, WordAround) {
+  llvm::StringRef Delimiters = " ;";
+  ASSERT_EQ(wordAround("foo.bar baz;", 0, Delimiters), "foo.bar");
+  ASSERT_EQ(wordAround("foo.bar baz;", 3, Delimiters), "foo.bar");
+  ASSERT_EQ(wordAround("foo.bar baz;", 8, Delimiters), "baz");
+  ASSERT_EQ(wordAround("foo.bar baz", 11, Delimiters), "baz");
+  ASSERT_EQ(wordAround(" x", 0, Delimiters), "");
+  ASSERT_EQ(wordAround("", 0, Delimiters), "");
+}
+
+} // namespace lspserver
@@ -0,0 +1,64 @@
+#include <gtest/gtest.h>
+
+#include "lspserver/Trace.h"
+
+#include <llvm/ADT/ScopeExit.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <map>
+#include <string>
+
+namespace lspserver {
+
+TEST(Trace, Events) {
+  llvm::SmallString<64> Path;
+  ASSERT_FALSE(llvm::sys::fs::createTemporaryFile("nixd-trace", "json", Path));
+  auto Err = trace::enable(Path);
+  ASSERT_FALSE(bool(Err));
+  // Tracing is process-wide, do not leak it into other tests.
+  auto Disable = llvm::make_scope_exit([]() { trace::disable(); });
+  ASSERT_TRUE(trace::enabled());
+
+  {
+    trace::ContextScope Scope({/*Request=*/42, /*Flow=*/0});
+    trace::Span Outer("outer");
+    Outer.Args["answer"] = 42;
+    trace::AsyncSpan Pending("pending");
+    trace::flowBegin(7);
+    trace::flowEnd(7);
+  }
+  ASSERT_EQ(trace::current().Request, 0);
+  trace::disable();
+  ASSERT_FALSE(trace::enabled());
+
+  auto Buffer = llvm::MemoryBuffer::getFile(Path);
+  ASSERT_TRUE(bool(Buffer));
+  llvm::sys::fs::remove(Path);
+
+  // The array is not terminated, each event is followed by ",\n".
+  auto Text = (*Buffer)->getBuffer().str();
+  ASSERT_TRUE(llvm::StringRef(Text).endswith(",\n"));
+  Text.resize(Text.size() - 2);
+  auto JSON = llvm::json::parse(Text + "]");
+  ASSERT_TRUE(bool(JSON));
+
+  std::map<std::string, int> Phases;
+  for (const auto &Event : *JSON->getAsArray()) {
+    const auto *Object = Event.getAsObject();
+    auto Phase = Object->getString("ph")->str();
+    Phases[Phase]++;
+    if (Phase == "X") {
+      ASSERT_EQ(Object->getString("name"), "outer");
+      const auto *Args = Object->getObject("args");
+      ASSERT_EQ(Args->getInteger("answer"), 42);
+      ASSERT_EQ(Args->getString("request"), "0x2a");
+    }
+  }
+  ASSERT_EQ(Phases, (std::map<std::string, int>{
+                        {"X", 1}, {"b", 1}, {"e", 1}, {"s", 1}, {"f", 1}}));
+}
+
+} // namespace lspserver
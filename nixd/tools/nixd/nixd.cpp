@@ -3,6 +3,7 @@
 #include "lspserver/Connection.h"
 #include "lspserver/LSPServer.h"
 #include "lspserver/Logger.h"
+#include "lspserver/Trace.h"
 
 #include "nixd/Server/Server.h"
 
@@ -101,6 +102,11 @@ opt<bool> WaitWorker{"wait-worker",
                           "any timeout logic"),
                      init(false), cat(Misc)};
 
+opt<std::string> TraceFile{
+    "trace",
+    desc("Write spans of requests to the file, in Chrome trace format"),
+    init(""), cat(Misc)};
+
 int main(int argc, char *argv[]) {
   using namespace lspserver;
 #ifdef __linux__
@@ -128,6 +134,12 @@ int main(int argc, char *argv[]) {
 #else
   lspserver::log("nixd {0} started", NIXD_VERSION);
 #endif
+  if (!TraceFile.empty()) {
+    if (auto Err = trace::enable(TraceFile))
+      elog("{0}", std::move(Err));
+    else
+      trace::nameProcess("controller");
+  }
   nixd::Server Server{
       std::make_unique<lspserver::InboundPort>(STDIN_FILENO, InputStyle),
       std::make_unique<lspserver::OutboundPort>(PrettyPrint), WaitWorker};